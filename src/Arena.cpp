@@ -0,0 +1,71 @@
+#include "Arena.h"
+#include "NAPTest.h"
+
+Arena::Arena(char* _block, char* _base, size_t _capacity)
+    : block(_block)
+    , base(_base)
+    , capacity(_capacity)
+    , used(0)
+{
+}
+
+Arena* Arena::Create(size_t capacity)
+{
+    // new only guarantees the alignment of the largest fundamental type, the block is aligned by hand
+    const size_t header = Align(sizeof(Arena));
+    char* block = new char[header + capacity + ALIGNMENT];
+    char* start = block + ((ALIGNMENT - (size_t)block % ALIGNMENT) % ALIGNMENT);
+    memset(start, 0, header + capacity);
+    return new (start) Arena(block, start + header, capacity);
+}
+
+void Arena::Destroy(Arena* arena)
+{
+    if (arena == NULL)
+        return;
+    char* block = arena->block;
+    arena->~Arena();
+    delete[] block;
+}
+
+void* Arena::Allocate(size_t size)
+{
+    const size_t aligned = Align(size);
+    if (aligned > capacity - used)
+        return NULL;
+    void* memory = base + used;
+    used += aligned;
+    return memory;
+}
+
+size_t Arena::GetMemorySize() const
+{
+    return Align(sizeof(Arena)) + capacity + ALIGNMENT;
+}
+
+NAP_TESTSUITE(Arena)
+{
+    struct Object
+    {
+        int value = 7;
+        float zeroed;
+    };
+
+    NAP_UNITTEST(CarvesAlignedZeroedBlocks)
+    {
+        Arena* arena = Arena::Create(Arena::Align(sizeof(Object)) + Arena::Align(3 * sizeof(float)) + 100);
+        bool ok = true;
+        Object* object = arena->New<Object>();
+        ok = ok && object != NULL && object->value == 7 && object->zeroed == 0.0f;
+        float* samples = arena->AllocateArray<float>(3);
+        ok = ok && samples != NULL && samples[0] == 0.0f && samples[2] == 0.0f;
+        ok = ok && (size_t)object % Arena::ALIGNMENT == 0 && (size_t)samples % Arena::ALIGNMENT == 0;
+        NAP_CHECK(ok);
+
+        // Allocations are rounded up to whole cache lines, so 100 bytes leave room for one more line only
+        NAP_CHECK(arena->Allocate(Arena::ALIGNMENT) != NULL);
+        NAP_CHECK(arena->Allocate(1) == NULL);
+        NAP_CHECK(arena->GetUsed() <= arena->GetCapacity());
+        Arena::Destroy(arena);
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+
+#include <new>
+
+/// Bump allocator over a single block of zeroed memory, which holds the state of one spatializer instance.
+/// Every allocation starts on a cache line, which also satisfies the aligned BlockOps kernels. Nothing is
+/// freed individually: the block is released as a whole by Destroy, and objects placed in the arena have
+/// to be destructed by their owner before. The arena itself sits at the start of its block.
+class Arena
+{
+public:
+    static const size_t ALIGNMENT = 64;
+
+public:
+    // Allocates an arena with room for capacity bytes, not realtime safe
+    static Arena* Create(size_t capacity);
+    static void Destroy(Arena* arena);
+
+    // Bytes an allocation of size bytes takes up, sum these up for the capacity
+    static inline size_t Align(size_t size) { return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1); }
+
+public:
+    // Returns size zeroed bytes, or NULL if the arena is full. Only used while the instance is created.
+    void* Allocate(size_t size);
+
+    template<typename T> T* AllocateArray(size_t count)
+    {
+        return (T*)Allocate(sizeof(T) * count);
+    }
+
+    // Value initializes an object in the arena, which zeroes the members the constructor leaves alone
+    template<typename T> T* New()
+    {
+        void* memory = Allocate(sizeof(T));
+        return (memory != NULL) ? new (memory) T() : NULL;
+    }
+
+    inline size_t GetCapacity() const { return capacity; }
+    inline size_t GetUsed() const { return used; }
+    size_t GetMemorySize() const;
+
+private:
+    Arena(char* block, char* base, size_t capacity);
+
+    // Prevent uncontrolled usage
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+private:
+    // Block as returned by new and the first aligned byte after the arena
+    char* block;
+    char* base;
+    size_t capacity;
+    size_t used;
+};
@@ -1,7 +1,11 @@
 #include "AudioPluginUtil.h"
+#include "LoadProfiler.h"
+#include "NAPTest.h"
+#include "RTAudit.h"
 #include <stdarg.h>
-
-#define ENABLE_TESTS ((UNITY_WIN || UNITY_OSX) && 1)
+#if NAP_TEST_RUNNER
+#include <thread>
+#endif
 
 char* strnew(const char* src)
 {
@@ -20,200 +24,1234 @@ char* tmpstr(int index, const char* fmtstr, ...)
     return buf[index];
 }
 
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define FFT_SSE2 1
+#   include <emmintrin.h>
+#endif
+
 template<typename T> void UnitySwap(T& a, T& b) { T t = a; a = b; b = t; }
 
-template<typename T>
-static void FFTProcess(UnityComplexNumber* data, int numsamples, bool forward)
+// Precomputed tables of one transform size. Plans are built on first use by whichever thread gets there
+// first (concurrent builders throw their copy away) and are never freed, so they can be shared freely.
+struct FFTPlan
 {
-	unsigned int count = 1, numbits = 0;
-	while (count < numsamples)
+	int numsamples;
+	int numbits;
+	unsigned int* reverse;
+	// Forward twiddles of the radix-4 passes. For the pass combining blocks of h samples the factors
+	// w^k, w^2k and w^3k with w = exp(-2 pi i / 4h) follow each other as three arrays of h entries.
+	UnityComplexNumberT<float>* twiddles;
+	UnityComplexNumberT<double>* twiddles_double;
+	// exp(-2 pi i k / 2n) for k <= n / 2, splits the spectrum of a real signal of 2n samples packed into n complex ones
+	UnityComplexNumber* realtwiddles;
+
+	static const FFTPlan* Get(int numsamples);
+	static FFTPlan* Create(int numbits);
+};
+
+static std::atomic<FFTPlan*> fftplans[32];
+
+FFTPlan* FFTPlan::Create(int numbits)
+{
+	FFTPlan* plan = new FFTPlan;
+	const int n = 1 << numbits;
+	plan->numsamples = n;
+	plan->numbits = numbits;
+
+	plan->reverse = new unsigned int [n];
+	plan->reverse[0] = 0;
+	for (int i = 1; i < n; i++)
+		plan->reverse[i] = (plan->reverse[i >> 1] >> 1) | ((i & 1) << (numbits - 1));
+#if ENABLE_TESTS
+	for (int i = 0; i < n; i++)
 	{
-		count += count;
-		++numbits;
+		assert (plan->reverse[plan->reverse[i]] == (unsigned int)i);
 	}
-	
-	static unsigned int* reversetable[32] = { NULL };
-	unsigned int* tbl = reversetable[numbits];
-	if (tbl == NULL)
+#endif
+
+	// Every factor is evaluated directly in double precision, nothing accumulates rounding errors
+	int numtwiddles = 0;
+	for (int h = (numbits & 1) ? 2 : 1; h < n; h *= 4)
+		numtwiddles += 3 * h;
+	plan->twiddles = new UnityComplexNumberT<float> [numtwiddles + 1];
+	plan->twiddles_double = new UnityComplexNumberT<double> [numtwiddles + 1];
+	int index = 0;
+	for (int h = (numbits & 1) ? 2 : 1; h < n; h *= 4)
 	{
-		tbl = new unsigned int [numsamples];
-		for (unsigned int n = 0; n < numsamples; n++)
+		for (int m = 1; m <= 3; m++)
 		{
-			unsigned int j = 1, k = 0, m = numsamples >> 1;
-			while (m > 0)
+			for (int k = 0; k < h; k++)
 			{
-				if (n & m)
-					k |= j;
-				j += j;
-				m >>= 1;
+				const double w = -2.0 * kPI_double * (double)(m * k) / (double)(4 * h);
+				plan->twiddles_double[index].Set(cos(w), sin(w));
+				plan->twiddles[index].Set((float)cos(w), (float)sin(w));
+				index++;
 			}
-			tbl[n] = k;
-		}
-#if ENABLE_TESTS
-		for (unsigned int n = 0; n < numsamples; n++)
-		{
-			assert (tbl[tbl[n]] == n);
 		}
-#endif
-		reversetable[numbits] = tbl;
 	}
-	
-	for (unsigned int i = 0; i < numsamples; i++)
+
+	plan->realtwiddles = new UnityComplexNumber [n / 2 + 1];
+	for (int k = 0; k <= n / 2; k++)
+	{
+		const double w = -kPI_double * (double)k / (double)n;
+		plan->realtwiddles[k].Set((float)cos(w), (float)sin(w));
+	}
+
+	return plan;
+}
+
+const FFTPlan* FFTPlan::Get(int numsamples)
+{
+	int numbits = 0;
+	while ((1 << numbits) < numsamples)
+		++numbits;
+
+	FFTPlan* plan = fftplans[numbits].load(std::memory_order_acquire);
+	if (plan != NULL)
+		return plan;
+
+	FFTPlan* created = Create(numbits);
+	if (fftplans[numbits].compare_exchange_strong(plan, created, std::memory_order_acq_rel))
+		return created;
+
+	// Another thread was faster
+	delete[] created->reverse;
+	delete[] created->twiddles;
+	delete[] created->twiddles_double;
+	delete[] created->realtwiddles;
+	delete created;
+	return plan;
+}
+
+// Radix-4 decimation in time butterfly on x[0], x[h], x[2h] and x[3h], w1 = w^k, w2 = w^2k, w3 = w^3k
+template<typename T>
+static inline void FFTButterfly4(UnityComplexNumber* x, int h, const UnityComplexNumberT<T>& w1, const UnityComplexNumberT<T>& w2, const UnityComplexNumberT<T>& w3)
+{
+	UnityComplexNumberT<T> a, b, c, d, u0, u1, u2, u3;
+	a.Set(x[0].re, x[0].im);
+	UnityComplexNumber::Mul(x[h], w2, b);
+	UnityComplexNumber::Mul(x[2 * h], w1, c);
+	UnityComplexNumber::Mul(x[3 * h], w3, d);
+	UnityComplexNumber::Add(a, b, u0);
+	UnityComplexNumber::Sub(a, b, u1);
+	UnityComplexNumber::Add(c, d, u2);
+	UnityComplexNumber::Sub(c, d, u3);
+	UnityComplexNumber::Add(u0, u2, x[0]);
+	UnityComplexNumber::Sub(u0, u2, x[2 * h]);
+	// u1 -/+ i * u3
+	x[h].Set(u1.re + u3.im, u1.im - u3.re);
+	x[3 * h].Set(u1.re - u3.im, u1.im + u3.re);
+}
+
+// One radix-4 pass over all blocks of 4h samples
+template<typename T>
+static void FFTPass4(UnityComplexNumber* data, int n, int h, const UnityComplexNumberT<T>* w1, const UnityComplexNumberT<T>* w2, const UnityComplexNumberT<T>* w3)
+{
+	for (int g = 0; g < n; g += 4 * h)
+		for (int k = 0; k < h; k++)
+			FFTButterfly4(data + g + k, h, w1[k], w2[k], w3[k]);
+}
+
+#if FFT_SSE2
+// Two interleaved complex products a * w
+static inline __m128 FFTMulSSE2(__m128 a, __m128 w)
+{
+	const __m128 negeven = _mm_castsi128_ps(_mm_set_epi32(0, (int)0x80000000, 0, (int)0x80000000));
+	const __m128 wr = _mm_shuffle_ps(w, w, _MM_SHUFFLE(2, 2, 0, 0));
+	const __m128 wi = _mm_shuffle_ps(w, w, _MM_SHUFFLE(3, 3, 1, 1));
+	const __m128 swapped = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+	return _mm_add_ps(_mm_mul_ps(a, wr), _mm_xor_ps(_mm_mul_ps(swapped, wi), negeven));
+}
+
+// FFTButterfly4 for k and k + 1 at once
+static inline void FFTButterfly4SSE2(float* x, int h, const float* w1, const float* w2, const float* w3)
+{
+	const __m128 negodd = _mm_castsi128_ps(_mm_set_epi32((int)0x80000000, 0, (int)0x80000000, 0));
+	const __m128 a = _mm_loadu_ps(x);
+	const __m128 b = FFTMulSSE2(_mm_loadu_ps(x + 2 * h), _mm_loadu_ps(w2));
+	const __m128 c = FFTMulSSE2(_mm_loadu_ps(x + 4 * h), _mm_loadu_ps(w1));
+	const __m128 d = FFTMulSSE2(_mm_loadu_ps(x + 6 * h), _mm_loadu_ps(w3));
+	const __m128 u0 = _mm_add_ps(a, b), u1 = _mm_sub_ps(a, b);
+	const __m128 u2 = _mm_add_ps(c, d), u3 = _mm_sub_ps(c, d);
+	// -i * u3
+	const __m128 r = _mm_xor_ps(_mm_shuffle_ps(u3, u3, _MM_SHUFFLE(2, 3, 0, 1)), negodd);
+	_mm_storeu_ps(x, _mm_add_ps(u0, u2));
+	_mm_storeu_ps(x + 4 * h, _mm_sub_ps(u0, u2));
+	_mm_storeu_ps(x + 2 * h, _mm_add_ps(u1, r));
+	_mm_storeu_ps(x + 6 * h, _mm_sub_ps(u1, r));
+}
+
+static void FFTPass4(UnityComplexNumber* data, int n, int h, const UnityComplexNumber* w1, const UnityComplexNumber* w2, const UnityComplexNumber* w3)
+{
+	if (h < 2)
+	{
+		FFTPass4<float>(data, n, h, w1, w2, w3);
+		return;
+	}
+	for (int g = 0; g < n; g += 4 * h)
+	{
+		float* x = &data[g].re;
+		for (int k = 0; k < h; k += 2)
+			FFTButterfly4SSE2(x + 2 * k, h, &w1[k].re, &w2[k].re, &w3[k].re);
+	}
+}
+#endif
+
+// Forward transform in place: bit reversal, one radix-2 pass for odd sizes and radix-4 passes for the rest
+template<typename T>
+static void FFTProcess(UnityComplexNumber* data, const FFTPlan* plan, const UnityComplexNumberT<T>* twiddles)
+{
+	const int n = plan->numsamples;
+	const unsigned int* tbl = plan->reverse;
+	for (int i = 0; i < n; i++)
 	{
-		unsigned int j = tbl[i];
+		const int j = (int)tbl[i];
 		if (i < j)
 		{
 			UnitySwap(data[i].re, data[j].re);
 			UnitySwap(data[i].im, data[j].im);
 		}
 	}
-	
-	T w0 = (forward) ? -T(kPI_double) : T(kPI_double);
-    for (int j = 1; j < numsamples; j += j)
-    {
-		UnityComplexNumberT<T> wr, wd;
-		wr.Set(T(cos(w0)), T(sin(w0)));
-		wd.Set(T(1.0), T(0.0));
-		int step = j + j;
-        for (int m = 0; m < j; ++m)
+
+	int h = 1;
+	if (plan->numbits & 1)
+	{
+		for (int i = 0; i < n; i += 2)
+		{
+			UnityComplexNumber t;
+			t.Set(data[i + 1]);
+			UnityComplexNumber::Sub(data[i], t, data[i + 1]);
+			UnityComplexNumber::Add(data[i], t, data[i]);
+		}
+		h = 2;
+	}
+
+	for (; h < n; h *= 4)
+	{
+		const UnityComplexNumberT<T>* w1 = twiddles;
+		const UnityComplexNumberT<T>* w2 = twiddles + h;
+		const UnityComplexNumberT<T>* w3 = twiddles + 2 * h;
+		twiddles += 3 * h;
+		FFTPass4(data, n, h, w1, w2, w3);
+	}
+}
+
+static void FFTProcess(UnityComplexNumber* data, const FFTPlan* plan, bool highprecision)
+{
+	if (highprecision)
+		FFTProcess<double>(data, plan, plan->twiddles_double);
+	else
+		FFTProcess<float>(data, plan, plan->twiddles);
+}
+
+void FFT::Forward(UnityComplexNumber* data, int numsamples, bool highprecision)
+{
+	FFTProcess(data, FFTPlan::Get(numsamples), highprecision);
+}
+
+// The inverse is the conjugate of the forward transform of the conjugate
+void FFT::Backward(UnityComplexNumber* data, int numsamples, bool highprecision)
+{
+	for (int n = 0; n < numsamples; n++)
+		data[n].im = -data[n].im;
+
+	FFTProcess(data, FFTPlan::Get(numsamples), highprecision);
+
+	const float scale = 1.0f / (float)numsamples;
+	for (int n = 0; n < numsamples; n++)
+	{
+		data[n].re *= scale;
+		data[n].im *= -scale;
+	}
+}
+
+// The even and odd samples are transformed as the real and imaginary part of one complex signal of half
+// the size, the spectra of both are then separated and combined
+void FFT::ForwardReal(const float* input, UnityComplexNumber* spectrum, int numsamples)
+{
+	const int n = numsamples / 2;
+	const FFTPlan* plan = FFTPlan::Get(n);
+	for (int i = 0; i < n; i++)
+		spectrum[i].Set(input[2 * i], input[2 * i + 1]);
+	FFTProcess<float>(spectrum, plan, plan->twiddles);
+
+	const UnityComplexNumber* w = plan->realtwiddles;
+	const float re0 = spectrum[0].re, im0 = spectrum[0].im;
+	spectrum[0].Set(re0 + im0, 0.0f);
+	spectrum[n].Set(re0 - im0, 0.0f);
+	for (int k = 1; k <= n / 2; k++)
+	{
+		const UnityComplexNumber z1 = spectrum[k], z2 = spectrum[n - k];
+		// even = (z1 + conj(z2)) / 2, odd = (z1 - conj(z2)) / 2i
+		const float er = 0.5f * (z1.re + z2.re), ei = 0.5f * (z1.im - z2.im);
+		const float orr = 0.5f * (z1.im + z2.im), oi = -0.5f * (z1.re - z2.re);
+		// X[k] = even + w^k odd, X[n - k] = conj(even - w^k odd)
+		const float tr = w[k].re * orr - w[k].im * oi, ti = w[k].re * oi + w[k].im * orr;
+		spectrum[k].Set(er + tr, ei + ti);
+		spectrum[n - k].Set(er - tr, ti - ei);
+	}
+}
+
+void FFT::BackwardReal(const UnityComplexNumber* spectrum, float* output, int numsamples)
+{
+	const int n = numsamples / 2;
+	const FFTPlan* plan = FFTPlan::Get(n);
+	UnityComplexNumber* z = (UnityComplexNumber*)output;
+
+	// Pack even + i * odd, conjugated for the inverse
+	const UnityComplexNumber* w = plan->realtwiddles;
+	z[0].Set(0.5f * (spectrum[0].re + spectrum[n].re), -0.5f * (spectrum[0].re - spectrum[n].re));
+	for (int k = 1; k <= n / 2; k++)
+	{
+		const UnityComplexNumber x1 = spectrum[k], x2 = spectrum[n - k];
+		const float er = 0.5f * (x1.re + x2.re), ei = 0.5f * (x1.im - x2.im);
+		// odd = (x1 - conj(x2)) / 2 * conj(w^k)
+		const float dr = 0.5f * (x1.re - x2.re), di = 0.5f * (x1.im + x2.im);
+		const float orr = dr * w[k].re + di * w[k].im, oi = di * w[k].re - dr * w[k].im;
+		// z[k] = even + i odd, z[n - k] = conj(even) + i conj(odd)
+		z[k].Set(er - oi, -(ei + orr));
+		z[n - k].Set(er + oi, -(orr - ei));
+	}
+
+	FFTProcess<float>(z, plan, plan->twiddles);
+
+	const float scale = 1.0f / (float)n;
+	for (int k = 0; k < n; k++)
+	{
+		z[k].re *= scale;
+		z[k].im *= -scale;
+	}
+}
+
+void FFTAnalyzer::Cleanup()
+{
+    delete[] window;
+    delete[] ibuffer;
+    delete[] obuffer;
+    delete[] wbuffer;
+    delete[] ispec1;
+    delete[] ispec2;
+    delete[] ospec1;
+    delete[] ospec2;
+    delete[] cspec;
+}
+
+void FFTAnalyzer::AnalyzeInput(float* data, int numchannels, int numsamples, float decaySpeed)
+{
+    CheckInitialized();
+
+    for (int n = 0; n < spectrumSize - numsamples; n++)
+        ibuffer[n] = ibuffer[n + numsamples];
+    for (int n = 0; n < numsamples; n++)
+        ibuffer[n + spectrumSize - numsamples] = data[n * numchannels];
+    for (int n = 0; n < spectrumSize; n++)
+        wbuffer[n] = ibuffer[n] * window[n];
+    ForwardReal(wbuffer, cspec, spectrumSize);
+    for (int n = 0; n < spectrumSize / 2; n++)
+    {
+        float a = cspec[n].Magnitude();
+        ispec1[n] = (a > ispec2[n]) ? a : ispec2[n] * decaySpeed;
+    }
+}
+
+void FFTAnalyzer::AnalyzeOutput(float* data, int numchannels, int numsamples, float decaySpeed)
+{
+    CheckInitialized();
+
+    for (int n = 0; n < spectrumSize - numsamples; n++)
+        obuffer[n] = obuffer[n + numsamples];
+    for (int n = 0; n < numsamples; n++)
+        obuffer[n + spectrumSize - numsamples] = data[n * numchannels];
+    for (int n = 0; n < spectrumSize; n++)
+        wbuffer[n] = obuffer[n] * window[n];
+    ForwardReal(wbuffer, cspec, spectrumSize);
+    for (int n = 0; n < spectrumSize / 2; n++)
+    {
+        float a = cspec[n].Magnitude();
+        ospec1[n] = (a > ospec2[n]) ? a : ospec2[n] * decaySpeed;
+    }
+
+    float* tmp;
+    tmp = ispec1; ispec1 = ispec2; ispec2 = tmp;
+    tmp = ospec1; ospec1 = ospec2; ospec2 = tmp;
+
+    if (numSpectraReady < 2)
+        numSpectraReady++;
+}
+
+void FFTAnalyzer::CheckInitialized()
+{
+    if (window == NULL)
+    {
+        window = new float[spectrumSize];
+        ibuffer = new float[spectrumSize];
+        obuffer = new float[spectrumSize];
+        wbuffer = new float[spectrumSize];
+        ispec1 = new float[spectrumSize / 2];
+        ispec2 = new float[spectrumSize / 2];
+        ospec1 = new float[spectrumSize / 2];
+        ospec2 = new float[spectrumSize / 2];
+        cspec = new UnityComplexNumber[spectrumSize / 2 + 1];
+        for (int n = 0; n < spectrumSize; n++)
+            window[n] = 0.54f - 0.46f * cosf(n * (kPI / (float)spectrumSize));
+        memset(ibuffer, 0, sizeof(float) * spectrumSize);
+        memset(obuffer, 0, sizeof(float) * spectrumSize);
+        memset(ispec1, 0, sizeof(float) * (spectrumSize / 2));
+        memset(ispec2, 0, sizeof(float) * (spectrumSize / 2));
+        memset(ospec1, 0, sizeof(float) * (spectrumSize / 2));
+        memset(ospec2, 0, sizeof(float) * (spectrumSize / 2));
+        memset(wbuffer, 0, sizeof(float) * spectrumSize);
+        memset(cspec, 0, sizeof(UnityComplexNumber) * (spectrumSize / 2 + 1));
+    }
+}
+
+bool FFTAnalyzer::CanBeRead() const
+{
+    return numSpectraReady >= 2;
+}
+
+void FFTAnalyzer::ReadBuffer(float* buffer, int numsamples, bool readInputBuffer)
+{
+    if (!CanBeRead())
+    {
+        memset(buffer, 0, sizeof(float) * numsamples);
+        return;
+    }
+    if (numsamples > spectrumSize)
+        numsamples = spectrumSize;
+    float* buf = (readInputBuffer) ? ispec2 : ospec2;
+    float scale = (float)((spectrumSize / 2) - 2) / (float)(numsamples - 1);
+    for (int n = 0; n < numsamples; n++)
+    {
+        float f = n * scale;
+        int i = FastFloor(f);
+        buffer[n] = buf[i] + (buf[i + 1] - buf[i]) * (f - i);
+    }
+}
+
+// BlockOps kernels. Every instruction set fills a table of the same kernels, the aligned flavour of each
+// one is the template instantiated with ALIGNED. Linear ramps are computed as start + step * index instead of
+// accumulating the step, so long blocks end exactly where they should.
+
+#if FFT_SSE2 && (defined(__GNUC__) || defined(_MSC_VER))
+#   define BLOCKOPS_AVX 1
+#   include <immintrin.h>
+#   if defined(_MSC_VER)
+#       include <intrin.h>
+#       define BLOCKOPS_TARGET_AVX
+#   else
+#       include <cpuid.h>
+#       define BLOCKOPS_TARGET_AVX __attribute__((target("avx")))
+#   endif
+#endif
+
+struct BlockOpsKernels
+{
+    // Gains of sample i: start + step * (i + 1) for the linear and start * factor^(i + 1) for the exponential ramps
+    void (*gain[2])(float* dst, const float* src, int numsamples, float start, float step);
+    void (*gainexp[2])(float* dst, const float* src, int numsamples, float start, float factor);
+    void (*mixadd[2])(float* dst, const float* src, int numsamples, float start, float step);
+    void (*mixaddexp[2])(float* dst, const float* src, int numsamples, float start, float factor);
+    // Fade position of sample i: start + step * (i + 1), angles in radians for the equal power curve
+    void (*crossfade[2])(float* dst, const float* from, const float* to, int numsamples, float start, float step);
+    void (*crossfadepower[2])(float* dst, const float* from, const float* to, int numsamples, float start, float step);
+    void (*measure[2])(const float* src, int numsamples, float* peak, float* sumsquares);
+    void (*interleave2)(float* dst, const float* left, const float* right, int numframes);
+    void (*deinterleave2)(float* left, float* right, const float* src, int numframes);
+};
+
+static void GainScalar(float* dst, const float* src, int numsamples, float start, float step)
+{
+    for (int i = 0; i < numsamples; i++)
+        dst[i] = src[i] * (start + step * (float)(i + 1));
+}
+
+static void GainExpScalar(float* dst, const float* src, int numsamples, float start, float factor)
+{
+    float g = start;
+    for (int i = 0; i < numsamples; i++)
+    {
+        g *= factor;
+        dst[i] = src[i] * g;
+    }
+}
+
+static void MixAddScalar(float* dst, const float* src, int numsamples, float start, float step)
+{
+    for (int i = 0; i < numsamples; i++)
+        dst[i] += src[i] * (start + step * (float)(i + 1));
+}
+
+static void MixAddExpScalar(float* dst, const float* src, int numsamples, float start, float factor)
+{
+    float g = start;
+    for (int i = 0; i < numsamples; i++)
+    {
+        g *= factor;
+        dst[i] += src[i] * g;
+    }
+}
+
+static void CrossfadeScalar(float* dst, const float* from, const float* to, int numsamples, float start, float step)
+{
+    for (int i = 0; i < numsamples; i++)
+        dst[i] = from[i] + (to[i] - from[i]) * (start + step * (float)(i + 1));
+}
+
+// The equal power gains are the cosine and sine of the angle, which is advanced by rotating both
+static void CrossfadePowerScalar(float* dst, const float* from, const float* to, int numsamples, float start, float step)
+{
+    const float c = cosf(step), s = sinf(step);
+    float fadeout = cosf(start), fadein = sinf(start);
+    for (int i = 0; i < numsamples; i++)
+    {
+        const float t = fadeout * c - fadein * s;
+        fadein = fadein * c + fadeout * s;
+        fadeout = t;
+        dst[i] = from[i] * fadeout + to[i] * fadein;
+    }
+}
+
+static void MeasureScalar(const float* src, int numsamples, float* peak, float* sumsquares)
+{
+    float p = 0.0f, sum = 0.0f;
+    for (int i = 0; i < numsamples; i++)
+    {
+        const float a = fabsf(src[i]);
+        p = (a > p) ? a : p;
+        sum += src[i] * src[i];
+    }
+    *peak = p;
+    *sumsquares = sum;
+}
+
+static void Interleave2Scalar(float* dst, const float* left, const float* right, int numframes)
+{
+    for (int i = 0; i < numframes; i++)
+    {
+        dst[2 * i] = left[i];
+        dst[2 * i + 1] = right[i];
+    }
+}
+
+static void Deinterleave2Scalar(float* left, float* right, const float* src, int numframes)
+{
+    for (int i = 0; i < numframes; i++)
+    {
+        left[i] = src[2 * i];
+        right[i] = src[2 * i + 1];
+    }
+}
+
+static const BlockOpsKernels blockops_scalar =
+{
+    { GainScalar, GainScalar },
+    { GainExpScalar, GainExpScalar },
+    { MixAddScalar, MixAddScalar },
+    { MixAddExpScalar, MixAddExpScalar },
+    { CrossfadeScalar, CrossfadeScalar },
+    { CrossfadePowerScalar, CrossfadePowerScalar },
+    { MeasureScalar, MeasureScalar },
+    Interleave2Scalar,
+    Deinterleave2Scalar
+};
+
+#if FFT_SSE2
+
+template<bool ALIGNED> static inline __m128 LoadSSE2(const float* p) { return ALIGNED ? _mm_load_ps(p) : _mm_loadu_ps(p); }
+template<bool ALIGNED> static inline void StoreSSE2(float* p, __m128 v) { if (ALIGNED) _mm_store_ps(p, v); else _mm_storeu_ps(p, v); }
+
+template<bool ALIGNED> static void GainSSE2(float* dst, const float* src, int numsamples, float start, float step)
+{
+    const __m128 vstep = _mm_set1_ps(step);
+    __m128 index = _mm_setr_ps(1.0f, 2.0f, 3.0f, 4.0f);
+    const __m128 four = _mm_set1_ps(4.0f), vstart = _mm_set1_ps(start);
+    int i = 0;
+    for (; i + 4 <= numsamples; i += 4)
+    {
+        const __m128 g = _mm_add_ps(vstart, _mm_mul_ps(vstep, index));
+        StoreSSE2<ALIGNED>(dst + i, _mm_mul_ps(LoadSSE2<ALIGNED>(src + i), g));
+        index = _mm_add_ps(index, four);
+    }
+    GainScalar(dst + i, src + i, numsamples - i, start + step * (float)i, step);
+}
+
+template<bool ALIGNED> static void GainExpSSE2(float* dst, const float* src, int numsamples, float start, float factor)
+{
+    const float f2 = factor * factor;
+    __m128 g = _mm_mul_ps(_mm_set1_ps(start), _mm_setr_ps(factor, f2, f2 * factor, f2 * f2));
+    const __m128 f4 = _mm_set1_ps(f2 * f2);
+    int i = 0;
+    for (; i + 4 <= numsamples; i += 4)
+    {
+        StoreSSE2<ALIGNED>(dst + i, _mm_mul_ps(LoadSSE2<ALIGNED>(src + i), g));
+        g = _mm_mul_ps(g, f4);
+    }
+    GainExpScalar(dst + i, src + i, numsamples - i, start * powf(factor, (float)i), factor);
+}
+
+template<bool ALIGNED> static void MixAddSSE2(float* dst, const float* src, int numsamples, float start, float step)
+{
+    const __m128 vstep = _mm_set1_ps(step);
+    __m128 index = _mm_setr_ps(1.0f, 2.0f, 3.0f, 4.0f);
+    const __m128 four = _mm_set1_ps(4.0f), vstart = _mm_set1_ps(start);
+    int i = 0;
+    for (; i + 4 <= numsamples; i += 4)
+    {
+        const __m128 g = _mm_add_ps(vstart, _mm_mul_ps(vstep, index));
+        StoreSSE2<ALIGNED>(dst + i, _mm_add_ps(LoadSSE2<ALIGNED>(dst + i), _mm_mul_ps(LoadSSE2<ALIGNED>(src + i), g)));
+        index = _mm_add_ps(index, four);
+    }
+    MixAddScalar(dst + i, src + i, numsamples - i, start + step * (float)i, step);
+}
+
+template<bool ALIGNED> static void MixAddExpSSE2(float* dst, const float* src, int numsamples, float start, float factor)
+{
+    const float f2 = factor * factor;
+    __m128 g = _mm_mul_ps(_mm_set1_ps(start), _mm_setr_ps(factor, f2, f2 * factor, f2 * f2));
+    const __m128 f4 = _mm_set1_ps(f2 * f2);
+    int i = 0;
+    for (; i + 4 <= numsamples; i += 4)
+    {
+        StoreSSE2<ALIGNED>(dst + i, _mm_add_ps(LoadSSE2<ALIGNED>(dst + i), _mm_mul_ps(LoadSSE2<ALIGNED>(src + i), g)));
+        g = _mm_mul_ps(g, f4);
+    }
+    MixAddExpScalar(dst + i, src + i, numsamples - i, start * powf(factor, (float)i), factor);
+}
+
+template<bool ALIGNED> static void CrossfadeSSE2(float* dst, const float* from, const float* to, int numsamples, float start, float step)
+{
+    const __m128 vstep = _mm_set1_ps(step);
+    __m128 index = _mm_setr_ps(1.0f, 2.0f, 3.0f, 4.0f);
+    const __m128 four = _mm_set1_ps(4.0f), vstart = _mm_set1_ps(start);
+    int i = 0;
+    for (; i + 4 <= numsamples; i += 4)
+    {
+        const __m128 x = _mm_add_ps(vstart, _mm_mul_ps(vstep, index));
+        const __m128 a = LoadSSE2<ALIGNED>(from + i);
+        StoreSSE2<ALIGNED>(dst + i, _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(LoadSSE2<ALIGNED>(to + i), a), x)));
+        index = _mm_add_ps(index, four);
+    }
+    CrossfadeScalar(dst + i, from + i, to + i, numsamples - i, start + step * (float)i, step);
+}
+
+template<bool ALIGNED> static void CrossfadePowerSSE2(float* dst, const float* from, const float* to, int numsamples, float start, float step)
+{
+    // Each lane rotates by four steps per iteration
+    __m128 fadeout = _mm_setr_ps(cosf(start + step), cosf(start + 2.0f * step), cosf(start + 3.0f * step), cosf(start + 4.0f * step));
+    __m128 fadein = _mm_setr_ps(sinf(start + step), sinf(start + 2.0f * step), sinf(start + 3.0f * step), sinf(start + 4.0f * step));
+    const __m128 c = _mm_set1_ps(cosf(4.0f * step)), s = _mm_set1_ps(sinf(4.0f * step));
+    int i = 0;
+    for (; i + 4 <= numsamples; i += 4)
+    {
+        StoreSSE2<ALIGNED>(dst + i, _mm_add_ps(_mm_mul_ps(LoadSSE2<ALIGNED>(from + i), fadeout), _mm_mul_ps(LoadSSE2<ALIGNED>(to + i), fadein)));
+        const __m128 t = _mm_sub_ps(_mm_mul_ps(fadeout, c), _mm_mul_ps(fadein, s));
+        fadein = _mm_add_ps(_mm_mul_ps(fadein, c), _mm_mul_ps(fadeout, s));
+        fadeout = t;
+    }
+    CrossfadePowerScalar(dst + i, from + i, to + i, numsamples - i, start + step * (float)i, step);
+}
+
+template<bool ALIGNED> static void MeasureSSE2(const float* src, int numsamples, float* peak, float* sumsquares)
+{
+    const __m128 absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 p = _mm_setzero_ps(), sum = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= numsamples; i += 4)
+    {
+        const __m128 x = LoadSSE2<ALIGNED>(src + i);
+        p = _mm_max_ps(p, _mm_and_ps(x, absmask));
+        sum = _mm_add_ps(sum, _mm_mul_ps(x, x));
+    }
+    float lanes[4], sums[4];
+    _mm_storeu_ps(lanes, p);
+    _mm_storeu_ps(sums, sum);
+    MeasureScalar(src + i, numsamples - i, peak, sumsquares);
+    for (int k = 0; k < 4; k++)
+    {
+        *peak = (lanes[k] > *peak) ? lanes[k] : *peak;
+        *sumsquares += sums[k];
+    }
+}
+
+static void Interleave2SSE2(float* dst, const float* left, const float* right, int numframes)
+{
+    int i = 0;
+    for (; i + 4 <= numframes; i += 4)
+    {
+        const __m128 l = _mm_loadu_ps(left + i), r = _mm_loadu_ps(right + i);
+        _mm_storeu_ps(dst + 2 * i, _mm_unpacklo_ps(l, r));
+        _mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(l, r));
+    }
+    Interleave2Scalar(dst + 2 * i, left + i, right + i, numframes - i);
+}
+
+static void Deinterleave2SSE2(float* left, float* right, const float* src, int numframes)
+{
+    int i = 0;
+    for (; i + 4 <= numframes; i += 4)
+    {
+        const __m128 a = _mm_loadu_ps(src + 2 * i), b = _mm_loadu_ps(src + 2 * i + 4);
+        _mm_storeu_ps(left + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(right + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    Deinterleave2Scalar(left + i, right + i, src + 2 * i, numframes - i);
+}
+
+static const BlockOpsKernels blockops_sse2 =
+{
+    { GainSSE2<false>, GainSSE2<true> },
+    { GainExpSSE2<false>, GainExpSSE2<true> },
+    { MixAddSSE2<false>, MixAddSSE2<true> },
+    { MixAddExpSSE2<false>, MixAddExpSSE2<true> },
+    { CrossfadeSSE2<false>, CrossfadeSSE2<true> },
+    { CrossfadePowerSSE2<false>, CrossfadePowerSSE2<true> },
+    { MeasureSSE2<false>, MeasureSSE2<true> },
+    Interleave2SSE2,
+    Deinterleave2SSE2
+};
+
+#endif
+
+#if BLOCKOPS_AVX
+
+// Compiled for AVX regardless of the compiler flags, only called after CPUSupportsAVX said yes
+template<bool ALIGNED> BLOCKOPS_TARGET_AVX static inline __m256 LoadAVX(const float* p) { return ALIGNED ? _mm256_load_ps(p) : _mm256_loadu_ps(p); }
+template<bool ALIGNED> BLOCKOPS_TARGET_AVX static inline void StoreAVX(float* p, __m256 v) { if (ALIGNED) _mm256_store_ps(p, v); else _mm256_storeu_ps(p, v); }
+
+template<bool ALIGNED> BLOCKOPS_TARGET_AVX static void GainAVX(float* dst, const float* src, int numsamples, float start, float step)
+{
+    const __m256 vstep = _mm256_set1_ps(step);
+    __m256 index = _mm256_setr_ps(1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f);
+    const __m256 eight = _mm256_set1_ps(8.0f), vstart = _mm256_set1_ps(start);
+    int i = 0;
+    for (; i + 8 <= numsamples; i += 8)
+    {
+        const __m256 g = _mm256_add_ps(vstart, _mm256_mul_ps(vstep, index));
+        StoreAVX<ALIGNED>(dst + i, _mm256_mul_ps(LoadAVX<ALIGNED>(src + i), g));
+        index = _mm256_add_ps(index, eight);
+    }
+    GainScalar(dst + i, src + i, numsamples - i, start + step * (float)i, step);
+}
+
+template<bool ALIGNED> BLOCKOPS_TARGET_AVX static void GainExpAVX(float* dst, const float* src, int numsamples, float start, float factor)
+{
+    float powers[8];
+    powers[0] = start * factor;
+    for (int k = 1; k < 8; k++)
+        powers[k] = powers[k - 1] * factor;
+    const float f2 = factor * factor, f4 = f2 * f2;
+    __m256 g = _mm256_loadu_ps(powers);
+    const __m256 f8 = _mm256_set1_ps(f4 * f4);
+    int i = 0;
+    for (; i + 8 <= numsamples; i += 8)
+    {
+        StoreAVX<ALIGNED>(dst + i, _mm256_mul_ps(LoadAVX<ALIGNED>(src + i), g));
+        g = _mm256_mul_ps(g, f8);
+    }
+    GainExpScalar(dst + i, src + i, numsamples - i, start * powf(factor, (float)i), factor);
+}
+
+template<bool ALIGNED> BLOCKOPS_TARGET_AVX static void MixAddAVX(float* dst, const float* src, int numsamples, float start, float step)
+{
+    const __m256 vstep = _mm256_set1_ps(step);
+    __m256 index = _mm256_setr_ps(1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f);
+    const __m256 eight = _mm256_set1_ps(8.0f), vstart = _mm256_set1_ps(start);
+    int i = 0;
+    for (; i + 8 <= numsamples; i += 8)
+    {
+        const __m256 g = _mm256_add_ps(vstart, _mm256_mul_ps(vstep, index));
+        StoreAVX<ALIGNED>(dst + i, _mm256_add_ps(LoadAVX<ALIGNED>(dst + i), _mm256_mul_ps(LoadAVX<ALIGNED>(src + i), g)));
+        index = _mm256_add_ps(index, eight);
+    }
+    MixAddScalar(dst + i, src + i, numsamples - i, start + step * (float)i, step);
+}
+
+template<bool ALIGNED> BLOCKOPS_TARGET_AVX static void MixAddExpAVX(float* dst, const float* src, int numsamples, float start, float factor)
+{
+    float powers[8];
+    powers[0] = start * factor;
+    for (int k = 1; k < 8; k++)
+        powers[k] = powers[k - 1] * factor;
+    const float f2 = factor * factor, f4 = f2 * f2;
+    __m256 g = _mm256_loadu_ps(powers);
+    const __m256 f8 = _mm256_set1_ps(f4 * f4);
+    int i = 0;
+    for (; i + 8 <= numsamples; i += 8)
+    {
+        StoreAVX<ALIGNED>(dst + i, _mm256_add_ps(LoadAVX<ALIGNED>(dst + i), _mm256_mul_ps(LoadAVX<ALIGNED>(src + i), g)));
+        g = _mm256_mul_ps(g, f8);
+    }
+    MixAddExpScalar(dst + i, src + i, numsamples - i, start * powf(factor, (float)i), factor);
+}
+
+template<bool ALIGNED> BLOCKOPS_TARGET_AVX static void CrossfadeAVX(float* dst, const float* from, const float* to, int numsamples, float start, float step)
+{
+    const __m256 vstep = _mm256_set1_ps(step);
+    __m256 index = _mm256_setr_ps(1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f);
+    const __m256 eight = _mm256_set1_ps(8.0f), vstart = _mm256_set1_ps(start);
+    int i = 0;
+    for (; i + 8 <= numsamples; i += 8)
+    {
+        const __m256 x = _mm256_add_ps(vstart, _mm256_mul_ps(vstep, index));
+        const __m256 a = LoadAVX<ALIGNED>(from + i);
+        StoreAVX<ALIGNED>(dst + i, _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(LoadAVX<ALIGNED>(to + i), a), x)));
+        index = _mm256_add_ps(index, eight);
+    }
+    CrossfadeScalar(dst + i, from + i, to + i, numsamples - i, start + step * (float)i, step);
+}
+
+template<bool ALIGNED> BLOCKOPS_TARGET_AVX static void CrossfadePowerAVX(float* dst, const float* from, const float* to, int numsamples, float start, float step)
+{
+    float fadeouts[8], fadeins[8];
+    for (int k = 0; k < 8; k++)
+    {
+        fadeouts[k] = cosf(start + (float)(k + 1) * step);
+        fadeins[k] = sinf(start + (float)(k + 1) * step);
+    }
+    __m256 fadeout = _mm256_loadu_ps(fadeouts), fadein = _mm256_loadu_ps(fadeins);
+    const __m256 c = _mm256_set1_ps(cosf(8.0f * step)), s = _mm256_set1_ps(sinf(8.0f * step));
+    int i = 0;
+    for (; i + 8 <= numsamples; i += 8)
+    {
+        StoreAVX<ALIGNED>(dst + i, _mm256_add_ps(_mm256_mul_ps(LoadAVX<ALIGNED>(from + i), fadeout), _mm256_mul_ps(LoadAVX<ALIGNED>(to + i), fadein)));
+        const __m256 t = _mm256_sub_ps(_mm256_mul_ps(fadeout, c), _mm256_mul_ps(fadein, s));
+        fadein = _mm256_add_ps(_mm256_mul_ps(fadein, c), _mm256_mul_ps(fadeout, s));
+        fadeout = t;
+    }
+    CrossfadePowerScalar(dst + i, from + i, to + i, numsamples - i, start + step * (float)i, step);
+}
+
+template<bool ALIGNED> BLOCKOPS_TARGET_AVX static void MeasureAVX(const float* src, int numsamples, float* peak, float* sumsquares)
+{
+    const __m256 absmask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 p = _mm256_setzero_ps(), sum = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= numsamples; i += 8)
+    {
+        const __m256 x = LoadAVX<ALIGNED>(src + i);
+        p = _mm256_max_ps(p, _mm256_and_ps(x, absmask));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(x, x));
+    }
+    float lanes[8], sums[8];
+    _mm256_storeu_ps(lanes, p);
+    _mm256_storeu_ps(sums, sum);
+    MeasureScalar(src + i, numsamples - i, peak, sumsquares);
+    for (int k = 0; k < 8; k++)
+    {
+        *peak = (lanes[k] > *peak) ? lanes[k] : *peak;
+        *sumsquares += sums[k];
+    }
+}
+
+// Interleaving is bound by memory rather than arithmetic, the SSE2 shuffles are as fast
+static const BlockOpsKernels blockops_avx =
+{
+    { GainAVX<false>, GainAVX<true> },
+    { GainExpAVX<false>, GainExpAVX<true> },
+    { MixAddAVX<false>, MixAddAVX<true> },
+    { MixAddExpAVX<false>, MixAddExpAVX<true> },
+    { CrossfadeAVX<false>, CrossfadeAVX<true> },
+    { CrossfadePowerAVX<false>, CrossfadePowerAVX<true> },
+    { MeasureAVX<false>, MeasureAVX<true> },
+    Interleave2SSE2,
+    Deinterleave2SSE2
+};
+
+// AVX needs the CPU to support it and the OS to save the YMM registers on context switches
+static bool CPUSupportsAVX()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    const unsigned int ecx = (unsigned int)info[2];
+#else
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+#endif
+    if ((ecx & (1u << 27)) == 0 || (ecx & (1u << 28)) == 0)
+        return false;
+#if defined(_MSC_VER)
+    const unsigned long long xcr0 = _xgetbv(0);
+#else
+    unsigned int lo, hi;
+    __asm__ volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+    const unsigned long long xcr0 = ((unsigned long long)hi << 32) | lo;
+#endif
+    return (xcr0 & 6) == 6;
+}
+
+#endif
+
+static std::atomic<int> blockops_isa(-1);
+
+static const BlockOpsKernels& GetBlockOpsKernels()
+{
+    int isa = blockops_isa.load(std::memory_order_relaxed);
+    if (isa < 0)
+    {
+        isa = BlockOps::GetSupportedISA();
+        blockops_isa.store(isa, std::memory_order_relaxed);
+    }
+#if BLOCKOPS_AVX
+    if (isa == BlockOps::ISA_AVX)
+        return blockops_avx;
+#endif
+#if FFT_SSE2
+    if (isa == BlockOps::ISA_SSE2)
+        return blockops_sse2;
+#endif
+    return blockops_scalar;
+}
+
+BlockOps::ISA BlockOps::GetSupportedISA()
+{
+#if BLOCKOPS_AVX
+    static const bool avx = CPUSupportsAVX();
+    if (avx)
+        return ISA_AVX;
+#endif
+#if FFT_SSE2
+    return ISA_SSE2;
+#else
+    return ISA_Scalar;
+#endif
+}
+
+BlockOps::ISA BlockOps::GetISA()
+{
+    GetBlockOpsKernels();
+    return (ISA)blockops_isa.load(std::memory_order_relaxed);
+}
+
+void BlockOps::SetISA(ISA isa)
+{
+    const ISA supported = GetSupportedISA();
+    blockops_isa.store((isa > supported) ? supported : isa, std::memory_order_relaxed);
+}
+
+const char* BlockOps::GetISAName(ISA isa)
+{
+    switch (isa)
+    {
+        case ISA_AVX: return "AVX";
+        case ISA_SSE2: return "SSE2";
+        default: return "Scalar";
+    }
+}
+
+static inline bool IsExponentialRamp(BlockOps::Ramp ramp, float start, float end)
+{
+    return ramp == BlockOps::Ramp_Exponential && start > 0.0f && end > 0.0f && start != end;
+}
+
+static void ApplyGain(bool aligned, float* dst, const float* src, int numsamples, float start, float end, BlockOps::Ramp ramp)
+{
+    if (numsamples <= 0)
+        return;
+    const BlockOpsKernels& kernels = GetBlockOpsKernels();
+    if (IsExponentialRamp(ramp, start, end))
+        kernels.gainexp[aligned](dst, src, numsamples, start, (float)pow((double)end / start, 1.0 / numsamples));
+    else
+        kernels.gain[aligned](dst, src, numsamples, start, (end - start) / (float)numsamples);
+}
+
+static void ApplyMixAdd(bool aligned, float* dst, const float* src, int numsamples, float start, float end, BlockOps::Ramp ramp)
+{
+    if (numsamples <= 0)
+        return;
+    const BlockOpsKernels& kernels = GetBlockOpsKernels();
+    if (IsExponentialRamp(ramp, start, end))
+        kernels.mixaddexp[aligned](dst, src, numsamples, start, (float)pow((double)end / start, 1.0 / numsamples));
+    else
+        kernels.mixadd[aligned](dst, src, numsamples, start, (end - start) / (float)numsamples);
+}
+
+static void ApplyCrossfade(bool aligned, float* dst, const float* from, const float* to, int numsamples, float start, float end, BlockOps::Curve curve)
+{
+    if (numsamples <= 0)
+        return;
+    const BlockOpsKernels& kernels = GetBlockOpsKernels();
+    if (curve == BlockOps::Curve_EqualPower)
+    {
+        const float angle = 0.5f * kPI;
+        kernels.crossfadepower[aligned](dst, from, to, numsamples, start * angle, (end - start) * angle / (float)numsamples);
+    }
+    else
+        kernels.crossfade[aligned](dst, from, to, numsamples, start, (end - start) / (float)numsamples);
+}
+
+static void ApplyMeasure(bool aligned, const float* src, int numsamples, float* peak, float* rms)
+{
+    float p = 0.0f, sumsquares = 0.0f;
+    if (numsamples > 0)
+        GetBlockOpsKernels().measure[aligned](src, numsamples, &p, &sumsquares);
+    if (peak != NULL)
+        *peak = p;
+    if (rms != NULL)
+        *rms = (numsamples > 0) ? sqrtf(sumsquares / (float)numsamples) : 0.0f;
+}
+
+void BlockOps::Gain(float* dst, const float* src, int numsamples, float start, float end, Ramp ramp)
+{
+    ApplyGain(false, dst, src, numsamples, start, end, ramp);
+}
+
+void BlockOps::GainAligned(float* dst, const float* src, int numsamples, float start, float end, Ramp ramp)
+{
+    ApplyGain(true, dst, src, numsamples, start, end, ramp);
+}
+
+void BlockOps::GainInterleaved(float* dst, const float* src, int numchannels, int numframes, float start, float end, Ramp ramp)
+{
+    // A constant gain treats every sample alike, so the vectorized kernels apply
+    if (start == end)
+    {
+        ApplyGain(false, dst, src, numchannels * numframes, start, end, ramp);
+        return;
+    }
+    if (numframes <= 0)
+        return;
+    if (IsExponentialRamp(ramp, start, end))
+    {
+        const float factor = (float)pow((double)end / start, 1.0 / numframes);
+        float g = start;
+        for (int i = 0; i < numframes; i++)
+        {
+            g *= factor;
+            for (int c = 0; c < numchannels; c++)
+                dst[i * numchannels + c] = src[i * numchannels + c] * g;
+        }
+    }
+    else
+    {
+        const float step = (end - start) / (float)numframes;
+        for (int i = 0; i < numframes; i++)
         {
-            for (int i = m; i < numsamples; i += step)
-            {
-                UnityComplexNumberT<T> t;
-				UnityComplexNumber::Mul(wd, data[i + j], t);
-                UnityComplexNumber::Sub(data[i], t, data[i + j]);
-                UnityComplexNumber::Add(data[i], t, data[i]);
-            }
-            UnityComplexNumber::Mul(wd, wr, wd);
+            const float g = start + step * (float)(i + 1);
+            for (int c = 0; c < numchannels; c++)
+                dst[i * numchannels + c] = src[i * numchannels + c] * g;
         }
-		w0 *= T(0.5);
     }
 }
 
-void FFT::Forward(UnityComplexNumber* data, int numsamples, bool highprecision)
+void BlockOps::MixAdd(float* dst, const float* src, int numsamples, float start, float end, Ramp ramp)
+{
+    ApplyMixAdd(false, dst, src, numsamples, start, end, ramp);
+}
+
+void BlockOps::MixAddAligned(float* dst, const float* src, int numsamples, float start, float end, Ramp ramp)
 {
-	if (highprecision)
-		FFTProcess<double>(data, numsamples, true);
-	else
-		FFTProcess<float>(data, numsamples, true);
+    ApplyMixAdd(true, dst, src, numsamples, start, end, ramp);
 }
 
-void FFT::Backward(UnityComplexNumber* data, int numsamples, bool highprecision)
+void BlockOps::Crossfade(float* dst, const float* from, const float* to, int numsamples, float start, float end, Curve curve)
 {
-	if (highprecision)
-		FFTProcess<double>(data, numsamples, false);
-	else
-		FFTProcess<float>(data, numsamples, false);
-    
-	const float scale = 1.0f / (float)numsamples;
-	for (int n = 0; n < numsamples; n++)
-	{
-		data[n].re *= scale;
-		data[n].im *= scale;
-	}	
+    ApplyCrossfade(false, dst, from, to, numsamples, start, end, curve);
 }
 
-void FFTAnalyzer::Cleanup()
+void BlockOps::CrossfadeAligned(float* dst, const float* from, const float* to, int numsamples, float start, float end, Curve curve)
 {
-    delete[] window;
-    delete[] ibuffer;
-    delete[] obuffer;
-    delete[] ispec1;
-    delete[] ispec2;
-    delete[] ospec1;
-    delete[] ospec2;
-    delete[] cspec;
+    ApplyCrossfade(true, dst, from, to, numsamples, start, end, curve);
 }
 
-void FFTAnalyzer::AnalyzeInput(float* data, int numchannels, int numsamples, float decaySpeed)
+void BlockOps::Measure(const float* src, int numsamples, float* peak, float* rms)
 {
-    CheckInitialized();
+    ApplyMeasure(false, src, numsamples, peak, rms);
+}
 
-    for (int n = 0; n < spectrumSize - numsamples; n++)
-        ibuffer[n] = ibuffer[n + numsamples];
-    for (int n = 0; n < numsamples; n++)
-        ibuffer[n + spectrumSize - numsamples] = data[n * numchannels];
-    for (int n = 0; n < spectrumSize; n++)
-        cspec[n].Set(ibuffer[n] * window[n], 0.0f);
-    Forward(cspec, spectrumSize, true);
-    for (int n = 0; n < spectrumSize / 2; n++)
+void BlockOps::MeasureAligned(const float* src, int numsamples, float* peak, float* rms)
+{
+    ApplyMeasure(true, src, numsamples, peak, rms);
+}
+
+void BlockOps::Interleave(float* dst, const float* const* src, int numchannels, int numframes)
+{
+    if (numchannels == 2 && src[0] != NULL && src[1] != NULL)
     {
-        float a = cspec[n].Magnitude();
-        ispec1[n] = (a > ispec2[n]) ? a : ispec2[n] * decaySpeed;
+        GetBlockOpsKernels().interleave2(dst, src[0], src[1], numframes);
+        return;
+    }
+    for (int c = 0; c < numchannels; c++)
+    {
+        float* d = dst + c;
+        const float* s = src[c];
+        if (s == NULL)
+            for (int i = 0; i < numframes; i++)
+                d[i * numchannels] = 0.0f;
+        else
+            for (int i = 0; i < numframes; i++)
+                d[i * numchannels] = s[i];
     }
 }
 
-void FFTAnalyzer::AnalyzeOutput(float* data, int numchannels, int numsamples, float decaySpeed)
+void BlockOps::Deinterleave(float* const* dst, const float* src, int numchannels, int numframes)
 {
-    CheckInitialized();
+    if (numchannels == 2 && dst[0] != NULL && dst[1] != NULL)
+    {
+        GetBlockOpsKernels().deinterleave2(dst[0], dst[1], src, numframes);
+        return;
+    }
+    for (int c = 0; c < numchannels; c++)
+    {
+        float* d = dst[c];
+        if (d == NULL)
+            continue;
+        const float* s = src + c;
+        for (int i = 0; i < numframes; i++)
+            d[i] = s[i * numchannels];
+    }
+}
 
-    for (int n = 0; n < spectrumSize - numsamples; n++)
-        obuffer[n] = obuffer[n + numsamples];
-    for (int n = 0; n < numsamples; n++)
-        obuffer[n + spectrumSize - numsamples] = data[n * numchannels];
-    for (int n = 0; n < spectrumSize; n++)
-        cspec[n].Set(obuffer[n] * window[n], 0.0f);
-    Forward(cspec, spectrumSize, true);
-    for (int n = 0; n < spectrumSize / 2; n++)
+SpectrumAnalyzer::SpectrumAnalyzer()
+    : fftsize(0)
+    , hopsize(0)
+    , decay(0.0f)
+    , scale(0.0f)
+    , window(NULL)
+    , history(NULL)
+    , writepos(0)
+    , hopcount(0)
+    , wbuffer(NULL)
+    , spec(NULL)
+    , peaks(NULL)
+    , back(0)
+    , front(1)
+    , middle(2)
+    , ready(false)
+{
+    for (int i = 0; i < 3; i++)
+        published[i] = NULL;
+}
+
+SpectrumAnalyzer::~SpectrumAnalyzer()
+{
+    Cleanup();
+}
+
+void SpectrumAnalyzer::Cleanup()
+{
+    delete[] window;
+    delete[] history;
+    delete[] wbuffer;
+    delete[] spec;
+    delete[] peaks;
+    for (int i = 0; i < 3; i++)
     {
-        float a = cspec[n].Magnitude();
-        ospec1[n] = (a > ospec2[n]) ? a : ospec2[n] * decaySpeed;
+        delete[] published[i];
+        published[i] = NULL;
     }
+    window = history = wbuffer = peaks = NULL;
+    spec = NULL;
+}
 
-    float* tmp;
-    tmp = ispec1; ispec1 = ispec2; ispec2 = tmp;
-    tmp = ospec1; ospec1 = ospec2; ospec2 = tmp;
+void SpectrumAnalyzer::Init(int _fftsize, int _hopsize, float _decay)
+{
+    Cleanup();
+    fftsize = _fftsize;
+    hopsize = (_hopsize < 1) ? 1 : _hopsize;
+    decay = _decay;
+    writepos = 0;
+    hopcount = 0;
 
-    if (numSpectraReady < 2)
-        numSpectraReady++;
+    const int numbins = GetNumBins();
+    window = new float[fftsize];
+    history = new float[fftsize];
+    wbuffer = new float[fftsize];
+    spec = new UnityComplexNumber[numbins];
+    peaks = new float[numbins];
+    float windowsum = 0.0f;
+    for (int n = 0; n < fftsize; n++)
+    {
+        window[n] = 0.5f - 0.5f * cosf(2.0f * kPI * (float)n / (float)fftsize); // Hann
+        windowsum += window[n];
+    }
+    scale = 2.0f / windowsum;
+    memset(history, 0, sizeof(float) * fftsize);
+    memset(peaks, 0, sizeof(float) * numbins);
+    for (int i = 0; i < 3; i++)
+    {
+        published[i] = new float[numbins];
+        memset(published[i], 0, sizeof(float) * numbins);
+    }
+    back = 0;
+    front = 1;
+    middle.store(2);
+    ready.store(false);
 }
 
-void FFTAnalyzer::CheckInitialized()
+void SpectrumAnalyzer::Feed(const float* data, int stride, int numsamples)
 {
-    if (window == NULL)
+    const int mask = fftsize - 1;
+    while (numsamples > 0)
     {
-        window = new float[spectrumSize];
-        ibuffer = new float[spectrumSize];
-        obuffer = new float[spectrumSize];
-        ispec1 = new float[spectrumSize / 2];
-        ispec2 = new float[spectrumSize / 2];
-        ospec1 = new float[spectrumSize / 2];
-        ospec2 = new float[spectrumSize / 2];
-        cspec = new UnityComplexNumber[spectrumSize];
-        for (int n = 0; n < spectrumSize; n++)
-            window[n] = 0.54f - 0.46f * cosf(n * (kPI / (float)spectrumSize));
-        memset(ibuffer, 0, sizeof(float) * spectrumSize);
-        memset(obuffer, 0, sizeof(float) * spectrumSize);
-        memset(ispec1, 0, sizeof(float) * (spectrumSize / 2));
-        memset(ispec2, 0, sizeof(float) * (spectrumSize / 2));
-        memset(ospec1, 0, sizeof(float) * (spectrumSize / 2));
-        memset(ospec2, 0, sizeof(float) * (spectrumSize / 2));
-        memset(cspec, 0, sizeof(UnityComplexNumber) * spectrumSize);
+        // Copy up to the end of the current hop
+        int num = hopsize - hopcount;
+        if (num > numsamples)
+            num = numsamples;
+        for (int n = 0; n < num; n++)
+        {
+            history[writepos] = data[n * stride];
+            writepos = (writepos + 1) & mask;
+        }
+        data += num * stride;
+        numsamples -= num;
+        hopcount += num;
+        if (hopcount == hopsize)
+        {
+            hopcount = 0;
+            Analyze();
+        }
     }
 }
 
-bool FFTAnalyzer::CanBeRead() const
+void SpectrumAnalyzer::Analyze()
 {
-    return numSpectraReady >= 2;
+    // writepos points at the oldest sample
+    const int tail = fftsize - writepos;
+    for (int n = 0; n < tail; n++)
+        wbuffer[n] = history[writepos + n] * window[n];
+    for (int n = 0; n < writepos; n++)
+        wbuffer[tail + n] = history[n] * window[tail + n];
+    FFT::ForwardReal(wbuffer, spec, fftsize);
+
+    const int numbins = GetNumBins();
+    float* target = published[back];
+    for (int n = 0; n < numbins; n++)
+    {
+        const float a = spec[n].Magnitude() * scale;
+        const float held = peaks[n] * decay;
+        peaks[n] = (a > held) ? a : held;
+        target[n] = peaks[n];
+    }
+
+    back = middle.exchange(back | kDirty, std::memory_order_acq_rel) & ~kDirty;
+    ready.store(true, std::memory_order_release);
 }
 
-void FFTAnalyzer::ReadBuffer(float* buffer, int numsamples, bool readInputBuffer)
+bool SpectrumAnalyzer::ReadSpectrum(float* buffer, int numbins)
 {
-    if (!CanBeRead())
+    if (!ready.load(std::memory_order_acquire) || numbins < 1)
     {
-        memset(buffer, 0, sizeof(float) * numsamples);
-        return;
+        if (numbins > 0)
+            memset(buffer, 0, sizeof(float) * numbins);
+        return false;
     }
-    if (numsamples > spectrumSize)
-        numsamples = spectrumSize;
-    float* buf = (readInputBuffer) ? ispec2 : ospec2;
-    float scale = (float)((spectrumSize / 2) - 2) / (float)(numsamples - 1);
-    for (int n = 0; n < numsamples; n++)
+
+    if (middle.load(std::memory_order_relaxed) & kDirty)
+        front = middle.exchange(front, std::memory_order_acq_rel) & ~kDirty;
+
+    const float* spectrum = published[front];
+    const int last = GetNumBins() - 1;
+    const float step = (numbins > 1) ? (float)last / (float)(numbins - 1) : 0.0f;
+    for (int n = 0; n < numbins; n++)
     {
-        float f = n * scale;
-        int i = FastFloor(f);
-        buffer[n] = buf[i] + (buf[i + 1] - buf[i]) * (f - i);
+        const float f = n * step;
+        const int i = FastFloor(f);
+        buffer[n] = (i >= last) ? spectrum[last] : spectrum[i] + (spectrum[i + 1] - spectrum[i]) * (f - i);
     }
+    return true;
 }
 
 HistoryBuffer::HistoryBuffer()
@@ -230,16 +1268,36 @@ HistoryBuffer::~HistoryBuffer()
 
 void HistoryBuffer::Init(int _length)
 {
-    length = _length;
+    delete[] data;
+    length = 1;
+    while (length < _length)
+        length *= 2;
     data = new float[length];
     memset(data, 0, sizeof(float) * length);
+    writeindex.store(0);
+}
+
+int HistoryBuffer::Read(float* buffer, int numsamples) const
+{
+    if (numsamples > length)
+        numsamples = length;
+    Read(buffer, numsamples, 0);
+    return numsamples;
+}
+
+void HistoryBuffer::Read(float* buffer, int numsamples, int delay) const
+{
+    const int start = (writeindex.load(std::memory_order_acquire) + 1 - numsamples - delay) & (length - 1);
+    const int first = (numsamples < length - start) ? numsamples : (length - start);
+    memcpy(buffer, data + start, first * sizeof(float));
+    memcpy(buffer + first, data, (numsamples - first) * sizeof(float));
 }
 
 void HistoryBuffer::ReadBuffer(float* buffer, int numsamplesTarget, int numsamplesSource, float offset)
 {
     numsamplesTarget--; // reserve last sample for count of how much we were able to read
     float speed = (float)numsamplesSource / (float)numsamplesTarget;
-    int n, w = writeindex; // since ReadBuffer is called from the GUI thread, writeindex may be modified by the DSP thread simultaneously
+    int n, w = writeindex.load(std::memory_order_acquire); // since ReadBuffer is called from the GUI thread, writeindex may be modified by the DSP thread simultaneously
     float p = offset;
     for (n = 0; n < numsamplesTarget; n++)
     {
@@ -301,6 +1359,9 @@ bool Mutex::TryLock()
 
 void Mutex::Lock()
 {
+#if !SOFA_RT_AUDIT_WRAP
+    RT_AUDIT_REPORT(RTAudit::Kind_Lock);
+#endif
 #if UNITY_WIN
     EnterCriticalSection(&crit_sec);
 #else
@@ -413,6 +1474,19 @@ void DeclareEffect(
 #include "PluginList.h"
 #undef DECLARE_EFFECT
 
+// With the audit enabled every process callback runs inside an RTAudit::Scope
+#if SOFA_RT_AUDIT
+template<UnityAudioEffect_ProcessCallback callback>
+static UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK AuditedProcessCallback(UnityAudioEffectState* state, float* inbuffer, float* outbuffer, unsigned int length, int inchannels, int outchannels)
+{
+    RTAudit::Scope scope;
+    return callback(state, inbuffer, outbuffer, length, inchannels, outchannels);
+}
+    #define PROCESS_CALLBACK(ns) AuditedProcessCallback<ns::ProcessCallback>
+#else
+    #define PROCESS_CALLBACK(ns) ns::ProcessCallback
+#endif
+
 #if UNITY_PS3
     #define DECLARE_EFFECT(namestr,ns) \
     DeclareEffect( \
@@ -432,7 +1506,7 @@ void DeclareEffect(
     namestr, \
     ns::CreateCallback, \
     ns::ReleaseCallback, \
-    ns::ProcessCallback, \
+    PROCESS_CALLBACK(ns), \
     ns::SetFloatParameterCallback, \
     ns::GetFloatParameterCallback, \
     ns::GetFloatBufferCallback, \
@@ -454,28 +1528,47 @@ extern "C" UNITY_AUDIODSP_EXPORT_API int UnityGetAudioEffectDefinitions(UnityAud
     return numeffects;
 }
 
-// Simplistic unit-test framework
 #if ENABLE_TESTS
-	#define NAP_TESTSUITE(name)\
-		namespace testsuite_##name { inline const char* GetSuiteName() { return #name; } }\
-		namespace testsuite_##name
-	#define NAP_UNITTEST(name)\
-		struct NAP_Test_##name { NAP_Test_##name(const char* testname); };\
-		static NAP_Test_##name test_##name(#name);\
-		NAP_Test_##name::NAP_Test_##name(const char* testname)
-	#define NAP_CHECK(...)\
-		do\
-		{\
-			if(!(__VA_ARGS__))\
-			{\
-				printf("%s(%d): Unit test '%s' failed for expression '%s'.\n", __FILE__, __LINE__, testname, #__VA_ARGS__);\
-				assert(false && "Unit test in native audio plugin framework failed!");\
-			}\
-		} while(false)
-#else
-	#define NAP_TESTSUITE(name) namespace testsuite_##name
-	#define NAP_UNITTEST(name) static void test_##name()
-	#define NAP_CHECK(...) do {} while(false)
+static int nap_numfailures = 0;
+static int nap_numtimings = 0;
+static char nap_timingnames[64][64];
+static double nap_timings[64];
+
+void NAP_ReportFailure()
+{
+	nap_numfailures++;
+#if !NAP_TEST_RUNNER
+	assert(false && "Unit test in native audio plugin framework failed!");
+#endif
+}
+
+int NAP_GetNumFailures()
+{
+	return nap_numfailures;
+}
+
+void NAP_RecordTiming(const char* name, double nspersample)
+{
+	if (nap_numtimings >= 64)
+		return;
+	snprintf(nap_timingnames[nap_numtimings], sizeof(nap_timingnames[0]), "%s", name);
+	nap_timings[nap_numtimings++] = nspersample;
+}
+
+int NAP_GetNumTimings()
+{
+	return nap_numtimings;
+}
+
+const char* NAP_GetTimingName(int index)
+{
+	return nap_timingnames[index];
+}
+
+double NAP_GetTiming(int index)
+{
+	return nap_timings[index];
+}
 #endif
 
 NAP_TESTSUITE(FFT)
@@ -526,4 +1619,393 @@ NAP_TESTSUITE(FFT)
 			}
 		}
 	}
+
+	NAP_UNITTEST(RealAccuracy)
+	{
+		Random r;
+		for (int b = 1; b <= 16; b++)
+		{
+			int num = 1 << b;
+
+			float* input = new float [num];
+			float* output = new float [num];
+			UnityComplexNumber* spectrum = new UnityComplexNumber [num / 2 + 1];
+			UnityComplexNumber* reference = new UnityComplexNumber [num];
+
+			for (int n = 0; n < num; n++)
+			{
+				input[n] = r.GetFloat(-1.0f, 1.0f);
+				reference[n].Set(input[n], 0.0f);
+			}
+
+			FFT::ForwardReal (input, spectrum, num);
+			FFT::Forward (reference, num, true);
+			FFT::BackwardReal (spectrum, output, num);
+
+			// Bins grow with sqrt(num) for noise
+			double specerr = 0.0, err = 0.0;
+			for (int n = 0; n <= num / 2; n++)
+			{
+				specerr = fmax (specerr, fabs (spectrum[n].re - reference[n].re));
+				specerr = fmax (specerr, fabs (spectrum[n].im - reference[n].im));
+			}
+			for (int n = 0; n < num; n++)
+				err = fmax (err, fabs (output[n] - input[n]));
+			specerr /= sqrt ((double)num);
+
+			delete[] input;
+			delete[] output;
+			delete[] spectrum;
+			delete[] reference;
+
+			printf ("%2d bits: Real SpecErr=%15.8g RoundTripErr=%15.8g\n", b, specerr, err);
+			NAP_CHECK (specerr < 1.0e-5);
+			NAP_CHECK (err < 1.0e-5);
+		}
+	}
+
+#if NAP_TEST_RUNNER
+	NAP_UNITTEST(Throughput)
+	{
+		Random r;
+		static const int sizes[] = { 256, 4096 };
+		for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+		{
+			const int num = sizes[s], repeats = (1 << 22) / num;
+			float* input = new float [num];
+			UnityComplexNumber* spectrum = new UnityComplexNumber [num];
+			for (int n = 0; n < num; n++)
+				input[n] = r.GetFloat(-1.0f, 1.0f);
+
+			double best[2] = { 0.0, 0.0 };
+			for (int attempt = 0; attempt < 5; attempt++)
+			{
+				for (int real = 0; real < 2; real++)
+				{
+					const UInt64 start = LoadProfiler::GetTime();
+					for (int i = 0; i < repeats; i++)
+					{
+						if (real)
+							FFT::ForwardReal (input, spectrum, num);
+						else
+						{
+							for (int n = 0; n < num; n++)
+								spectrum[n].Set(input[n], 0.0f);
+							FFT::Forward (spectrum, num, false);
+						}
+					}
+					const double time = (double)(LoadProfiler::GetTime() - start) / ((double)repeats * num);
+					if (attempt == 0 || time < best[real])
+						best[real] = time;
+				}
+			}
+
+			delete[] input;
+			delete[] spectrum;
+
+			char name[64];
+			snprintf (name, sizeof(name), "FFT.Complex.%d", num);
+			NAP_RecordTiming (name, best[0]);
+			snprintf (name, sizeof(name), "FFT.Real.%d", num);
+			NAP_RecordTiming (name, best[1]);
+			printf ("FFT %5d: Complex=%8.3f Real=%8.3f ns/sample\n", num, best[0], best[1]);
+		}
+	}
+#endif
+}
+
+NAP_TESTSUITE(SpectrumAnalyzer)
+{
+	NAP_UNITTEST(SinePeak)
+	{
+		// Bin-centered sine fed in blocks that do not line up with the hop
+		const int fftsize = 1024, hopsize = 256, bin = 64;
+		SpectrumAnalyzer analyzer;
+		analyzer.Init (fftsize, hopsize, 0.0f);
+
+		float out[1024 / 2 + 1];
+		NAP_CHECK (!analyzer.ReadSpectrum (out, analyzer.GetNumBins()));
+
+		float block[2 * 97];
+		int pos = 0;
+		while (pos < 4 * fftsize)
+		{
+			for (int n = 0; n < 97; n++, pos++)
+			{
+				block[2 * n] = 0.5f * sinf (2.0f * kPI * bin * pos / fftsize);
+				block[2 * n + 1] = 0.0f;
+			}
+			analyzer.Feed (block, 2, 97);
+		}
+
+		NAP_CHECK (analyzer.ReadSpectrum (out, analyzer.GetNumBins()));
+		int peak = 0;
+		for (int n = 1; n < analyzer.GetNumBins(); n++)
+			if (out[n] > out[peak])
+				peak = n;
+		printf ("Spectrum peak bin %d: %g\n", peak, out[peak]);
+		NAP_CHECK (peak == bin);
+		NAP_CHECK (fabsf (out[peak] - 0.5f) < 1.0e-3f);
+		NAP_CHECK (out[bin + 8] < 1.0e-4f);
+	}
+}
+
+NAP_TESTSUITE(BlockOps)
+{
+	// Every supported instruction set against the reference formulas, with an odd length that leaves a
+	// scalar tail and with buffers that are aligned and misaligned by one sample
+	NAP_UNITTEST(Kernels)
+	{
+		const int num = 203;
+		alignas(32) float src[num + 8], other[num + 8], dst[num + 8];
+		Random r;
+		for (int n = 0; n < num + 8; n++)
+		{
+			src[n] = r.GetFloat (-1.0f, 1.0f);
+			other[n] = r.GetFloat (-1.0f, 1.0f);
+		}
+
+		const BlockOps::ISA supported = BlockOps::GetSupportedISA();
+		for (int isa = BlockOps::ISA_Scalar; isa <= supported; isa++)
+		{
+			BlockOps::SetISA ((BlockOps::ISA)isa);
+			NAP_CHECK (BlockOps::GetISA() == isa);
+			for (int offset = 0; offset < 2; offset++)
+			{
+				const bool aligned = offset == 0;
+				const float* s = src + offset;
+				const float* o = other + offset;
+				float* d = dst + offset;
+				float error = 0.0f;
+
+				// Linear ramp
+				if (aligned)
+					BlockOps::GainAligned (d, s, num, 0.25f, 2.0f);
+				else
+					BlockOps::Gain (d, s, num, 0.25f, 2.0f);
+				for (int n = 0; n < num; n++)
+					error = fmaxf (error, fabsf (d[n] - s[n] * (float)(0.25 + 1.75 * (n + 1) / num)));
+				NAP_CHECK (error < 1.0e-6f);
+
+				// Exponential ramp, relative to the gain
+				error = 0.0f;
+				if (aligned)
+					BlockOps::GainAligned (d, s, num, 0.01f, 1.0f, BlockOps::Ramp_Exponential);
+				else
+					BlockOps::Gain (d, s, num, 0.01f, 1.0f, BlockOps::Ramp_Exponential);
+				for (int n = 0; n < num; n++)
+				{
+					const double g = 0.01 * pow (100.0, (double)(n + 1) / num);
+					error = fmaxf (error, (float)(fabs (d[n] - s[n] * g) / g));
+				}
+				NAP_CHECK (error < 1.0e-5f);
+
+				// Mix with a constant gain and with a ramp
+				error = 0.0f;
+				memcpy (d, o, num * sizeof(float));
+				if (aligned)
+					BlockOps::MixAddAligned (d, s, num, 0.5f, 0.5f);
+				else
+					BlockOps::MixAdd (d, s, num, 0.5f, 0.5f);
+				for (int n = 0; n < num; n++)
+					error = fmaxf (error, fabsf (d[n] - (o[n] + 0.5f * s[n])));
+				NAP_CHECK (error < 1.0e-6f);
+
+				error = 0.0f;
+				memcpy (d, o, num * sizeof(float));
+				if (aligned)
+					BlockOps::MixAddAligned (d, s, num, 1.0f, 0.1f, BlockOps::Ramp_Exponential);
+				else
+					BlockOps::MixAdd (d, s, num, 1.0f, 0.1f, BlockOps::Ramp_Exponential);
+				for (int n = 0; n < num; n++)
+					error = fmaxf (error, fabsf (d[n] - (o[n] + s[n] * (float)pow (0.1, (double)(n + 1) / num))));
+				NAP_CHECK (error < 1.0e-5f);
+
+				// Crossfades over part of the fade
+				for (int curve = BlockOps::Curve_Linear; curve <= BlockOps::Curve_EqualPower; curve++)
+				{
+					error = 0.0f;
+					if (aligned)
+						BlockOps::CrossfadeAligned (d, s, o, num, 0.25f, 0.75f, (BlockOps::Curve)curve);
+					else
+						BlockOps::Crossfade (d, s, o, num, 0.25f, 0.75f, (BlockOps::Curve)curve);
+					for (int n = 0; n < num; n++)
+					{
+						const double x = 0.25 + 0.5 * (n + 1) / num;
+						const double fadeout = (curve == BlockOps::Curve_Linear) ? 1.0 - x : cos (x * 0.5 * kPI_double);
+						const double fadein = (curve == BlockOps::Curve_Linear) ? x : sin (x * 0.5 * kPI_double);
+						error = fmaxf (error, (float)fabs (d[n] - (s[n] * fadeout + o[n] * fadein)));
+					}
+					NAP_CHECK (error < 1.0e-5f);
+				}
+
+				// Peak and RMS, with the peak placed in the tail
+				d = dst + offset;
+				memcpy (d, s, num * sizeof(float));
+				d[num - 2] = -1.5f;
+				double sumsquares = 0.0;
+				for (int n = 0; n < num; n++)
+					sumsquares += (double)d[n] * d[n];
+				float peak, rms;
+				if (aligned)
+					BlockOps::MeasureAligned (d, num, &peak, &rms);
+				else
+					BlockOps::Measure (d, num, &peak, &rms);
+				NAP_CHECK (peak == 1.5f);
+				NAP_CHECK (fabs (rms - sqrt (sumsquares / num)) < 1.0e-5);
+			}
+		}
+		BlockOps::SetISA (supported);
+	}
+
+	NAP_UNITTEST(Interleave)
+	{
+		const int numframes = 37;
+		static const int channels[] = { 1, 2, 3, 6 };
+		float planar[6][numframes], restored[6][numframes], interleaved[6 * numframes];
+		for (int c = 0; c < 6; c++)
+			for (int n = 0; n < numframes; n++)
+				planar[c][n] = (float)(c * 1000 + n);
+
+		const BlockOps::ISA supported = BlockOps::GetSupportedISA();
+		for (int isa = BlockOps::ISA_Scalar; isa <= supported; isa++)
+		{
+			BlockOps::SetISA ((BlockOps::ISA)isa);
+			for (int k = 0; k < 4; k++)
+			{
+				const int num = channels[k];
+				const float* src[6];
+				float* dst[6];
+				for (int c = 0; c < num; c++)
+				{
+					src[c] = planar[c];
+					dst[c] = restored[c];
+				}
+				memset (restored, 0, sizeof(restored));
+				BlockOps::Interleave (interleaved, src, num, numframes);
+				NAP_CHECK (interleaved[(numframes - 1) * num + num - 1] == planar[num - 1][numframes - 1]);
+				BlockOps::Deinterleave (dst, interleaved, num, numframes);
+				NAP_CHECK (memcmp (restored, planar, num * numframes * sizeof(float)) == 0);
+			}
+
+			// Missing channels are silent when interleaving and skipped when deinterleaving
+			const float* mono[3] = { planar[1], NULL, NULL };
+			BlockOps::Interleave (interleaved, mono, 3, numframes);
+			NAP_CHECK (interleaved[3 * 5] == planar[1][5] && interleaved[3 * 5 + 1] == 0.0f && interleaved[3 * 5 + 2] == 0.0f);
+			float* left[2] = { restored[0], NULL };
+			BlockOps::Deinterleave (left, interleaved, 2, numframes);
+			NAP_CHECK (restored[0][4] == interleaved[8]);
+		}
+		BlockOps::SetISA (supported);
+	}
+
+	NAP_UNITTEST(GainInterleaved)
+	{
+		// All channels of a frame get the same gain and the last frame reaches the end of the ramp
+		const int numframes = 37, numchannels = 3;
+		float src[numchannels * numframes], dst[numchannels * numframes];
+		for (int n = 0; n < numchannels * numframes; n++)
+			src[n] = 1.0f;
+		for (int ramp = BlockOps::Ramp_Linear; ramp <= BlockOps::Ramp_Exponential; ramp++)
+		{
+			BlockOps::GainInterleaved (dst, src, numchannels, numframes, 0.1f, 1.0f, (BlockOps::Ramp)ramp);
+			bool ok = true;
+			for (int n = 0; n < numframes; n++)
+			{
+				const double g = (ramp == BlockOps::Ramp_Linear) ? 0.1 + 0.9 * (n + 1) / numframes : 0.1 * pow (10.0, (double)(n + 1) / numframes);
+				for (int c = 0; c < numchannels; c++)
+					ok = ok && dst[n * numchannels + c] == dst[n * numchannels] && fabs (dst[n * numchannels + c] - g) < 1.0e-5;
+			}
+			NAP_CHECK (ok);
+			NAP_CHECK (fabsf (dst[numchannels * numframes - 1] - 1.0f) < 1.0e-5f);
+		}
+		BlockOps::GainInterleaved (dst, src, numchannels, numframes, 0.5f, 0.5f);
+		NAP_CHECK (dst[0] == 0.5f && dst[numchannels * numframes - 1] == 0.5f);
+	}
+}
+
+NAP_TESTSUITE(RingBuffer)
+{
+	NAP_UNITTEST(BulkWrap)
+	{
+		RingBuffer<16, int> ring;
+		NAP_CHECK (ring.GetCapacity() == 16);
+
+		int src[16], dst[16], next = 0, expected = 0;
+		bool ok = true;
+		for (int round = 0; round < 50; round++)
+		{
+			// Uneven chunks cross the wrap at every position
+			const int numwrite = 1 + round % 13;
+			for (int n = 0; n < numwrite; n++)
+				src[n] = next + n;
+			const int written = ring.Write (src, numwrite);
+			ok = ok && written == ((numwrite < 16 - (next - expected)) ? numwrite : 16 - (next - expected));
+			next += written;
+			NAP_CHECK (ring.GetNumBuffered() == next - expected);
+
+			const int numread = ring.Read (dst, 1 + round % 7);
+			for (int n = 0; n < numread; n++)
+				ok = ok && dst[n] == expected + n;
+			expected += numread;
+		}
+		NAP_CHECK (ok);
+
+		while (ring.Feed (next))
+			next++;
+		NAP_CHECK (ring.GetNumFree() == 0);
+		ring.Skip (3);
+		int val = -1;
+		ring.Read (val);
+		NAP_CHECK (val == expected + 3);
+	}
+
+#if NAP_TEST_RUNNER
+	NAP_UNITTEST(Concurrent)
+	{
+		static RingBuffer<256, int> ring;
+		const int total = 1 << 20;
+		std::thread producer([]()
+		{
+			int chunk[37], next = 0;
+			while (next < total)
+			{
+				const int num = (total - next < 37) ? (total - next) : 37;
+				for (int n = 0; n < num; n++)
+					chunk[n] = next + n;
+				next += ring.Write (chunk, num);
+			}
+		});
+
+		int chunk[53], expected = 0;
+		bool ok = true;
+		while (expected < total)
+		{
+			const int num = ring.Read (chunk, 53);
+			for (int n = 0; n < num; n++)
+				ok = ok && chunk[n] == expected + n;
+			expected += num;
+		}
+		producer.join();
+		NAP_CHECK (ok);
+	}
+#endif
+
+	NAP_UNITTEST(History)
+	{
+		HistoryBuffer history;
+		history.Init (100);
+		NAP_CHECK (history.GetCapacity() == 128);
+
+		float samples[300], latest[50];
+		for (int n = 0; n < 300; n++)
+			samples[n] = (float)n;
+		history.Feed (samples, 90, 1);
+		history.Feed (samples + 90, 210, 1);
+		history.Read (latest, 50);
+		bool ok = true;
+		for (int n = 0; n < 50; n++)
+			ok = ok && latest[n] == (float)(250 + n);
+		NAP_CHECK (ok);
+	}
 }
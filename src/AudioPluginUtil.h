@@ -8,6 +8,8 @@
 #include <string.h>
 #include <assert.h>
 
+#include <atomic>
+
 #if UNITY_WIN
 #   include <windows.h>
 #else
@@ -20,6 +22,14 @@
 #   define strcpy_s strcpy
 #endif
 
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#   include <emmintrin.h>
+#   define CPU_RELAX() _mm_pause()
+#else
+#   include <thread>
+#   define CPU_RELAX() std::this_thread::yield()
+#endif
+
 typedef int (*InternalEffectDefinitionRegistrationCallback)(UnityAudioEffectDefinition& desc);
 
 const float kMaxSampleRate = 22050.0f;
@@ -112,6 +122,71 @@ class FFT
 public:
     static void Forward(UnityComplexNumber* data, int numsamples, bool highprecision);
     static void Backward(UnityComplexNumber* data, int numsamples, bool highprecision);
+    // Transforms numsamples (a power of two, at least 2) real samples into the numsamples / 2 + 1 bins up to Nyquist
+    static void ForwardReal(const float* input, UnityComplexNumber* spectrum, int numsamples);
+    // Inverse of ForwardReal, scaled like Backward. output may not overlap the spectrum.
+    static void BackwardReal(const UnityComplexNumber* spectrum, float* output, int numsamples);
+};
+
+// Vectorized operations on blocks of samples, dispatched at runtime to the widest instruction set the
+// CPU supports (AVX, SSE2 or plain C). The Aligned variants require all buffers to be aligned to
+// ALIGNMENT bytes, the others accept any float pointer. Buffers may be the same but must not overlap otherwise.
+// Ramps run from start to end over the block, so the first sample already moves by one step and the
+// last one reaches end. On interleaved buffers they advance with every sample of every channel, except for
+// GainInterleaved, which applies the same gain to all channels of a frame.
+class BlockOps
+{
+public:
+    static const int ALIGNMENT = 32;
+
+    enum Ramp
+    {
+        Ramp_Linear,
+        Ramp_Exponential    // Even steps in dB, linear when start or end is not positive
+    };
+
+    enum Curve
+    {
+        Curve_Linear,       // Gains sum to 1, for correlated signals
+        Curve_EqualPower    // Powers sum to 1, for uncorrelated signals
+    };
+
+    enum ISA
+    {
+        ISA_Scalar,
+        ISA_SSE2,
+        ISA_AVX
+    };
+
+public:
+    // dst = src * gain
+    static void Gain(float* dst, const float* src, int numsamples, float start, float end, Ramp ramp = Ramp_Linear);
+    static void GainAligned(float* dst, const float* src, int numsamples, float start, float end, Ramp ramp = Ramp_Linear);
+    // The same on numframes interleaved frames of numchannels channels, the ramp advances once per frame
+    static void GainInterleaved(float* dst, const float* src, int numchannels, int numframes, float start, float end, Ramp ramp = Ramp_Linear);
+
+    // dst += src * gain
+    static void MixAdd(float* dst, const float* src, int numsamples, float start, float end, Ramp ramp = Ramp_Linear);
+    static void MixAddAligned(float* dst, const float* src, int numsamples, float start, float end, Ramp ramp = Ramp_Linear);
+
+    // dst = from * fadeout + to * fadein, where the fade position moves from start to end (0 is from, 1 is to)
+    static void Crossfade(float* dst, const float* from, const float* to, int numsamples, float start, float end, Curve curve);
+    static void CrossfadeAligned(float* dst, const float* from, const float* to, int numsamples, float start, float end, Curve curve);
+
+    // Interleaves numchannels planar channels, NULL channels are written as silence
+    static void Interleave(float* dst, const float* const* src, int numchannels, int numframes);
+    // Splits interleaved frames into numchannels planar channels, NULL channels are skipped
+    static void Deinterleave(float* const* dst, const float* src, int numchannels, int numframes);
+
+    // Largest absolute sample and root mean square of a block
+    static void Measure(const float* src, int numsamples, float* peak, float* rms);
+    static void MeasureAligned(const float* src, int numsamples, float* peak, float* rms);
+
+    // The instruction set in use. SetISA is meant for tests and benchmarks and is limited to GetSupportedISA.
+    static ISA GetISA();
+    static ISA GetSupportedISA();
+    static void SetISA(ISA isa);
+    static const char* GetISAName(ISA isa);
 };
 
 class FFTAnalyzer : public FFT
@@ -128,6 +203,7 @@ public:
     float* window;
     float* ibuffer;
     float* obuffer;
+    float* wbuffer;
     UnityComplexNumber* cspec;
     float* ispec1;
     float* ispec2;
@@ -137,6 +213,58 @@ public:
     int numSpectraReady;
 };
 
+// Magnitude spectrum of a stream, updated every hopsize samples from the last fftsize samples.
+// The audio thread feeds blocks of any length into a circular buffer and only transforms once per hop.
+// One other thread reads the latest spectrum through a triple buffer, so neither side ever waits.
+// All memory is allocated by Init.
+class SpectrumAnalyzer
+{
+public:
+    SpectrumAnalyzer();
+    ~SpectrumAnalyzer();
+
+public:
+    // fftsize has to be a power of two, decay is the factor the held peaks fall by per hop
+    void Init(int fftsize, int hopsize, float decay);
+    void Feed(const float* data, int stride, int numsamples);
+    // Peak magnitudes of the latest spectrum resampled to numbins, a full scale sine reads 1.
+    // Returns false (and writes zeros) until the first spectrum is ready.
+    bool ReadSpectrum(float* buffer, int numbins);
+    inline int GetNumBins() const { return fftsize / 2 + 1; }
+    // Bytes allocated by Init
+    inline size_t GetMemorySize() const { return (3 * fftsize + 5 * GetNumBins()) * sizeof(float) + GetNumBins() * sizeof(UnityComplexNumber); }
+
+private:
+    void Analyze();
+    void Cleanup();
+
+    // Prevent uncontrolled usage
+    SpectrumAnalyzer(const SpectrumAnalyzer&);
+    SpectrumAnalyzer& operator=(const SpectrumAnalyzer&);
+
+    static const int kDirty = 4;
+
+    int fftsize;
+    int hopsize;
+    float decay;
+    float scale;
+    float* window;
+    float* history;
+    int writepos;
+    int hopcount;
+    float* wbuffer;
+    UnityComplexNumber* spec;
+    float* peaks;
+    // Triple buffer of published spectra, the middle index carries kDirty while it holds a new one
+    float* published[3];
+    int back;
+    int front;
+    std::atomic<int> middle;
+    std::atomic<bool> ready;
+};
+
+// Latest samples of a stream for display, written by one thread and read by others at any time.
+// The length is rounded up to a power of two.
 class HistoryBuffer
 {
 public:
@@ -146,92 +274,146 @@ public:
 public:
     void Init(int _length);
     void ReadBuffer(float* buffer, int numsamplesTarget, int numsamplesSource, float offset);
+    // Copies the latest numsamples samples in chronological order, at most the capacity
+    int Read(float* buffer, int numsamples) const;
+    // The same for the numsamples samples that end delay samples before the latest one.
+    // delay + numsamples must not exceed the capacity.
+    void Read(float* buffer, int numsamples, int delay) const;
+    inline int GetCapacity() const { return length; }
 
 public:
     inline void Feed(float sample)
     {
-        // Don't try to optimize this with ++
-        // The writeindex veriable may be read at the same time, so we don't want intermediate values indexing out of the array.
-        int w = writeindex + 1;
-        if (w == length)
-            w = 0;
+        const int w = (writeindex.load(std::memory_order_relaxed) + 1) & (length - 1);
         data[w] = sample;
-        writeindex = w;
+        writeindex.store(w, std::memory_order_release);
+    }
+
+    inline void Feed(const float* buf, int numsamples, int stride)
+    {
+        const int mask = length - 1;
+        int w = writeindex.load(std::memory_order_relaxed);
+        if (stride == 1)
+        {
+            // Only the latest length samples are kept
+            if (numsamples > length)
+            {
+                buf += numsamples - length;
+                w = (w + numsamples - length) & mask;
+                numsamples = length;
+            }
+            const int start = (w + 1) & mask;
+            const int first = (numsamples < length - start) ? numsamples : (length - start);
+            memcpy(data + start, buf, first * sizeof(float));
+            memcpy(data, buf + first, (numsamples - first) * sizeof(float));
+            w = (w + numsamples) & mask;
+        }
+        else
+        {
+            for (int n = 0; n < numsamples; n++)
+            {
+                w = (w + 1) & mask;
+                data[w] = buf[n * stride];
+            }
+        }
+        writeindex.store(w, std::memory_order_release);
     }
-	
-	inline void Feed(float* buf, int numsamples, int stride)
-	{
-		int w = writeindex;
-		for(int n = 0; n < numsamples; n++)
-		{
-			if(++w == length)
-				w = 0;
-			data[w] = buf[n * stride];
-		}
-		writeindex = w;
-	}
 
 public:
     int length;
-    int writeindex;
+    // Index of the latest sample
+    std::atomic<int> writeindex;
     float* data;
 };
 
+// Lock-free ring for one producer and one consumer thread, LENGTH has to be a power of two and
+// all LENGTH elements can be used. T is copied with memcpy, so it has to be trivially copyable.
+// The positions count up freely and are masked on access. Each one is written by only one side
+// and sits on its own cache line, so the producer and the consumer don't invalidate each other.
 template<const int _LENGTH, typename T = float>
 class RingBuffer
 {
 public:
-    enum { LENGTH = _LENGTH };
+    enum { LENGTH = _LENGTH, MASK = _LENGTH - 1 };
+    static_assert(_LENGTH > 0 && (_LENGTH & (_LENGTH - 1)) == 0, "RingBuffer length has to be a power of two");
 
-    volatile int readpos;
-    volatile int writepos;
-    T buffer[LENGTH];
+    RingBuffer() : readpos(0), writepos(0) {}
 
-    inline bool Read(T& val)
+    // Producer side, returns false if the ring is full
+    inline bool Feed(const T& input)
     {
-        int r = readpos;
-        if (r == writepos)
-            return false;
-        r = (r == LENGTH - 1) ? 0 : (r + 1);
-        val = buffer[r];
-        readpos = r;
-        return true;
+        return Write(&input, 1) == 1;
     }
 
-    inline void Skip(int num)
+    // Producer side, writes as many of the num elements as fit and returns their number
+    inline int Write(const T* src, int num)
     {
-        int r = readpos + num;
-        if (r >= LENGTH)
-            r -= LENGTH;
-        readpos = r;
+        const UInt32 w = writepos.load(std::memory_order_relaxed);
+        const int numfree = LENGTH - (int)(w - readpos.load(std::memory_order_acquire));
+        if (num > numfree)
+            num = numfree;
+        const int start = (int)(w & MASK);
+        const int first = (num < LENGTH - start) ? num : (LENGTH - start);
+        memcpy(buffer + start, src, first * sizeof(T));
+        memcpy(buffer, src + first, (num - first) * sizeof(T));
+        writepos.store(w + num, std::memory_order_release);
+        return num;
     }
 
-    inline void SyncWritePos()
+    // Consumer side, returns false if the ring is empty
+    inline bool Read(T& val)
     {
-        writepos = readpos;
+        return Read(&val, 1) == 1;
     }
 
-    inline bool Feed(const T& input)
+    // Consumer side, reads up to num elements and returns their number
+    inline int Read(T* dst, int num)
     {
-        int w = (writepos == LENGTH - 1) ? 0 : (writepos + 1);
-        buffer[w] = input;
-        writepos = w;
-        return true;
+        const UInt32 r = readpos.load(std::memory_order_relaxed);
+        const int numbuffered = (int)(writepos.load(std::memory_order_acquire) - r);
+        if (num > numbuffered)
+            num = numbuffered;
+        const int start = (int)(r & MASK);
+        const int first = (num < LENGTH - start) ? num : (LENGTH - start);
+        memcpy(dst, buffer + start, first * sizeof(T));
+        memcpy(dst + first, buffer, (num - first) * sizeof(T));
+        readpos.store(r + num, std::memory_order_release);
+        return num;
     }
 
+    // Consumer side, drops up to num elements
+    inline void Skip(int num)
+    {
+        const UInt32 r = readpos.load(std::memory_order_relaxed);
+        const int numbuffered = (int)(writepos.load(std::memory_order_acquire) - r);
+        readpos.store(r + ((num < numbuffered) ? num : numbuffered), std::memory_order_release);
+    }
+
+    // A snapshot while the other side keeps going: on the producer side an upper bound, since the consumer
+    // may have read more meanwhile, on the consumer side a lower bound, since the producer may have written more.
+    // Exact only while the other side is idle.
     inline int GetNumBuffered() const
     {
-        int b = writepos - readpos;
-        if (b < 0)
-            b += LENGTH;
-        return b;
+        return (int)(writepos.load(std::memory_order_acquire) - readpos.load(std::memory_order_acquire));
     }
 
+    // The converse of GetNumBuffered: a lower bound on the producer side, an upper bound on the consumer side
+    inline int GetNumFree() const { return LENGTH - GetNumBuffered(); }
+    inline int GetCapacity() const { return LENGTH; }
+
+    // Not thread safe, neither side may use the ring meanwhile
     inline void Clear()
     {
-        writepos = 0;
-        readpos = 0;
+        writepos.store(0, std::memory_order_relaxed);
+        readpos.store(0, std::memory_order_relaxed);
     }
+
+private:
+    std::atomic<UInt32> readpos;
+    char pad1[64 - sizeof(std::atomic<UInt32>)];
+    std::atomic<UInt32> writepos;
+    char pad2[64 - sizeof(std::atomic<UInt32>)];
+    T buffer[LENGTH];
 };
 
 class BiquadFilter
@@ -471,6 +653,19 @@ protected:
     Mutex* mutex;
 };
 
+// For critical sections of a handful of instructions that may be entered from the audio thread
+class SpinLock
+{
+public:
+    SpinLock() { flag.clear(); }
+public:
+    inline bool TryLock() { return !flag.test_and_set(std::memory_order_acquire); }
+    inline void Lock() { while (flag.test_and_set(std::memory_order_acquire)) CPU_RELAX(); }
+    inline void Unlock() { flag.clear(std::memory_order_release); }
+protected:
+    std::atomic_flag flag;
+};
+
 void RegisterParameter(
     UnityAudioEffectDefinition& desc,
     const char* name,
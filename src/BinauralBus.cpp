@@ -0,0 +1,191 @@
+#include "BinauralBus.h"
+
+#include <string.h>
+
+// Tag of a frame whose accumulators have been rendered already
+static const UInt64 kNoTick = ~(UInt64)0;
+
+BinauralBus& BinauralBus::Instance()
+{
+    static BinauralBus bus;
+    return bus;
+}
+
+BinauralBus::BinauralBus()
+    : blocksize(0)
+{
+    frame.dsptick = kNoTick;
+    frame.numsends = 0;
+    for (int e = 0; e < NUM_EARS; e++)
+    {
+        frame.spectra[e] = NULL;
+        spare[e] = NULL;
+    }
+}
+
+BinauralBus::~BinauralBus()
+{
+    for (int e = 0; e < NUM_EARS; e++)
+    {
+        delete frame.spectra[e];
+        delete spare[e];
+    }
+}
+
+bool BinauralBus::Init(int _blocksize)
+{
+    MutexScopeLock lock(mutex);
+
+    const int current = blocksize.load(std::memory_order_acquire);
+    if (current != 0)
+        return current == _blocksize;
+    // The convolvers transform blocks of twice the block size, which only works for powers of two
+    if ((_blocksize & (_blocksize - 1)) != 0)
+        return false;
+
+    const int spectrumsize = _blocksize + 1;
+    for (int e = 0; e < NUM_EARS; e++)
+    {
+        frame.spectra[e] = new fftconvolver::SplitComplex(spectrumsize);
+        spare[e] = new fftconvolver::SplitComplex(spectrumsize);
+    }
+    fft.init(2 * _blocksize);
+    fftbuffer.resize(2 * _blocksize);
+    frame.dsptick = kNoTick;
+    frame.numsends = 0;
+
+    blocksize.store(_blocksize, std::memory_order_release);
+    return true;
+}
+
+void BinauralBus::Accumulate(UInt64 dsptick, const fftconvolver::SplitComplex* spectra)
+{
+    const int spectrumsize = GetBlockSize() + 1;
+    if (spectrumsize == 1)
+        return;
+
+    frame.lock.Lock();
+    if (frame.dsptick != dsptick)
+    {
+        // First send of a new block
+        for (int e = 0; e < NUM_EARS; e++)
+            frame.spectra[e]->setZero();
+        frame.dsptick = dsptick;
+        frame.numsends = 0;
+    }
+    for (int e = 0; e < NUM_EARS; e++)
+    {
+        float* re = frame.spectra[e]->re();
+        float* im = frame.spectra[e]->im();
+        const float* sre = spectra[e].re();
+        const float* sim = spectra[e].im();
+        for (int n = 0; n < spectrumsize; n++)
+        {
+            re[n] += sre[n];
+            im[n] += sim[n];
+        }
+    }
+    frame.numsends++;
+    frame.lock.Unlock();
+}
+
+int BinauralBus::Render(UInt64 dsptick, float* left, float* right)
+{
+    const int length = GetBlockSize();
+    if (length == 0)
+        return 0;
+
+    int numsends = 0;
+    frame.lock.Lock();
+    if (frame.dsptick == dsptick)
+    {
+        for (int e = 0; e < NUM_EARS; e++)
+        {
+            fftconvolver::SplitComplex* spectrum = frame.spectra[e];
+            frame.spectra[e] = spare[e];
+            spare[e] = spectrum;
+        }
+        numsends = frame.numsends;
+        frame.dsptick = kNoTick;
+    }
+    frame.lock.Unlock();
+
+    float* out[NUM_EARS] = { left, right };
+    for (int e = 0; e < NUM_EARS; e++)
+    {
+        if (numsends == 0)
+        {
+            memset(out[e], 0, sizeof(float) * length);
+            continue;
+        }
+        fft.ifft(fftbuffer.data(), spare[e]->re(), spare[e]->im());
+        memcpy(out[e], fftbuffer.data() + length, sizeof(float) * length);
+    }
+    return numsends;
+}
+
+BusSend::BusSend()
+    : current(0)
+    , fading(false)
+    , has_ir(false)
+{
+}
+
+void BusSend::Init(int blocksize, int maxirlen)
+{
+    convolver.Init(blocksize, maxirlen, 2 * BinauralBus::NUM_EARS);
+    for (int e = 0; e < BinauralBus::NUM_EARS; e++)
+        spectra[e].resize(blocksize + 1);
+    current = 0;
+    fading = false;
+    has_ir = false;
+}
+
+void BusSend::Reset()
+{
+    convolver.Reset();
+    fading = false;
+}
+
+void BusSend::SetIR(const float* left, const float* right, int irlen)
+{
+    const int next = has_ir ? 2 - current : current;
+    convolver.SetIR(next, left, irlen);
+    convolver.SetIR(next + 1, right, irlen);
+    fading = has_ir;
+    current = next;
+    has_ir = true;
+}
+
+void BusSend::Process(UInt64 dsptick, const float* input)
+{
+    convolver.PushInput(input);
+    if (!has_ir)
+        return;
+
+    const int spectrumsize = convolver.GetSpectrumSize();
+    for (int e = 0; e < BinauralBus::NUM_EARS; e++)
+    {
+        spectra[e].setZero();
+        convolver.Accumulate(current + e, spectra[e]);
+        if (fading)
+        {
+            convolver.Accumulate(2 - current + e, spectra[e]);
+            float* re = spectra[e].re();
+            float* im = spectra[e].im();
+            for (int n = 0; n < spectrumsize; n++)
+            {
+                re[n] *= 0.5f;
+                im[n] *= 0.5f;
+            }
+        }
+    }
+    fading = false;
+
+    BinauralBus::Instance().Accumulate(dsptick, spectra);
+}
+
+size_t BusSend::GetMemorySize() const
+{
+    return convolver.GetMemorySize() + BinauralBus::NUM_EARS * 2 * sizeof(float) * (size_t)convolver.GetSpectrumSize();
+}
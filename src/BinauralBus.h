@@ -0,0 +1,90 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+#include "PartitionedConvolver.h"
+
+/// Sums the binaural output of many sources in the frequency domain.
+/// Every send multiplies its input spectrum with its filter spectra and adds the result to the
+/// accumulators of the current block, the bus effect then does a single inverse transform per ear
+/// for all of them. Since all sends use overlap-save with the same transform size, the second half
+/// of the summed inverse transform is exactly the sum of their outputs.
+class BinauralBus
+{
+public:
+    static const int NUM_EARS = 2;
+
+public:
+    static BinauralBus& Instance();
+
+public:
+    // Allocates the accumulators, not realtime safe. Returns false if the bus already runs with another block size
+    // or the block size is no power of two.
+    bool Init(int blocksize);
+    inline int GetBlockSize() const { return blocksize.load(std::memory_order_acquire); }
+
+    // Adds the spectra of a send (blocksize + 1 bins per ear) to the block starting at dsptick
+    void Accumulate(UInt64 dsptick, const fftconvolver::SplitComplex* spectra);
+
+    // Synthesizes the sum of all sends of the block starting at dsptick, returns the number of sends mixed
+    int Render(UInt64 dsptick, float* left, float* right);
+
+private:
+    BinauralBus();
+    ~BinauralBus();
+
+private:
+    // Accumulators of the block currently being summed, tagged with its dsptick
+    struct Frame
+    {
+        SpinLock lock;
+        UInt64 dsptick;
+        int numsends;
+        fftconvolver::SplitComplex* spectra[NUM_EARS];
+    };
+
+    Frame frame;
+    // Swapped with the accumulators of the frame on render, so the inverse transforms happen outside the lock
+    fftconvolver::SplitComplex* spare[NUM_EARS];
+    audiofft::AudioFFT fft;
+    fftconvolver::SampleBuffer fftbuffer;
+    std::atomic<int> blocksize;
+    Mutex mutex;
+};
+
+/// Per source state of the send mode: convolves the input of a spatializer with the filters of both
+/// ears and hands the resulting spectra to the bus. The two ears share one frequency domain delay line.
+/// A change of filters averages the old and the new filters for one block, since the spectra can't be
+/// crossfaded sample by sample before they are transformed back.
+class BusSend
+{
+public:
+    BusSend();
+
+public:
+    // Allocates everything, not realtime safe
+    void Init(int blocksize, int maxirlen);
+    void Reset();
+
+    // Transforms new filters, longer ones are truncated. Realtime safe.
+    void SetIR(const float* left, const float* right, int irlen);
+
+    // Convolves one block of blocksize input samples and accumulates it on the bus
+    void Process(UInt64 dsptick, const float* input);
+
+    inline int GetBlockSize() const { return convolver.GetBlockSize(); }
+    inline int GetMaxIRLength() const { return convolver.GetMaxIRLength(); }
+    size_t GetMemorySize() const;
+
+private:
+    // Prevent uncontrolled usage
+    BusSend(const BusSend&);
+    BusSend& operator=(const BusSend&);
+
+private:
+    // Slots 0/1 and 2/3 hold the left/right filters of the two filter sets
+    PartitionedConvolver convolver;
+    fftconvolver::SplitComplex spectra[BinauralBus::NUM_EARS];
+    int current;
+    bool fading;
+    bool has_ir;
+};
@@ -0,0 +1,83 @@
+#include "BinauralConvolver.h"
+
+#include <string.h>
+
+BinauralConvolver::BinauralConvolver()
+    : spectrum_re(NULL)
+    , spectrum_im(NULL)
+    , ownarena(NULL)
+    , current(0)
+    , has_ir(false)
+{
+}
+
+BinauralConvolver::~BinauralConvolver()
+{
+    Arena::Destroy(ownarena);
+}
+
+size_t BinauralConvolver::GetArenaSize(int partition, int maxirlen)
+{
+    return PartitionedConvolver::GetArenaSize(partition, maxirlen, 2 * NUM_EARS)
+         + 2 * Arena::Align(sizeof(float) * (size_t)(partition + 1));
+}
+
+void BinauralConvolver::Init(int partition, int maxirlen)
+{
+    Arena* arena = Arena::Create(GetArenaSize(partition, maxirlen));
+    Init(*arena, partition, maxirlen);
+    Arena::Destroy(ownarena);
+    ownarena = arena;
+}
+
+void BinauralConvolver::Init(Arena& arena, int partition, int maxirlen)
+{
+    convolver.Init(arena, partition, maxirlen, 2 * NUM_EARS);
+    spectrum_re = arena.AllocateArray<float>(convolver.GetSpectrumSize());
+    spectrum_im = arena.AllocateArray<float>(convolver.GetSpectrumSize());
+    current = 0;
+    has_ir = false;
+}
+
+void BinauralConvolver::Reset()
+{
+    convolver.Reset();
+}
+
+void BinauralConvolver::SetIR(const float* left, const float* right, int irlen)
+{
+    const int next = has_ir ? 2 - current : current;
+    convolver.SetIR(next, left, irlen);
+    convolver.SetIR(next + 1, right, irlen);
+    current = next;
+    has_ir = true;
+}
+
+void BinauralConvolver::Render(int slot, float* output)
+{
+    memset(spectrum_re, 0, sizeof(float) * convolver.GetSpectrumSize());
+    memset(spectrum_im, 0, sizeof(float) * convolver.GetSpectrumSize());
+    convolver.Accumulate(slot, spectrum_re, spectrum_im);
+    convolver.Synthesize(spectrum_re, spectrum_im, output);
+}
+
+void BinauralConvolver::Process(const float* input, float* output, float* previous, int numsamples)
+{
+    const int partition = convolver.GetBlockSize();
+    for (int offset = 0; offset < numsamples; offset += partition)
+    {
+        convolver.PushInput(input + offset);
+        for (int ear = 0; ear < NUM_EARS; ear++)
+        {
+            // Slots without a filter accumulate nothing and render silence
+            Render(current + ear, output + ear * numsamples + offset);
+            if (previous != NULL)
+                Render(2 - current + ear, previous + ear * numsamples + offset);
+        }
+    }
+}
+
+size_t BinauralConvolver::GetMemorySize() const
+{
+    return (convolver.GetBlockSize() > 0) ? GetArenaSize(convolver.GetBlockSize(), convolver.GetMaxIRLength()) : 0;
+}
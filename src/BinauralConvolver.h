@@ -0,0 +1,61 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+#include "PartitionedConvolver.h"
+
+/// Convolves a mono input with the filters of both ears in partitions of a fixed size, which may be
+/// shorter than the blocks it is called with. The two ears share one frequency domain delay line and the
+/// previous filters are kept when new ones are set, so the output of both can be rendered from the same
+/// input for a crossfade. Unlike fftconvolver::BinauralFFTConvolver the input history survives a change of
+/// filters, and all memory is allocated by Init (from an arena of the caller if given one), everything else is
+/// realtime safe.
+class BinauralConvolver
+{
+public:
+    static const int NUM_EARS = 2;
+
+public:
+    BinauralConvolver();
+    ~BinauralConvolver();
+
+public:
+    // Allocates everything for partitions of partition samples and filters of up to maxirlen samples, not realtime safe
+    void Init(int partition, int maxirlen);
+    // The same, carving everything from arena, which has to outlive the convolver
+    void Init(Arena& arena, int partition, int maxirlen);
+    void Reset();
+
+    // Bytes Init takes from an arena
+    static size_t GetArenaSize(int partition, int maxirlen);
+
+    // Transforms new filters, the current ones become the previous ones. Longer filters are truncated.
+    void SetIR(const float* left, const float* right, int irlen);
+
+    // Convolves numsamples input samples, a multiple of the partition size, into output (left ear followed
+    // by the right ear). If previous is not NULL the output of the previous filters is written there alike.
+    void Process(const float* input, float* output, float* previous, int numsamples);
+
+    inline int GetPartitionSize() const { return convolver.GetBlockSize(); }
+    inline int GetMaxIRLength() const { return convolver.GetMaxIRLength(); }
+    // Bytes allocated by Init, wherever they were allocated
+    size_t GetMemorySize() const;
+
+private:
+    // Synthesizes one partition of output of the filter in slot
+    void Render(int slot, float* output);
+
+    // Prevent uncontrolled usage
+    BinauralConvolver(const BinauralConvolver&);
+    BinauralConvolver& operator=(const BinauralConvolver&);
+
+private:
+    // Slots 0/1 and 2/3 hold the left/right filters of the two filter sets
+    PartitionedConvolver convolver;
+    // Spectrum the filters of one ear are accumulated into, real and imaginary parts
+    float* spectrum_re;
+    float* spectrum_im;
+    // Arena of a convolver that was initialized without one
+    Arena* ownarena;
+    int current;
+    bool has_ir;
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+
+#include <vector>
+
+/// Cascades of biquads for many channels at once, e.g. the ears of several sources.
+/// Coefficients and states are kept as structure of arrays with four channels side by side, so one
+/// SSE instruction advances a stage of four channels. Every group of four channels is processed in
+/// lockstep, the samples are gathered from and scattered back to planar buffers.
+/// The stages are the Direct Form II of BiquadFilter. New coefficients are approached linearly over
+/// the next processed block in steps of INTERPOLATION_STEP samples, which keeps them stable since
+/// stable (a1, a2) pairs form a convex set.
+/// All memory is allocated by Init, everything else is realtime safe.
+class BiquadBank
+{
+public:
+    static const int MAX_STAGES = 4;
+    static const int NUM_COEFFS = 5;
+    static const int INTERPOLATION_STEP = 16;
+
+    BiquadBank();
+
+public:
+    void Init(int numchannels, int numstages);
+
+    // Clears the states and jumps to the coefficients that were set last
+    void Reset();
+
+    // Sets the coefficients a stage of a channel reaches at the end of the next Process call.
+    // The coefficients are ordered like BiquadFilter::StoreCoeffs: b2, b1, b0, a2, a1.
+    void SetCoeffs(int channel, int stage, const float* coeffs);
+    void SetCoeffs(int channel, int stage, BiquadFilter& filter);
+    void SetBypass(int channel, int stage);
+
+    // Filters numsamples samples of every channel in place, NULL channels are skipped
+    void Process(float* const* channels, int numsamples);
+
+    inline int GetNumChannels() const { return numchannels; }
+    inline int GetNumStages() const { return numstages; }
+
+private:
+    // Four channels of one stage: current and target b2, b1, b0, a2, a1, then z1 and z2
+    struct Stage
+    {
+        float coeffs[NUM_COEFFS][4];
+        float targets[NUM_COEFFS][4];
+        float z1[4];
+        float z2[4];
+    };
+
+    void ProcessGroup(Stage* stages, float* const* channels, int numsamples, bool interpolate);
+
+    int numchannels;
+    int numstages;
+    int numgroups;
+    std::vector<Stage> stages; // [group][stage]
+    std::vector<char> changed; // per group, set while targets differ from the coefficients
+};
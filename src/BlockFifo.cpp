@@ -0,0 +1,184 @@
+#include "BlockFifo.h"
+#include "NAPTest.h"
+
+#include <vector>
+
+BlockFifo::BlockFifo()
+    : blocksize(0)
+    , maxchannels(0)
+    , numinputs(0)
+    , numoutputs(0)
+    , engaged(false)
+    , inqueue(NULL)
+    , infill(0)
+    , outqueue(NULL)
+    , outread(0)
+    , outcount(0)
+{
+}
+
+void BlockFifo::Init(int _blocksize, int _maxchannels, Arena& arena)
+{
+    blocksize = _blocksize;
+    maxchannels = _maxchannels;
+    inqueue = arena.AllocateArray<float>(blocksize * maxchannels);
+    outqueue = arena.AllocateArray<float>(2 * blocksize * maxchannels);
+    engaged = false;
+}
+
+size_t BlockFifo::GetArenaSize(int blocksize, int maxchannels)
+{
+    return Arena::Align(sizeof(float) * blocksize * maxchannels) + Arena::Align(sizeof(float) * 2 * blocksize * maxchannels);
+}
+
+bool BlockFifo::Engage(int _numinputs, int _numoutputs)
+{
+    if (engaged && numinputs == _numinputs && numoutputs == _numoutputs)
+        return true;
+    if (blocksize <= 0 || _numinputs <= 0 || _numoutputs <= 0 || _numinputs > maxchannels || _numoutputs > maxchannels)
+        return false;
+
+    numinputs = _numinputs;
+    numoutputs = _numoutputs;
+    infill = 0;
+    memset(outqueue, 0, sizeof(float) * blocksize * numoutputs);
+    outread = 0;
+    outcount = blocksize;
+    engaged = true;
+    return true;
+}
+
+void BlockFifo::Process(const float* input, float* output, int numframes, BlockFunc func, void* arg)
+{
+    const int ringsize = 2 * blocksize;
+    while (numframes > 0)
+    {
+        // Never queue past the end of the block, so the output of the frames is due after it was rendered
+        const int count = (numframes < blocksize - infill) ? numframes : blocksize - infill;
+        memcpy(inqueue + infill * numinputs, input, sizeof(float) * count * numinputs);
+        infill += count;
+        if (infill == blocksize)
+        {
+            // The queued output always ends at a block boundary
+            const int write = (outread + outcount) % ringsize;
+            func(arg, inqueue, outqueue + write * numoutputs, blocksize, numinputs, numoutputs);
+            outcount += blocksize;
+            infill = 0;
+        }
+
+        const int first = (count < ringsize - outread) ? count : ringsize - outread;
+        memcpy(output, outqueue + outread * numoutputs, sizeof(float) * first * numoutputs);
+        memcpy(output + first * numoutputs, outqueue, sizeof(float) * (count - first) * numoutputs);
+        outread = (outread + count) % ringsize;
+        outcount -= count;
+
+        input += count * numinputs;
+        output += count * numoutputs;
+        numframes -= count;
+    }
+}
+
+int BlockFifo::Disengage(float* output, int numframes)
+{
+    if (!engaged)
+        return 0;
+    engaged = false;
+
+    const int ringsize = 2 * blocksize;
+    const int count = (numframes < outcount) ? numframes : outcount;
+    const int first = (count < ringsize - outread) ? count : ringsize - outread;
+    memcpy(output, outqueue + outread * numoutputs, sizeof(float) * first * numoutputs);
+    memcpy(output + first * numoutputs, outqueue, sizeof(float) * (count - first) * numoutputs);
+    infill = 0;
+    outcount = 0;
+    return count;
+}
+
+NAP_TESTSUITE(BlockFifo)
+{
+    // Doubles the first input channel into both outputs and counts the blocks
+    static void Render(void* arg, const float* input, float* output, int numframes, int numinputs, int numoutputs)
+    {
+        for (int n = 0; n < numframes; n++)
+            for (int ch = 0; ch < numoutputs; ch++)
+                output[n * numoutputs + ch] = 2.0f * input[n * numinputs];
+        (*(int*)arg)++;
+    }
+
+    NAP_UNITTEST(ReblocksWithOneBlockLatency)
+    {
+        // Calls of uneven lengths, some longer than a block, come out delayed by one block
+        const int blocksize = 64, total = 1000;
+        Arena* arena = Arena::Create(BlockFifo::GetArenaSize(blocksize, 2));
+        BlockFifo fifo;
+        fifo.Init(blocksize, 2, *arena);
+        NAP_CHECK(!fifo.Engage(3, 2));
+        NAP_CHECK(fifo.Engage(1, 2) && fifo.GetLatency() == blocksize);
+
+        std::vector<float> input(total), output(2 * total);
+        for (int n = 0; n < total; n++)
+            input[n] = (float)(n + 1);
+        const int lengths[] = { 10, 64, 1, 130, 37, 200, 63, 65 };
+        int numblocks = 0;
+        int pos = 0;
+        for (int call = 0; pos < total; call++)
+        {
+            int length = lengths[call % 8];
+            if (length > total - pos)
+                length = total - pos;
+            fifo.Process(&input[pos], &output[2 * pos], length, Render, &numblocks);
+            pos += length;
+        }
+
+        bool ok = true;
+        for (int n = 0; n < total; n++)
+        {
+            const float expected = (n < blocksize) ? 0.0f : 2.0f * input[n - blocksize];
+            ok = ok && output[2 * n] == expected && output[2 * n + 1] == expected;
+        }
+        NAP_CHECK(ok);
+        NAP_CHECK(numblocks == total / blocksize);
+        Arena::Destroy(arena);
+    }
+
+    NAP_UNITTEST(DisengagesAndEngagesAgain)
+    {
+        // After an uneven call the FIFO hands out the output it still queued and starts over once engaged again
+        const int blocksize = 64;
+        Arena* arena = Arena::Create(BlockFifo::GetArenaSize(blocksize, 2));
+        BlockFifo fifo;
+        fifo.Init(blocksize, 2, *arena);
+        std::vector<float> input(4 * blocksize), output(8 * blocksize);
+        for (int n = 0; n < 4 * blocksize; n++)
+            input[n] = (float)(n + 1);
+        int numblocks = 0;
+
+        NAP_CHECK(fifo.Disengage(&output[0], blocksize) == 0);
+        NAP_CHECK(fifo.Engage(1, 2));
+        fifo.Process(&input[0], &output[0], blocksize + 10, Render, &numblocks);
+        NAP_CHECK(numblocks == 1);
+
+        // The first block was rendered, 10 of its frames were read, the 10 frames queued after it are dropped
+        std::vector<float> queued(2 * blocksize);
+        const int count = fifo.Disengage(&queued[0], blocksize);
+        NAP_CHECK(count == blocksize - 10 && !fifo.IsEngaged() && fifo.GetLatency() == 0);
+        bool ok = true;
+        for (int n = 0; n < count; n++)
+            ok = ok && queued[2 * n] == 2.0f * input[10 + n] && queued[2 * n + 1] == 2.0f * input[10 + n];
+        NAP_CHECK(ok);
+        NAP_CHECK(fifo.Disengage(&queued[0], blocksize) == 0);
+
+        // Engaged anew, the output starts with a block of silence again
+        NAP_CHECK(fifo.Engage(1, 2) && fifo.GetLatency() == blocksize);
+        fifo.Process(&input[0], &output[0], 2 * blocksize, Render, &numblocks);
+        ok = true;
+        for (int n = 0; n < 2 * blocksize; n++)
+        {
+            const float expected = (n < blocksize) ? 0.0f : 2.0f * input[n - blocksize];
+            ok = ok && output[2 * n] == expected && output[2 * n + 1] == expected;
+        }
+        NAP_CHECK(ok);
+        NAP_CHECK(numblocks == 3);
+        Arena::Destroy(arena);
+    }
+}
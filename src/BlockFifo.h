@@ -0,0 +1,61 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+#include "Arena.h"
+
+/// Re-blocks interleaved audio delivered in calls of any length into blocks of a fixed size and back.
+/// Input frames are queued until a whole block is available, which is then processed in place of the
+/// caller, and the output blocks are queued until they are read. Once engaged the output is delayed by
+/// exactly one block, so every call can be served no matter how its length relates to the block size.
+/// The queues are carved from an arena by Init, everything else is realtime safe.
+class BlockFifo
+{
+public:
+    // Processes one block of numframes interleaved frames
+    typedef void (*BlockFunc)(void* arg, const float* input, float* output, int numframes, int numinputs, int numoutputs);
+
+public:
+    BlockFifo();
+
+public:
+    // Carves the queues for blocks of blocksize frames of up to maxchannels channels from arena
+    void Init(int blocksize, int maxchannels, Arena& arena);
+
+    // Bytes Init takes from the arena
+    static size_t GetArenaSize(int blocksize, int maxchannels);
+
+    // Starts queueing frames of the given channel counts with one block of silence ahead of the output.
+    // Already engaged with the same counts nothing changes. Returns false if the queues are too narrow.
+    bool Engage(int numinputs, int numoutputs);
+
+    // Calls func for every whole block of input and writes numframes frames of output, must be engaged
+    void Process(const float* input, float* output, int numframes, BlockFunc func, void* arg);
+
+    // Stops queueing and hands out up to numframes frames of the output that was still queued, so the caller
+    // can fade it into the direct output. The input frames of the unfinished block are dropped.
+    // Returns the number of frames written to output.
+    int Disengage(float* output, int numframes);
+
+    inline bool IsEngaged() const { return engaged; }
+    inline int GetBlockSize() const { return blocksize; }
+    inline int GetLatency() const { return engaged ? blocksize : 0; }
+
+private:
+    // Prevent uncontrolled usage
+    BlockFifo(const BlockFifo&);
+    BlockFifo& operator=(const BlockFifo&);
+
+private:
+    int blocksize;
+    int maxchannels;
+    int numinputs;
+    int numoutputs;
+    bool engaged;
+    // Input frames of the block being filled
+    float* inqueue;
+    int infill;
+    // Ring of two output blocks, blocks are always written to one of both halves as a whole
+    float* outqueue;
+    int outread;
+    int outcount;
+};
@@ -0,0 +1,390 @@
+#include "NAPTest.h"
+#include "LoadProfiler.h"
+#include "BinauralConvolver.h"
+#include "PartitionedConvolver.h"
+#include "FFTConvolver/BinauralFFTConvolver.h"
+#include "FFTConvolver/TwoStageFFTConvolver.h"
+
+#include <vector>
+
+// Checks the convolvers against direct convolution in the time domain and measures their throughput.
+// Only built into the SofaTests runner, the plugin itself would run them on every load.
+
+#if ENABLE_TESTS
+NAP_TESTSUITE(Convolver)
+{
+	static const int blocksizes[] = { 64, 256, 1024 };
+	static const int irlengths[] = { 1, 37, 256, 1000, 4096 };
+
+	static void MakeSignal(Random& r, std::vector<float>& signal, int length)
+	{
+		signal.resize(length);
+		for (int n = 0; n < length; n++)
+			signal[n] = r.GetFloat(-1.0f, 1.0f);
+	}
+
+	// Exponentially decaying noise, shaped like a measured filter
+	static void MakeIR(Random& r, std::vector<float>& ir, int length)
+	{
+		ir.resize(length);
+		for (int n = 0; n < length; n++)
+			ir[n] = r.GetFloat(-1.0f, 1.0f) * expf(-6.0f * (float)n / (float)length);
+	}
+
+	// Output sample n of the convolution of the whole input with the filter
+	static double Direct(const std::vector<float>& input, const std::vector<float>& ir, int n)
+	{
+		double sum = 0.0;
+		const int num = (n + 1 < (int)ir.size()) ? n + 1 : (int)ir.size();
+		for (int k = 0; k < num; k++)
+			sum += (double)ir[k] * (double)input[n - k];
+		return sum;
+	}
+
+	// Maximum error relative to the peak of the reference, from sample start on
+	struct ErrorMeter
+	{
+		ErrorMeter() : maxerr(0.0), peak(1.0) {}
+		void Add(double reference, float output)
+		{
+			const double err = fabs(reference - (double)output);
+			if (err > maxerr)
+				maxerr = err;
+			if (fabs(reference) > peak)
+				peak = fabs(reference);
+		}
+		double GetRelative() const { return maxerr / peak; }
+		double maxerr;
+		double peak;
+	};
+
+	static const double errtol = 1.0e-4;
+
+	NAP_UNITTEST(BinauralAccuracy)
+	{
+		Random r;
+		for (int b = 0; b < sizeof(blocksizes) / sizeof(blocksizes[0]); b++)
+		{
+			for (int i = 0; i < sizeof(irlengths) / sizeof(irlengths[0]); i++)
+			{
+				const int blocksize = blocksizes[b], irlen = irlengths[i];
+				const int numblocks = (2 * irlen) / blocksize + 4;
+				std::vector<float> irL, irR, input, outL(blocksize), outR(blocksize);
+				MakeIR(r, irL, irlen);
+				MakeIR(r, irR, irlen);
+				MakeSignal(r, input, numblocks * blocksize);
+
+				fftconvolver::BinauralFFTConvolver convolver;
+				convolver.init(blocksize, &irL[0], &irR[0], irlen);
+
+				ErrorMeter errL, errR;
+				for (int block = 0; block < numblocks; block++)
+				{
+					convolver.process(&input[block * blocksize], &outL[0], &outR[0], blocksize);
+					for (int n = 0; n < blocksize; n++)
+					{
+						errL.Add(Direct(input, irL, block * blocksize + n), outL[n]);
+						errR.Add(Direct(input, irR, block * blocksize + n), outR[n]);
+					}
+				}
+
+				printf("Binaural %4d/%4d: RelErrL=%15.8g RelErrR=%15.8g\n", blocksize, irlen, errL.GetRelative(), errR.GetRelative());
+				NAP_CHECK(errL.GetRelative() < errtol);
+				NAP_CHECK(errR.GetRelative() < errtol);
+			}
+		}
+	}
+
+	// The spatializer picks partitions shorter than the block for short filters, see choose_partition
+	NAP_UNITTEST(BinauralSmallPartitions)
+	{
+		Random r;
+		static const int configs[][3] = { { 256, 32, 37 }, { 256, 64, 300 }, { 1024, 128, 256 }, { 1024, 256, 1000 } };
+		for (int c = 0; c < sizeof(configs) / sizeof(configs[0]); c++)
+		{
+			const int blocksize = configs[c][0], partition = configs[c][1], irlen = configs[c][2];
+			const int numblocks = (2 * irlen) / blocksize + 4;
+			std::vector<float> irL, irR, input, output(2 * blocksize);
+			MakeIR(r, irL, irlen);
+			MakeIR(r, irR, irlen);
+			MakeSignal(r, input, numblocks * blocksize);
+
+			BinauralConvolver convolver;
+			convolver.Init(partition, irlen);
+			convolver.SetIR(&irL[0], &irR[0], irlen);
+
+			ErrorMeter err;
+			for (int block = 0; block < numblocks; block++)
+			{
+				convolver.Process(&input[block * blocksize], &output[0], NULL, blocksize);
+				for (int n = 0; n < blocksize; n++)
+				{
+					err.Add(Direct(input, irL, block * blocksize + n), output[n]);
+					err.Add(Direct(input, irR, block * blocksize + n), output[blocksize + n]);
+				}
+			}
+
+			printf("Binaural partition %4d/%3d/%4d: RelErr=%15.8g\n", blocksize, partition, irlen, err.GetRelative());
+			NAP_CHECK(err.GetRelative() < errtol);
+		}
+	}
+
+	// The spatializer sets the new filters, renders the block through both the previous and the new ones and
+	// crossfades linearly from one to the other. The input history survives the switch, so the reference
+	// convolves the whole input with each filter.
+	NAP_UNITTEST(BinauralSwitch)
+	{
+		Random r;
+		static const int patterns[] = { 1, 2, 7 }; // Blocks between switches, 0 switches at random
+		for (int b = 0; b < sizeof(blocksizes) / sizeof(blocksizes[0]); b++)
+		{
+			for (int p = 0; p < sizeof(patterns) / sizeof(patterns[0]) + 1; p++)
+			{
+				// Partitions of half a block exercise switches within the partitions of a block
+				const int blocksize = blocksizes[b], partition = (p % 2 == 0) ? blocksize : blocksize / 2, irlen = 300;
+				const int numblocks = 48;
+				std::vector<float> irs[4][2], input, output(2 * blocksize), previousoutput(2 * blocksize);
+				for (int f = 0; f < 4; f++)
+				{
+					MakeIR(r, irs[f][0], irlen);
+					MakeIR(r, irs[f][1], irlen);
+				}
+				MakeSignal(r, input, numblocks * blocksize);
+
+				BinauralConvolver convolver;
+				convolver.Init(partition, irlen);
+				convolver.SetIR(&irs[0][0][0], &irs[0][1][0], irlen);
+
+				// Filter of the block and the one it fades from
+				int filter = 0, previous = 0;
+				ErrorMeter err;
+				bool finite = true;
+				for (int block = 0; block < numblocks; block++)
+				{
+					const bool doswitch = (p < sizeof(patterns) / sizeof(patterns[0])) ? ((block + 1) % patterns[p] == 0) : (r.Get() % 3 == 0);
+					previous = filter;
+					if (doswitch)
+					{
+						filter = (filter + 1 + r.Get() % 3) % 4;
+						convolver.SetIR(&irs[filter][0][0], &irs[filter][1][0], irlen);
+						convolver.Process(&input[block * blocksize], &output[0], &previousoutput[0], blocksize);
+						BlockOps::Crossfade(&output[0], &previousoutput[0], &output[0], 2 * blocksize, 0.0f, 1.0f, BlockOps::Curve_Linear);
+					}
+					else
+					{
+						convolver.Process(&input[block * blocksize], &output[0], NULL, blocksize);
+					}
+
+					for (int n = 0; n < 2 * blocksize; n++)
+					{
+						const int ear = n / blocksize, pos = block * blocksize + n % blocksize;
+						finite = finite && output[n] == output[n] && fabsf(output[n]) < 1.0e4f;
+						// Ramps reach the next step with every sample, see BlockOps
+						const double fade = doswitch ? (double)(n + 1) / (double)(2 * blocksize) : 1.0;
+						err.Add((1.0 - fade) * Direct(input, irs[previous][ear], pos) + fade * Direct(input, irs[filter][ear], pos), output[n]);
+					}
+				}
+
+				printf("Binaural switch %4d/%4d/%d: RelErr=%15.8g\n", blocksize, partition, p < sizeof(patterns) / sizeof(patterns[0]) ? patterns[p] : 0, err.GetRelative());
+				NAP_CHECK(finite);
+				NAP_CHECK(err.GetRelative() < errtol);
+			}
+		}
+	}
+
+	NAP_UNITTEST(TwoStageAccuracy)
+	{
+		Random r;
+		static const int tailblocksizes[] = { 1024, 4096 };
+		for (int b = 0; b < sizeof(blocksizes) / sizeof(blocksizes[0]); b++)
+		{
+			for (int t = 0; t < sizeof(tailblocksizes) / sizeof(tailblocksizes[0]); t++)
+			{
+				for (int i = 0; i < sizeof(irlengths) / sizeof(irlengths[0]); i++)
+				{
+					const int headblocksize = blocksizes[b], tailblocksize = tailblocksizes[t], irlen = irlengths[i] * 3;
+					const int length = 2 * irlen + 3 * tailblocksize;
+					std::vector<float> ir, input, output(length);
+					MakeIR(r, ir, irlen);
+					MakeSignal(r, input, length);
+
+					fftconvolver::TwoStageFFTConvolver convolver;
+					convolver.init(headblocksize, tailblocksize, &ir[0], irlen);
+
+					// Uneven chunks exercise the internal buffering
+					int pos = 0;
+					while (pos < length)
+					{
+						int chunk = 1 + r.Get() % (2 * headblocksize);
+						if (chunk > length - pos)
+							chunk = length - pos;
+						convolver.process(&input[pos], &output[pos], chunk);
+						pos += chunk;
+					}
+
+					ErrorMeter err;
+					for (int n = 0; n < length; n++)
+						err.Add(Direct(input, ir, n), output[n]);
+
+					printf("TwoStage %4d/%4d/%5d: RelErr=%15.8g\n", headblocksize, tailblocksize, irlen, err.GetRelative());
+					NAP_CHECK(err.GetRelative() < errtol);
+				}
+			}
+		}
+	}
+
+	// Filters exchanged in a slot keep the input history, so the output follows the new filter at once
+	NAP_UNITTEST(PartitionedSwitch)
+	{
+		Random r;
+		for (int b = 0; b < sizeof(blocksizes) / sizeof(blocksizes[0]); b++)
+		{
+			for (int i = 0; i < sizeof(irlengths) / sizeof(irlengths[0]); i++)
+			{
+				const int blocksize = blocksizes[b], irlen = irlengths[i];
+				const int numblocks = (2 * irlen) / blocksize + 8;
+				std::vector<float> irs[3], input, output(blocksize);
+				for (int f = 0; f < 3; f++)
+					MakeIR(r, irs[f], irlen);
+				MakeSignal(r, input, numblocks * blocksize);
+
+				PartitionedConvolver convolver;
+				convolver.Init(blocksize, irlen);
+				convolver.SetIR(0, &irs[0][0], irlen);
+
+				int filter = 0, slot = 0;
+				ErrorMeter err;
+				for (int block = 0; block < numblocks; block++)
+				{
+					if (block % 3 == 2)
+					{
+						filter = (filter + 1) % 3;
+						slot = 1 - slot;
+						convolver.SetIR(slot, &irs[filter][0], irlen);
+					}
+					convolver.Process(slot, &input[block * blocksize], &output[0]);
+					for (int n = 0; n < blocksize; n++)
+						err.Add(Direct(input, irs[filter], block * blocksize + n), output[n]);
+				}
+
+				printf("Partitioned switch %4d/%4d: RelErr=%15.8g\n", blocksize, irlen, err.GetRelative());
+				NAP_CHECK(err.GetRelative() < errtol);
+			}
+		}
+	}
+
+	// Filters transformed ahead of time can be exchanged between blocks without any slot of the convolver
+	NAP_UNITTEST(PartitionedPrepared)
+	{
+		Random r;
+		for (int b = 0; b < sizeof(blocksizes) / sizeof(blocksizes[0]); b++)
+		{
+			for (int i = 0; i < sizeof(irlengths) / sizeof(irlengths[0]); i++)
+			{
+				const int blocksize = blocksizes[b], irlen = irlengths[i];
+				const int numblocks = (2 * irlen) / blocksize + 8;
+				std::vector<float> irs[2], input, output(blocksize);
+				PartitionedFilter filters[2];
+				for (int f = 0; f < 2; f++)
+				{
+					MakeIR(r, irs[f], irlen);
+					filters[f].Init(blocksize, &irs[f][0], irlen);
+				}
+				MakeSignal(r, input, numblocks * blocksize);
+
+				PartitionedConvolver convolver;
+				convolver.Init(blocksize, irlen, 0);
+				fftconvolver::SplitComplex spectrum(convolver.GetSpectrumSize());
+
+				ErrorMeter err;
+				for (int block = 0; block < numblocks; block++)
+				{
+					const int filter = (block / 3) % 2;
+					convolver.PushInput(&input[block * blocksize]);
+					spectrum.setZero();
+					convolver.Accumulate(filters[filter], spectrum);
+					convolver.Synthesize(spectrum, &output[0]);
+					for (int n = 0; n < blocksize; n++)
+						err.Add(Direct(input, irs[filter], block * blocksize + n), output[n]);
+				}
+
+				printf("Partitioned prepared %4d/%4d: RelErr=%15.8g\n", blocksize, irlen, err.GetRelative());
+				NAP_CHECK(err.GetRelative() < errtol);
+			}
+		}
+	}
+
+	// Best of a few runs, in nanoseconds per input sample
+	template<class Run>
+	static double Measure(Run run, int numsamples)
+	{
+		double best = 0.0;
+		for (int attempt = 0; attempt < 5; attempt++)
+		{
+			const UInt64 start = LoadProfiler::GetTime();
+			run();
+			const double time = (double)(LoadProfiler::GetTime() - start) / (double)numsamples;
+			if (attempt == 0 || time < best)
+				best = time;
+		}
+		return best;
+	}
+
+	NAP_UNITTEST(Throughput)
+	{
+		Random r;
+		static const int configs[][2] = { { 256, 256 }, { 1024, 512 }, { 1024, 8192 } };
+		for (int c = 0; c < sizeof(configs) / sizeof(configs[0]); c++)
+		{
+			const int blocksize = configs[c][0], irlen = configs[c][1];
+			const int numblocks = 64;
+			std::vector<float> irL, irR, input, outL(blocksize), outR(blocksize);
+			MakeIR(r, irL, irlen);
+			MakeIR(r, irR, irlen);
+			MakeSignal(r, input, numblocks * blocksize);
+			char name[64];
+
+			fftconvolver::BinauralFFTConvolver binaural;
+			binaural.init(blocksize, &irL[0], &irR[0], irlen);
+			const double binauraltime = Measure([&]() {
+				for (int block = 0; block < numblocks; block++)
+					binaural.process(&input[block * blocksize], &outL[0], &outR[0], blocksize);
+			}, numblocks * blocksize);
+			snprintf(name, sizeof(name), "Binaural.%d.%d", blocksize, irlen);
+			NAP_RecordTiming(name, binauraltime);
+
+			fftconvolver::TwoStageFFTConvolver twostage;
+			twostage.init(blocksize, 4 * blocksize, &irL[0], irlen);
+			const double twostagetime = Measure([&]() {
+				for (int block = 0; block < numblocks; block++)
+					twostage.process(&input[block * blocksize], &outL[0], blocksize);
+			}, numblocks * blocksize);
+			snprintf(name, sizeof(name), "TwoStage.%d.%d", blocksize, irlen);
+			NAP_RecordTiming(name, twostagetime);
+
+			PartitionedConvolver partitioned;
+			partitioned.Init(blocksize, irlen);
+			partitioned.SetIR(0, &irL[0], irlen);
+			partitioned.SetIR(1, &irR[0], irlen);
+			fftconvolver::SplitComplex spectrum(partitioned.GetSpectrumSize());
+			const double partitionedtime = Measure([&]() {
+				for (int block = 0; block < numblocks; block++)
+				{
+					// Both ears share the input transform, like the bus sends
+					partitioned.PushInput(&input[block * blocksize]);
+					spectrum.setZero();
+					partitioned.Accumulate(0, spectrum);
+					partitioned.Synthesize(spectrum, &outL[0]);
+					spectrum.setZero();
+					partitioned.Accumulate(1, spectrum);
+					partitioned.Synthesize(spectrum, &outR[0]);
+				}
+			}, numblocks * blocksize);
+			snprintf(name, sizeof(name), "Partitioned.%d.%d", blocksize, irlen);
+			NAP_RecordTiming(name, partitionedtime);
+
+			printf("Throughput %4d/%4d: Binaural=%8.2f TwoStage=%8.2f Partitioned=%8.2f ns/sample\n", blocksize, irlen, binauraltime, twostagetime, partitionedtime);
+		}
+	}
+}
+#endif
@@ -0,0 +1,530 @@
+#include "EarlyReflections.h"
+#include "Epoch.h"
+#include "NAPTest.h"
+
+#include <string.h>
+#include <vector>
+
+const float ShoeboxRoom::SPEED_OF_SOUND = 343.0f;
+
+// Reflections are not rendered closer than this, which keeps sources on the listener finite
+static const float kMinDistance = 0.1f;
+
+// Tag of a frame whose accumulators have been rendered already
+static const UInt64 kNoTick = ~(UInt64)0;
+
+ShoeboxRoom::ShoeboxRoom()
+    : reflectivity(0.0f)
+    , order(0)
+{
+    size[0] = size[1] = size[2] = 1.0f;
+}
+
+void ShoeboxRoom::Set(float width, float height, float depth, float _reflectivity, int _order)
+{
+    size[0] = fmaxf(width, kMinDistance);
+    size[1] = fmaxf(height, kMinDistance);
+    size[2] = fmaxf(depth, kMinDistance);
+    reflectivity = _reflectivity;
+    order = (_order < 0) ? 0 : (_order > MAX_ORDER) ? MAX_ORDER : _order;
+}
+
+int ShoeboxRoom::Compute(const float* m, const float* sourcematrix, Image* images) const
+{
+    // The listener matrix is a rotation followed by a translation, so the listener sits at -R^T t
+    const float listener[3] = {
+        -(m[0] * m[12] + m[1] * m[13] + m[2] * m[14]),
+        -(m[4] * m[12] + m[5] * m[13] + m[6] * m[14]),
+        -(m[8] * m[12] + m[9] * m[13] + m[10] * m[14])
+    };
+
+    // Room coordinates run from 0 to the size of the room along each axis
+    const float origin[3] = { -0.5f * size[0], 0.0f, -0.5f * size[2] };
+    float l[3], s[3];
+    for (int a = 0; a < 3; a++)
+    {
+        l[a] = fminf(fmaxf(listener[a] - origin[a], 0.0f), size[a]);
+        s[a] = fminf(fmaxf(sourcematrix[12 + a] - origin[a], 0.0f), size[a]);
+    }
+    const float direct = fmaxf(sqrtf((s[0] - l[0]) * (s[0] - l[0]) + (s[1] - l[1]) * (s[1] - l[1]) + (s[2] - l[2]) * (s[2] - l[2])), kMinDistance);
+
+    // Mirroring n times along an axis puts the source at n * size + s for even and (n + 1) * size - s for odd n
+    int numimages = 0;
+    for (int nx = -order; nx <= order; nx++)
+    {
+        for (int ny = -order; ny <= order; ny++)
+        {
+            for (int nz = -order; nz <= order; nz++)
+            {
+                const int reflections = abs(nx) + abs(ny) + abs(nz);
+                if (reflections == 0 || reflections > order)
+                    continue;
+
+                const int n[3] = { nx, ny, nz };
+                float v[3];
+                for (int a = 0; a < 3; a++)
+                    v[a] = ((n[a] & 1) ? (n[a] + 1) * size[a] - s[a] : n[a] * size[a] + s[a]) - l[a];
+                const float distance = fmaxf(sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]), kMinDistance);
+
+                Image& image = images[numimages++];
+                image.delay = (distance - direct) / SPEED_OF_SOUND;
+                image.gain = powf(reflectivity, (float)reflections) * direct / distance;
+
+                // Rotate into listener space (x right, y up, z forward) and convert to sofa coordinates
+                const float x = m[0] * v[0] + m[4] * v[1] + m[8] * v[2];
+                const float y = m[1] * v[0] + m[5] * v[1] + m[9] * v[2];
+                const float z = m[2] * v[0] + m[6] * v[1] + m[10] * v[2];
+                image.dir[0] = z / distance;
+                image.dir[1] = -x / distance;
+                image.dir[2] = y / distance;
+            }
+        }
+    }
+    return numimages;
+}
+
+ReflectionSend::ReflectionSend()
+    : blocksize(0)
+    , samplerate(0)
+    , maxdelay(0)
+    , numtaps(0)
+    , numlasttaps(0)
+    , clusters(NULL)
+    , scratch(NULL)
+{
+}
+
+ReflectionSend::~ReflectionSend()
+{
+    delete[] clusters;
+    delete[] scratch;
+}
+
+void ReflectionSend::Init(int _blocksize, int _samplerate, float _maxdelay)
+{
+    blocksize = _blocksize;
+    samplerate = _samplerate;
+    // One more block leaves room for the latency of the render pool
+    maxdelay = (int)(_maxdelay * (float)samplerate) + blocksize;
+    history.Init(maxdelay + blocksize);
+    memset(history.data, 0, history.GetCapacity() * sizeof(float));
+    delete[] clusters;
+    delete[] scratch;
+    clusters = new float[ReflectionBus::NUM_CLUSTERS * blocksize];
+    scratch = new float[blocksize];
+    numtaps = numlasttaps = 0;
+}
+
+void ReflectionSend::SetImages(const ShoeboxRoom::Image* images, int numimages, int latency)
+{
+    for (int i = 0; i < numimages; i++)
+    {
+        Tap& tap = taps[i];
+        tap.delay = (int)(images[i].delay * (float)samplerate + 0.5f) + latency;
+        tap.cluster = ReflectionBus::FindCluster(images[i].dir);
+        tap.gain = images[i].gain;
+        // Dropped taps keep their index, so they fade out like the others
+        if (tap.delay < 0 || tap.delay > maxdelay)
+        {
+            tap.delay = 0;
+            tap.gain = 0.0f;
+        }
+    }
+    numtaps = numimages;
+}
+
+void ReflectionSend::Process(UInt64 dsptick, const float* input)
+{
+    history.Feed(input, blocksize, 1);
+
+    // Taps that kept their delay and cluster only ramp their gain, the others fade out and in again
+    const int num = (numlasttaps > numtaps) ? numlasttaps : numtaps;
+    const Tap silent = { 0, 0, 0.0f };
+    bool used[ReflectionBus::NUM_CLUSTERS] = { false };
+    for (int i = 0; i < num; i++)
+    {
+        const Tap& from = (i < numlasttaps) ? lasttaps[i] : silent;
+        const Tap& to = (i < numtaps) ? taps[i] : silent;
+        const bool moved = from.delay != to.delay || from.cluster != to.cluster;
+        for (int k = moved ? 0 : 1; k < 2; k++)
+        {
+            const Tap& tap = (k == 0) ? from : to;
+            const float start = (k == 0 || !moved) ? from.gain : 0.0f;
+            const float end = (k == 0) ? 0.0f : to.gain;
+            if (start == 0.0f && end == 0.0f)
+                continue;
+
+            history.Read(scratch, blocksize, tap.delay);
+            float* cluster = clusters + tap.cluster * blocksize;
+            if (used[tap.cluster])
+                BlockOps::MixAdd(cluster, scratch, blocksize, start, end);
+            else
+                BlockOps::Gain(cluster, scratch, blocksize, start, end);
+            used[tap.cluster] = true;
+        }
+    }
+
+    memcpy(lasttaps, taps, numtaps * sizeof(Tap));
+    numlasttaps = numtaps;
+
+    ReflectionBus& bus = ReflectionBus::Instance();
+    if (bus.GetBlockSize() != blocksize)
+        return;
+    for (int c = 0; c < ReflectionBus::NUM_CLUSTERS; c++)
+    {
+        if (used[c])
+        {
+            bus.Accumulate(dsptick, clusters, used);
+            break;
+        }
+    }
+}
+
+size_t ReflectionSend::GetMemorySize() const
+{
+    return sizeof(ReflectionSend) + sizeof(float) * ((size_t)history.GetCapacity() + (ReflectionBus::NUM_CLUSTERS + 1) * (size_t)blocksize);
+}
+
+ReflectionBus& ReflectionBus::Instance()
+{
+    static ReflectionBus bus;
+    return bus;
+}
+
+void ReflectionBus::GetClusterDirection(int cluster, float* dir)
+{
+    float azimuth, elevation;
+    if (cluster < 8)
+    {
+        azimuth = 45.0f * (float)cluster;
+        elevation = 0.0f;
+    }
+    else
+    {
+        const int ring = (cluster - 8) / 3;
+        azimuth = 120.0f * (float)((cluster - 8) % 3) + 60.0f * (float)ring;
+        elevation = ring ? -45.0f : 45.0f;
+    }
+    const float a = azimuth * kPI / 180.0f, e = elevation * kPI / 180.0f;
+    dir[0] = cosf(a) * cosf(e);
+    dir[1] = sinf(a) * cosf(e);
+    dir[2] = sinf(e);
+}
+
+// Table of the cluster directions, built once by the first thread that needs it
+struct ClusterDirections
+{
+    ClusterDirections()
+    {
+        for (int c = 0; c < ReflectionBus::NUM_CLUSTERS; c++)
+            ReflectionBus::GetClusterDirection(c, dirs[c]);
+    }
+    float dirs[ReflectionBus::NUM_CLUSTERS][3];
+};
+
+int ReflectionBus::FindCluster(const float* dir)
+{
+    static const ClusterDirections directions;
+    int nearest = 0;
+    float best = -2.0f;
+    for (int c = 0; c < NUM_CLUSTERS; c++)
+    {
+        const float* d = directions.dirs[c];
+        const float dot = dir[0] * d[0] + dir[1] * d[1] + dir[2] * d[2];
+        if (dot > best)
+        {
+            best = dot;
+            nearest = c;
+        }
+    }
+    return nearest;
+}
+
+ReflectionBus::ReflectionBus()
+    : spare(NULL)
+    , convolvers(NULL)
+    , blocksize(0)
+{
+    frame.dsptick = kNoTick;
+    frame.numsends = 0;
+    frame.clusters = NULL;
+    for (int c = 0; c < NUM_CLUSTERS; c++)
+    {
+        frame.used[c] = false;
+        spareused[c] = false;
+        silentblocks[c] = 0;
+    }
+    for (int s = 0; s < NUM_SLOTS; s++)
+        filters[s].store(NULL);
+}
+
+ReflectionBus::~ReflectionBus()
+{
+    // The library is being unloaded, so there is no audio thread left that could render the filters
+    for (int s = 0; s < NUM_SLOTS; s++)
+        delete filters[s].exchange(NULL);
+    delete[] frame.clusters;
+    delete[] spare;
+    delete[] convolvers;
+}
+
+bool ReflectionBus::Init(int _blocksize)
+{
+    MutexScopeLock lock(mutex);
+
+    const int current = blocksize.load(std::memory_order_acquire);
+    if (current != 0)
+        return current == _blocksize;
+    // The convolvers transform blocks of twice the block size, which only works for powers of two
+    if ((_blocksize & (_blocksize - 1)) != 0)
+        return false;
+
+    frame.clusters = new float[NUM_CLUSTERS * _blocksize];
+    spare = new float[NUM_CLUSTERS * _blocksize];
+    convolvers = new PartitionedConvolver[NUM_CLUSTERS];
+    for (int c = 0; c < NUM_CLUSTERS; c++)
+    {
+        convolvers[c].Init(_blocksize, MAX_IR_LEN, 0);
+        // Idle until the first input
+        silentblocks[c] = convolvers[c].GetMaxIRLength() / _blocksize + 1;
+    }
+    for (int e = 0; e < NUM_EARS; e++)
+        spectra[e].resize(_blocksize + 1);
+    frame.dsptick = kNoTick;
+    frame.numsends = 0;
+    blocksize.store(_blocksize, std::memory_order_release);
+
+    // Databases loaded before the first bus were not prepared yet
+    SofaContainer& sofa = SofaContainer::Instance();
+    for (int s = 0; s < NUM_SLOTS; s++)
+    {
+        Epoch::Scope epoch;
+        Replace(s, sofa.Acquire(s));
+    }
+    return true;
+}
+
+void ReflectionBus::Prepare(int slot, const SofaDatabase* database)
+{
+    MutexScopeLock lock(mutex);
+    if (GetBlockSize() != 0)
+        Replace(slot, database);
+}
+
+void ReflectionBus::Replace(int slot, const SofaDatabase* database)
+{
+    const int length = GetBlockSize();
+    Filters* prepared = NULL;
+    if (database != NULL && database->ir_len > 0)
+    {
+        prepared = new Filters();
+        const int irlen = (database->ir_len < MAX_IR_LEN) ? database->ir_len : MAX_IR_LEN;
+        std::vector<float> left(database->ir_len), right(database->ir_len);
+        for (int c = 0; c < NUM_CLUSTERS; c++)
+        {
+            float dir[3];
+            GetClusterDirection(c, dir);
+            database->DecodeFilters(database->Lookup(dir), left.data(), right.data());
+            prepared->ears[c][0].Init(length, left.data(), irlen);
+            prepared->ears[c][1].Init(length, right.data(), irlen);
+        }
+    }
+
+    Epoch::Retire(filters[slot].exchange(prepared, std::memory_order_acq_rel));
+    Epoch::Reclaim();
+}
+
+void ReflectionBus::Accumulate(UInt64 dsptick, const float* clusters, const bool* used)
+{
+    const int length = GetBlockSize();
+    if (length == 0)
+        return;
+
+    frame.lock.Lock();
+    if (frame.dsptick != dsptick)
+    {
+        // First send of a new block, its clusters are copied instead of cleared and added
+        for (int c = 0; c < NUM_CLUSTERS; c++)
+            frame.used[c] = false;
+        frame.dsptick = dsptick;
+        frame.numsends = 0;
+    }
+    for (int c = 0; c < NUM_CLUSTERS; c++)
+    {
+        if (!used[c])
+            continue;
+        float* dst = frame.clusters + c * length;
+        const float* src = clusters + c * length;
+        if (frame.used[c])
+            BlockOps::MixAdd(dst, src, length, 1.0f, 1.0f);
+        else
+            memcpy(dst, src, sizeof(float) * length);
+        frame.used[c] = true;
+    }
+    frame.numsends++;
+    frame.lock.Unlock();
+}
+
+int ReflectionBus::Render(UInt64 dsptick, int slot, float* left, float* right)
+{
+    const int length = GetBlockSize();
+    if (length == 0)
+        return 0;
+    const Filters* selected = (slot >= 0 && slot < NUM_SLOTS) ? filters[slot].load(std::memory_order_acquire) : NULL;
+
+    bool received = false;
+    frame.lock.Lock();
+    if (frame.dsptick == dsptick)
+    {
+        float* clusters = frame.clusters;
+        frame.clusters = spare;
+        spare = clusters;
+        memcpy(spareused, frame.used, sizeof(spareused));
+        received = frame.numsends > 0;
+        frame.dsptick = kNoTick;
+    }
+    frame.lock.Unlock();
+
+    for (int e = 0; e < NUM_EARS; e++)
+        spectra[e].setZero();
+
+    int numactive = 0;
+    PartitionedConvolver* synthesizer = NULL;
+    for (int c = 0; c < NUM_CLUSTERS; c++)
+    {
+        // A cluster keeps being convolved with silence until its delay line is flushed
+        float* input = spare + c * length;
+        const int numpartitions = convolvers[c].GetMaxIRLength() / length;
+        if (received && spareused[c])
+            silentblocks[c] = 0;
+        else if (silentblocks[c] <= numpartitions)
+        {
+            silentblocks[c]++;
+            memset(input, 0, sizeof(float) * length);
+        }
+        if (silentblocks[c] > numpartitions)
+            continue;
+
+        convolvers[c].PushInput(input);
+        if (selected == NULL)
+            continue;
+        for (int e = 0; e < NUM_EARS; e++)
+            convolvers[c].Accumulate(selected->ears[c][e], spectra[e]);
+        synthesizer = &convolvers[c];
+        numactive++;
+    }
+
+    float* out[NUM_EARS] = { left, right };
+    for (int e = 0; e < NUM_EARS; e++)
+    {
+        if (synthesizer != NULL)
+            synthesizer->Synthesize(spectra[e], out[e]);
+        else
+            memset(out[e], 0, sizeof(float) * length);
+    }
+    return numactive;
+}
+
+size_t ReflectionBus::GetMemorySize() const
+{
+    const int length = GetBlockSize();
+    if (length == 0)
+        return 0;
+    size_t size = 2 * NUM_CLUSTERS * sizeof(float) * (size_t)length;
+    size += NUM_EARS * 2 * sizeof(float) * (size_t)(length + 1);
+    for (int c = 0; c < NUM_CLUSTERS; c++)
+        size += convolvers[c].GetMemorySize();
+    Epoch::Scope epoch;
+    for (int s = 0; s < NUM_SLOTS; s++)
+    {
+        const Filters* prepared = filters[s].load(std::memory_order_acquire);
+        if (prepared == NULL)
+            continue;
+        for (int c = 0; c < NUM_CLUSTERS; c++)
+            for (int e = 0; e < NUM_EARS; e++)
+                size += prepared->ears[c][e].GetMemorySize();
+    }
+    return size;
+}
+
+NAP_TESTSUITE(EarlyReflections)
+{
+    // Identity matrices put the listener at the origin looking along +z
+    static void MakeMatrices(float* listener, float* source, float sx, float sy, float sz)
+    {
+        memset(listener, 0, 16 * sizeof(float));
+        memset(source, 0, 16 * sizeof(float));
+        for (int i = 0; i < 4; i++)
+            listener[i * 5] = source[i * 5] = 1.0f;
+        source[12] = sx;
+        source[13] = sy;
+        source[14] = sz;
+    }
+
+    NAP_UNITTEST(ImageSources)
+    {
+        // Listener in the middle of a 4 x 2 x 6 m room, 1 m above the floor, the source 1 m in front
+        float listener[16], source[16];
+        MakeMatrices(listener, source, 0.0f, 1.0f, 1.0f);
+        listener[13] = -1.0f;
+
+        ShoeboxRoom room;
+        room.Set(4.0f, 2.0f, 6.0f, 0.5f, 1);
+        ShoeboxRoom::Image images[ShoeboxRoom::MAX_IMAGES];
+        NAP_CHECK(room.Compute(listener, source, images) == 6);
+
+        // The floor reflection travels sqrt(1 + 4) m and arrives from below in front, as far as the ceiling one
+        bool found = false;
+        for (int i = 0; i < 6; i++)
+        {
+            const float distance = sqrtf(5.0f);
+            if (fabsf(images[i].delay - (distance - 1.0f) / ShoeboxRoom::SPEED_OF_SOUND) > 1.0e-6f)
+                continue;
+            found = found || (images[i].dir[2] < 0.0f && images[i].dir[0] > 0.0f &&
+                    fabsf(images[i].gain - 0.5f / distance) < 1.0e-6f &&
+                    fabsf(images[i].dir[2] + 2.0f / distance) < 1.0e-5f);
+        }
+        NAP_CHECK(found);
+
+        room.Set(4.0f, 2.0f, 6.0f, 0.5f, 3);
+        NAP_CHECK(room.Compute(listener, source, images) == ShoeboxRoom::MAX_IMAGES);
+    }
+
+    NAP_UNITTEST(Clusters)
+    {
+        // Every direction belongs to its own cluster, also when it is off by a few degrees
+        for (int c = 0; c < ReflectionBus::NUM_CLUSTERS; c++)
+        {
+            float dir[3];
+            ReflectionBus::GetClusterDirection(c, dir);
+            NAP_CHECK(ReflectionBus::FindCluster(dir) == c);
+            dir[1] += 0.1f;
+            dir[2] += 0.1f;
+            NAP_CHECK(ReflectionBus::FindCluster(dir) == c);
+        }
+    }
+
+    NAP_UNITTEST(SendDelaysTaps)
+    {
+        // A single tap on an impulse comes out of its cluster delayed and scaled once it faded in
+        const int blocksize = 64, delay = 100;
+        ReflectionSend send;
+        send.Init(blocksize, 48000, 0.01f);
+        ShoeboxRoom::Image image = { (float)delay / 48000.0f, 0.5f, { 0.0f, 1.0f, 0.0f } };
+        send.SetImages(&image, 1, 0);
+
+        float input[blocksize];
+        memset(input, 0, sizeof(input));
+        send.Process(0, input);
+        input[10] = 1.0f;
+        send.Process(1, input);
+        memset(input, 0, sizeof(input));
+        send.Process(2, input);
+
+        const float* cluster = send.GetClusters() + ReflectionBus::FindCluster(image.dir) * blocksize;
+        bool ok = true;
+        for (int n = 0; n < blocksize; n++)
+            ok = ok && cluster[n] == ((n == blocksize + 10 + delay - 2 * blocksize) ? 0.5f : 0.0f);
+        NAP_CHECK(ok);
+    }
+}
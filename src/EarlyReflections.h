@@ -0,0 +1,183 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+#include "PartitionedConvolver.h"
+#include "SofaDatabase.h"
+
+#include <atomic>
+
+/// Early reflections of a shoebox room, rendered through a fixed set of shared directions.
+/// Every source computes the image sources of the room, delays and attenuates its input for each of
+/// them and adds the result to the cluster of the direction it arrives from. The ReflectionBus then
+/// convolves every cluster with the HRTF of its direction once for all sources, so the cost of the
+/// convolutions depends on NUM_CLUSTERS and not on the number of sources times reflections.
+class ShoeboxRoom
+{
+public:
+    static const int MAX_ORDER = 3;
+    // Images of the orders 1 to 3 (6 + 18 + 38)
+    static const int MAX_IMAGES = 62;
+    static const float SPEED_OF_SOUND;
+
+    struct Image
+    {
+        // Relative to the direct sound, in seconds and as a factor
+        float delay;
+        float gain;
+        // Arrival direction in sofa coordinates (x front, y left, z up), normalized
+        float dir[3];
+    };
+
+public:
+    ShoeboxRoom();
+
+public:
+    // The room spans the world from -width/2 to width/2 along x, from the floor at 0 to height along y
+    // and from -depth/2 to depth/2 along z. Every reflection scales the sound by reflectivity.
+    void Set(float width, float height, float depth, float reflectivity, int order);
+
+    // Images of a source for a listener, both given by Unity's matrices (the listener matrix maps from
+    // world to listener space, the source matrix from source to world space). Positions outside the
+    // room are moved onto its walls. The images are always ordered the same for the same order, so the
+    // taps of two calls can be matched by index. Returns the number of images.
+    int Compute(const float* listenermatrix, const float* sourcematrix, Image* images) const;
+
+private:
+    float size[3];
+    float reflectivity;
+    int order;
+};
+
+/// Per source state of the early reflections: keeps enough input history for the longest reflection
+/// and renders its taps into the clusters, which are handed to the ReflectionBus. Taps are faded over
+/// one block whenever their delay or cluster changes, gains are ramped.
+class ReflectionSend
+{
+public:
+    ReflectionSend();
+    ~ReflectionSend();
+
+public:
+    // Allocates everything, not realtime safe. Reflections later than maxdelay seconds are dropped.
+    void Init(int blocksize, int samplerate, float maxdelay);
+
+    // Replaces the taps with the images, delayed by latency samples more than the images say.
+    // Realtime safe, the taps change in the next Process.
+    void SetImages(const ShoeboxRoom::Image* images, int numimages, int latency);
+
+    // Renders one block of blocksize input samples and accumulates the clusters on the bus, if it
+    // runs with the same block size
+    void Process(UInt64 dsptick, const float* input);
+
+    // The clusters rendered by the last Process, NUM_CLUSTERS x blocksize samples. Clusters without
+    // taps hold whatever they held before.
+    inline const float* GetClusters() const { return clusters; }
+    inline int GetBlockSize() const { return blocksize; }
+    size_t GetMemorySize() const;
+
+private:
+    struct Tap
+    {
+        int delay;
+        int cluster;
+        float gain;
+    };
+
+    // Prevent uncontrolled usage
+    ReflectionSend(const ReflectionSend&);
+    ReflectionSend& operator=(const ReflectionSend&);
+
+private:
+    int blocksize;
+    int samplerate;
+    int maxdelay;
+    HistoryBuffer history;
+    // Taps of the next block and the ones rendered in the last block, matched by index
+    Tap taps[ShoeboxRoom::MAX_IMAGES];
+    Tap lasttaps[ShoeboxRoom::MAX_IMAGES];
+    int numtaps;
+    int numlasttaps;
+    float* clusters;
+    float* scratch;
+};
+
+/// Sums the clusters of all ReflectionSends and convolves each of them with the filters of its
+/// direction. The spectra of all clusters are summed, so there is one inverse transform per ear.
+/// Clusters that got no input for longer than their filters are skipped. The filters of every sofa slot
+/// are transformed once when its database is published, rendering only selects the ones of a slot.
+class ReflectionBus
+{
+public:
+    static const int NUM_EARS = 2;
+    static const int NUM_CLUSTERS = 14;
+    // The clusters only need the direct part of the HRTFs, longer filters (rooms) are truncated
+    static const int MAX_IR_LEN = 512;
+    static const int NUM_SLOTS = SofaContainer::MAX_SOFA_FILES;
+
+public:
+    static ReflectionBus& Instance();
+
+    // Unit vector of a cluster in sofa coordinates: eight directions on the horizon and three each
+    // at 45 degrees above and below it, staggered between them
+    static void GetClusterDirection(int cluster, float* dir);
+    // Cluster nearest to a normalized direction
+    static int FindCluster(const float* dir);
+
+public:
+    // Allocates the clusters and convolvers and prepares the filters of the loaded databases, not realtime safe.
+    // Returns false if the bus already runs with another block size or the block size is no power of two.
+    bool Init(int blocksize);
+    inline int GetBlockSize() const { return blocksize.load(std::memory_order_acquire); }
+
+    // Replaces the cluster filters of a slot with the measurements of the database that was just published
+    // into it that are nearest to the cluster directions. Not realtime safe, does nothing before Init.
+    void Prepare(int slot, const SofaDatabase* database);
+
+    // Adds the clusters of a send (NUM_CLUSTERS x blocksize samples) to the block starting at dsptick.
+    // Clusters the send did not use are flagged in used as false and skipped.
+    void Accumulate(UInt64 dsptick, const float* clusters, const bool* used);
+
+    // Renders the reflections of the block starting at dsptick with the filters of a slot, must be called
+    // inside an Epoch::Scope. Returns the number of clusters that were convolved, the output is silent if
+    // there were none.
+    int Render(UInt64 dsptick, int slot, float* left, float* right);
+
+    size_t GetMemorySize() const;
+
+private:
+    ReflectionBus();
+    ~ReflectionBus();
+
+    // Prepare without taking the mutex
+    void Replace(int slot, const SofaDatabase* database);
+
+private:
+    // The filters of all clusters for one slot, published through an atomic pointer and retired to the Epoch
+    struct Filters
+    {
+        PartitionedFilter ears[NUM_CLUSTERS][NUM_EARS];
+    };
+
+    // Accumulators of the block currently being summed, tagged with its dsptick
+    struct Frame
+    {
+        SpinLock lock;
+        UInt64 dsptick;
+        int numsends;
+        float* clusters;
+        bool used[NUM_CLUSTERS];
+    };
+
+    Frame frame;
+    // Swapped with the accumulators of the frame on render, so the convolutions happen outside the lock
+    float* spare;
+    bool spareused[NUM_CLUSTERS];
+    // One convolver per cluster, only its delay line is used
+    PartitionedConvolver* convolvers;
+    // Blocks since the last input of each cluster, its convolver is idle once this exceeds its partitions
+    int silentblocks[NUM_CLUSTERS];
+    std::atomic<Filters*> filters[NUM_SLOTS];
+    fftconvolver::SplitComplex spectra[NUM_EARS];
+    std::atomic<int> blocksize;
+    Mutex mutex;
+};
@@ -0,0 +1,157 @@
+#include "Epoch.h"
+
+#include <atomic>
+
+namespace
+{
+    // Every thread that enters a read side critical section claims one of these records on first use.
+    // Threads that can't get a record fall back to a shared counter which holds back all reclamation.
+    const int kMaxReaders = 64;
+
+    struct Reader
+    {
+        std::atomic<UInt64> epoch; // 0 while the thread is outside of a scope
+        std::atomic<int> used;
+        char pad[64 - sizeof(std::atomic<UInt64>) - sizeof(std::atomic<int>)];
+    };
+
+    struct Retired
+    {
+        void* ptr;
+        Epoch::Deleter deleter;
+        UInt64 epoch;
+        Retired* next;
+    };
+
+    Reader readers[kMaxReaders];
+    std::atomic<UInt64> global_epoch(1);
+    std::atomic<int> overflow_readers(0);
+
+    // Only touched by the non-realtime writers
+    Retired* retired = NULL;
+
+    Mutex& GetWriterMutex()
+    {
+        // Intentionally leaked so that it outlives any static destructor that may still retire data
+        static Mutex* mutex = new Mutex();
+        return *mutex;
+    }
+
+    struct ThreadReader
+    {
+        Reader* reader;
+        int depth;
+        bool overflow;
+
+        ~ThreadReader()
+        {
+            if (reader != NULL)
+                reader->used.store(0, std::memory_order_release);
+        }
+
+        Reader* Claim()
+        {
+            for (int n = 0; n < kMaxReaders; n++)
+            {
+                int expected = 0;
+                if (readers[n].used.compare_exchange_strong(expected, 1, std::memory_order_acq_rel))
+                    return &readers[n];
+            }
+            return NULL;
+        }
+    };
+
+    thread_local ThreadReader thread_reader = { NULL, 0, false };
+}
+
+void Epoch::Enter()
+{
+    ThreadReader& t = thread_reader;
+    if (t.depth++ > 0)
+        return;
+
+    if (t.reader == NULL)
+        t.reader = t.Claim();
+
+    if (t.reader != NULL)
+    {
+        // The sequentially consistent store orders the announcement before any load of shared pointers
+        t.reader->epoch.store(global_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+        t.overflow = false;
+    }
+    else
+    {
+        overflow_readers.fetch_add(1, std::memory_order_seq_cst);
+        t.overflow = true;
+    }
+}
+
+void Epoch::Leave()
+{
+    ThreadReader& t = thread_reader;
+    assert(t.depth > 0);
+    if (--t.depth > 0)
+        return;
+
+    if (t.overflow)
+        overflow_readers.fetch_sub(1, std::memory_order_release);
+    else
+        t.reader->epoch.store(0, std::memory_order_release);
+}
+
+void Epoch::Retire(void* ptr, Deleter deleter)
+{
+    if (ptr == NULL)
+        return;
+
+    MutexScopeLock lock(GetWriterMutex());
+
+    // The object was unpublished before this point, so only readers that announced an epoch
+    // up to and including the current one may still hold a reference to it.
+    Retired* r = new Retired;
+    r->ptr = ptr;
+    r->deleter = deleter;
+    r->epoch = global_epoch.fetch_add(1, std::memory_order_seq_cst);
+    r->next = retired;
+    retired = r;
+}
+
+int Epoch::Reclaim()
+{
+    MutexScopeLock lock(GetWriterMutex());
+
+    if (overflow_readers.load(std::memory_order_seq_cst) > 0)
+    {
+        int pending = 0;
+        for (Retired* r = retired; r != NULL; r = r->next)
+            pending++;
+        return pending;
+    }
+
+    UInt64 oldest = global_epoch.load(std::memory_order_seq_cst);
+    for (int n = 0; n < kMaxReaders; n++)
+    {
+        UInt64 e = readers[n].epoch.load(std::memory_order_seq_cst);
+        if (e != 0 && e < oldest)
+            oldest = e;
+    }
+
+    int pending = 0;
+    Retired** link = &retired;
+    while (*link != NULL)
+    {
+        Retired* r = *link;
+        if (r->epoch < oldest)
+        {
+            *link = r->next;
+            r->deleter(r->ptr);
+            delete r;
+        }
+        else
+        {
+            link = &r->next;
+            pending++;
+        }
+    }
+    return pending;
+}
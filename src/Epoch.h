@@ -0,0 +1,35 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+
+// Epoch based deferred reclamation (RCU) for data that is shared with the audio threads.
+// Writers publish a new version through an atomic pointer swap and hand the old version to Retire.
+// Readers wrap every access in an Epoch::Scope, which is wait free and never allocates.
+// Retired objects are only freed by Reclaim once every reader that could still see them has left
+// the epoch in which they were retired. Retire and Reclaim may block and must not be called from
+// an audio thread.
+class Epoch
+{
+public:
+    typedef void (*Deleter)(void* ptr);
+
+    static void Enter();
+    static void Leave();
+    static void Retire(void* ptr, Deleter deleter);
+    static int Reclaim(); // Returns the number of objects that are still pending
+
+    template<typename T> static void Retire(T* ptr)
+    {
+        Retire(ptr, &DeleteObject<T>);
+    }
+
+    class Scope
+    {
+    public:
+        Scope() { Enter(); }
+        ~Scope() { Leave(); }
+    };
+
+private:
+    template<typename T> static void DeleteObject(void* ptr) { delete (T*)ptr; }
+};
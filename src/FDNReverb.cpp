@@ -0,0 +1,470 @@
+#include "FDNReverb.h"
+#include "NAPTest.h"
+
+#include <climits>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define FDN_SSE2 1
+#   include <emmintrin.h>
+#endif
+
+/////////////////////////////////////////
+/// FDNReverb
+///////////////////////////////////////
+
+static const UInt64 kNoTick = ~(UInt64)0;
+
+// Delays of the lines in milliseconds, spread evenly on a log scale. They are rounded up to the next
+// prime number of samples, so no two lines share a period.
+static const float kDelays[FDNReverb::NUM_LINES] =
+{
+    17.1f, 18.7f, 20.3f, 22.1f, 24.1f, 26.3f, 28.7f, 31.3f, 34.1f, 37.1f, 40.5f, 44.1f, 48.1f, 52.3f, 57.1f, 62.3f
+};
+
+// Signs of a row of the Hadamard matrix of size NUM_LINES, rows of different index are orthogonal
+static inline float HadamardSign(int row, int column)
+{
+    int bits = row & column, parity = 0;
+    for (; bits != 0; bits >>= 1)
+        parity ^= bits & 1;
+    return parity ? -1.0f : 1.0f;
+}
+
+// The input is spread over the lines and both ears tap them with different rows, scaled to keep the energy
+struct FDNTaps
+{
+    FDNTaps()
+    {
+        const float scale = 1.0f / sqrtf((float)FDNReverb::NUM_LINES);
+        for (int i = 0; i < FDNReverb::NUM_LINES; i++)
+        {
+            input[i] = HadamardSign(7, i) * scale;
+            left[i] = HadamardSign(5, i) * scale;
+            right[i] = HadamardSign(10, i) * scale;
+        }
+    }
+    float input[FDNReverb::NUM_LINES];
+    float left[FDNReverb::NUM_LINES];
+    float right[FDNReverb::NUM_LINES];
+};
+
+static const FDNTaps& GetTaps()
+{
+    static const FDNTaps taps;
+    return taps;
+}
+
+static bool IsPrime(int n)
+{
+    if (n < 2)
+        return false;
+    for (int d = 2; d * d <= n; d++)
+        if (n % d == 0)
+            return false;
+    return true;
+}
+
+FDNReverb::FDNReverb()
+    : samplerate(0)
+    , matrix(Matrix_Householder)
+    , buffer(NULL)
+    , size(0)
+    , writepos(0)
+{
+    for (int i = 0; i < NUM_LINES; i++)
+    {
+        delays[i] = 0;
+        offsets[i] = 0;
+        masks[i] = 0;
+        b[i] = 0.0f;
+        a[i] = 0.0f;
+        z[i] = 0.0f;
+    }
+}
+
+FDNReverb::~FDNReverb()
+{
+    delete[] buffer;
+}
+
+void FDNReverb::Init(int _samplerate)
+{
+    samplerate = _samplerate;
+    size = 0;
+    for (int i = 0; i < NUM_LINES; i++)
+    {
+        int delay = (int)ceilf(kDelays[i] * 0.001f * (float)samplerate);
+        while (!IsPrime(delay))
+            delay++;
+        int length = 1;
+        while (length <= delay)
+            length *= 2;
+        delays[i] = delay;
+        offsets[i] = size;
+        masks[i] = (unsigned int)length - 1;
+        size += length;
+    }
+    delete[] buffer;
+    buffer = new float[size];
+    Reset();
+    SetDecay(1.5f, 0.5f);
+}
+
+void FDNReverb::Reset()
+{
+    if (buffer != NULL)
+        memset(buffer, 0, sizeof(float) * size);
+    for (int i = 0; i < NUM_LINES; i++)
+        z[i] = 0.0f;
+    writepos = 0;
+}
+
+void FDNReverb::SetDecay(float rt60, float damping)
+{
+    if (damping > 1.0f)
+        damping = 1.0f;
+    for (int i = 0; i < NUM_LINES; i++)
+    {
+        if (rt60 <= 0.0f || damping <= 0.0f || samplerate == 0)
+        {
+            b[i] = 0.0f;
+            a[i] = 0.0f;
+            continue;
+        }
+        // A line loses 60 dB per rt60 seconds, the lowpass interpolates from the gain at DC to the one at Nyquist
+        const float seconds = (float)delays[i] / (float)samplerate;
+        const float low = powf(10.0f, -3.0f * seconds / rt60);
+        const float high = powf(10.0f, -3.0f * seconds / (rt60 * damping));
+        a[i] = (low - high) / (low + high);
+        b[i] = low * (1.0f - a[i]);
+    }
+}
+
+void FDNReverb::SetMatrix(Matrix _matrix)
+{
+    matrix = _matrix;
+}
+
+size_t FDNReverb::GetMemorySize() const
+{
+    return sizeof(FDNReverb) + sizeof(float) * (size_t)size;
+}
+
+#if FDN_SSE2
+
+static inline float HorizontalSum(__m128 v)
+{
+    const __m128 t = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    return _mm_cvtss_f32(_mm_add_ss(t, _mm_shuffle_ps(t, t, _MM_SHUFFLE(1, 1, 1, 1))));
+}
+
+void FDNReverb::Process(const float* input, float* left, float* right, int numsamples)
+{
+    static_assert(NUM_LINES == 16, "The lines are processed as four vectors of four");
+    const FDNTaps& taps = GetTaps();
+    __m128 vb[4], va[4], vz[4], vinput[4], vleft[4], vright[4];
+    for (int v = 0; v < 4; v++)
+    {
+        vb[v] = _mm_loadu_ps(&b[4 * v]);
+        va[v] = _mm_loadu_ps(&a[4 * v]);
+        vz[v] = _mm_loadu_ps(&z[4 * v]);
+        vinput[v] = _mm_loadu_ps(&taps.input[4 * v]);
+        vleft[v] = _mm_loadu_ps(&taps.left[4 * v]);
+        vright[v] = _mm_loadu_ps(&taps.right[4 * v]);
+    }
+    const __m128 pairsigns = _mm_setr_ps(1.0f, -1.0f, 1.0f, -1.0f);
+    const __m128 quadsigns = _mm_setr_ps(1.0f, 1.0f, -1.0f, -1.0f);
+    const __m128 hadamardscale = _mm_set1_ps(0.25f);
+    const __m128 householderscale = _mm_set1_ps(-2.0f / (float)NUM_LINES);
+    const bool hadamard = matrix == Matrix_Hadamard;
+
+    unsigned int pos = writepos;
+    float lines[NUM_LINES];
+    for (int n = 0; n < numsamples; n++)
+    {
+        for (int i = 0; i < NUM_LINES; i++)
+            lines[i] = buffer[offsets[i] + ((pos - (unsigned int)delays[i]) & masks[i])];
+
+        __m128 s[4];
+        for (int v = 0; v < 4; v++)
+        {
+            vz[v] = _mm_add_ps(_mm_mul_ps(vb[v], _mm_loadu_ps(&lines[4 * v])), _mm_mul_ps(va[v], vz[v]));
+            s[v] = vz[v];
+        }
+
+        __m128 l = _mm_mul_ps(vleft[0], s[0]), r = _mm_mul_ps(vright[0], s[0]);
+        for (int v = 1; v < 4; v++)
+        {
+            l = _mm_add_ps(l, _mm_mul_ps(vleft[v], s[v]));
+            r = _mm_add_ps(r, _mm_mul_ps(vright[v], s[v]));
+        }
+        left[n] = HorizontalSum(l);
+        right[n] = HorizontalSum(r);
+
+        if (hadamard)
+        {
+            // Fast Walsh-Hadamard transform: butterflies of neighbouring lanes, of lane pairs and of the vectors
+            for (int v = 0; v < 4; v++)
+            {
+                s[v] = _mm_add_ps(_mm_mul_ps(s[v], pairsigns), _mm_shuffle_ps(s[v], s[v], _MM_SHUFFLE(2, 3, 0, 1)));
+                s[v] = _mm_add_ps(_mm_mul_ps(s[v], quadsigns), _mm_shuffle_ps(s[v], s[v], _MM_SHUFFLE(1, 0, 3, 2)));
+            }
+            const __m128 t0 = _mm_add_ps(s[0], s[1]), t1 = _mm_sub_ps(s[0], s[1]);
+            const __m128 t2 = _mm_add_ps(s[2], s[3]), t3 = _mm_sub_ps(s[2], s[3]);
+            s[0] = _mm_mul_ps(_mm_add_ps(t0, t2), hadamardscale);
+            s[1] = _mm_mul_ps(_mm_add_ps(t1, t3), hadamardscale);
+            s[2] = _mm_mul_ps(_mm_sub_ps(t0, t2), hadamardscale);
+            s[3] = _mm_mul_ps(_mm_sub_ps(t1, t3), hadamardscale);
+        }
+        else
+        {
+            // Subtract 2/N of the sum of all lines from each of them
+            __m128 sum = _mm_add_ps(_mm_add_ps(s[0], s[1]), _mm_add_ps(s[2], s[3]));
+            sum = _mm_add_ps(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(2, 3, 0, 1)));
+            sum = _mm_add_ps(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 0, 3, 2)));
+            sum = _mm_mul_ps(sum, householderscale);
+            for (int v = 0; v < 4; v++)
+                s[v] = _mm_add_ps(s[v], sum);
+        }
+
+        const __m128 x = _mm_set1_ps(input[n]);
+        for (int v = 0; v < 4; v++)
+            _mm_storeu_ps(&lines[4 * v], _mm_add_ps(s[v], _mm_mul_ps(vinput[v], x)));
+        for (int i = 0; i < NUM_LINES; i++)
+            buffer[offsets[i] + (pos & masks[i])] = lines[i];
+        pos++;
+    }
+
+    for (int v = 0; v < 4; v++)
+        _mm_storeu_ps(&z[4 * v], vz[v]);
+    writepos = pos;
+}
+
+#else
+
+void FDNReverb::Process(const float* input, float* left, float* right, int numsamples)
+{
+    const FDNTaps& taps = GetTaps();
+    unsigned int pos = writepos;
+    float s[NUM_LINES];
+    for (int n = 0; n < numsamples; n++)
+    {
+        float l = 0.0f, r = 0.0f, sum = 0.0f;
+        for (int i = 0; i < NUM_LINES; i++)
+        {
+            const float x = buffer[offsets[i] + ((pos - (unsigned int)delays[i]) & masks[i])];
+            z[i] = b[i] * x + a[i] * z[i];
+            s[i] = z[i];
+            l += taps.left[i] * s[i];
+            r += taps.right[i] * s[i];
+            sum += s[i];
+        }
+        left[n] = l;
+        right[n] = r;
+
+        if (matrix == Matrix_Hadamard)
+        {
+            for (int h = 1; h < NUM_LINES; h *= 2)
+                for (int i = 0; i < NUM_LINES; i += 2 * h)
+                    for (int j = i; j < i + h; j++)
+                    {
+                        const float x = s[j], y = s[j + h];
+                        s[j] = x + y;
+                        s[j + h] = x - y;
+                    }
+            const float scale = 1.0f / sqrtf((float)NUM_LINES);
+            for (int i = 0; i < NUM_LINES; i++)
+                s[i] *= scale;
+        }
+        else
+        {
+            for (int i = 0; i < NUM_LINES; i++)
+                s[i] -= 2.0f / (float)NUM_LINES * sum;
+        }
+
+        for (int i = 0; i < NUM_LINES; i++)
+            buffer[offsets[i] + (pos & masks[i])] = s[i] + taps.input[i] * input[n];
+        pos++;
+    }
+    writepos = pos;
+}
+
+#endif
+
+/////////////////////////////////////////
+/// ReverbBus
+///////////////////////////////////////
+
+ReverbBus& ReverbBus::Instance()
+{
+    static ReverbBus bus;
+    return bus;
+}
+
+ReverbBus::ReverbBus()
+    : spare(NULL)
+    , rt60(0.0f)
+    , damping(0.0f)
+    , matrix(FDNReverb::Matrix_Householder)
+    , silentsamples(0)
+    , samplerate(0)
+    , blocksize(0)
+{
+    frame.dsptick = kNoTick;
+    frame.input = NULL;
+}
+
+ReverbBus::~ReverbBus()
+{
+    delete[] frame.input;
+    delete[] spare;
+}
+
+bool ReverbBus::Init(int _blocksize, int _samplerate)
+{
+    MutexScopeLock lock(mutex);
+
+    const int current = blocksize.load(std::memory_order_acquire);
+    if (current != 0)
+        return current == _blocksize && samplerate == _samplerate;
+
+    frame.input = new float[_blocksize];
+    spare = new float[_blocksize];
+    samplerate = _samplerate;
+    reverb.Init(samplerate);
+    rt60 = 0.0f;
+    // Idle until the first input
+    silentsamples = INT_MAX;
+    frame.dsptick = kNoTick;
+    blocksize.store(_blocksize, std::memory_order_release);
+    return true;
+}
+
+void ReverbBus::Accumulate(UInt64 dsptick, const float* input, float startgain, float endgain)
+{
+    const int length = GetBlockSize();
+    if (length == 0)
+        return;
+
+    frame.lock.Lock();
+    if (frame.dsptick != dsptick)
+    {
+        // First send of a new block, its input is copied instead of cleared and added
+        BlockOps::Gain(frame.input, input, length, startgain, endgain);
+        frame.dsptick = dsptick;
+    }
+    else
+        BlockOps::MixAdd(frame.input, input, length, startgain, endgain);
+    frame.lock.Unlock();
+}
+
+void ReverbBus::Configure(float _rt60, float _damping, FDNReverb::Matrix _matrix)
+{
+    if (_rt60 != rt60 || _damping != damping)
+    {
+        rt60 = _rt60;
+        damping = _damping;
+        reverb.SetDecay(rt60, damping);
+    }
+    if (_matrix != matrix)
+    {
+        matrix = _matrix;
+        reverb.SetMatrix(matrix);
+    }
+}
+
+bool ReverbBus::Render(UInt64 dsptick, float* left, float* right)
+{
+    const int length = GetBlockSize();
+    if (length == 0)
+        return false;
+
+    bool received = false;
+    frame.lock.Lock();
+    if (frame.dsptick == dsptick)
+    {
+        float* input = frame.input;
+        frame.input = spare;
+        spare = input;
+        received = true;
+        frame.dsptick = kNoTick;
+    }
+    frame.lock.Unlock();
+
+    // The tail is 120 dB down after twice the reverberation time, then the lines are cleared and skipped
+    const int limit = (int)(2.0f * rt60 * (float)samplerate);
+    if (received && rt60 > 0.0f)
+        silentsamples = 0;
+    else if (silentsamples <= limit)
+    {
+        silentsamples += length;
+        memset(spare, 0, sizeof(float) * length);
+        if (silentsamples > limit)
+            reverb.Reset();
+    }
+    if (silentsamples > limit)
+    {
+        memset(left, 0, sizeof(float) * length);
+        memset(right, 0, sizeof(float) * length);
+        return false;
+    }
+
+    reverb.Process(spare, left, right, length);
+    return true;
+}
+
+NAP_TESTSUITE(FDNReverb)
+{
+    static double Energy(const std::vector<float>& samples, int begin, int end)
+    {
+        double energy = 0.0;
+        for (int n = begin; n < end; n++)
+            energy += (double)samples[n] * samples[n];
+        return energy;
+    }
+
+    NAP_UNITTEST(DecayAndDecorrelation)
+    {
+        const int samplerate = 48000, length = 3 * samplerate / 2;
+        for (int m = 0; m < FDNReverb::Matrix_Num; m++)
+        {
+            FDNReverb reverb;
+            reverb.Init(samplerate);
+            reverb.SetDecay(1.0f, 1.0f);
+            reverb.SetMatrix((FDNReverb::Matrix)m);
+
+            std::vector<float> input(length, 0.0f), left(length), right(length);
+            input[0] = 1.0f;
+            reverb.Process(&input[0], &left[0], &right[0], length);
+
+            // Nothing before the shortest line, then 30 dB less every half second
+            NAP_CHECK(Energy(left, 0, reverb.GetDelay(0)) == 0.0);
+            NAP_CHECK(fabs(10.0 * log10(Energy(left, samplerate / 5, 2 * samplerate / 5) / Energy(left, 7 * samplerate / 10, 9 * samplerate / 10)) - 30.0) < 3.0);
+            NAP_CHECK(fabs(10.0 * log10(Energy(right, samplerate / 5, 2 * samplerate / 5) / Energy(right, 7 * samplerate / 10, 9 * samplerate / 10)) - 30.0) < 3.0);
+
+            // The ears tap orthogonal combinations of the lines
+            double lr = 0.0;
+            for (int n = samplerate / 10; n < samplerate; n++)
+                lr += (double)left[n] * right[n];
+            NAP_CHECK(fabs(lr) < 0.2 * sqrt(Energy(left, samplerate / 10, samplerate) * Energy(right, samplerate / 10, samplerate)));
+        }
+    }
+
+    NAP_UNITTEST(Damping)
+    {
+        // With damping the high frequencies decay faster, so the tail gets smoother than white
+        const int samplerate = 48000, length = samplerate;
+        FDNReverb reverb;
+        reverb.Init(samplerate);
+        reverb.SetDecay(1.0f, 0.3f);
+        std::vector<float> input(length, 0.0f), left(length), right(length);
+        input[0] = 1.0f;
+        reverb.Process(&input[0], &left[0], &right[0], length);
+
+        double difference = 0.0;
+        for (int n = samplerate / 2 + 1; n < length; n++)
+            difference += ((double)left[n] - left[n - 1]) * ((double)left[n] - left[n - 1]);
+        NAP_CHECK(difference < Energy(left, samplerate / 2, length));
+    }
+}
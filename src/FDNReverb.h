@@ -0,0 +1,111 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+
+/// Late reverb of a feedback delay network with NUM_LINES delay lines.
+/// Every sample the outputs of all lines pass a one-pole lowpass that sets their decay, are mixed by an
+/// orthogonal feedback matrix (Householder or Hadamard) and written back together with the input.
+/// The lines are processed side by side, four per SSE instruction, and both ears tap them with
+/// orthogonal sign patterns, so their outputs are decorrelated.
+/// All memory is allocated by Init, everything else is realtime safe.
+class FDNReverb
+{
+public:
+    static const int NUM_LINES = 16;
+
+    enum Matrix
+    {
+        Matrix_Householder = 0, // I - 2/N * 11^T, spreads every line evenly over all others
+        Matrix_Hadamard = 1,    // Scaled Hadamard matrix, densest mixing
+        Matrix_Num
+    };
+
+public:
+    FDNReverb();
+    ~FDNReverb();
+
+public:
+    // Allocates the delay lines for the sample rate and clears them
+    void Init(int samplerate);
+    void Reset();
+
+    // Reverberation time in seconds at low frequencies and its ratio at the Nyquist frequency to it (at most 1)
+    void SetDecay(float rt60, float damping);
+    void SetMatrix(Matrix matrix);
+
+    // Writes the reverb of numsamples input samples to left and right
+    void Process(const float* input, float* left, float* right, int numsamples);
+
+    inline int GetDelay(int line) const { return delays[line]; }
+    size_t GetMemorySize() const;
+
+private:
+    // Prevent uncontrolled usage
+    FDNReverb(const FDNReverb&);
+    FDNReverb& operator=(const FDNReverb&);
+
+private:
+    int samplerate;
+    Matrix matrix;
+    float* buffer;
+    int size;
+    // Delay, start in buffer and index mask (the length is a power of two) of every line
+    int delays[NUM_LINES];
+    int offsets[NUM_LINES];
+    unsigned int masks[NUM_LINES];
+    unsigned int writepos;
+    // Damping filters of the lines: y = b * x + a * y
+    float b[NUM_LINES];
+    float a[NUM_LINES];
+    float z[NUM_LINES];
+};
+
+/// Sums the reverb sends of all sources and renders them through one FDNReverb, so the reverb costs the same
+/// for any number of sources. The reverb stops once its input was silent long enough for the tail to decay.
+class ReverbBus
+{
+public:
+    static ReverbBus& Instance();
+
+public:
+    // Allocates the accumulators and the reverb, not realtime safe.
+    // Returns false if the bus already runs with another block size or sample rate.
+    bool Init(int blocksize, int samplerate);
+    inline int GetBlockSize() const { return blocksize.load(std::memory_order_acquire); }
+
+    // Adds one block of input to the block starting at dsptick, ramped from startgain to endgain
+    void Accumulate(UInt64 dsptick, const float* input, float startgain, float endgain);
+
+    // Parameters of the reverb, must be called from the thread that renders
+    void Configure(float rt60, float damping, FDNReverb::Matrix matrix);
+
+    // Renders the reverb of the block starting at dsptick. Returns false if the reverb is idle and the
+    // output silent.
+    bool Render(UInt64 dsptick, float* left, float* right);
+
+private:
+    ReverbBus();
+    ~ReverbBus();
+
+private:
+    // Accumulator of the block currently being summed, tagged with its dsptick
+    struct Frame
+    {
+        SpinLock lock;
+        UInt64 dsptick;
+        float* input;
+    };
+
+    Frame frame;
+    // Swapped with the accumulator of the frame on render, so the reverb runs outside the lock
+    float* spare;
+    FDNReverb reverb;
+    float rt60;
+    float damping;
+    FDNReverb::Matrix matrix;
+    // Samples since the last input, the reverb is idle once this exceeds the decay to -120 dB
+    int silentsamples;
+    int samplerate;
+    std::atomic<int> blocksize;
+    Mutex mutex;
+};
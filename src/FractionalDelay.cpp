@@ -0,0 +1,212 @@
+#include "FractionalDelay.h"
+#include "NAPTest.h"
+
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define DELAY_SSE2 1
+#   include <emmintrin.h>
+#endif
+
+// The interpolator reads one sample after the read position, so the newest sample limits the delay to one
+const float FractionalDelay::MIN_DELAY = 1.0f;
+const float FractionalDelay::MAX_SLOPE = 0.5f;
+
+FractionalDelay::FractionalDelay()
+    : buffer(NULL)
+    , mask(0)
+    , writepos(0)
+    , maxdelay(0)
+    , maxblocksize(0)
+    , delay(0.0f)
+    , primed(false)
+{
+}
+
+FractionalDelay::~FractionalDelay()
+{
+    delete[] buffer;
+}
+
+void FractionalDelay::Init(int _maxdelay, int _maxblocksize)
+{
+    maxdelay = (_maxdelay > (int)MIN_DELAY) ? _maxdelay : (int)MIN_DELAY;
+    maxblocksize = (_maxblocksize > 0) ? _maxblocksize : 1;
+
+    // The block is written before it is read and the interpolator reaches two samples further back
+    unsigned int length = 1;
+    while (length < (unsigned int)(maxdelay + maxblocksize + 3))
+        length *= 2;
+    delete[] buffer;
+    buffer = new float[length];
+    mask = length - 1;
+    Reset();
+}
+
+void FractionalDelay::Reset()
+{
+    if (buffer != NULL)
+        memset(buffer, 0, sizeof(float) * (mask + 1));
+    writepos = 0;
+    delay = MIN_DELAY;
+    primed = false;
+}
+
+size_t FractionalDelay::GetMemorySize() const
+{
+    return sizeof(FractionalDelay) + sizeof(float) * (buffer != NULL ? (size_t)mask + 1 : 0);
+}
+
+void FractionalDelay::Process(float* data, int numsamples, float target)
+{
+    if (target < MIN_DELAY)
+        target = MIN_DELAY;
+    if (target > (float)maxdelay)
+        target = (float)maxdelay;
+    if (!primed)
+    {
+        delay = target;
+        primed = true;
+    }
+
+    // Pieces ramp towards the same target, so a split block ramps like a whole one
+    const float slope = (target - delay) / (float)numsamples;
+    while (numsamples > 0)
+    {
+        const int length = (numsamples < maxblocksize) ? numsamples : maxblocksize;
+        ProcessBlock(data, length, (length == numsamples) ? target : delay + slope * (float)length);
+        data += length;
+        numsamples -= length;
+    }
+}
+
+// Third order Lagrange interpolation at j + g from the samples j - 1 to j + 2
+static inline float Interpolate(const float* buffer, unsigned int mask, unsigned int j, float g)
+{
+    return -g * (g - 1.0f) * (g - 2.0f) / 6.0f * buffer[(j - 1) & mask]
+           + (g + 1.0f) * (g - 1.0f) * (g - 2.0f) / 2.0f * buffer[j & mask]
+           - (g + 1.0f) * g * (g - 2.0f) / 2.0f * buffer[(j + 1) & mask]
+           + (g + 1.0f) * g * (g - 1.0f) / 6.0f * buffer[(j + 2) & mask];
+}
+
+void FractionalDelay::ProcessBlock(float* data, int numsamples, float target)
+{
+    for (int n = 0; n < numsamples; n++)
+        buffer[(writepos + n) & mask] = data[n];
+
+    float slope = (target - delay) / (float)numsamples;
+    if (slope > MAX_SLOPE)
+        slope = MAX_SLOPE;
+    if (slope < -MAX_SLOPE)
+        slope = -MAX_SLOPE;
+
+    // Sample t is read at t - delay = j + g with j = t - floor(delay) - 1 and g in (0, 1]
+    int n = 0;
+#if DELAY_SSE2
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 sixth = _mm_set1_ps(1.0f / 6.0f);
+    const __m128 lanes = _mm_mul_ps(_mm_set1_ps(slope), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+    for (; n + 4 <= numsamples; n += 4)
+    {
+        // Truncation is floor for the positive delays
+        const __m128 d = _mm_add_ps(_mm_set1_ps(delay + slope * (float)n), lanes);
+        const __m128i whole = _mm_cvttps_epi32(d);
+        const __m128 g = _mm_sub_ps(one, _mm_sub_ps(d, _mm_cvtepi32_ps(whole)));
+
+        // Gather the four neighbours of every output sample, one vector per neighbour
+        int wholes[4];
+        _mm_storeu_si128((__m128i*)wholes, whole);
+        float taps[4][4];
+        for (int k = 0; k < 4; k++)
+        {
+            const unsigned int j = writepos + (unsigned int)(n + k) - (unsigned int)wholes[k] - 1;
+            for (int i = 0; i < 4; i++)
+                taps[i][k] = buffer[(j + i - 1) & mask];
+        }
+
+        const __m128 gp1 = _mm_add_ps(g, one), gm1 = _mm_sub_ps(g, one), gm2 = _mm_sub_ps(g, two);
+        const __m128 gp1g = _mm_mul_ps(gp1, g), gm1gm2 = _mm_mul_ps(gm1, gm2);
+        const __m128 h0 = _mm_mul_ps(_mm_mul_ps(g, gm1gm2), sixth);
+        const __m128 h1 = _mm_mul_ps(_mm_mul_ps(gp1, gm1gm2), half);
+        const __m128 h2 = _mm_mul_ps(_mm_mul_ps(gp1g, gm2), half);
+        const __m128 h3 = _mm_mul_ps(_mm_mul_ps(gp1g, gm1), sixth);
+        __m128 y = _mm_sub_ps(_mm_mul_ps(h1, _mm_loadu_ps(taps[1])), _mm_mul_ps(h0, _mm_loadu_ps(taps[0])));
+        y = _mm_sub_ps(y, _mm_mul_ps(h2, _mm_loadu_ps(taps[2])));
+        y = _mm_add_ps(y, _mm_mul_ps(h3, _mm_loadu_ps(taps[3])));
+        _mm_storeu_ps(&data[n], y);
+    }
+#endif
+    for (; n < numsamples; n++)
+    {
+        const float d = delay + slope * (float)n;
+        const int whole = (int)d;
+        const unsigned int j = writepos + (unsigned int)n - (unsigned int)whole - 1;
+        data[n] = Interpolate(buffer, mask, j, 1.0f - (d - (float)whole));
+    }
+
+    delay += slope * (float)numsamples;
+    writepos += (unsigned int)numsamples;
+}
+
+NAP_TESTSUITE(FractionalDelay)
+{
+    NAP_UNITTEST(WholeAndFractionalDelays)
+    {
+        // Whole delays are exact, half a sample of a cubic is exact as well since the interpolator is cubic
+        const int numsamples = 64;
+        FractionalDelay line;
+        line.Init(100, numsamples);
+
+        float data[numsamples];
+        for (int n = 0; n < numsamples; n++)
+            data[n] = (n == 5) ? 1.0f : 0.0f;
+        line.Process(data, numsamples, 10.0f);
+        bool ok = true;
+        for (int n = 0; n < numsamples; n++)
+            ok = ok && data[n] == ((n == 15) ? 1.0f : 0.0f);
+        NAP_CHECK(ok);
+
+        line.Reset();
+        for (int n = 0; n < numsamples; n++)
+            data[n] = 0.001f * (float)(n * n * n) - 0.02f * (float)(n * n) + (float)n;
+        line.Process(data, numsamples, 3.5f);
+        ok = true;
+        for (int n = 8; n < numsamples; n++)
+        {
+            const float t = (float)n - 3.5f;
+            ok = ok && fabsf(data[n] - (0.001f * t * t * t - 0.02f * t * t + t)) < 1.0e-3f;
+        }
+        NAP_CHECK(ok);
+    }
+
+    NAP_UNITTEST(RampAndSlope)
+    {
+        // The delay reaches its target at the end of the block, unless the change exceeds the slope
+        const int numsamples = 100;
+        FractionalDelay line;
+        line.Init(1000, 32);
+        std::vector<float> data(numsamples, 0.0f);
+        line.Process(&data[0], numsamples, 20.0f);
+        line.Process(&data[0], numsamples, 40.0f);
+        NAP_CHECK(fabsf(line.GetDelay() - 40.0f) < 1.0e-3f);
+        line.Process(&data[0], numsamples, 500.0f);
+        NAP_CHECK(fabsf(line.GetDelay() - (40.0f + FractionalDelay::MAX_SLOPE * numsamples)) < 1.0e-3f);
+
+        // A ramp over a sine shifts its pitch: a delay growing by 0.25 samples per sample plays at 3/4 the rate
+        line.Init(1000, 256);
+        const int length = 1024;
+        std::vector<float> sine(length);
+        for (int n = 0; n < length; n++)
+            sine[n] = sinf(0.1f * (float)n);
+        line.Process(&sine[0], length / 2, 100.0f);
+        line.Process(&sine[length / 2], length / 2, 100.0f + 0.25f * length / 2);
+        int crossings = 0;
+        for (int n = length / 2 + 1; n < length; n++)
+            if ((sine[n - 1] < 0.0f) != (sine[n] < 0.0f))
+                crossings++;
+        // 0.75 * 0.1 / pi crossings per sample
+        NAP_CHECK(abs(crossings - (int)(0.75f * 0.1f / kPI * (length / 2) + 0.5f)) <= 1);
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+
+/// Delay line with a smoothly varying, fractional delay, e.g. the propagation time of a moving source,
+/// which also renders its Doppler shift. Reads use third order Lagrange interpolation over four
+/// neighbouring samples, computed for four output samples per SSE instruction.
+/// The delay ramps linearly over every block towards its target but never changes by more than
+/// MAX_SLOPE samples per sample, which bounds the pitch shift of jumps to one octave either way.
+/// All memory is allocated by Init, everything else is realtime safe.
+class FractionalDelay
+{
+public:
+    static const float MIN_DELAY;
+    static const float MAX_SLOPE;
+
+public:
+    FractionalDelay();
+    ~FractionalDelay();
+
+public:
+    // Allocates the line for delays of up to maxdelay samples, blocks of any length are split into
+    // pieces of at most maxblocksize samples
+    void Init(int maxdelay, int maxblocksize);
+
+    // Clears the line, the next Process starts right at its target delay
+    void Reset();
+
+    // Delays numsamples samples in place while the delay moves towards target samples
+    void Process(float* data, int numsamples, float target);
+
+    inline float GetDelay() const { return delay; }
+    inline int GetMaxDelay() const { return maxdelay; }
+    size_t GetMemorySize() const;
+
+private:
+    void ProcessBlock(float* data, int numsamples, float target);
+
+    // Prevent uncontrolled usage
+    FractionalDelay(const FractionalDelay&);
+    FractionalDelay& operator=(const FractionalDelay&);
+
+private:
+    float* buffer;
+    unsigned int mask;
+    unsigned int writepos;
+    int maxdelay;
+    int maxblocksize;
+    float delay;
+    bool primed;
+};
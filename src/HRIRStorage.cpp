@@ -0,0 +1,294 @@
+#include "HRIRStorage.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define HRIR_SSE2 1
+#   include <immintrin.h>
+#   if defined(_MSC_VER)
+#       include <intrin.h>
+#       define HRIR_TARGET_F16C
+#   else
+#       define HRIR_TARGET_F16C __attribute__((target("f16c")))
+#   endif
+#elif defined(__aarch64__)
+#   define HRIR_NEON 1
+#   include <arm_neon.h>
+#endif
+
+/////////////////////////////////////////
+/// Scalar conversion
+///////////////////////////////////////
+
+union FloatBits
+{
+    float f;
+    UInt32 u;
+};
+
+// Round to nearest even float -> binary16 conversion (see F. Giesen, "Half to float done quick")
+static UInt16 FloatToHalf(float value)
+{
+    FloatBits v;
+    v.f = value;
+    UInt32 sign = v.u & 0x80000000u;
+    UInt32 x = v.u ^ sign;
+    UInt16 h;
+    if (x >= 0x47800000u)
+    {
+        // Out of range maps to infinity, NaN stays NaN
+        h = (x > 0x7F800000u) ? 0x7E00 : 0x7C00;
+    }
+    else if (x < 0x38800000u)
+    {
+        // Subnormal result, let the FPU do the rounding by aligning the mantissa at the bottom
+        FloatBits magic, t;
+        magic.u = 126u << 23;
+        t.u = x;
+        t.f += magic.f;
+        h = (UInt16)(t.u - magic.u);
+    }
+    else
+    {
+        UInt32 odd = (x >> 13) & 1;
+        x += ((UInt32)(15 - 127) << 23) + 0xFFF;
+        x += odd;
+        h = (UInt16)(x >> 13);
+    }
+    return (UInt16)(h | (sign >> 16));
+}
+
+static float HalfToFloat(UInt16 h)
+{
+    const UInt32 shifted_exp = 0x7C00u << 13;
+    FloatBits o, magic;
+    magic.u = 113u << 23;
+    o.u = (h & 0x7FFFu) << 13;
+    UInt32 exp = shifted_exp & o.u;
+    o.u += (UInt32)(127 - 15) << 23;
+    if (exp == shifted_exp)
+    {
+        o.u += (UInt32)(128 - 16) << 23; // Inf/NaN
+    }
+    else if (exp == 0)
+    {
+        o.u += 1u << 23; // Zero/subnormal
+        o.f -= magic.f;
+    }
+    o.u |= (UInt32)(h & 0x8000u) << 16;
+    return o.f;
+}
+
+/////////////////////////////////////////
+/// SIMD decoding
+///////////////////////////////////////
+
+#if HRIR_SSE2
+static bool HasF16C()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 29)) != 0;
+#else
+    return __builtin_cpu_supports("f16c") != 0;
+#endif
+}
+
+static const bool kHasF16C = HasF16C();
+
+HRIR_TARGET_F16C static int DecodeHalfF16C(const UInt16* src, float* dst, int num)
+{
+    int n = 0;
+    for (; n + 8 <= num; n += 8)
+    {
+        __m128i h = _mm_loadu_si128((const __m128i*)(src + n));
+        _mm_storeu_ps(dst + n, _mm_cvtph_ps(h));
+        _mm_storeu_ps(dst + n + 4, _mm_cvtph_ps(_mm_unpackhi_epi64(h, h)));
+    }
+    return n;
+}
+#endif
+
+static void DecodeHalf(const UInt16* src, float* dst, int num)
+{
+    int n = 0;
+#if HRIR_SSE2
+    if (kHasF16C)
+        n = DecodeHalfF16C(src, dst, num);
+#elif HRIR_NEON
+    for (; n + 4 <= num; n += 4)
+        vst1q_f32(dst + n, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src + n))));
+#endif
+    for (; n < num; n++)
+        dst[n] = HalfToFloat(src[n]);
+}
+
+static void DecodeInt16(const SInt16* src, float* dst, int num, float scale)
+{
+    int n = 0;
+#if HRIR_SSE2
+    __m128 s = _mm_set1_ps(scale);
+    for (; n + 8 <= num; n += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + n));
+        // Sign extend by placing each value in the upper half of a 32 bit lane and shifting back down
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(dst + n, _mm_mul_ps(_mm_cvtepi32_ps(lo), s));
+        _mm_storeu_ps(dst + n + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), s));
+    }
+#elif HRIR_NEON
+    float32x4_t s = vdupq_n_f32(scale);
+    for (; n + 8 <= num; n += 8)
+    {
+        int16x8_t v = vld1q_s16(src + n);
+        vst1q_f32(dst + n, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), s));
+        vst1q_f32(dst + n + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), s));
+    }
+#endif
+    for (; n < num; n++)
+        dst[n] = src[n] * scale;
+}
+
+/////////////////////////////////////////
+/// HRIRStorage
+///////////////////////////////////////
+
+HRIRStorage::HRIRStorage()
+    : format(Format_Float)
+    , numfilters(0)
+    , filterlength(0)
+    , data(NULL)
+    , scales(NULL)
+{
+}
+
+HRIRStorage::~HRIRStorage()
+{
+    Cleanup();
+}
+
+void HRIRStorage::Init(Format _format, const float* src, int _numfilters, int _filterlength)
+{
+    Cleanup();
+
+    format = _format;
+    numfilters = _numfilters;
+    filterlength = _filterlength;
+
+    const int total = numfilters * filterlength;
+    switch (format)
+    {
+        case Format_Half:
+        {
+            UInt16* h = new UInt16[total];
+            for (int n = 0; n < total; n++)
+                h[n] = FloatToHalf(src[n]);
+            data = h;
+            break;
+        }
+        case Format_Int16:
+        {
+            SInt16* q = new SInt16[total];
+            scales = new float[numfilters];
+            for (int f = 0; f < numfilters; f++)
+            {
+                const float* s = src + f * filterlength;
+                float peak = 0.0f;
+                for (int n = 0; n < filterlength; n++)
+                    peak = FastMax(peak, fabsf(s[n]));
+                scales[f] = (peak > 0.0f) ? peak / 32767.0f : 1.0f;
+                const float invscale = 1.0f / scales[f];
+                SInt16* d = q + f * filterlength;
+                for (int n = 0; n < filterlength; n++)
+                {
+                    float v = floorf(s[n] * invscale + 0.5f);
+                    d[n] = (SInt16)FastClip(v, -32767.0f, 32767.0f);
+                }
+            }
+            data = q;
+            break;
+        }
+        default:
+        {
+            format = Format_Float;
+            float* f = new float[total];
+            memcpy(f, src, sizeof(float) * total);
+            data = f;
+            break;
+        }
+    }
+}
+
+void HRIRStorage::Cleanup()
+{
+    switch (format)
+    {
+        case Format_Half:  delete[] (UInt16*)data; break;
+        case Format_Int16: delete[] (SInt16*)data; break;
+        default:           delete[] (float*)data; break;
+    }
+    delete[] scales;
+    data = NULL;
+    scales = NULL;
+    numfilters = 0;
+    filterlength = 0;
+}
+
+void HRIRStorage::Decode(int filter, float* dst) const
+{
+    assert(filter >= 0 && filter < numfilters);
+    const int offset = filter * filterlength;
+    switch (format)
+    {
+        case Format_Half:  DecodeHalf((const UInt16*)data + offset, dst, filterlength); break;
+        case Format_Int16: DecodeInt16((const SInt16*)data + offset, dst, filterlength, scales[filter]); break;
+        default:           memcpy(dst, (const float*)data + offset, sizeof(float) * filterlength); break;
+    }
+}
+
+void HRIRStorage::MeasureError(const float* reference, ErrorReport& report) const
+{
+    float* tmp = new float[filterlength];
+    double maxerr = 0.0, errsum = 0.0, sigsum = 0.0;
+    for (int f = 0; f < numfilters; f++)
+    {
+        Decode(f, tmp);
+        const float* ref = reference + f * filterlength;
+        for (int n = 0; n < filterlength; n++)
+        {
+            double diff = (double)tmp[n] - (double)ref[n];
+            double err = fabs(diff);
+            if (err > maxerr)
+                maxerr = err;
+            errsum += diff * diff;
+            sigsum += (double)ref[n] * (double)ref[n];
+        }
+    }
+    delete[] tmp;
+
+    const double num = (double)numfilters * (double)filterlength;
+    report.maxerr = (float)maxerr;
+    report.rmserr = (num > 0.0) ? (float)sqrt(errsum / num) : 0.0f;
+    report.snr = (errsum > 0.0) ? (float)(10.0 * log10(sigsum / errsum)) : INFINITY;
+}
+
+size_t HRIRStorage::GetMemorySize() const
+{
+    const size_t total = (size_t)numfilters * (size_t)filterlength;
+    switch (format)
+    {
+        case Format_Half:  return total * sizeof(UInt16);
+        case Format_Int16: return total * sizeof(SInt16) + numfilters * sizeof(float);
+        default:           return total * sizeof(float);
+    }
+}
+
+const char* HRIRStorage::GetFormatName(Format format)
+{
+    switch (format)
+    {
+        case Format_Half:  return "half";
+        case Format_Int16: return "int16";
+        default:           return "float";
+    }
+}
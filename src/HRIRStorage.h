@@ -0,0 +1,49 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+
+// Compact storage for impulse responses (and any other per-filter float data such as cached spectra).
+// A SOFA set with thousands of measurements quickly occupies tens of MB as float, so the filters can
+// optionally be kept as IEEE half floats or as int16 with one scale factor per filter.
+// Filters are only expanded back to float when they are activated, so the decoding cost is paid once
+// per filter switch and not per sample.
+class HRIRStorage
+{
+public:
+    enum Format
+    {
+        Format_Float = 0,   // Plain copy, bit exact
+        Format_Half  = 1,   // IEEE 754 binary16, ~11 bits of mantissa
+        Format_Int16 = 2,   // Signed 16 bit with a per-filter peak scale
+        Format_Num
+    };
+
+    // Quality of the compact representation measured against the float reference
+    struct ErrorReport
+    {
+        float maxerr;   // Largest absolute sample error
+        float rmserr;   // RMS of the sample error
+        float snr;      // Signal to error ratio in dB (infinite for bit exact storage)
+    };
+
+public:
+    HRIRStorage();
+    ~HRIRStorage();
+
+public:
+    void Init(Format format, const float* src, int numfilters, int filterlength);
+    void Cleanup();
+    void Decode(int filter, float* dst) const;
+    void MeasureError(const float* reference, ErrorReport& report) const;
+    size_t GetMemorySize() const;
+
+public:
+    static const char* GetFormatName(Format format);
+
+public:
+    Format format;
+    int numfilters;
+    int filterlength;
+    void* data;
+    float* scales;
+};
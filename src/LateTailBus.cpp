@@ -0,0 +1,260 @@
+#include "LateTailBus.h"
+#include "Epoch.h"
+#include "NAPTest.h"
+
+/////////////////////////////////////////
+/// LateTailBus
+///////////////////////////////////////
+
+static const UInt64 kNoTick = ~(UInt64)0;
+
+LateTailBus& LateTailBus::Instance()
+{
+    static LateTailBus bus;
+    return bus;
+}
+
+LateTailBus::LateTailBus()
+    : spare(NULL)
+    , blocksize(0)
+{
+    frame.dsptick = kNoTick;
+    frame.inputs = NULL;
+    for (int s = 0; s < NUM_SLOTS; s++)
+    {
+        frame.used[s] = false;
+        spareused[s] = false;
+        tails[s].store(NULL);
+    }
+}
+
+LateTailBus::~LateTailBus()
+{
+    // The library is being unloaded, so there is no audio thread left that could render the tails
+    for (int s = 0; s < NUM_SLOTS; s++)
+        delete tails[s].exchange(NULL);
+    delete[] frame.inputs;
+    delete[] spare;
+}
+
+bool LateTailBus::Init(int _blocksize)
+{
+    MutexScopeLock lock(mutex);
+
+    const int current = blocksize.load(std::memory_order_acquire);
+    if (current != 0)
+        return current == _blocksize;
+    // The convolvers transform blocks of twice the block size, which only works for powers of two
+    if ((_blocksize & (_blocksize - 1)) != 0)
+        return false;
+
+    frame.inputs = new float[NUM_SLOTS * _blocksize];
+    spare = new float[NUM_SLOTS * _blocksize];
+    for (int e = 0; e < NUM_EARS; e++)
+        spectra[e].resize(_blocksize + 1);
+    frame.dsptick = kNoTick;
+    blocksize.store(_blocksize, std::memory_order_release);
+
+    // Databases loaded before the first bus were not prepared yet
+    SofaContainer& sofa = SofaContainer::Instance();
+    for (int s = 0; s < NUM_SLOTS; s++)
+    {
+        Epoch::Scope epoch;
+        Replace(s, sofa.Acquire(s));
+    }
+    return true;
+}
+
+void LateTailBus::Prepare(int slot, const SofaDatabase* database)
+{
+    MutexScopeLock lock(mutex);
+    if (GetBlockSize() != 0)
+        Replace(slot, database);
+}
+
+void LateTailBus::Replace(int slot, const SofaDatabase* database)
+{
+    const int length = GetBlockSize();
+    Tail* tail = NULL;
+    if (database != NULL && database->HasLateTail())
+    {
+        tail = new Tail();
+        tail->offset = database->late_offset;
+        tail->delay.Init(tail->offset + length);
+        tail->delayed = new float[length];
+        tail->convolver.Init(length, database->late_len, NUM_EARS);
+        float* left = new float[database->late_len];
+        float* right = new float[database->late_len];
+        database->DecodeLateTail(left, right);
+        tail->convolver.SetIR(0, left, database->late_len);
+        tail->convolver.SetIR(1, right, database->late_len);
+        delete[] left;
+        delete[] right;
+        // Idle until the first input
+        tail->flushblocks = (tail->offset + length - 1) / length + tail->convolver.GetMaxIRLength() / length;
+        tail->silentblocks = tail->flushblocks + 1;
+    }
+
+    Epoch::Retire(tails[slot].exchange(tail, std::memory_order_acq_rel));
+    Epoch::Reclaim();
+}
+
+void LateTailBus::Accumulate(UInt64 dsptick, int slot, const float* input)
+{
+    const int length = GetBlockSize();
+    if (length == 0 || slot < 0 || slot >= NUM_SLOTS)
+        return;
+
+    frame.lock.Lock();
+    if (frame.dsptick != dsptick)
+    {
+        // First send of a new block, its input is copied instead of cleared and added
+        for (int s = 0; s < NUM_SLOTS; s++)
+            frame.used[s] = false;
+        frame.dsptick = dsptick;
+    }
+    float* dst = frame.inputs + slot * length;
+    if (frame.used[slot])
+        BlockOps::MixAdd(dst, input, length, 1.0f, 1.0f);
+    else
+        memcpy(dst, input, sizeof(float) * length);
+    frame.used[slot] = true;
+    frame.lock.Unlock();
+}
+
+int LateTailBus::Render(UInt64 dsptick, float* left, float* right)
+{
+    const int length = GetBlockSize();
+    if (length == 0)
+        return 0;
+
+    bool received = false;
+    frame.lock.Lock();
+    if (frame.dsptick == dsptick)
+    {
+        float* inputs = frame.inputs;
+        frame.inputs = spare;
+        spare = inputs;
+        memcpy(spareused, frame.used, sizeof(spareused));
+        received = true;
+        frame.dsptick = kNoTick;
+    }
+    frame.lock.Unlock();
+
+    for (int e = 0; e < NUM_EARS; e++)
+        spectra[e].setZero();
+
+    int numactive = 0;
+    PartitionedConvolver* synthesizer = NULL;
+    for (int s = 0; s < NUM_SLOTS; s++)
+    {
+        Tail* tail = tails[s].load(std::memory_order_acquire);
+        if (tail == NULL)
+            continue;
+
+        // A tail keeps being fed with silence until its delay line and convolver are flushed
+        float* input = spare + s * length;
+        if (received && spareused[s])
+            tail->silentblocks = 0;
+        else if (tail->silentblocks <= tail->flushblocks)
+        {
+            tail->silentblocks++;
+            memset(input, 0, sizeof(float) * length);
+        }
+        if (tail->silentblocks > tail->flushblocks)
+            continue;
+
+        tail->delay.Feed(input, length, 1);
+        tail->delay.Read(tail->delayed, length, tail->offset);
+        tail->convolver.PushInput(tail->delayed);
+        for (int e = 0; e < NUM_EARS; e++)
+            tail->convolver.Accumulate(e, spectra[e]);
+        synthesizer = &tail->convolver;
+        numactive++;
+    }
+
+    float* out[NUM_EARS] = { left, right };
+    for (int e = 0; e < NUM_EARS; e++)
+    {
+        if (synthesizer != NULL)
+            synthesizer->Synthesize(spectra[e], out[e]);
+        else
+            memset(out[e], 0, sizeof(float) * length);
+    }
+    return numactive;
+}
+
+// Only built into the SofaTests runner: the test initializes the process wide bus with its own block size,
+// which the plugin would then keep for good if the test ran while it is loaded
+#if NAP_TEST_RUNNER
+NAP_TESTSUITE(LateTailBus)
+{
+    static float* AllocArray(MYSOFA_ARRAY& array, unsigned int elements)
+    {
+        array.values = (float*)calloc(elements, sizeof(float));
+        array.elements = elements;
+        array.attributes = NULL;
+        return array.values;
+    }
+
+    NAP_UNITTEST(DelaysToTail)
+    {
+        // One measurement split after 100 ms, its tail holds an impulse 200 ms into the impulse response
+        const int blocksize = 64, R = 2, N = 300;
+        LateTailBus& bus = LateTailBus::Instance();
+        if (!bus.Init(blocksize))
+            return;
+
+        MYSOFA_HRTF* hrtf = (MYSOFA_HRTF*)calloc(1, sizeof(MYSOFA_HRTF));
+        hrtf->I = 1;
+        hrtf->C = 3;
+        hrtf->R = R;
+        hrtf->E = 1;
+        hrtf->N = N;
+        hrtf->M = 1;
+        AllocArray(hrtf->ListenerPosition, 3);
+        AllocArray(hrtf->ReceiverPosition, R * 3);
+        AllocArray(hrtf->EmitterPosition, 3);
+        AllocArray(hrtf->ListenerUp, 3)[2] = 1.0f;
+        AllocArray(hrtf->ListenerView, 3)[0] = 1.0f;
+        AllocArray(hrtf->DataSamplingRate, 1)[0] = 1000.0f;
+        AllocArray(hrtf->DataDelay, R);
+        AllocArray(hrtf->SourcePosition, 3)[0] = 1.0f;
+        float* irs = AllocArray(hrtf->DataIR, R * N);
+        irs[0] = 1.0f;
+        irs[200] = 1.0f;
+        irs[N + 250] = 0.5f;
+
+        int err;
+        SofaDatabase* database = SofaDatabase::Create(hrtf, HRIRStorage::Format_Float, &err, 0.1f);
+        NAP_CHECK(database != NULL && database->HasLateTail());
+        if (database == NULL)
+            return;
+
+        // An impulse sent in the first block comes out where it hits the tail, nothing sent renders nothing
+        Epoch::Scope epoch;
+        bus.Prepare(0, database);
+        float input[blocksize], left[6 * blocksize], right[6 * blocksize];
+        memset(input, 0, sizeof(input));
+        NAP_CHECK(bus.Render(0, left, right) == 0);
+        input[3] = 1.0f;
+        for (int b = 0; b < 6; b++)
+        {
+            if (b == 0)
+                bus.Accumulate(0, 0, input);
+            NAP_CHECK(bus.Render((UInt64)b * blocksize, &left[b * blocksize], &right[b * blocksize]) == 1);
+        }
+
+        bool ok = true;
+        for (int n = 0; n < 6 * blocksize; n++)
+        {
+            ok = ok && fabsf(left[n] - ((n == 203) ? 1.0f : 0.0f)) < 1.0e-5f;
+            ok = ok && fabsf(right[n] - ((n == 253) ? 0.5f : 0.0f)) < 1.0e-5f;
+        }
+        NAP_CHECK(ok);
+
+        bus.Prepare(0, NULL);
+        delete database;
+    }
+}
+#endif
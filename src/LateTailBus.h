@@ -0,0 +1,80 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+#include "PartitionedConvolver.h"
+#include "SofaDatabase.h"
+
+#include <atomic>
+
+/// Renders the direction averaged late tails of split impulse responses (see SofaDatabase::Create)
+/// once for all sources. The spatializers only convolve the early part of their filters and send their
+/// input to the slot of their database, the bus delays the sum of each slot to where its tail starts
+/// and convolves it with the tail. Long rooms therefore cost about one convolution in total.
+class LateTailBus
+{
+public:
+    static const int NUM_EARS = 2;
+    static const int NUM_SLOTS = SofaContainer::MAX_SOFA_FILES;
+
+public:
+    static LateTailBus& Instance();
+
+    // Allocates the accumulators and prepares the tails of the loaded databases, not realtime safe.
+    // Returns false if the bus already runs with another block size or the block size is no power of two.
+    bool Init(int blocksize);
+    inline int GetBlockSize() const { return blocksize.load(std::memory_order_acquire); }
+
+    // Replaces the tail of a slot with the one of the database that was just published into it, or removes
+    // it if the database was not split. Not realtime safe, does nothing before Init.
+    void Prepare(int slot, const SofaDatabase* database);
+
+    // Adds one block of mono input to the slot for the block starting at dsptick
+    void Accumulate(UInt64 dsptick, int slot, const float* input);
+
+    // Renders the tails of the block starting at dsptick, must be called inside an Epoch::Scope.
+    // Returns the number of tails that were convolved, the output is silent if there were none.
+    int Render(UInt64 dsptick, float* left, float* right);
+
+private:
+    LateTailBus();
+    ~LateTailBus();
+
+    // Prepare without taking the mutex
+    void Replace(int slot, const SofaDatabase* database);
+
+private:
+    // The convolver of one slot, published through an atomic pointer and retired to the Epoch
+    struct Tail
+    {
+        // Delays the input by offset samples, the start of the tail in the impulse responses
+        HistoryBuffer delay;
+        int offset;
+        // One slot for each ear
+        PartitionedConvolver convolver;
+        // Blocks since the last input, the tail is idle once its delay and convolver are flushed
+        int silentblocks;
+        int flushblocks;
+        float* delayed;
+
+        Tail() : delayed(NULL) {}
+        ~Tail() { delete[] delayed; }
+    };
+
+    // Accumulators of the block currently being summed, tagged with its dsptick
+    struct Frame
+    {
+        SpinLock lock;
+        UInt64 dsptick;
+        float* inputs;
+        bool used[NUM_SLOTS];
+    };
+
+    Frame frame;
+    // Swapped with the accumulators of the frame on render, so the convolutions happen outside the lock
+    float* spare;
+    bool spareused[NUM_SLOTS];
+    std::atomic<Tail*> tails[NUM_SLOTS];
+    fftconvolver::SplitComplex spectra[NUM_EARS];
+    std::atomic<int> blocksize;
+    Mutex mutex;
+};
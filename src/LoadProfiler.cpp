@@ -0,0 +1,168 @@
+#include "LoadProfiler.h"
+
+#include <chrono>
+
+#if defined(_MSC_VER)
+#   include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#   include <x86intrin.h>
+#endif
+
+namespace
+{
+    inline int Log2Bin(UInt64 time)
+    {
+        int bin = 0;
+        while (time > 1 && bin < LoadProfiler::NUM_BINS - 1)
+        {
+            time >>= 1;
+            bin++;
+        }
+        return bin;
+    }
+
+    inline void Store(std::atomic<UInt64>& value, UInt64 x) { value.store(x, std::memory_order_relaxed); }
+    inline UInt64 Load(const std::atomic<UInt64>& value) { return value.load(std::memory_order_relaxed); }
+}
+
+LoadProfiler::LoadProfiler()
+    : current(0)
+    , total_time(0)
+    , total_cycles(0)
+    , total_calls(0)
+{
+    for (int w = 0; w < 2; w++)
+    {
+        for (int n = 0; n < NUM_BINS; n++)
+            windows[w].bins[n].store(0);
+        windows[w].calls.store(0);
+        windows[w].max_time.store(0);
+        windows[w].max_cycles.store(0);
+        windows[w].time.store(0);
+        windows[w].budget.store(0);
+    }
+}
+
+void LoadProfiler::Add(UInt64 time, UInt64 cycles, UInt64 budget)
+{
+    int w = current.load(std::memory_order_relaxed);
+    if (windows[w].calls.load(std::memory_order_relaxed) >= (UInt32)WINDOW_SIZE)
+    {
+        // Start over in the older window
+        w ^= 1;
+        Window& window = windows[w];
+        for (int n = 0; n < NUM_BINS; n++)
+            window.bins[n].store(0, std::memory_order_relaxed);
+        window.calls.store(0, std::memory_order_relaxed);
+        Store(window.max_time, 0);
+        Store(window.max_cycles, 0);
+        Store(window.time, 0);
+        Store(window.budget, 0);
+        current.store(w, std::memory_order_relaxed);
+    }
+
+    Window& window = windows[w];
+    std::atomic<UInt32>& bin = window.bins[Log2Bin(time)];
+    bin.store(bin.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    window.calls.store(window.calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (time > Load(window.max_time))
+        Store(window.max_time, time);
+    if (cycles > Load(window.max_cycles))
+        Store(window.max_cycles, cycles);
+    Increment(window.time, time);
+    Increment(window.budget, budget);
+
+    Increment(total_time, time);
+    Increment(total_cycles, cycles);
+    Increment(total_calls);
+}
+
+float LoadProfiler::GetPercentile(const UInt32* counts, UInt32 total, float fraction) const
+{
+    if (total == 0)
+        return 0.0f;
+
+    // Interpolates linearly inside the bin that holds the percentile
+    const float target = fraction * (float)total;
+    float below = 0.0f;
+    for (int n = 0; n < NUM_BINS; n++)
+    {
+        if (below + (float)counts[n] >= target && counts[n] > 0)
+        {
+            const float lower = (n == 0) ? 0.0f : (float)((UInt64)1 << n);
+            const float upper = (float)((UInt64)1 << (n + 1));
+            return lower + (upper - lower) * (target - below) / (float)counts[n];
+        }
+        below += (float)counts[n];
+    }
+    return (float)((UInt64)1 << NUM_BINS);
+}
+
+int LoadProfiler::GetStats(float* stats, int numstats) const
+{
+    UInt32 counts[NUM_BINS];
+    UInt32 total = 0;
+    UInt64 max_time = 0, max_cycles = 0, time = 0, budget = 0;
+    for (int n = 0; n < NUM_BINS; n++)
+        counts[n] = 0;
+    for (int w = 0; w < 2; w++)
+    {
+        const Window& window = windows[w];
+        for (int n = 0; n < NUM_BINS; n++)
+        {
+            const UInt32 count = window.bins[n].load(std::memory_order_relaxed);
+            counts[n] += count;
+            total += count;
+        }
+        if (Load(window.max_time) > max_time)
+            max_time = Load(window.max_time);
+        if (Load(window.max_cycles) > max_cycles)
+            max_cycles = Load(window.max_cycles);
+        time += Load(window.time);
+        budget += Load(window.budget);
+    }
+
+    const UInt64 all_time = Load(total_time);
+    const float cycles_per_ns = (all_time > 0) ? (float)Load(total_cycles) / (float)all_time : 0.0f;
+    const float p50 = GetPercentile(counts, total, 0.5f);
+    const float p99 = GetPercentile(counts, total, 0.99f);
+
+    float values[Stat_Num];
+    values[Stat_P50_Microseconds] = p50 * 0.001f;
+    values[Stat_P99_Microseconds] = p99 * 0.001f;
+    values[Stat_Max_Microseconds] = (float)max_time * 0.001f;
+    values[Stat_P50_Cycles] = p50 * cycles_per_ns;
+    values[Stat_P99_Cycles] = p99 * cycles_per_ns;
+    values[Stat_Max_Cycles] = (float)max_cycles;
+    values[Stat_Calls] = (float)Load(total_calls);
+    values[Stat_Load] = (budget > 0) ? (float)time / (float)budget : 0.0f;
+
+    const int num = (numstats < Stat_Num) ? numstats : Stat_Num;
+    for (int n = 0; n < num; n++)
+        stats[n] = values[n];
+    return num;
+}
+
+int LoadProfiler::GetHistogram(float* bins, int numbins) const
+{
+    const int num = (numbins < NUM_BINS) ? numbins : NUM_BINS;
+    for (int n = 0; n < num; n++)
+        bins[n] = (float)(windows[0].bins[n].load(std::memory_order_relaxed) + windows[1].bins[n].load(std::memory_order_relaxed));
+    return num;
+}
+
+UInt64 LoadProfiler::GetCycles()
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    return __rdtsc();
+#elif defined(__i386__) || defined(__x86_64__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+UInt64 LoadProfiler::GetTime()
+{
+    return (UInt64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
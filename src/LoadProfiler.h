@@ -0,0 +1,83 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+
+/// Rolling profile of the process callback durations of one plugin instance.
+/// Durations are sorted into log2 bins of nanoseconds. Two windows of WINDOW_SIZE callbacks are
+/// kept, so the statistics always cover the last one to two windows. Only the audio thread writes
+/// and readers on other threads get a slightly inconsistent but never torn view, which makes a
+/// measurement cost two timer reads and a few relaxed stores.
+class LoadProfiler
+{
+public:
+    static const int NUM_BINS = 32;
+    static const int WINDOW_SIZE = 2048;
+
+    enum Stat
+    {
+        Stat_P50_Microseconds,
+        Stat_P99_Microseconds,
+        Stat_Max_Microseconds,
+        Stat_P50_Cycles,
+        Stat_P99_Cycles,
+        Stat_Max_Cycles,
+        Stat_Calls,
+        Stat_Load, // Time spent processing relative to the duration of the processed audio
+        Stat_Num
+    };
+
+    // Measures its own lifetime
+    class Scope
+    {
+    public:
+        Scope(LoadProfiler& profiler, UInt64 budget) : profiler(profiler), budget(budget), cycles(GetCycles()), time(GetTime()) {}
+        ~Scope() { profiler.Add(GetTime() - time, GetCycles() - cycles, budget); }
+        inline UInt64 GetStartTime() const { return time; }
+    private:
+        LoadProfiler& profiler;
+        UInt64 budget;
+        UInt64 cycles;
+        UInt64 time;
+    };
+
+public:
+    LoadProfiler();
+
+public:
+    // Adds one callback that took the given time in nanoseconds for a block of budget nanoseconds
+    void Add(UInt64 time, UInt64 cycles, UInt64 budget);
+
+    // Writes up to Stat_Num values, returns the number written
+    int GetStats(float* stats, int numstats) const;
+    // Writes the callback counts of the bins, bin n counts durations from 2^n to 2^(n+1) nanoseconds
+    int GetHistogram(float* bins, int numbins) const;
+
+    // Single writer increment for counters that are read by other threads
+    static inline void Increment(std::atomic<UInt64>& counter, UInt64 amount = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    static UInt64 GetCycles(); // Time stamp counter where available, 0 otherwise
+    static UInt64 GetTime();   // Monotonic time in nanoseconds
+
+private:
+    float GetPercentile(const UInt32* counts, UInt32 total, float fraction) const;
+
+    struct Window
+    {
+        std::atomic<UInt32> bins[NUM_BINS];
+        std::atomic<UInt32> calls;
+        std::atomic<UInt64> max_time;
+        std::atomic<UInt64> max_cycles;
+        std::atomic<UInt64> time;
+        std::atomic<UInt64> budget;
+    };
+
+    Window windows[2];
+    std::atomic<int> current;
+    // Totals since creation, for the ratio of cycles to nanoseconds
+    std::atomic<UInt64> total_time;
+    std::atomic<UInt64> total_cycles;
+    std::atomic<UInt64> total_calls;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+
+// Tests run while the library is loaded. The SofaTests runner enables them on every platform.
+#ifndef ENABLE_TESTS
+	#define ENABLE_TESTS ((UNITY_WIN || UNITY_OSX) && 1)
+#endif
+
+// Simplistic unit-test framework
+#if ENABLE_TESTS
+	#define NAP_TESTSUITE(name)\
+		namespace testsuite_##name { inline const char* GetSuiteName() { return #name; } }\
+		namespace testsuite_##name
+	#define NAP_UNITTEST(name)\
+		struct NAP_Test_##name { NAP_Test_##name(const char* testname); };\
+		static NAP_Test_##name test_##name(#name);\
+		NAP_Test_##name::NAP_Test_##name(const char* testname)
+	#define NAP_CHECK(...)\
+		do\
+		{\
+			if(!(__VA_ARGS__))\
+			{\
+				printf("%s(%d): Unit test '%s' failed for expression '%s'.\n", __FILE__, __LINE__, testname, #__VA_ARGS__);\
+				NAP_ReportFailure();\
+			}\
+		} while(false)
+
+	// Counts a failed check. Asserts unless the tests run in the SofaTests runner (NAP_TEST_RUNNER),
+	// which reports all failures and returns their number instead.
+	void NAP_ReportFailure();
+	int NAP_GetNumFailures();
+
+	// Records the throughput of a benchmark in nanoseconds per processed sample.
+	// The runner compares the timings against a stored baseline once all tests have run.
+	void NAP_RecordTiming(const char* name, double nspersample);
+	int NAP_GetNumTimings();
+	const char* NAP_GetTimingName(int index);
+	double NAP_GetTiming(int index);
+#else
+	#define NAP_TESTSUITE(name) namespace testsuite_##name
+	#define NAP_UNITTEST(name) static void test_##name()
+	#define NAP_CHECK(...) do {} while(false)
+#endif
@@ -0,0 +1,231 @@
+#include "PartitionedConvolver.h"
+
+#include <string.h>
+
+// Each partition is zero padded to the transform size of 2 * blocksize, so the second half of every
+// circular convolution holds the linear convolution result (overlap-save)
+static void TransformPartition(audiofft::AudioFFT& fft, float* fftbuffer, int blocksize, const float* ir, int num,
+                               float* re, float* im)
+{
+    memset(fftbuffer, 0, 2 * blocksize * sizeof(float));
+    memcpy(fftbuffer, ir, num * sizeof(float));
+    fft.fft(fftbuffer, re, im);
+}
+
+// Floats per real or imaginary part of a spectrum of blocksize + 1 bins, padded to whole cache lines
+static int GetSpectrumStride(int blocksize)
+{
+    return (int)(Arena::Align((blocksize + 1) * sizeof(float)) / sizeof(float));
+}
+
+static int CountPartitions(int blocksize, int maxirlen)
+{
+    const int numpartitions = (maxirlen + blocksize - 1) / blocksize;
+    return (numpartitions < 1) ? 1 : numpartitions;
+}
+
+PartitionedFilter::PartitionedFilter()
+    : blocksize(0)
+{
+}
+
+PartitionedFilter::~PartitionedFilter()
+{
+    for (size_t p = 0; p < partitions.size(); p++)
+        delete partitions[p];
+}
+
+void PartitionedFilter::Init(int _blocksize, const float* ir, int irlen)
+{
+    for (size_t p = 0; p < partitions.size(); p++)
+        delete partitions[p];
+    partitions.clear();
+    blocksize = _blocksize;
+    const int numpartitions = (irlen + blocksize - 1) / blocksize;
+    for (int p = 0; p < numpartitions; p++)
+        partitions.push_back(new fftconvolver::SplitComplex(blocksize + 1));
+
+    audiofft::AudioFFT fft;
+    fft.init(2 * blocksize);
+    fftconvolver::SampleBuffer fftbuffer(2 * blocksize);
+    for (int p = 0; p < numpartitions; p++)
+    {
+        const int offset = p * blocksize;
+        const int num = (irlen - offset < blocksize) ? irlen - offset : blocksize;
+        TransformPartition(fft, fftbuffer.data(), blocksize, ir + offset, num, partitions[p]->re(), partitions[p]->im());
+    }
+}
+
+size_t PartitionedFilter::GetMemorySize() const
+{
+    return sizeof(PartitionedFilter) + partitions.size() * 2 * sizeof(float) * (size_t)(blocksize + 1);
+}
+
+PartitionedConvolver::PartitionedConvolver()
+    : blocksize(0)
+    , numpartitions(0)
+    , numslots(0)
+    , fdlpos(0)
+    , stride(0)
+    , ownarena(NULL)
+    , numirpartitions(NULL)
+    , irs(NULL)
+    , fdl(NULL)
+    , inputbuffer(NULL)
+    , fftbuffer(NULL)
+    , accumulator(NULL)
+{
+}
+
+PartitionedConvolver::~PartitionedConvolver()
+{
+    Cleanup();
+}
+
+void PartitionedConvolver::Cleanup()
+{
+    Arena::Destroy(ownarena);
+    ownarena = NULL;
+    numirpartitions = NULL;
+    irs = NULL;
+    fdl = NULL;
+    inputbuffer = NULL;
+    fftbuffer = NULL;
+    accumulator = NULL;
+    numslots = 0;
+    numpartitions = 0;
+}
+
+size_t PartitionedConvolver::GetArenaSize(int blocksize, int maxirlen, int numslots)
+{
+    const size_t spectrum = 2 * sizeof(float) * (size_t)GetSpectrumStride(blocksize);
+    const size_t numpartitions = (size_t)CountPartitions(blocksize, maxirlen);
+    return Arena::Align(sizeof(int) * numslots)
+         + Arena::Align(spectrum * numpartitions * numslots)              // filters
+         + Arena::Align(spectrum * numpartitions)                         // delay line
+         + Arena::Align(spectrum)                                         // accumulator
+         + 2 * Arena::Align(sizeof(float) * (size_t)(2 * blocksize));     // input and transform buffers
+}
+
+void PartitionedConvolver::Init(int _blocksize, int maxirlen, int _numslots)
+{
+    Cleanup();
+    Arena* arena = Arena::Create(GetArenaSize(_blocksize, maxirlen, _numslots));
+    Init(*arena, _blocksize, maxirlen, _numslots);
+    ownarena = arena;
+}
+
+void PartitionedConvolver::Init(Arena& arena, int _blocksize, int maxirlen, int _numslots)
+{
+    Cleanup();
+
+    blocksize = _blocksize;
+    numslots = _numslots;
+    numpartitions = CountPartitions(blocksize, maxirlen);
+    stride = GetSpectrumStride(blocksize);
+    fft.init(2 * blocksize);
+
+    // The arena hands out zeroed memory, so all filters start out empty
+    numirpartitions = arena.AllocateArray<int>(numslots);
+    irs = arena.AllocateArray<float>(2 * (size_t)stride * numpartitions * numslots);
+    fdl = arena.AllocateArray<float>(2 * (size_t)stride * numpartitions);
+    accumulator = arena.AllocateArray<float>(2 * (size_t)stride);
+    inputbuffer = arena.AllocateArray<float>(2 * blocksize);
+    fftbuffer = arena.AllocateArray<float>(2 * blocksize);
+
+    Reset();
+}
+
+void PartitionedConvolver::Reset()
+{
+    memset(fdl, 0, 2 * sizeof(float) * stride * (size_t)numpartitions);
+    memset(inputbuffer, 0, 2 * blocksize * sizeof(float));
+    fdlpos = 0;
+}
+
+void PartitionedConvolver::SetIR(int slot, const float* ir, int irlen)
+{
+    if (irlen > GetMaxIRLength())
+        irlen = GetMaxIRLength();
+
+    int p = 0;
+    for (int offset = 0; offset < irlen; offset += blocksize, p++)
+    {
+        const int num = (irlen - offset < blocksize) ? irlen - offset : blocksize;
+        float* spectrum = GetFilter(slot, p);
+        TransformPartition(fft, fftbuffer, blocksize, ir + offset, num, spectrum, spectrum + stride);
+    }
+    numirpartitions[slot] = p;
+}
+
+void PartitionedConvolver::PushInput(const float* input)
+{
+    // Slide the input window by one block
+    memmove(inputbuffer, inputbuffer + blocksize, blocksize * sizeof(float));
+    memcpy(inputbuffer + blocksize, input, blocksize * sizeof(float));
+
+    // The newest spectrum sits at fdlpos, older ones follow
+    fdlpos = (fdlpos == 0) ? numpartitions - 1 : fdlpos - 1;
+    float* spectrum = GetDelayLine(fdlpos);
+    fft.fft(inputbuffer, spectrum, spectrum + stride);
+}
+
+void PartitionedConvolver::Accumulate(int slot, fftconvolver::SplitComplex& result) const
+{
+    Accumulate(slot, result.re(), result.im());
+}
+
+void PartitionedConvolver::Accumulate(int slot, float* re, float* im) const
+{
+    const int num = numirpartitions[slot];
+    const size_t numbins = (size_t)GetSpectrumSize();
+    int index = fdlpos;
+    for (int p = 0; p < num; p++)
+    {
+        const float* input = GetDelayLine(index);
+        const float* filter = GetFilter(slot, p);
+        fftconvolver::ComplexMultiplyAccumulate(re, im, input, input + stride, filter, filter + stride, numbins);
+        if (++index == numpartitions)
+            index = 0;
+    }
+}
+
+void PartitionedConvolver::Accumulate(const PartitionedFilter& filter, fftconvolver::SplitComplex& result) const
+{
+    const int num = (filter.GetNumPartitions() < numpartitions) ? filter.GetNumPartitions() : numpartitions;
+    const size_t numbins = (size_t)GetSpectrumSize();
+    int index = fdlpos;
+    for (int p = 0; p < num; p++)
+    {
+        const float* input = GetDelayLine(index);
+        const fftconvolver::SplitComplex& partition = *filter.partitions[p];
+        fftconvolver::ComplexMultiplyAccumulate(result.re(), result.im(), input, input + stride, partition.re(),
+                                                partition.im(), numbins);
+        if (++index == numpartitions)
+            index = 0;
+    }
+}
+
+void PartitionedConvolver::Synthesize(const fftconvolver::SplitComplex& spectrum, float* output)
+{
+    Synthesize(spectrum.re(), spectrum.im(), output);
+}
+
+void PartitionedConvolver::Synthesize(const float* re, const float* im, float* output)
+{
+    fft.ifft(fftbuffer, re, im);
+    memcpy(output, fftbuffer + blocksize, blocksize * sizeof(float));
+}
+
+void PartitionedConvolver::Process(int slot, const float* input, float* output)
+{
+    PushInput(input);
+    memset(accumulator, 0, 2 * sizeof(float) * (size_t)stride);
+    Accumulate(slot, accumulator, accumulator + stride);
+    Synthesize(accumulator, accumulator + stride, output);
+}
+
+size_t PartitionedConvolver::GetMemorySize() const
+{
+    return (numpartitions > 0) ? GetArenaSize(blocksize, numpartitions * blocksize, numslots) : 0;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "Arena.h"
+#include "FFTConvolver/AudioFFT.h"
+#include "FFTConvolver/Utilities.h"
+
+#include <vector>
+
+/// Spectra of a filter partitioned for convolvers of one block size. Transformed once off the audio thread,
+/// it can be shared by several convolvers and published to the audio thread, which then only multiplies.
+/// Not realtime safe.
+class PartitionedFilter
+{
+public:
+    PartitionedFilter();
+    ~PartitionedFilter();
+
+public:
+    // Transforms irlen samples of ir into partitions of blocksize samples
+    void Init(int blocksize, const float* ir, int irlen);
+
+    inline int GetBlockSize() const { return blocksize; }
+    inline int GetNumPartitions() const { return (int)partitions.size(); }
+    size_t GetMemorySize() const;
+
+private:
+    friend class PartitionedConvolver;
+
+    // Prevent uncontrolled usage
+    PartitionedFilter(const PartitionedFilter&);
+    PartitionedFilter& operator=(const PartitionedFilter&);
+
+private:
+    int blocksize;
+    std::vector<fftconvolver::SplitComplex*> partitions;
+};
+
+/// Uniformly partitioned overlap-save convolution in the frequency domain.
+/// Unlike fftconvolver::FFTConvolver the input history (the frequency domain delay line) is kept
+/// when a filter gets exchanged, and two filters can be held at the same time so the output of
+/// the old and the new filter can be computed from the same input for a crossfade. More slots can
+/// be requested to convolve one input with several filters, e.g. the two ears.
+/// The spectra can also be accumulated into external buffers, so that several convolutions can
+/// share a single inverse transform.
+/// All memory is allocated by Init, either from an arena of the caller or from one of its own
+/// (only the tables of the transform come from the heap), everything else is realtime safe.
+class PartitionedConvolver
+{
+public:
+    PartitionedConvolver();
+    ~PartitionedConvolver();
+
+public:
+    void Init(int blocksize, int maxirlen, int numslots = 2);
+    // Carves the spectra and buffers from arena, which has to outlive the convolver
+    void Init(Arena& arena, int blocksize, int maxirlen, int numslots = 2);
+    void Reset();
+
+    // Bytes Init takes from an arena
+    static size_t GetArenaSize(int blocksize, int maxirlen, int numslots = 2);
+
+    // Transforms the filter into the given slot, filters longer than maxirlen are truncated
+    void SetIR(int slot, const float* ir, int irlen);
+
+    // Adds the next block of blocksize input samples to the delay line
+    void PushInput(const float* input);
+
+    // Adds the spectrum of the current output block of the given filter to result
+    void Accumulate(int slot, fftconvolver::SplitComplex& result) const;
+    void Accumulate(int slot, float* re, float* im) const;
+    // The same for a filter prepared for this block size, partitions beyond maxirlen are left out
+    void Accumulate(const PartitionedFilter& filter, fftconvolver::SplitComplex& result) const;
+
+    // Transforms an accumulated spectrum back into blocksize output samples
+    void Synthesize(const fftconvolver::SplitComplex& spectrum, float* output);
+    void Synthesize(const float* re, const float* im, float* output);
+
+    // PushInput, Accumulate and Synthesize in one go
+    void Process(int slot, const float* input, float* output);
+
+    inline int GetBlockSize() const { return blocksize; }
+    inline int GetSpectrumSize() const { return blocksize + 1; }
+    inline int GetMaxIRLength() const { return numpartitions * blocksize; }
+    inline int GetNumSlots() const { return numslots; }
+    inline int GetNumPartitions(int slot) const { return numirpartitions[slot]; }
+    // Bytes of the spectra and buffers, wherever they were allocated
+    size_t GetMemorySize() const;
+
+private:
+    void Cleanup();
+
+    // Real parts of a spectrum, the imaginary ones follow after stride floats
+    inline float* GetFilter(int slot, int partition) const { return irs + 2 * stride * ((size_t)slot * numpartitions + partition); }
+    inline float* GetDelayLine(int partition) const { return fdl + 2 * stride * (size_t)partition; }
+
+    // Prevent uncontrolled usage
+    PartitionedConvolver(const PartitionedConvolver&);
+    PartitionedConvolver& operator=(const PartitionedConvolver&);
+
+private:
+    int blocksize;
+    int numpartitions;
+    int numslots;
+    int fdlpos;
+    // Floats per real or imaginary part of a spectrum, padded to whole cache lines
+    int stride;
+    audiofft::AudioFFT fft;
+    // Arena of a convolver that was initialized without one
+    Arena* ownarena;
+    int* numirpartitions;
+    // numslots x numpartitions filter spectra and numpartitions spectra of the delay line
+    float* irs;
+    float* fdl;
+    float* inputbuffer;
+    float* fftbuffer;
+    float* accumulator;
+};
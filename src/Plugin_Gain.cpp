@@ -49,6 +49,7 @@ namespace Plugin_Gain {
     struct EffectData
     {
         float p[P_NUM]; // Parameters
+        float gain;     // The gain reached at the end of the last block, ramped towards p[P_GAIN] to avoid zipper noise
     };
 
     // UNITY_AUDIODSP_RESULT is defined as `int`
@@ -60,6 +61,7 @@ namespace Plugin_Gain {
         EffectData* effectdata = new EffectData;    // Create a new pointer to the struct defined earlier
         memset(effectdata, 0, sizeof(EffectData));  // Quickly fill memory location with zeros
         effectdata->p[P_GAIN] = 1.0f;               // Initialize effectdata with default parameter value(s)
+        effectdata->gain = 1.0f;
         state->effectdata = effectdata;             // Add our effectdata pointer to the state so we can reach it in other callbacks
         // Use the callback we defined earlier to initialize the parameters
         InitParametersFromDefinitions(InternalRegisterEffectDefinition, effectdata->p);
@@ -102,17 +104,11 @@ namespace Plugin_Gain {
         // Grab the EffectData struct we created in CreateCallback
         EffectData *data = state->GetEffectData<EffectData>();
 
-        // For each sample going to the output buffer
-        for(unsigned int n = 0; n < length; ++n)
-        {
-            // For each channel of the sample
-            for(int i = 0; i < outchannels; ++i)
-            {
-                // Write the sample to the buffer
-                unsigned int j = n * outchannels + i;
-                outbuffer[j] = data->p[P_GAIN] * inbuffer[j];
-            }
-        }
+        // Ramp from the last gain to the current parameter over the block, in even steps of dB unless one of
+        // them is silent. Both channels of a frame get the same gain, so the stereo image stays put.
+        const float target = data->p[P_GAIN];
+        BlockOps::GainInterleaved(outbuffer, inbuffer, outchannels, length, data->gain, target, BlockOps::Ramp_Exponential);
+        data->gain = target;
 
         return UNITY_AUDIODSP_OK;
     }
@@ -0,0 +1,184 @@
+#include "AudioPluginUtil.h"
+#include "BinauralBus.h"
+#include "EarlyReflections.h"
+#include "Epoch.h"
+#include "FDNReverb.h"
+#include "LateTailBus.h"
+#include "SofaDatabase.h"
+
+// Mixer group effect that renders all SOFA Spatializers in send mode, the early reflections of all of them,
+// the shared late tails of split sofa files and one reverb fed by the reverb zone mix of every source.
+// Put it on the group the sending sources are routed to, their binaural signal is summed
+// in the frequency domain and added to whatever else passes through the group.
+namespace Plugin_SofaMixBus {
+
+    static const int NUM_EARS = BinauralBus::NUM_EARS;
+
+    /////////////////////////////////////////
+    /// plugin logic
+    ///////////////////////////////////////
+
+    enum Param
+    {
+        P_GAIN,
+        P_REFLECTION_SOFA,
+        P_REVERB_TIME,
+        P_REVERB_DAMPING,
+        P_REVERB_MATRIX,
+        P_NUM
+    };
+
+    struct EffectData
+    {
+        // Editor parameters
+        float p[P_NUM];
+        // Sends mixed in the last block
+        int num_sends;
+        // Output of the bus for both ears, allocated for dspbuffersize samples
+        float* out_deinterleaved;
+        bool is_initialized;
+        bool has_reflections;
+        bool has_late_tails;
+        bool has_reverb;
+    };
+
+    int InternalRegisterEffectDefinition(UnityAudioEffectDefinition& definition)
+    {
+        definition.paramdefs = new UnityAudioParameterDefinition [P_NUM];
+        RegisterParameter(definition, "Gain", "", 0.0f, 10.0f, 1.0f, 1.0f, 1.0f, P_GAIN,
+                          "Gain applied to the summed sends");
+        RegisterParameter(definition, "Reflection Sofa", "", 0.0f, SofaContainer::MAX_SOFA_FILES - 1, 0.0f, 1.0f, 1.0f, P_REFLECTION_SOFA,
+                          "Sofa slot whose filters render the early reflections of the spatializers");
+        RegisterParameter(definition, "Reverb Time", "s", 0.0f, 10.0f, 1.5f, 1.0f, 1.0f, P_REVERB_TIME,
+                          "Time the reverb fed by the reverb zone mix of the spatializers takes to decay by 60 dB. 0 disables it.");
+        RegisterParameter(definition, "Reverb Damping", "", 0.1f, 1.0f, 0.5f, 1.0f, 1.0f, P_REVERB_DAMPING,
+                          "Reverb time of the highest frequencies relative to the one of the low frequencies");
+        RegisterParameter(definition, "Reverb Matrix", "", 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, P_REVERB_MATRIX,
+                          "Feedback matrix of the delay network: 0 Householder, 1 Hadamard");
+        return P_NUM;
+    }
+
+    UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK CreateCallback(UnityAudioEffectState* state)
+    {
+        auto data = new EffectData;
+        memset(data, 0, sizeof(EffectData));
+        // Spatializers in send mode use the block size of the first bus
+        data->is_initialized = BinauralBus::Instance().Init(state->dspbuffersize);
+        data->has_reflections = ReflectionBus::Instance().Init(state->dspbuffersize);
+        data->has_late_tails = LateTailBus::Instance().Init(state->dspbuffersize);
+        data->has_reverb = ReverbBus::Instance().Init(state->dspbuffersize, state->samplerate);
+        data->out_deinterleaved = new float[state->dspbuffersize * NUM_EARS * 2];
+        state->effectdata = data;
+        InitParametersFromDefinitions(InternalRegisterEffectDefinition, data->p);
+
+        return UNITY_AUDIODSP_OK;
+    }
+
+    UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK ReleaseCallback(UnityAudioEffectState* state)
+    {
+        EffectData *data = state->GetEffectData<EffectData>();
+        delete[] data->out_deinterleaved;
+        delete data;
+        return UNITY_AUDIODSP_OK;
+    }
+
+    /////////////////////////////////////////
+    /// Soundprocessing
+    ///////////////////////////////////////
+
+    // Adds both ears to the first two channels of the interleaved buffer
+    static void mix_ears(float *outbuffer, const float *left, const float *right, unsigned int length, int outchannels, float gain) {
+        for (unsigned int i = 0; i < length; ++i) {
+            outbuffer[i * outchannels] += left[i] * gain;
+            outbuffer[i * outchannels + 1] += right[i] * gain;
+        }
+    }
+
+    UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK ProcessCallback(
+            UnityAudioEffectState* state,
+            float* inbuffer,
+            float* outbuffer,
+            unsigned int length,
+            int inchannels,
+            int outchannels)
+    {
+        memcpy(outbuffer, inbuffer, length * outchannels * sizeof(float));
+
+        auto data = state->GetEffectData<EffectData>();
+        BinauralBus &bus = BinauralBus::Instance();
+        if (!data->is_initialized || length != bus.GetBlockSize() || outchannels < NUM_EARS) {
+            return UNITY_AUDIODSP_OK;
+        }
+
+        const float gain = data->p[P_GAIN];
+        float *left = &data->out_deinterleaved[0];
+        float *right = &data->out_deinterleaved[length];
+        data->num_sends = bus.Render(state->currdsptick, left, right);
+        if (data->num_sends > 0) {
+            mix_ears(outbuffer, left, right, length, outchannels, gain);
+        }
+
+        Epoch::Scope epoch;
+        left = &data->out_deinterleaved[NUM_EARS * length];
+        right = &data->out_deinterleaved[(NUM_EARS + 1) * length];
+        ReflectionBus &reflections = ReflectionBus::Instance();
+        if (data->has_reflections && length == reflections.GetBlockSize()) {
+            // The bus filtered the clusters with every slot when its database was published
+            if (reflections.Render(state->currdsptick, (int)data->p[P_REFLECTION_SOFA], left, right) > 0) {
+                mix_ears(outbuffer, left, right, length, outchannels, gain);
+            }
+        }
+
+        LateTailBus &tails = LateTailBus::Instance();
+        if (data->has_late_tails && length == tails.GetBlockSize()) {
+            if (tails.Render(state->currdsptick, left, right) > 0) {
+                mix_ears(outbuffer, left, right, length, outchannels, gain);
+            }
+        }
+
+        ReverbBus &reverb = ReverbBus::Instance();
+        if (data->has_reverb && length == reverb.GetBlockSize()) {
+            const auto matrix = (data->p[P_REVERB_MATRIX] >= 0.5f) ? FDNReverb::Matrix_Hadamard : FDNReverb::Matrix_Householder;
+            reverb.Configure(data->p[P_REVERB_TIME], data->p[P_REVERB_DAMPING], matrix);
+            if (reverb.Render(state->currdsptick, left, right)) {
+                mix_ears(outbuffer, left, right, length, outchannels, gain);
+            }
+        }
+
+        return UNITY_AUDIODSP_OK;
+    }
+
+    /////////////////////////////////////////
+    /// editor parameter manipulation
+    ///////////////////////////////////////
+
+    UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK SetFloatParameterCallback(UnityAudioEffectState* state, int index, float value)
+    {
+        EffectData *data = state->GetEffectData<EffectData>();
+        if (index >= P_NUM) {
+            return UNITY_AUDIODSP_ERR_UNSUPPORTED;
+        }
+        data->p[index] = value;
+        return UNITY_AUDIODSP_OK;
+    }
+
+    UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK GetFloatParameterCallback(UnityAudioEffectState* state, int index, float* value, char *valuestr)
+    {
+        EffectData *data = state->GetEffectData<EffectData>();
+        if (index >= P_NUM) {
+            return UNITY_AUDIODSP_ERR_UNSUPPORTED;
+        }
+        if (value != NULL) {
+            *value = data->p[index];
+        }
+        if (valuestr != NULL) {
+            valuestr[0] = 0;
+        }
+        return UNITY_AUDIODSP_OK;
+    }
+
+    int UNITY_AUDIODSP_CALLBACK GetFloatBufferCallback(UnityAudioEffectState* state, const char* name, float* buffer, int numsamples)
+    {
+        return UNITY_AUDIODSP_OK;
+    }
+}
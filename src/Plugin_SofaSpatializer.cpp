@@ -1,78 +1,45 @@
+#include "Arena.h"
 #include "AudioPluginUtil.h"
+#include "BinauralBus.h"
+#include "BinauralConvolver.h"
+#include "BiquadBank.h"
+#include "BlockFifo.h"
+#include "EarlyReflections.h"
+#include "Epoch.h"
+#include "FDNReverb.h"
+#include "FractionalDelay.h"
+#include "LateTailBus.h"
+#include "LoadProfiler.h"
+#include "NAPTest.h"
+#include "RenderPool.h"
+#include "RTAudit.h"
+#include "SofaDatabase.h"
+#include "Telemetry.h"
+#include "TailConvolver.h"
+#include "VoiceBudget.h"
 #include "FFTConvolver/FFTConvolver.h"
-#include "FFTConvolver/BinauralFFTConvolver.h"
 #include "FFTConvolver/TwoStageFFTConvolver.h"
 
-#include <mysofa.h>
-
+#include <algorithm>
+#include <cfloat>
+#include <climits>
 #include <math.h>
+#include <vector>
 
 // A plugin will be encapsulated within a namespace
 // This namespace is later used to include the plugin
 // in the build with PluginList.h
 namespace Plugin_SofaSpatializer {
 
-    // There cant be more sofa files loaded then this number
-    static const unsigned MAX_SOFA_FILES = 10;
-    static const int DIR_DIM = 3;
-
-    static int err;
+    static const int MAX_SOFA_FILES = SofaContainer::MAX_SOFA_FILES;
+    static const int DIR_DIM = SofaContainer::DIR_DIM;
+    static const int NUM_EARS = 2;
 
     /// LibMySofa
-    class SofaContainer {
-    public:
-        ~SofaContainer() {
-            if (is_initialized) {
-                for (int i = 0; i < sizeof(this->hrtfs)/sizeof(*this->hrtfs); ++i) {
-                    mysofa_free(hrtfs[i]);
-                    mysofa_lookup_free(lookups[i]);
-                    mysofa_neighborhood_free(neighborhoods[i]);
-                }
-                this->is_initialized = false;
-            }
-        }
-
-        MYSOFA_HRTF* hrtfs[MAX_SOFA_FILES];
-        MYSOFA_LOOKUP* lookups[MAX_SOFA_FILES];
-        MYSOFA_NEIGHBORHOOD* neighborhoods[MAX_SOFA_FILES];
-        int errs[MAX_SOFA_FILES];
-        float dirs[DIR_DIM * MAX_SOFA_FILES];
-        bool is_initialized = false;
-
-
-        void init(unsigned samplerate) {
-            if (!is_initialized) {
-                this->is_initialized = true;
-
-                // load sofa files
-                for (int i = 0; i < MAX_SOFA_FILES; ++i) {
-                    char filename[50];
-                    sprintf_s(filename, sizeof(filename), "Assets/Sofa/hrtf%u.sofa", i);
-                    hrtfs[i] = mysofa_load(filename, &errs[i]);
-
-                    if (errs[i] != MYSOFA_OK) {
-                        continue;
-                    }
-
-                    // Convert to cartesian, initialize the look up
-                    mysofa_tocartesian(hrtfs[i]);
-                    lookups[i] = mysofa_lookup_init(hrtfs[i]);
-                    neighborhoods[i] = mysofa_neighborhood_init(hrtfs[i], lookups[i]);
-
-                    // resample if samplerates doesent match (Warning: long coputationtime!)
-                    //if (samplerate != hrtfs[i]->DataSamplingRate.values[i]) { mysofa_resample(hrtfs[i], (float)samplerate); }
-
-                    /// TODO: perfomance can be improved by precomputing hrtfs into the frequency domain
-                    /// and let the convolver be initializable with them
-                }
-            }
-        }
-    };
-
-    static SofaContainer sofa;
+    static SofaContainer& sofa = SofaContainer::Instance();
 
     /// Communication with unity
-    extern "C" __declspec(dllexport) void write_direction(float *array, int index) {
+    extern "C" UNITY_AUDIODSP_EXPORT_API void write_direction(float *array, int index) {
 
         if (index < 0 || index >= MAX_SOFA_FILES) {
             return;
@@ -84,31 +51,84 @@ namespace Plugin_SofaSpatializer {
         }
     }
 
-    extern "C" __declspec(dllexport) int get_err() {
-        return err;
+    // Number of telemetry events lost because a ring was full, see drain_events
+    extern "C" UNITY_AUDIODSP_EXPORT_API int get_err() {
+        return (int)Telemetry::Instance().GetDropped();
+    }
+
+    // Moves the pending telemetry events of all instances into events, ordered by time.
+    // Returns the number of events written.
+    extern "C" UNITY_AUDIODSP_EXPORT_API int drain_events(Telemetry::Event *events, int maxevents) {
+        return Telemetry::Instance().Drain(events, maxevents);
     }
 
-    extern "C" __declspec(dllexport) int get_max_sofa_files() {
+    extern "C" UNITY_AUDIODSP_EXPORT_API int get_max_sofa_files() {
         return MAX_SOFA_FILES;
     }
 
-    /// Utilities
-    static void deinterleave_data(float *in, float *out, int len, int num_ch) {
-        for (int ch = 0; ch < num_ch; ++ch) {
-            int offset = ch * len;
-            for (int i = 0; i < len; ++i) {
-                out[offset + i] = in[ch + i*2];
-            }
+    // Selects the storage format (0 = float, 1 = half, 2 = int16) for sofa files loaded afterwards
+    extern "C" UNITY_AUDIODSP_EXPORT_API void set_storage_format(int format) {
+        if (format < 0 || format >= HRIRStorage::Format_Num) {
+            return;
         }
+        sofa.storage_format = (HRIRStorage::Format)format;
     }
 
-    static void interleave_data(float *in, float *out, int len, int num_ch) {
-        for (int ch = 0; ch < num_ch; ++ch) {
-            int offset = ch * len;
-            for (int i = 0; i < len; ++i) {
-                out[ch + i*2] = in[offset + i];
-            }
+    // Splits the impulse responses of sofa files loaded afterwards at the given time in seconds, 0 keeps them whole.
+    // Sources only convolve the early part, the late tail averaged over all directions is rendered once for all
+    // of them on the SOFA Mix Bus.
+    extern "C" UNITY_AUDIODSP_EXPORT_API void set_mixing_time(float seconds) {
+        sofa.mixing_time = fmaxf(seconds, 0.0f);
+    }
+
+    // Writes the max error, rms error and SNR in dB of the stored filters compared to the float data of the file
+    extern "C" UNITY_AUDIODSP_EXPORT_API int get_storage_error(int index, float *report) {
+        if (index < 0 || index >= MAX_SOFA_FILES) {
+            return -1;
+        }
+        Epoch::Scope epoch;
+        const SofaDatabase *database = sofa.Acquire(index);
+        if (database == NULL) {
+            return -1;
         }
+        report[0] = database->storage_err.maxerr;
+        report[1] = database->storage_err.rmserr;
+        report[2] = database->storage_err.snr;
+        return 0;
+    }
+
+    // Loads a sofa file into the given slot while the audio keeps running.
+    // Spatializers using the slot crossfade over to the new database, the old one is freed
+    // once no audio thread reads it anymore. Returns the libmysofa error code.
+    extern "C" UNITY_AUDIODSP_EXPORT_API int load_sofa(int index, const char *filename) {
+        return sofa.Load(index, filename);
+    }
+
+    // Reloads Assets/Sofa/hrtf<index>.sofa, see load_sofa
+    extern "C" UNITY_AUDIODSP_EXPORT_API int reload_sofa(int index) {
+        return sofa.Reload(index);
+    }
+
+    // Starts the given number of render threads, 0 renders every source on the mixer thread again.
+    // Sources rendered by the pool are delayed by one block.
+    extern "C" UNITY_AUDIODSP_EXPORT_API void set_render_threads(int numthreads) {
+        RenderPool::Instance().Start(numthreads);
+    }
+
+    // Limits the sources that convolve with HRTFs to the given number and microseconds of rendering per block,
+    // 0 leaves either unlimited. The least audible sources over the budget are panned instead.
+    extern "C" UNITY_AUDIODSP_EXPORT_API void set_voice_budget(int maxvoices, float maxmicroseconds) {
+        VoiceBudget::Instance().SetLimits(maxvoices, maxmicroseconds);
+    }
+
+    // Writes the real-time safety violations counted since the last reset, one line per call site.
+    // Returns the number of sites, always 0 unless built with SOFA_RT_AUDIT.
+    extern "C" UNITY_AUDIODSP_EXPORT_API int get_rt_audit_report(char *buffer, int size) {
+        return RTAudit::GetReport(buffer, size);
+    }
+
+    extern "C" UNITY_AUDIODSP_EXPORT_API void reset_rt_audit() {
+        RTAudit::Reset();
     }
 
     /////////////////////////////////////////
@@ -122,29 +142,214 @@ namespace Plugin_SofaSpatializer {
     enum Param
     {
         P_SOFA_SELECTOR,
+        P_CROSSFADE_BLOCKS,
+        P_TAIL_MODE,
+        P_SEND_MODE,
+        P_INTERPOLATE,
+        P_OUTPUT_METER,
+        P_AIR_ABSORPTION,
+        P_NEAR_FIELD,
+        P_REFLECTION_ORDER,
+        P_ROOM_WIDTH,
+        P_ROOM_HEIGHT,
+        P_ROOM_DEPTH,
+        P_REFLECTIVITY,
+        P_DELAY_DISTANCE,
         P_NUM
         // Since enum values start at 0, the last value
         // gives us the total number of parameters in the enum
         // However, we don't use it as an actual parameter
     };
 
-    // Define a struct that will hold the plugin's state
-    // Our noise plugin is very simple, so we're only interested
-    // in keeping track of the single parameter we have: gain
+    // A render posts a database swap and a filter switch at most
+    static const int MAX_JOB_EVENTS = 4;
+
+    // A block handed over to the render pool, its result is output one callback later
+    struct RenderJob
+    {
+        RenderPool::Task task;
+        UnityAudioEffectState* state;
+        float* in;
+        float* out;
+        unsigned int length;
+        unsigned int capacity;
+        // Set while a block has been handed over but not output yet
+        bool pending;
+        // Samples at the start of in that belong to a block dropped while the previous render was still running.
+        // They are rendered ahead of the block, so the history of the convolvers has no gap, see render_job.
+        unsigned int backlog;
+        // Input of the last dropped block, only touched by the mixer thread until it is moved into in
+        float* missed;
+        unsigned int missed_length;
+        // Events of the render path, posted by the mixer thread, see post_render_events
+        Telemetry::Event events[MAX_JOB_EVENTS];
+        int num_events;
+    };
+
+    static void render_task(void *arg);
+
+    // Spectra of the binaural output for metering, see GetFloatBufferCallback
+    struct OutputMeter {
+        SpectrumAnalyzer ears[NUM_EARS];
+    };
+    static const int METER_FFT_SIZE = 2048;
+    static const int METER_HOP_SIZE = METER_FFT_SIZE / 4;
+
+    // Distance filters, see filter_distance
+    static const int NUM_DISTANCE_STAGES = 2;
+    static const float AIR_SHELF_FREQ = 6000.0f;
+    static const float MAX_AIR_ABSORPTION = 40.0f;      // dB
+    static const float NEAR_FIELD_RADIUS = 1.0f;        // m, about the distance HRTFs are measured at
+    static const float NEAR_FIELD_MIN_DISTANCE = 0.15f; // m, roughly the head radius
+    static const float NEAR_FIELD_BOOST_FREQ = 1000.0f;
+    static const float NEAR_FIELD_BOOST = 3.0f;         // dB per halving of the distance at the side
+    static const float NEAR_FIELD_SHADOW_FREQ = 1500.0f;
+    static const float NEAR_FIELD_SHADOW = 4.0f;        // dB per halving of the distance at the side
+
+    // Reflections arriving later than this after the direct sound are left to the reverb
+    static const float MAX_REFLECTION_DELAY = 0.25f;    // s
+
+    // Time for the input level a voice is ranked by to fall by 60 dB once the input stopped
+    static const float VOICE_LEVEL_RELEASE = 0.5f;      // s
+
+    // Share of a block the mixer thread waits at most for a render that is still running, see join_job
+    static const float JOIN_BUDGET = 0.5f;
+
+    // Input below this peak level counts as silence, about -140 dBFS
+    static const float SILENCE_THRESHOLD = 1.0e-7f;
+
+    // Channels of the host buffers the FIFO and the scratch blocks are sized for, wider layouts are passed through
+    static const int MAX_CHANNELS = 8;
+
+    // Consecutive calls of the announced block size after which the FIFO is released again
+    static const int FIFO_RELEASE_CALLS = 4;
+
+    // Filter length an instance is created for at least, databases loaded later with longer filters are passed through
+    static const size_t MIN_IR_CAPACITY = 1024;
+
+    // Cost model of the partitioned convolution, see choose_partition
+    static const float FFT_COST = 2.5f;     // flops per sample and octave of a real transform
+    static const float MAC_COST = 8.0f;     // flops of a complex multiply-add
+    static const int MIN_PARTITION = 32;
+
+    // Whether a source convolves or pans because it is over the voice budget, see admit_voice
+    enum VoiceState
+    {
+        Voice_Rendered,
+        Voice_Virtual,
+        // Admitted again, panned until the convolution delivers its first block
+        Voice_Waking
+    };
+
+    // State of one spatializer instance. CreateCallback carves it from the arena of the instance together with
+    // everything it renders with: the convolvers, the render job, the filter and scratch blocks and the FIFO.
+    // Only the optional propagation delay, meter, reflection send, bus send and tail convolver are created later
+    // by the parameter callbacks and reached through atomic pointers.
     struct EffectData
     {
         // Editor parameters
         float p[P_NUM];
         // Index of the associated sofafile
         int current_hrtf = 0;
-        // Length of the impusle response in samples (assumed to stay the same for each file)
+        // Generation of the database in the slot that is currently rendered
+        int current_generation = 0;
+        // Length of the impusle response in samples
         size_t ir_len = 0;
         // index of the current impulse response
         int current_ir = 0;
+        // Decoded filters of the current impulse response, allocated for ir_capacity samples in the arena
+        float* ir_left;
+        float* ir_right;
+        float* ir_scratch;
+        size_t ir_capacity = 0;
+        // Direction the current filters were interpolated for
+        float active_dir[DIR_DIM];
+        // Spread the current filters were blended for
+        float active_spread;
 
         bool is_initialized = false;
 
-        fftconvolver::BinauralFFTConvolver* convolver;
+        BinauralConvolver* convolver;
+        // Keeps rendering the previous database while fading over to a new one
+        BinauralConvolver* fade_convolver;
+        // Length of the current database crossfade and the blocks still left of it
+        int fade_blocks = 0;
+        int fade_blocks_left = 0;
+
+        RenderJob* job;
+
+        // Convolves everything after the head of long impulse responses on a background thread.
+        // Created and retired by the parameter callback, so the audio thread only ever reads it.
+        std::atomic<TailConvolver*> tail;
+        // Convolves the head in the frequency domain and sums it on the binaural bus instead of
+        // rendering it here. Handled like the tail convolver.
+        std::atomic<BusSend*> send;
+        // Analyzes the output while the meter is enabled. Handled like the tail convolver.
+        std::atomic<OutputMeter*> meter;
+        // Renders the early reflections into the clusters of the reflection bus. Handled like the tail convolver.
+        std::atomic<ReflectionSend*> reflections;
+        // Delays the input by the propagation time of the sound, which renders the Doppler shift as well.
+        // Handled like the tail convolver.
+        std::atomic<FractionalDelay*> propagation;
+        // Air absorption and near field filters of both ears, set while they are applied
+        BiquadBank* distance_filters;
+        bool distance_filtering;
+        // Bumped on every change of the tail or send mode and the value the current filter was activated for
+        std::atomic<int> mode_version;
+        int active_mode_version;
+        // Length of the filters in the convolvers, shorter than ir_len with a tail convolver
+        size_t head_len;
+        // Partition size of the convolvers, chosen for ir_capacity, see choose_partition
+        int partition;
+        // Re-blocks the calls of hosts that don't deliver the announced block size, with the output it still
+        // queued when it is released and the calls of the announced size since the last other one
+        BlockFifo* fifo;
+        float* fifo_scratch;
+        int aligned_calls;
+        // Whether the head of the current filter was loaded into the bus send instead of the convolver
+        bool head_on_bus;
+        // Holds this struct and everything else the instance renders with, see CreateCallback
+        Arena* arena;
+        // Planar blocks of max_length samples per channel: the input, the ears, their stand-in, the filters
+        // crossfaded from in render and the silence fed to the tail convolver of a bypassed voice
+        unsigned int max_length;
+        float* in_scratch;
+        float* out_scratch;
+        float* stand_in_scratch;
+        float* fade_scratch;
+        float* silence_scratch;
+
+        // Telemetry served by GetFloatBufferCallback
+        LoadProfiler profiler;
+        std::atomic<UInt64> num_lookups;
+        std::atomic<UInt64> num_ir_switches;
+        std::atomic<UInt64> num_database_switches;
+        Telemetry::Channel* events;
+        // Set while the input is passed through unprocessed, so only the transition is reported
+        bool passthrough;
+        // Direction of the source relative to the listener in sofa coordinates, derived from the
+        // spatializer data if Unity provides it. Otherwise the direction of the slot is used.
+        float dir[DIR_DIM];
+        bool has_dir;
+        // Spread of the source in degrees, 0 without spatializer data
+        float spread;
+        // Gain of the reverb send in the last block
+        float reverb_send;
+        // Id on the voice budget, the smoothed input level it is ranked by and whether it convolves
+        int voice;
+        float voice_level;
+        VoiceState voice_state;
+        // Broadband level of the current filters and the ear gains of the last panned block
+        float pan_level;
+        float pan_gains[NUM_EARS];
+        // Set if the last block that didn't convolve copied the input of a 2D source instead of panning it
+        bool flat;
+        std::atomic<UInt64> num_virtual_blocks;
+        // Consecutive silent input samples, saturated, and blocks skipped because of silence or a 2D source
+        int silent_samples;
+        std::atomic<UInt64> num_idle_blocks;
+        // Blocks output as silence because their render was still running at the deadline, see join_job
+        std::atomic<UInt64> num_dropped_blocks;
     };
 
     // This is a callback we'll have the SDK invoke when initializing parameters
@@ -161,25 +366,172 @@ namespace Plugin_SofaSpatializer {
                           1.0f,              // Display scale, Unity editor shows actualValue*displayScale
                           1.0f,              // Display exponent, in case you want a slider operating on an exponential scale in the editor
                           P_SOFA_SELECTOR);           // The index of the parameter in question; use the enum value
+        RegisterParameter(definition, "Crossfade", "blocks", 1.0f, 64.0f, 4.0f, 1.0f, 1.0f, P_CROSSFADE_BLOCKS,
+                          "Number of blocks over which a change of the sofa file is crossfaded");
+        RegisterParameter(definition, "BRIR Tail", "", 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, P_TAIL_MODE,
+                          "Convolves the late part of long (room) impulse responses on a background thread");
+        RegisterParameter(definition, "Bus Send", "", 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, P_SEND_MODE,
+                          "Mixes the source on the SOFA Mix Bus in the frequency domain instead of outputting it, bypasses the render threads");
+        RegisterParameter(definition, "Interpolate", "", 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, P_INTERPOLATE,
+                          "Blends the nearest measurements and updates the filters whenever the source moves, meant for offline rendering");
+        RegisterParameter(definition, "Output Meter", "", 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, P_OUTPUT_METER,
+                          "Analyzes the spectrum of both ears, read through the \"SpectrumL\" and \"SpectrumR\" buffers");
+        RegisterParameter(definition, "Air Absorption", "dB/100m", 0.0f, 20.0f, 0.0f, 1.0f, 1.0f, P_AIR_ABSORPTION,
+                          "Attenuation of high frequencies by the air along the path to the source");
+        RegisterParameter(definition, "Near Field", "", 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, P_NEAR_FIELD,
+                          "Strength of the head shadow and proximity boost of sources closer than a meter");
+        RegisterParameter(definition, "Reflections", "", 0.0f, (float)ShoeboxRoom::MAX_ORDER, 0.0f, 1.0f, 1.0f, P_REFLECTION_ORDER,
+                          "Image source order of the early reflections of the room, rendered on the SOFA Mix Bus. 0 disables them.");
+        RegisterParameter(definition, "Room Width", "m", 1.0f, 50.0f, 8.0f, 1.0f, 1.0f, P_ROOM_WIDTH,
+                          "Extent of the room along the world x axis, centered on the origin");
+        RegisterParameter(definition, "Room Height", "m", 1.0f, 20.0f, 3.0f, 1.0f, 1.0f, P_ROOM_HEIGHT,
+                          "Height of the room above the floor at y = 0");
+        RegisterParameter(definition, "Room Depth", "m", 1.0f, 50.0f, 6.0f, 1.0f, 1.0f, P_ROOM_DEPTH,
+                          "Extent of the room along the world z axis, centered on the origin");
+        RegisterParameter(definition, "Wall Reflectivity", "", 0.0f, 1.0f, 0.7f, 1.0f, 1.0f, P_REFLECTIVITY,
+                          "Amplitude left after each reflection");
+        RegisterParameter(definition, "Delay Distance", "m", 0.0f, 1000.0f, 0.0f, 1.0f, 1.0f, P_DELAY_DISTANCE,
+                          "Sources are delayed by the time their sound travels, which also shifts their pitch while they move. Further sources are held at this distance, 0 disables the delay.");
 
         // This flag needs to be set if this plugin should be used as the default spatialzer of unity
         //definition.flags |= UnityAudioEffectDefinitionFlags_IsSpatializer;
         return P_NUM;
     }
 
+    // Flops per sample of a uniformly partitioned convolution of both ears: a forward and an inverse transform
+    // per ear and block, and a multiply-add per bin for every partition of the filters
+    static float get_partition_cost(int partition, size_t ir_len) {
+        const float fftsize = 2.0f * (float)fftconvolver::NextPowerOf2(partition);
+        const float segments = ceilf((float)ir_len / (0.5f * fftsize));
+        const float transforms = 2.0f * FFT_COST * fftsize * log2f(fftsize);
+        const float products = MAC_COST * segments * (0.5f * fftsize + 1.0f);
+        return NUM_EARS * (transforms + products) / (float)partition;
+    }
+
+    // Partition size with the highest throughput for filters of ir_len samples. Short filters convolve faster
+    // with partitions shorter than the block, which are no longer than needed. The convolvers are always called
+    // with whole blocks and transform powers of two, so only the powers of two that divide the block keep them
+    // free of latency. Blocks whose power of two factor is below MIN_PARTITION (e.g. 441, 1000 or 240 frames)
+    // would only leave tiny partitions, so they choose among the powers of two up to the block size instead
+    // and get re-blocked to the partition, see get_render_block.
+    static int choose_partition(int blocksize, size_t ir_len) {
+        int largest = blocksize & -blocksize;
+        if (largest < MIN_PARTITION) {
+            largest = std::max(MIN_PARTITION, fftconvolver::NextPowerOf2(blocksize));
+        }
+        int best = largest;
+        float best_cost = get_partition_cost(largest, ir_len);
+        for (int partition = MIN_PARTITION; partition < largest; partition *= 2) {
+            const float cost = get_partition_cost(partition, ir_len);
+            if (cost < best_cost) {
+                best = partition;
+                best_cost = cost;
+            }
+        }
+        return best;
+    }
+
+    // Block size the instance renders with: the announced one, or the partition if that doesn't divide it.
+    // The FIFO then stays engaged and delays the output by one partition.
+    static unsigned int get_render_block(unsigned int blocksize, int partition) {
+        return (blocksize % partition == 0) ? blocksize : (unsigned int)partition;
+    }
+
+    // Bytes of the arena of an instance called with blocks of dspbuffersize samples and filters of up to
+    // ir_capacity samples, the sum of everything CreateCallback carves from it
+    static size_t get_arena_size(unsigned int dspbuffersize, size_t ir_capacity) {
+        const int partition = choose_partition(dspbuffersize, ir_capacity);
+        const unsigned int renderblock = get_render_block(dspbuffersize, partition);
+        const size_t blocksize = std::max(dspbuffersize, renderblock);
+        const size_t objects = Arena::Align(sizeof(EffectData)) + Arena::Align(sizeof(RenderJob))
+                               + 2 * Arena::Align(sizeof(BinauralConvolver))
+                               + 2 * BinauralConvolver::GetArenaSize(partition, (int)ir_capacity)
+                               + Arena::Align(sizeof(Telemetry::Channel)) + Arena::Align(sizeof(BiquadBank))
+                               + Arena::Align(sizeof(BlockFifo));
+        const size_t filters = 2 * Arena::Align(ir_capacity * sizeof(float))
+                               + Arena::Align(ir_capacity * NUM_EARS * sizeof(float));
+        const size_t block = Arena::Align(blocksize * sizeof(float));
+        const size_t ears = Arena::Align(blocksize * NUM_EARS * sizeof(float));
+        // The render job (its input has room for a dropped block ahead of the current one) and the scratch blocks
+        const size_t blocks = 2 * block + Arena::Align(2 * blocksize * sizeof(float)) + 4 * ears + Arena::Align(blocksize * (NUM_EARS + 1) * sizeof(float))
+                              + Arena::Align(blocksize * MAX_CHANNELS * sizeof(float));
+        return objects + filters + blocks + BlockFifo::GetArenaSize((int)renderblock, MAX_CHANNELS);
+    }
+
     // UNITY_AUDIODSP_RESULT is defined as `int`
     // UNITY_AUDIODSP_CALLBACK is defined as nothing
     // So behind the scenes, the function signature is really `int CreateCallback(UnityAudioEffectState* state)`
     // This callback is invoked by Unity when the plugin is loaded
     UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK CreateCallback(UnityAudioEffectState* state)
     {
-        sofa.init(state->samplerate);
+        sofa.Init(state->samplerate);
+        Epoch::Reclaim();
 
-        // Create a new pointer to the struct defined earlier
-        auto data = new EffectData;
-        // Quickly fill memory location with zeros
-        memset(data, 0, sizeof(EffectData));
-        data->convolver = new fftconvolver::BinauralFFTConvolver();
+        // The filters and convolvers are sized for the longest filters of the databases loaded so far
+        size_t ir_capacity = MIN_IR_CAPACITY;
+        {
+            Epoch::Scope epoch;
+            for (int i = 0; i < MAX_SOFA_FILES; ++i) {
+                const SofaDatabase *database = sofa.Acquire(i);
+                if (database != NULL && database->ir_len > ir_capacity) {
+                    ir_capacity = database->ir_len;
+                }
+            }
+        }
+
+        // Carve the struct defined earlier and everything it renders with from a single allocation,
+        // so nothing is allocated per block and the hot data of the instance is contiguous.
+        // The scratch blocks hold the announced block and the one rendered through the FIFO alike.
+        const int partition = choose_partition(state->dspbuffersize, ir_capacity);
+        const unsigned int renderblock = get_render_block(state->dspbuffersize, partition);
+        const unsigned int blocksize = std::max(state->dspbuffersize, renderblock);
+        Arena *arena = Arena::Create(get_arena_size(state->dspbuffersize, ir_capacity));
+        auto data = arena->New<EffectData>();
+        data->arena = arena;
+        // The convolvers carve their spectra from it as well, so switching filters never allocates. Only the
+        // tables of their transforms come from the heap. The optional propagation delay, meter, reflection send
+        // and tail convolver are created by the parameter callbacks instead and published through the Epoch.
+        data->partition = partition;
+        data->convolver = arena->New<BinauralConvolver>();
+        data->convolver->Init(*arena, data->partition, (int)ir_capacity);
+        data->fade_convolver = arena->New<BinauralConvolver>();
+        data->fade_convolver->Init(*arena, data->partition, (int)ir_capacity);
+        data->job = arena->New<RenderJob>();
+        data->job->task.func = render_task;
+        data->job->task.arg = data->job;
+        data->job->state = state;
+        data->job->capacity = blocksize;
+        data->job->in = arena->AllocateArray<float>(2 * blocksize);
+        data->job->out = arena->AllocateArray<float>(blocksize * NUM_EARS);
+        data->job->length = 0;
+        data->job->pending = false;
+        data->job->backlog = 0;
+        data->job->missed = arena->AllocateArray<float>(blocksize);
+        data->job->missed_length = 0;
+        data->ir_capacity = ir_capacity;
+        data->ir_left = arena->AllocateArray<float>(ir_capacity);
+        data->ir_right = arena->AllocateArray<float>(ir_capacity);
+        data->ir_scratch = arena->AllocateArray<float>(ir_capacity * NUM_EARS);
+        data->max_length = renderblock;
+        data->in_scratch = arena->AllocateArray<float>(blocksize);
+        data->out_scratch = arena->AllocateArray<float>(blocksize * NUM_EARS);
+        data->stand_in_scratch = arena->AllocateArray<float>(blocksize * NUM_EARS);
+        data->fade_scratch = arena->AllocateArray<float>(blocksize * NUM_EARS);
+        data->silence_scratch = arena->AllocateArray<float>(blocksize * (NUM_EARS + 1));
+        data->tail.store(NULL);
+        data->events = arena->New<Telemetry::Channel>();
+        data->send.store(NULL);
+        data->meter.store(NULL);
+        data->reflections.store(NULL);
+        data->propagation.store(NULL);
+        data->distance_filters = arena->New<BiquadBank>();
+        data->distance_filters->Init(NUM_EARS, NUM_DISTANCE_STAGES);
+        data->fifo = arena->New<BlockFifo>();
+        data->fifo->Init(renderblock, MAX_CHANNELS, *arena);
+        data->fifo_scratch = arena->AllocateArray<float>(blocksize * MAX_CHANNELS);
+        data->mode_version.store(0);
+        data->voice = VoiceBudget::Instance().Register();
+        data->voice_state = Voice_Rendered;
         // Add the effectdata pointer to the state so it can be reached in other callbacks
         state->effectdata = data;
         InitParametersFromDefinitions(InternalRegisterEffectDefinition, data->p);
@@ -192,9 +544,27 @@ namespace Plugin_SofaSpatializer {
     {
         // Grab the EffectData pointer we added earlier in CreateCallback
         EffectData *data = state->GetEffectData<EffectData>();
-        data->convolver->reset();
-        delete data->convolver;
-        delete data; // Cleanup
+        // Make sure no render thread touches the instance anymore
+        if (data->job->pending) {
+            RenderPool::Instance().Join(data->job->task, RenderPool::NO_DEADLINE);
+        }
+        RenderPool::Instance().Purge(data->job->task);
+        VoiceBudget::Instance().Unregister(data->voice);
+        data->job->~RenderJob();
+        data->convolver->~BinauralConvolver();
+        data->fade_convolver->~BinauralConvolver();
+        delete data->tail.load();
+        delete data->send.load();
+        delete data->meter.load();
+        delete data->reflections.load();
+        delete data->propagation.load();
+        data->distance_filters->~BiquadBank();
+        data->events->~Channel();
+        // Cleanup, the arena goes with the struct it holds
+        Arena *arena = data->arena;
+        data->~EffectData();
+        Arena::Destroy(arena);
+        Epoch::Reclaim();
         return UNITY_AUDIODSP_OK;
     }
 
@@ -202,6 +572,289 @@ namespace Plugin_SofaSpatializer {
     /// Soundprocessing
     ///////////////////////////////////////
 
+    static bool is_interpolating(const EffectData *data) {
+        return data->p[P_INTERPOLATE] >= 0.5f && data->has_dir;
+    }
+
+    // Interpolated filters are updated once the source moved by more than a degree
+    static bool has_moved(const EffectData *data) {
+        if (!is_interpolating(data)) {
+            return false;
+        }
+        const float *a = data->dir, *b = data->active_dir;
+        const float dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+        const float norm_a = a[0] * a[0] + a[1] * a[1] + a[2] * a[2];
+        const float norm_b = b[0] * b[0] + b[1] * b[1] + b[2] * b[2];
+        if (norm_b <= 0.0f) {
+            // The current filters were not interpolated
+            return norm_a > 0.0f;
+        }
+        return dot * fabsf(dot) < 0.99970f * norm_a * norm_b;
+    }
+
+    // Spread filters are blended anew once the spread changed by more than a degree
+    static bool has_spread_changed(const EffectData *data) {
+        return fabsf(data->spread - data->active_spread) > 1.0f;
+    }
+
+    // Filters longer than the instance was created for would have to be allocated on the audio thread,
+    // so their databases are passed through instead
+    static bool fits_instance(const EffectData *data, const SofaDatabase *database) {
+        return database->ir_len <= data->ir_capacity;
+    }
+
+    // Whether the database selected in the editor was loaded with filters that don't fit the instance.
+    // Must be called inside an Epoch::Scope.
+    static bool is_selection_too_long(const EffectData *data) {
+        const int slot = (int)data->p[P_SOFA_SELECTOR];
+        const SofaDatabase *database = (slot >= 0 && slot < MAX_SOFA_FILES) ? sofa.Acquire(slot) : NULL;
+        return database != NULL && !fits_instance(data, database);
+    }
+
+    // Decodes (or interpolates) the filters of the given measurement and loads them into the convolver
+    static void activate_filter(UnityAudioEffectState *state, const SofaDatabase *database, int measurement) {
+        auto *data = state->GetEffectData<EffectData>();
+
+        data->ir_len = database->ir_len;
+
+        // Wide sources use the precomputed spread filters, which cost the same to convolve as point filters
+        if (data->spread > 0.0f && database->HasSpreadFilters()) {
+            database->DecodeSpreadFilters(measurement, data->spread, data->ir_left, data->ir_right, data->ir_scratch);
+            if (is_interpolating(data)) {
+                memcpy(data->active_dir, data->dir, sizeof(data->active_dir));
+            } else {
+                memset(data->active_dir, 0, sizeof(data->active_dir));
+            }
+        } else if (is_interpolating(data)) {
+            database->InterpolateFilters(data->dir, data->ir_left, data->ir_right, data->ir_scratch);
+            memcpy(data->active_dir, data->dir, sizeof(data->active_dir));
+        } else {
+            database->DecodeFilters(measurement, data->ir_left, data->ir_right);
+            memset(data->active_dir, 0, sizeof(data->active_dir));
+        }
+        data->active_spread = data->spread;
+
+        // Panned voices keep the loudness of the filters
+        float peak, rms_left, rms_right;
+        BlockOps::Measure(data->ir_left, (int)data->ir_len, &peak, &rms_left);
+        BlockOps::Measure(data->ir_right, (int)data->ir_len, &peak, &rms_right);
+        data->pan_level = sqrtf(0.5f * (float)data->ir_len * (rms_left * rms_left + rms_right * rms_right));
+
+        // With a tail convolver only the head is convolved here
+        size_t head_len = data->ir_len;
+        const int version = data->mode_version.load(std::memory_order_acquire);
+        TailConvolver *tail = data->tail.load(std::memory_order_acquire);
+        if (tail != NULL) {
+            // Filters that don't fit the tail (loaded after it was created) are convolved inline as a whole
+            if (head_len > (size_t)tail->GetTailOffset() && head_len <= (size_t)tail->GetMaxIRLength()) {
+                head_len = tail->GetTailOffset();
+                tail->SetIR(data->ir_left, data->ir_right, (int)data->ir_len);
+            } else {
+                tail->SetIR(data->ir_left, data->ir_right, 0);
+            }
+        }
+        data->active_mode_version = version;
+        data->head_len = head_len;
+
+        // While the FIFO is engaged its blocks are out of step with the bus, so the head is convolved inline
+        BusSend *send = data->send.load(std::memory_order_acquire);
+        const bool was_on_bus = data->head_on_bus;
+        data->head_on_bus = send != NULL && !data->fifo->IsEngaged();
+        if (data->head_on_bus) {
+            send->SetIR(data->ir_left, data->ir_right, (int)head_len);
+        } else {
+            // The convolver didn't see the input while the bus convolved it
+            if (was_on_bus) {
+                data->convolver->Reset();
+            }
+            data->convolver->SetIR(data->ir_left, data->ir_right, (int)head_len);
+        }
+    }
+
+    // Looks up the measurement nearest to the direction of the source
+    static int lookup_filter(EffectData *data, const SofaDatabase *database) {
+        LoadProfiler::Increment(data->num_lookups);
+        return database->Lookup(data->has_dir ? data->dir : &sofa.dirs[data->current_hrtf * DIR_DIM]);
+    }
+
+    // Source position in the local space of the listener (x right, y up, z forward), the spatializer data must be set
+    static void get_local_position(const UnityAudioEffectState *state, float *x, float *y, float *z) {
+        const float *m = state->spatializerdata->listenermatrix;
+        const float *s = state->spatializerdata->sourcematrix;
+        const float px = s[12], py = s[13], pz = s[14];
+        *x = m[0] * px + m[4] * py + m[8] * pz + m[12];
+        *y = m[1] * px + m[5] * py + m[9] * pz + m[13];
+        *z = m[2] * px + m[6] * py + m[10] * pz + m[14];
+    }
+
+    // Takes the direction of the source from the spatializer data, if the host provides it
+    static void update_direction(UnityAudioEffectState *state) {
+        auto *data = state->GetEffectData<EffectData>();
+        if (state->structsize < sizeof(UnityAudioEffectState) || state->spatializerdata == NULL) {
+            data->has_dir = false;
+            data->spread = 0.0f;
+            return;
+        }
+        data->spread = state->spatializerdata->spread;
+
+        float x, y, z;
+        get_local_position(state, &x, &y, &z);
+
+        // Sofa uses x front, y left, z up
+        data->dir[0] = z;
+        data->dir[1] = -x;
+        data->dir[2] = y;
+        data->has_dir = true;
+    }
+
+    // Longest impulse response of all loaded databases
+    static int get_max_ir_len() {
+        Epoch::Scope epoch;
+        int maxirlen = 0;
+        for (int i = 0; i < MAX_SOFA_FILES; ++i) {
+            const SofaDatabase *database = sofa.Acquire(i);
+            if (database != NULL && (int)database->ir_len > maxirlen) {
+                maxirlen = (int)database->ir_len;
+            }
+        }
+        return maxirlen;
+    }
+
+    // Creates or retires the tail convolver when the tail mode changes, not realtime safe.
+    // The tail covers the longest impulse response of the databases loaded at this point.
+    static void update_tail_mode(UnityAudioEffectState *state) {
+        auto *data = state->GetEffectData<EffectData>();
+
+        const bool enabled = data->p[P_TAIL_MODE] >= 0.5f;
+        TailConvolver *tail = data->tail.load(std::memory_order_acquire);
+        if (enabled == (tail != NULL)) {
+            return;
+        }
+
+        if (!enabled) {
+            data->tail.store(NULL, std::memory_order_release);
+            data->mode_version.fetch_add(1, std::memory_order_release);
+            Epoch::Retire(tail);
+            Epoch::Reclaim();
+            return;
+        }
+
+        // Chunks of a few callbacks keep the worker well ahead while the head stays short
+        int chunksize = 2048;
+        while (chunksize < 4 * state->dspbuffersize) {
+            chunksize *= 2;
+        }
+
+        tail = new TailConvolver();
+        tail->Init(chunksize, get_max_ir_len());
+        data->tail.store(tail, std::memory_order_release);
+        data->mode_version.fetch_add(1, std::memory_order_release);
+    }
+
+    // Creates or retires the bus send when the send mode changes, not realtime safe
+    static void update_send_mode(UnityAudioEffectState *state) {
+        auto *data = state->GetEffectData<EffectData>();
+
+        const bool enabled = data->p[P_SEND_MODE] >= 0.5f;
+        BusSend *send = data->send.load(std::memory_order_acquire);
+        if (enabled == (send != NULL)) {
+            return;
+        }
+
+        if (!enabled) {
+            data->send.store(NULL, std::memory_order_release);
+            data->mode_version.fetch_add(1, std::memory_order_release);
+            Epoch::Retire(send);
+            Epoch::Reclaim();
+            return;
+        }
+
+        // All sends have to share the block size of the bus
+        if (!BinauralBus::Instance().Init(state->dspbuffersize)) {
+            return;
+        }
+
+        send = new BusSend();
+        send->Init(state->dspbuffersize, get_max_ir_len());
+        data->send.store(send, std::memory_order_release);
+        data->mode_version.fetch_add(1, std::memory_order_release);
+    }
+
+    // Creates or retires the output meter when it is switched, not realtime safe
+    static void update_output_meter(UnityAudioEffectState *state) {
+        auto *data = state->GetEffectData<EffectData>();
+
+        const bool enabled = data->p[P_OUTPUT_METER] >= 0.5f;
+        OutputMeter *meter = data->meter.load(std::memory_order_acquire);
+        if (enabled == (meter != NULL)) {
+            return;
+        }
+
+        if (!enabled) {
+            data->meter.store(NULL, std::memory_order_release);
+            Epoch::Retire(meter);
+            Epoch::Reclaim();
+            return;
+        }
+
+        // Held peaks fall by 20 dB per second
+        const float decay = powf(0.1f, (float)METER_HOP_SIZE / (float)state->samplerate);
+        meter = new OutputMeter();
+        for (int ear = 0; ear < NUM_EARS; ++ear) {
+            meter->ears[ear].Init(METER_FFT_SIZE, METER_HOP_SIZE, decay);
+        }
+        data->meter.store(meter, std::memory_order_release);
+    }
+
+    // Creates or retires the reflection send when the reflections are switched, not realtime safe
+    static void update_reflections(UnityAudioEffectState *state) {
+        auto *data = state->GetEffectData<EffectData>();
+
+        const bool enabled = data->p[P_REFLECTION_ORDER] >= 1.0f;
+        ReflectionSend *reflections = data->reflections.load(std::memory_order_acquire);
+        if (enabled == (reflections != NULL)) {
+            return;
+        }
+
+        if (!enabled) {
+            data->reflections.store(NULL, std::memory_order_release);
+            Epoch::Retire(reflections);
+            Epoch::Reclaim();
+            return;
+        }
+
+        // All sends have to share the block size of the bus
+        if (!ReflectionBus::Instance().Init(state->dspbuffersize)) {
+            return;
+        }
+
+        reflections = new ReflectionSend();
+        reflections->Init(state->dspbuffersize, state->samplerate, MAX_REFLECTION_DELAY);
+        data->reflections.store(reflections, std::memory_order_release);
+    }
+
+    // Creates, resizes or retires the propagation delay when its distance changes, not realtime safe
+    static void update_propagation(UnityAudioEffectState *state) {
+        auto *data = state->GetEffectData<EffectData>();
+
+        const float distance = data->p[P_DELAY_DISTANCE];
+        const int maxdelay = (distance > 0.0f) ? (int)ceilf(distance / ShoeboxRoom::SPEED_OF_SOUND * (float)state->samplerate) : 0;
+        FractionalDelay *propagation = data->propagation.load(std::memory_order_acquire);
+        if ((propagation != NULL ? propagation->GetMaxDelay() : 0) == maxdelay) {
+            return;
+        }
+
+        FractionalDelay *replacement = NULL;
+        if (maxdelay > 0) {
+            replacement = new FractionalDelay();
+            replacement->Init(maxdelay, state->dspbuffersize);
+        }
+        data->propagation.store(replacement, std::memory_order_release);
+        Epoch::Retire(propagation);
+        Epoch::Reclaim();
+    }
+
+    // Must be called inside an Epoch::Scope
     void init_convolver(UnityAudioEffectState *state) {
         // Grab the EffectData pointer we added earlier in CreateCallback
         auto *data = state->GetEffectData<EffectData>();
@@ -213,93 +866,717 @@ namespace Plugin_SofaSpatializer {
         // Convert editor param into an index
         auto new_hrtf = (int)data->p[P_SOFA_SELECTOR];
 
-        if (new_hrtf < 0 || new_hrtf >= MAX_SOFA_FILES ||
-                sofa.errs[new_hrtf] != MYSOFA_OK) {
+        if (new_hrtf < 0 || new_hrtf >= MAX_SOFA_FILES) {
+            return;
+        }
+
+        const int generation = sofa.GetGeneration(new_hrtf);
+        const SofaDatabase *database = sofa.Acquire(new_hrtf);
+        if (database == NULL || !fits_instance(data, database)) {
             return;
         }
 
         data->current_hrtf = new_hrtf;
+        data->current_generation = generation;
 
         // Get the index of the nearest HRTF in relation to the direction
-        data->current_ir = mysofa_lookup(sofa.lookups[data->current_hrtf],
-                                         &sofa.dirs[data->current_hrtf * DIR_DIM]);
-        // Transform to the first stereo pair index
-        if (data->current_ir % 2 != 0) { data->current_ir -= 1; }
-
-        data->ir_len = sofa.hrtfs[data->current_hrtf]->N;
+        update_direction(state);
+        data->current_ir = lookup_filter(data, database);
 
-        data->convolver->init(state->dspbuffersize,
-                              &sofa.hrtfs[data->current_hrtf]->DataIR.values[data->current_ir * data->ir_len],
-                              &sofa.hrtfs[data->current_hrtf]->DataIR.values[(data->current_ir + 1) * data->ir_len],
-                              data->ir_len);
+        activate_filter(state, database, data->current_ir);
         data->is_initialized = true;
     }
 
-    // ProcessCallback gets called as long as the plugin is loaded
-    // This includes when the editor is not in play mode!
-    UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK ProcessCallback(
-            UnityAudioEffectState* state, // The state gets passed into all callbacks
-            float* inbuffer,              // Plugins can be chained together; inbuffer holds the signal incoming from another plugin, or an AudioSource
-            float* outbuffer,             // We fill outbuffer with the signal Unity should send to the speakers
-            unsigned int length,          // The number of samples the buffers hold
-            int inchannels,               // The number of channels the incoming signal uses
-            int outchannels)              // The number of channels the outgoing signal uses
-    {
+    // The render path runs on the render pool as well, so its events wait in the job until the mixer thread
+    // posts them, which keeps it the only producer of the channel
+    static void record_event(EffectData *data, Telemetry::EventType type, int a, int b) {
+        RenderJob *job = data->job;
+        if (job->num_events < MAX_JOB_EVENTS) {
+            Telemetry::Event &event = job->events[job->num_events++];
+            event.time = LoadProfiler::GetTime();
+            event.type = type;
+            event.a = a;
+            event.b = b;
+        }
+    }
+
+    // Called by the mixer thread whenever no render is in flight
+    static void post_render_events(EffectData *data) {
+        RenderJob *job = data->job;
+        for (int i = 0; i < job->num_events; ++i) {
+            const Telemetry::Event &event = job->events[i];
+            data->events->Post((Telemetry::EventType)event.type, event.a, event.b, event.time);
+        }
+        job->num_events = 0;
+    }
+
+    // Starts a crossfade to the selected slot if the editor selection changed or a new database
+    // got published into the current slot. Must be called inside an Epoch::Scope.
+    static void update_database(UnityAudioEffectState *state) {
+        auto *data = state->GetEffectData<EffectData>();
+
+        auto new_hrtf = (int)data->p[P_SOFA_SELECTOR];
+        if (new_hrtf < 0 || new_hrtf >= MAX_SOFA_FILES) {
+            return;
+        }
+
+        const int generation = sofa.GetGeneration(new_hrtf);
+        if (new_hrtf == data->current_hrtf && generation == data->current_generation) {
+            return;
+        }
+
+        // Keep rendering the current database if the slot is empty or its filters don't fit, see fits_instance
+        const SofaDatabase *database = sofa.Acquire(new_hrtf);
+        if (database == NULL || !fits_instance(data, database)) {
+            return;
+        }
+
+        // The current convolver keeps its filters and fades out, the other one takes over
+        BinauralConvolver *old = data->convolver;
+        data->convolver = data->fade_convolver;
+        data->fade_convolver = old;
+        data->convolver->Reset();
+        LoadProfiler::Increment(data->num_database_switches);
+        record_event(data, Telemetry::Event_DatabaseSwap, new_hrtf, generation);
+
+        data->current_hrtf = new_hrtf;
+        data->current_generation = generation;
+        data->current_ir = lookup_filter(data, database);
+        activate_filter(state, database, data->current_ir);
+
+        data->fade_blocks = (int)data->p[P_CROSSFADE_BLOCKS];
+        if (data->fade_blocks < 1) {
+            data->fade_blocks = 1;
+        }
+        data->fade_blocks_left = data->fade_blocks;
+    }
+
+    // Renders one block of the mono input into out, which holds the left ear followed by the right ear.
+    // Must be called inside an Epoch::Scope with an initialized convolver.
+    static void render(UnityAudioEffectState *state, float *in_deinterleaved, float *out_deinterleaved, unsigned int length) {
+        auto data = state->GetEffectData<EffectData>();
+
+        update_database(state);
+        const SofaDatabase *database = sofa.Acquire(data->current_hrtf);
+
+        // Split the filter anew when the tail or send mode changed, or the head moves between bus and convolver
+        BusSend *send = data->send.load(std::memory_order_acquire);
+        const bool head_on_bus = send != NULL && !data->fifo->IsEngaged();
+        if (data->mode_version.load(std::memory_order_acquire) != data->active_mode_version
+            || data->head_on_bus != head_on_bus) {
+            activate_filter(state, database, data->current_ir);
+        }
+        TailConvolver *tail = data->tail.load(std::memory_order_acquire);
+
+        if (head_on_bus) {
+            // The bus averages old and new filters for one block, which replaces both crossfades
+            int nearest_ir = lookup_filter(data, database);
+            if (data->current_ir != nearest_ir || has_moved(data) || has_spread_changed(data)) {
+                LoadProfiler::Increment(data->num_ir_switches);
+                record_event(data, Telemetry::Event_IRSwitch, data->current_ir, nearest_ir);
+                activate_filter(state, database, nearest_ir);
+                data->current_ir = nearest_ir;
+            }
+            data->fade_blocks_left = 0;
+
+            if (length == send->GetBlockSize()) {
+                send->Process(state->currdsptick, &in_deinterleaved[0]);
+            }
+
+            // Only the tail is output here, the head is heard through the bus
+            memset(out_deinterleaved, 0, length * NUM_EARS * sizeof(float));
+            if (tail != NULL) {
+                tail->Process(&in_deinterleaved[0], &out_deinterleaved[0], &out_deinterleaved[length], length);
+            }
+            return;
+        }
+
+        // Get the index of the nearest HRTF in relation to the direction
+        int nearest_ir = lookup_filter(data, database);
+        float *out_deinterleaved_old = NULL;
+        if (data->current_ir != nearest_ir || has_moved(data) || has_spread_changed(data)) {
+            LoadProfiler::Increment(data->num_ir_switches);
+            record_event(data, Telemetry::Event_IRSwitch, data->current_ir, nearest_ir);
+            // Load the new impulse response, the convolver keeps the previous one for the crossfade
+            activate_filter(state, database, nearest_ir);
+            out_deinterleaved_old = data->fade_scratch;
+            data->current_ir = nearest_ir;
+        }
+
+        data->convolver->Process(&in_deinterleaved[0], &out_deinterleaved[0], out_deinterleaved_old, length);
+        if (out_deinterleaved_old != NULL) {
+            // Both frames are rendered from the same input through neighbouring filters, so they are
+            // correlated and a linear crossfade keeps the amplitude constant
+            BlockOps::Crossfade(out_deinterleaved, out_deinterleaved_old, out_deinterleaved, length * NUM_EARS, 0.0f, 1.0f,
+                                BlockOps::Curve_Linear);
+        }
+
+        if (data->fade_blocks_left > 0) {
+            // The previous database keeps its filter until it is faded out
+            out_deinterleaved_old = data->fade_scratch;
+            data->fade_convolver->Process(&in_deinterleaved[0], &out_deinterleaved_old[0], NULL, length);
+
+            // Equal power crossfade spread over fade_blocks blocks
+            const float start = (float)(data->fade_blocks - data->fade_blocks_left) / (float)data->fade_blocks;
+            const float end = start + 1.0f / (float)data->fade_blocks;
+            for (int ear = 0; ear < NUM_EARS; ++ear) {
+                BlockOps::Crossfade(&out_deinterleaved[ear * length], &out_deinterleaved_old[ear * length],
+                                    &out_deinterleaved[ear * length], length, start, end, BlockOps::Curve_EqualPower);
+            }
+
+            data->fade_blocks_left--;
+        }
+
+        if (tail != NULL) {
+            tail->Process(&in_deinterleaved[0], &out_deinterleaved[0], &out_deinterleaved[length], length);
+        }
+    }
+
+    // Complements the HRTFs, which are measured at a single distance, with cheap distance cues.
+    // The first stage of both ears is a high shelf for the absorption of the air along the path.
+    // The second one models sources inside the measurement radius: the ear facing the source gets a
+    // low shelf boost while the other one falls deeper into the head shadow.
+    static void filter_distance(UnityAudioEffectState *state, float *out_deinterleaved, unsigned int length) {
+        auto *data = state->GetEffectData<EffectData>();
+        const float absorption = data->p[P_AIR_ABSORPTION];
+        const float near_field = data->p[P_NEAR_FIELD];
+        if (absorption <= 0.0f && near_field <= 0.0f) {
+            data->distance_filtering = false;
+            return;
+        }
+
+        const float *dir = data->has_dir ? data->dir : &sofa.dirs[data->current_hrtf * DIR_DIM];
+        const float distance = sqrtf(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+        // Positive on the left
+        const float lateral = (distance > 0.0f) ? dir[1] / distance : 0.0f;
+        const float samplerate = (float)state->samplerate;
+        BiquadBank *filters = data->distance_filters;
+        BiquadFilter filter;
+
+        filter.SetupHighShelf(AIR_SHELF_FREQ, samplerate, -fminf(absorption * distance * 0.01f, MAX_AIR_ABSORPTION), 0.7071f);
+        for (int ear = 0; ear < NUM_EARS; ++ear) {
+            filters->SetCoeffs(ear, 0, filter);
+        }
+
+        const float halvings = log2f(NEAR_FIELD_RADIUS / fmaxf(distance, NEAR_FIELD_MIN_DISTANCE));
+        const float proximity = near_field * fabsf(lateral) * fmaxf(halvings, 0.0f);
+        const int near_ear = (lateral >= 0.0f) ? 0 : 1;
+        filter.SetupLowShelf(NEAR_FIELD_BOOST_FREQ, samplerate, NEAR_FIELD_BOOST * proximity, 0.7071f);
+        filters->SetCoeffs(near_ear, 1, filter);
+        filter.SetupHighShelf(NEAR_FIELD_SHADOW_FREQ, samplerate, -NEAR_FIELD_SHADOW * proximity, 0.7071f);
+        filters->SetCoeffs(1 - near_ear, 1, filter);
+
+        // Start from the current coefficients instead of fading in from bypass
+        if (!data->distance_filtering) {
+            filters->Reset();
+            data->distance_filtering = true;
+        }
+
+        float *ears[NUM_EARS] = { &out_deinterleaved[0], &out_deinterleaved[length] };
+        filters->Process(ears, length);
+    }
+
+    // Computes the image sources of the room for the current positions and sends the delayed input to the
+    // reflection bus. Runs on the audio thread even with the render pool, since the bus mixes the same block,
+    // and delays the reflections by the latency of the pool instead.
+    static void send_reflections(UnityAudioEffectState *state, const float *in_deinterleaved, unsigned int length, bool pooled) {
+        auto *data = state->GetEffectData<EffectData>();
+        ReflectionSend *reflections = data->reflections.load(std::memory_order_acquire);
+        if (reflections == NULL || (int)length != reflections->GetBlockSize() || data->fifo->IsEngaged()) {
+            return;
+        }
+
+        // Without positions the reflections fade out
+        ShoeboxRoom::Image images[ShoeboxRoom::MAX_IMAGES];
+        int numimages = 0;
+        if (data->has_dir) {
+            ShoeboxRoom room;
+            room.Set(data->p[P_ROOM_WIDTH], data->p[P_ROOM_HEIGHT], data->p[P_ROOM_DEPTH], data->p[P_REFLECTIVITY],
+                     (int)data->p[P_REFLECTION_ORDER]);
+            numimages = room.Compute(state->spatializerdata->listenermatrix, state->spatializerdata->sourcematrix, images);
+        }
+        reflections->SetImages(images, numimages, pooled ? (int)length : 0);
+        reflections->Process(state->currdsptick, in_deinterleaved);
+    }
+
+    // Sends the input to the buses rendering the late sound of all sources: the late tail bus if the current
+    // database was split, and the reverb bus scaled by the reverb zone mix of the source. The buses render the
+    // same block, so with the render pool this is the input of the block that is output now.
+    // Must be called inside an Epoch::Scope.
+    static void send_late(UnityAudioEffectState *state, const float *in_deinterleaved, unsigned int length) {
+        auto *data = state->GetEffectData<EffectData>();
+        // Blocks re-blocked by the FIFO don't line up with the dsptick of the buses
+        if (data->fifo->IsEngaged()) {
+            return;
+        }
+        LateTailBus &tails = LateTailBus::Instance();
+        if ((int)length == tails.GetBlockSize()) {
+            const SofaDatabase *database = sofa.Acquire(data->current_hrtf);
+            if (database != NULL && database->HasLateTail()) {
+                tails.Accumulate(state->currdsptick, data->current_hrtf, in_deinterleaved);
+            }
+        }
+
+        ReverbBus &reverb = ReverbBus::Instance();
+        const float send = (state->spatializerdata != NULL) ? state->spatializerdata->reverbzonemix : 0.0f;
+        if ((int)length == reverb.GetBlockSize() && (send > 0.0f || data->reverb_send > 0.0f)) {
+            reverb.Accumulate(state->currdsptick, in_deinterleaved, data->reverb_send, send);
+        }
+        data->reverb_send = send;
+    }
+
+    // Delays the input by the distance between source and listener ahead of everything else, so the reflections
+    // and sends are delayed along with the direct sound. Without spatializer data the delay stays where it is.
+    static void delay_propagation(UnityAudioEffectState *state, float *in_deinterleaved, unsigned int length) {
+        auto *data = state->GetEffectData<EffectData>();
+        FractionalDelay *propagation = data->propagation.load(std::memory_order_acquire);
+        if (propagation == NULL) {
+            return;
+        }
+
+        float target = propagation->GetDelay();
+        if (state->structsize >= sizeof(UnityAudioEffectState) && state->spatializerdata != NULL) {
+            float x, y, z;
+            get_local_position(state, &x, &y, &z);
+            target = sqrtf(x * x + y * y + z * z) / ShoeboxRoom::SPEED_OF_SOUND * (float)state->samplerate;
+        }
+        propagation->Process(in_deinterleaved, length, target);
+    }
+
+    // Renders and reports the time it took to the voice budget
+    static void render_timed(UnityAudioEffectState *state, float *in_deinterleaved, float *out_deinterleaved, unsigned int length) {
+        const UInt64 start = LoadProfiler::GetTime();
+        render(state, in_deinterleaved, out_deinterleaved, length);
+        VoiceBudget::Instance().Report(LoadProfiler::GetTime() - start);
+    }
+
+    // Renders the block of a job, preceded by the block that was dropped before it if there was one. The output
+    // of that block is too late to be heard and gets overwritten, but its input reaches the convolvers.
+    static void render_job(RenderJob *job) {
+        if (job->backlog > 0) {
+            render_timed(job->state, job->in, job->out, job->backlog);
+        }
+        render_timed(job->state, job->in + job->backlog, job->out, job->length);
+    }
+
+    // Entry point of the render pool workers
+    static void render_task(void *arg) {
+        RenderJob *job = (RenderJob*)arg;
+        RT_AUDIT_SCOPE();
+        Epoch::Scope epoch;
+        render_job(job);
+    }
+
+    // Joins the block in flight, but waits for a render that is still running for JOIN_BUDGET of the block at most,
+    // so the callback keeps the rest of its time. Returns false if it is still running: the render thread keeps the
+    // convolvers and the job, so the caller outputs silence for this block, which is counted as dropped.
+    static bool join_job(UnityAudioEffectState *state, unsigned int length) {
+        auto *data = state->GetEffectData<EffectData>();
+        if (!data->job->pending) {
+            return true;
+        }
+        const UInt64 wait = (UInt64)(JOIN_BUDGET * (float)length * 1.0e9f / (float)state->samplerate);
+        if (RenderPool::Instance().Join(data->job->task, RenderPool::GetTime() + wait)) {
+            post_render_events(data);
+            return true;
+        }
+        LoadProfiler::Increment(data->num_dropped_blocks);
+        return false;
+    }
+
+    // Discards the block in flight before the convolvers are used on this thread, see join_job.
+    // A block that was dropped before it is discarded as well, the convolvers leave the pooled path here.
+    static bool drop_job(UnityAudioEffectState *state, unsigned int length) {
+        auto *data = state->GetEffectData<EffectData>();
+        if (!join_job(state, length)) {
+            return false;
+        }
+        data->job->pending = false;
+        data->job->missed_length = 0;
+        return true;
+    }
+
+    // Hands the current block to the render pool and outputs the block that was handed over in the
+    // previous callback, which adds one block of latency. Blocks the pool can't finish in time are
+    // rendered synchronously instead. Returns false if there was no block to output and the output is silent.
+    // While the previous block is still rendering the current one is output as silence and the previous one
+    // is output by the next callback instead. The input of the dropped block is rendered ahead of the next one.
+    static bool render_pooled(UnityAudioEffectState *state, float *in_deinterleaved, float *out_deinterleaved, unsigned int length) {
+        auto data = state->GetEffectData<EffectData>();
+        RenderJob *job = data->job;
+        RenderPool &pool = RenderPool::Instance();
+
+        const UInt64 now = RenderPool::GetTime();
+        const UInt64 deadline = now + (UInt64)length * 1000000000ull / state->samplerate;
+
+        if (!join_job(state, length)) {
+            // The render thread still owns the job, this copy is moved into it once it is joined
+            memcpy(job->missed, in_deinterleaved, length * sizeof(float));
+            job->missed_length = length;
+            memset(out_deinterleaved, 0, length * NUM_EARS * sizeof(float));
+            return false;
+        }
+        update_direction(state);
+        const bool rendered = job->pending && job->length == length;
+        if (rendered) {
+            memcpy(out_deinterleaved, job->out, length * NUM_EARS * sizeof(float));
+            send_late(state, job->in + job->backlog, length);
+        } else {
+            memset(out_deinterleaved, 0, length * NUM_EARS * sizeof(float));
+        }
+
+        job->backlog = job->missed_length;
+        memcpy(job->in, job->missed, job->backlog * sizeof(float));
+        job->missed_length = 0;
+        memcpy(job->in + job->backlog, in_deinterleaved, length * sizeof(float));
+        job->length = length;
+        job->pending = true;
+        if (!pool.Submit(job->task, deadline)) {
+            render_job(job);
+            post_render_events(data);
+        }
+        return rendered;
+    }
+
+    // Ranks the source on the voice budget by the level of its input, which already carries the volume and
+    // distance attenuation of the source, divided by its distance beyond the near field, since the direction
+    // of close sources is heard best. Returns true if the source may convolve this block.
+    static bool admit_voice(UnityAudioEffectState *state, float rms, unsigned int length) {
+        auto *data = state->GetEffectData<EffectData>();
+        const float release = powf(10.0f, -3.0f * (float)length / (VOICE_LEVEL_RELEASE * (float)state->samplerate));
+        data->voice_level = fmaxf(rms, data->voice_level * release);
+
+        float distance = NEAR_FIELD_RADIUS;
+        if (state->structsize >= sizeof(UnityAudioEffectState) && state->spatializerdata != NULL) {
+            float x, y, z;
+            get_local_position(state, &x, &y, &z);
+            distance = fmaxf(sqrtf(x * x + y * y + z * z), NEAR_FIELD_RADIUS);
+        }
+        return VoiceBudget::Instance().Admit(state->currdsptick, data->voice, data->voice_level / distance);
+    }
+
+    // Stand-in for the convolution of sources over the voice budget: equal power panning by the lateral
+    // direction at the level of the current filters. Ramps from the gains of the last panned block unless fresh.
+    static void pan_voice(UnityAudioEffectState *state, const float *in_deinterleaved, float *out_deinterleaved,
+                          unsigned int length, bool fresh) {
+        auto *data = state->GetEffectData<EffectData>();
+        const float *dir = data->has_dir ? data->dir : &sofa.dirs[data->current_hrtf * DIR_DIM];
+        const float distance = sqrtf(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+        // Positive on the left
+        const float lateral = (distance > 0.0f) ? dir[1] / distance : 0.0f;
+        const float gains[NUM_EARS] = {
+            data->pan_level * sqrtf(0.5f * (1.0f + lateral)),
+            data->pan_level * sqrtf(0.5f * (1.0f - lateral))
+        };
+        for (int ear = 0; ear < NUM_EARS; ++ear) {
+            const float start = fresh ? gains[ear] : data->pan_gains[ear];
+            BlockOps::Gain(&out_deinterleaved[ear * length], in_deinterleaved, length, start, gains[ear]);
+            data->pan_gains[ear] = gains[ear];
+        }
+    }
+
+    // Writes the first two input channels to the ears, mono input to both
+    static void copy_dry(const float *inbuffer, int inchannels, float *out_deinterleaved, unsigned int length) {
+        float *in_channels[MAX_CHANNELS];
+        for (int ch = 0; ch < inchannels; ++ch) {
+            in_channels[ch] = (ch < NUM_EARS) ? &out_deinterleaved[ch * length] : NULL;
+        }
+        BlockOps::Deinterleave(in_channels, inbuffer, inchannels, length);
+        if (inchannels < NUM_EARS) {
+            memcpy(&out_deinterleaved[length], &out_deinterleaved[0], length * sizeof(float));
+        }
+    }
+
+    // What sources render while they don't convolve: 2D sources their input as is, the others are panned
+    static void stand_in(UnityAudioEffectState *state, const float *inbuffer, int inchannels, const float *in_deinterleaved,
+                         float *out_deinterleaved, unsigned int length, bool fresh, bool flat) {
+        auto *data = state->GetEffectData<EffectData>();
+        if (flat) {
+            copy_dry(inbuffer, inchannels, out_deinterleaved, length);
+        } else {
+            pan_voice(state, in_deinterleaved, out_deinterleaved, length, fresh || data->flat);
+        }
+        data->flat = flat;
+    }
+
+    // 2D sources (a spatial blend of 0) are copied as they are, once they faded over from the convolution
+    static bool is_flat(const UnityAudioEffectState *state) {
+        return state->structsize >= sizeof(UnityAudioEffectState) && state->spatializerdata != NULL &&
+               state->spatializerdata->spatialblend <= 0.0f;
+    }
+
+    // Samples the output of a source keeps sounding after its input fell silent: the filters, the block the
+    // render pool is behind and the reflections. The buses flush the late sound on their own.
+    static int get_ring_length(UnityAudioEffectState *state, unsigned int length) {
+        auto *data = state->GetEffectData<EffectData>();
+        int ring = (int)data->ir_len + 2 * (int)length;
+        if (data->reflections.load(std::memory_order_acquire) != NULL) {
+            ring += (int)(MAX_REFLECTION_DELAY * (float)state->samplerate) + (int)length;
+        }
+        return ring;
+    }
+
+    // Skips all rendering of settled 2D sources, which copy their input, and of sources whose input and output
+    // are silent, which write silence. Silence is only skipped once the last input left the filters and delay
+    // lines, so they hold nothing but silence and rendering resumes exactly where it would have been.
+    // Returns true if the block was written.
+    static bool bypass_voice(UnityAudioEffectState *state, const float *inbuffer, float *outbuffer, unsigned int length,
+                             int inchannels, int outchannels, float peak, bool flat) {
+        auto *data = state->GetEffectData<EffectData>();
+        if (peak > SILENCE_THRESHOLD) {
+            data->silent_samples = 0;
+        } else if (data->silent_samples < INT_MAX - (int)length) {
+            data->silent_samples += (int)length;
+        }
+
+        const bool copy = flat && data->voice_state == Voice_Virtual && data->flat;
+        const bool silent = data->silent_samples >= get_ring_length(state, length) && data->fade_blocks_left == 0;
+        if (!copy && !silent) {
+            return false;
+        }
+
+        if (!drop_job(state, length)) {
+            memset(outbuffer, 0, length * outchannels * sizeof(float));
+            return true;
+        }
+        // The distance filters start from their coefficients again
+        data->distance_filtering = false;
+        LoadProfiler::Increment(data->num_idle_blocks);
+
+        if (silent) {
+            memset(outbuffer, 0, length * outchannels * sizeof(float));
+            return true;
+        }
+
+        // A tail convolver keeps running on silence, so it holds no stale input once the source is 3D again
+        TailConvolver *tail = data->tail.load(std::memory_order_acquire);
+        if (tail != NULL) {
+            float *silence = data->silence_scratch;
+            memset(silence, 0, length * (NUM_EARS + 1) * sizeof(float));
+            tail->Process(&silence[0], &silence[length], &silence[2 * length], length);
+        }
+        if (inchannels == outchannels) {
+            memcpy(outbuffer, inbuffer, length * outchannels * sizeof(float));
+        } else {
+            for (unsigned int n = 0; n < length; ++n) {
+                for (int ch = 0; ch < outchannels; ++ch) {
+                    outbuffer[n * outchannels + ch] = inbuffer[n * inchannels + (ch < inchannels ? ch : inchannels - 1)];
+                }
+            }
+        }
+        return true;
+    }
+
+    // Restarts the convolution of a source that was over the budget from silence, with the filters of its current
+    // direction. The job of the render pool was dropped when it went virtual.
+    static void wake_voice(UnityAudioEffectState *state) {
+        auto *data = state->GetEffectData<EffectData>();
+        const SofaDatabase *database = sofa.Acquire(data->current_hrtf);
+        if (database == NULL) {
+            return;
+        }
+        BusSend *send = data->send.load(std::memory_order_acquire);
+        if (send != NULL) {
+            send->Reset();
+        }
+        data->convolver->Reset();
+        update_direction(state);
+        data->current_ir = lookup_filter(data, database);
+        activate_filter(state, database, data->current_ir);
+        data->fade_blocks_left = 0;
+    }
+
+    // Fades every ear from one rendering of a block to another over the block
+    static void crossfade_ears(float *out_deinterleaved, const float *from, const float *to, unsigned int length) {
+        for (int ear = 0; ear < NUM_EARS; ++ear) {
+            BlockOps::Crossfade(&out_deinterleaved[ear * length], &from[ear * length], &to[ear * length], length,
+                                0.0f, 1.0f, BlockOps::Curve_Linear);
+        }
+    }
+
+    static void enter_passthrough(EffectData *data, Telemetry::PassthroughReason reason) {
+        if (!data->passthrough) {
+            data->events->Post(Telemetry::Event_Passthrough, reason, 0);
+            data->passthrough = true;
+        }
+    }
+
+    // Renders one block of interleaved frames, either as delivered by the host or re-blocked by the FIFO
+    static void process_block(UnityAudioEffectState *state, const float *inbuffer, float *outbuffer, unsigned int length,
+                              int inchannels, int outchannels) {
+        auto data = state->GetEffectData<EffectData>();
 
         if (!sofa.is_initialized) {
+            enter_passthrough(data, Telemetry::Passthrough_NotInitialized);
+            memcpy(outbuffer, inbuffer, length * outchannels * sizeof(float));
+            return;
+        }
+
+        // Databases may be swapped by other threads at any time, the epoch keeps the ones
+        // we are reading alive until the end of the callback
+        Epoch::Scope epoch;
+
+        if (is_selection_too_long(data)) {
+            enter_passthrough(data, Telemetry::Passthrough_FilterTooLong);
             memcpy(outbuffer, inbuffer, length * outchannels * sizeof(float));
-            return UNITY_AUDIODSP_OK;
+            return;
         }
 
         init_convolver(state);
-        auto data = state->GetEffectData<EffectData>();
 
         if (!data->is_initialized) {
+            enter_passthrough(data, Telemetry::Passthrough_NoDatabase);
             memcpy(outbuffer, inbuffer, length * outchannels * sizeof(float));
-            return UNITY_AUDIODSP_OK;
+            return;
         }
+        data->passthrough = false;
 
         // Prepare data
         // since we have an mono input we just have to deinterleave one channel
-        float in_deinterleaved[length];
-        deinterleave_data(inbuffer, in_deinterleaved, length, 1);
-        float out_deinterleaved[length * inchannels];
-        data->convolver->process(&in_deinterleaved[0], &out_deinterleaved[0], &out_deinterleaved[length], length);
+        float *in_deinterleaved = data->in_scratch;
+        float *in_channels[MAX_CHANNELS];
+        in_channels[0] = in_deinterleaved;
+        for (int ch = 1; ch < inchannels; ++ch) {
+            in_channels[ch] = NULL;
+        }
+        BlockOps::Deinterleave(in_channels, inbuffer, inchannels, length);
+        delay_propagation(state, in_deinterleaved, length);
 
-        // Get the index of the nearest HRTF in relation to the direction
-        int nearest_ir = mysofa_lookup(sofa.lookups[data->current_hrtf],
-                                       &sofa.dirs[data->current_hrtf * DIR_DIM]);
-        // Transform to the first stereo pair index
-        if (nearest_ir % 2 != 0) { nearest_ir -= 1; }
-        if (data->current_ir != nearest_ir) {
-            // Init new impulse response
-            data->convolver->init(state->dspbuffersize,
-                                  &sofa.hrtfs[data->current_hrtf]->DataIR.values[data->current_ir * data->ir_len],
-                                  &sofa.hrtfs[data->current_hrtf]->DataIR.values[(data->current_ir + 1) * data->ir_len],
-                                  data->ir_len);
-            float out_deinterleaved_new[length * inchannels];
-            data->convolver->process(&out_deinterleaved_new[0], &out_deinterleaved_new[length], length);
-
-            // Equal power crossfade between the old and new frame mixed into the out buffer
-            for (int i = 0; i < length; ++i) {
-                float ratio = (float)(i+1) / (float)length;
-                float volume_new = sqrtf(ratio);
-                float volume_old = 1 - volume_new;
-
-                for (int j = 0; j < inchannels; ++j) {
-                    size_t index = (length*j) + i;
-                    out_deinterleaved[index] *= volume_old;
-                    out_deinterleaved[index] += out_deinterleaved_new[index] * volume_new;
+        float peak, rms;
+        BlockOps::Measure(in_deinterleaved, length, &peak, &rms);
+        const bool flat = is_flat(state);
+        if (bypass_voice(state, inbuffer, outbuffer, length, inchannels, outchannels, peak, flat)) {
+            return;
+        }
+        float *out_deinterleaved = data->out_scratch;
+
+        // Sends have to reach the bus within the same block, so they bypass the render threads
+        const bool pooled = RenderPool::Instance().IsRunning() && data->send.load(std::memory_order_acquire) == NULL;
+        const bool use_pool = pooled && length <= data->job->capacity;
+        // 2D sources leave the convolution like sources over the budget, but don't take part in the ranking
+        const bool admitted = !flat && admit_voice(state, rms, length);
+        if (!admitted && data->voice_state != Voice_Rendered) {
+            // Over the budget the convolvers idle, only the tail keeps running in the background
+            if (!drop_job(state, length)) {
+                memset(outbuffer, 0, length * outchannels * sizeof(float));
+                return;
+            }
+            update_direction(state);
+            stand_in(state, inbuffer, inchannels, in_deinterleaved, out_deinterleaved, length, false, flat);
+            TailConvolver *tail = data->tail.load(std::memory_order_acquire);
+            if (tail != NULL) {
+                tail->Process(&in_deinterleaved[0], &out_deinterleaved[0], &out_deinterleaved[length], length);
+            }
+            send_late(state, in_deinterleaved, length);
+            data->voice_state = Voice_Virtual;
+            LoadProfiler::Increment(data->num_virtual_blocks);
+        } else {
+            if (data->voice_state == Voice_Virtual) {
+                wake_voice(state);
+                data->voice_state = Voice_Waking;
+            }
+
+            bool rendered = true;
+            if (use_pool) {
+                rendered = render_pooled(state, in_deinterleaved, out_deinterleaved, length);
+            } else {
+                // The pool was stopped or bypassed, drop the block that is still in flight
+                if (!drop_job(state, length)) {
+                    memset(outbuffer, 0, length * outchannels * sizeof(float));
+                    return;
                 }
+                update_direction(state);
+                render_timed(state, in_deinterleaved, out_deinterleaved, length);
+                post_render_events(data);
+                send_late(state, in_deinterleaved, length);
             }
 
-            data->current_ir = nearest_ir;
-        } //*/
+            // Sources crossing the budget or turning 2D fade between convolution and their stand-in over one block
+            if (!admitted || data->voice_state == Voice_Waking) {
+                float *panned = data->stand_in_scratch;
+                stand_in(state, inbuffer, inchannels, in_deinterleaved, panned, length, !admitted, flat);
+                if (!rendered) {
+                    memcpy(out_deinterleaved, panned, length * NUM_EARS * sizeof(float));
+                } else if (!admitted) {
+                    crossfade_ears(out_deinterleaved, out_deinterleaved, panned, length);
+                } else {
+                    crossfade_ears(out_deinterleaved, panned, out_deinterleaved, length);
+                }
+                if (!admitted || rendered) {
+                    data->voice_state = admitted ? Voice_Rendered : Voice_Virtual;
+                    data->events->Post(Telemetry::Event_VoiceState, admitted ? 0 : 1, VoiceBudget::Instance().GetAllowed());
+                }
+            }
+        }
+
+        send_reflections(state, in_deinterleaved, length, use_pool);
+        filter_distance(state, out_deinterleaved, length);
+
+        OutputMeter *meter = data->meter.load(std::memory_order_acquire);
+        if (meter != NULL) {
+            for (int ear = 0; ear < NUM_EARS; ++ear) {
+                meter->ears[ear].Feed(&out_deinterleaved[ear * length], 1, length);
+            }
+        }
+
+        // Channels beyond the two ears are silent
+        const float *out_channels[MAX_CHANNELS];
+        for (int ch = 0; ch < outchannels; ++ch) {
+            out_channels[ch] = (ch < NUM_EARS) ? &out_deinterleaved[ch * length] : NULL;
+        }
+        BlockOps::Interleave(outbuffer, out_channels, outchannels, length);
+    }
+
+    static void process_fifo_block(void *arg, const float *input, float *output, int numframes, int numinputs,
+                                   int numoutputs) {
+        process_block((UnityAudioEffectState *)arg, input, output, (unsigned int)numframes, numinputs, numoutputs);
+    }
 
-        //err = sofa.errs[data->current_hrtf];
-        err = data->current_ir;
-        //err = data->current_hrtf;
-        interleave_data(out_deinterleaved, outbuffer, length, outchannels);
+    // ProcessCallback gets called as long as the plugin is loaded
+    // This includes when the editor is not in play mode!
+    UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK ProcessCallback(
+            UnityAudioEffectState* state, // The state gets passed into all callbacks
+            float* inbuffer,              // Plugins can be chained together; inbuffer holds the signal incoming from another plugin, or an AudioSource
+            float* outbuffer,             // We fill outbuffer with the signal Unity should send to the speakers
+            unsigned int length,          // The number of samples the buffers hold
+            int inchannels,               // The number of channels the incoming signal uses
+            int outchannels)              // The number of channels the outgoing signal uses
+    {
+        auto data = state->GetEffectData<EffectData>();
+        const UInt64 budget = (UInt64)length * 1000000000ull / state->samplerate;
+        LoadProfiler::Scope profile(data->profiler, budget);
+
+        // Blocks of the render size (the announced one unless it is re-blocked, see get_render_block) are
+        // rendered as they come. The first call of another length engages the FIFO, which renders whole blocks
+        // one block late, until the calls are back at the render size for FIFO_RELEASE_CALLS calls. The bus sends pause meanwhile, since the blocks are out of step with the buses.
+        // The scratch blocks only hold the announced block of up to MAX_CHANNELS channels.
+        BlockFifo *fifo = data->fifo;
+        const bool supported = inchannels <= MAX_CHANNELS && outchannels <= MAX_CHANNELS;
+        const bool aligned = length == data->max_length && supported;
+        data->aligned_calls = aligned ? data->aligned_calls + 1 : 0;
+        if (aligned && !fifo->IsEngaged()) {
+            process_block(state, inbuffer, outbuffer, length, inchannels, outchannels);
+        } else if (aligned && data->aligned_calls >= FIFO_RELEASE_CALLS) {
+            // Skip ahead to the direct output, faded in over the output the FIFO still queued
+            float *queued = data->fifo_scratch;
+            const int count = fifo->Disengage(queued, (int)length);
+            process_block(state, inbuffer, outbuffer, length, inchannels, outchannels);
+            BlockOps::Crossfade(outbuffer, queued, outbuffer, count * outchannels, 0.0f, 1.0f, BlockOps::Curve_Linear);
+            data->events->Post(Telemetry::Event_Reblocking, 0, 0);
+        } else if (fifo->IsEngaged() && fifo->Engage(inchannels, outchannels)) {
+            fifo->Process(inbuffer, outbuffer, (int)length, process_fifo_block, state);
+        } else if (fifo->Engage(inchannels, outchannels)) {
+            data->events->Post(Telemetry::Event_Reblocking, 1, fifo->GetLatency());
+            fifo->Process(inbuffer, outbuffer, (int)length, process_fifo_block, state);
+        } else {
+            enter_passthrough(data, Telemetry::Passthrough_UnsupportedLayout);
+            memcpy(outbuffer, inbuffer, length * outchannels * sizeof(float));
+        }
+
+        const UInt64 elapsed = LoadProfiler::GetTime() - profile.GetStartTime();
+        if (elapsed > budget) {
+            data->events->Post(Telemetry::Event_DeadlineOverrun, (int)(elapsed / 1000), (int)(budget / 1000));
+        }
         return UNITY_AUDIODSP_OK;
     }
 
@@ -315,11 +1592,21 @@ namespace Plugin_SofaSpatializer {
         if (index >= P_NUM) {
             return UNITY_AUDIODSP_ERR_UNSUPPORTED;
         }
-        if (index == P_SOFA_SELECTOR && (int)value != data->current_hrtf) {
-            data->is_initialized = false;
-        }
+        // A new sofa selection is picked up and crossfaded by the next ProcessCallback
         data->p[index] = value;
 
+        if (index == P_TAIL_MODE) {
+            update_tail_mode(state);
+        } else if (index == P_SEND_MODE) {
+            update_send_mode(state);
+        } else if (index == P_OUTPUT_METER) {
+            update_output_meter(state);
+        } else if (index == P_REFLECTION_ORDER) {
+            update_reflections(state);
+        } else if (index == P_DELAY_DISTANCE) {
+            update_propagation(state);
+        }
+
         return UNITY_AUDIODSP_OK;
     }
 
@@ -339,9 +1626,155 @@ namespace Plugin_SofaSpatializer {
         return UNITY_AUDIODSP_OK;
     }
 
-    // Also unsure where this is used, but it's required to be defined, so just return from the function as soon as it's called
+    // Named buffers for the C# tools, cheap enough to be queried in production builds:
+    // "LoadStats"     p50, p99 and max callback duration in microseconds, the same in cycles, number of calls and load
+    // "LoadHistogram" callback counts per log2 bin of nanoseconds, see LoadProfiler
+    // "Counters"      lookups, IR switches, database switches, background tail underruns, blocks panned
+    //                 over the voice budget, blocks skipped for silence or a 2D source and blocks dropped
+    //                 because their render missed the deadline
+    // "Latency"       samples the output lags behind the input in total, in the FIFO for hosts with uneven
+    //                 block lengths and in the render pool
+    // "Memory"        bytes used by this instance, by all databases and by the database of every slot
+    // "SpectrumL/R"   peak magnitudes of the output of each ear from 0 Hz to Nyquist, resampled to numsamples
+    //                 values (a full scale sine reads 1), zeros while the "Output Meter" is off.
+    //                 Each of them may only be read by one thread.
     int UNITY_AUDIODSP_CALLBACK GetFloatBufferCallback(UnityAudioEffectState* state, const char* name, float* buffer, int numsamples)
     {
+        EffectData *data = state->GetEffectData<EffectData>();
+
+        if (strcmp(name, "LoadStats") == 0) {
+            data->profiler.GetStats(buffer, numsamples);
+        } else if (strcmp(name, "LoadHistogram") == 0) {
+            data->profiler.GetHistogram(buffer, numsamples);
+        } else if (strcmp(name, "Counters") == 0) {
+            Epoch::Scope epoch;
+            const TailConvolver *tail = data->tail.load(std::memory_order_acquire);
+            const float counters[] = {
+                (float)data->num_lookups.load(std::memory_order_relaxed),
+                (float)data->num_ir_switches.load(std::memory_order_relaxed),
+                (float)data->num_database_switches.load(std::memory_order_relaxed),
+                (tail != NULL) ? (float)tail->GetUnderruns() : 0.0f,
+                (float)data->num_virtual_blocks.load(std::memory_order_relaxed),
+                (float)data->num_idle_blocks.load(std::memory_order_relaxed),
+                (float)data->num_dropped_blocks.load(std::memory_order_relaxed)
+            };
+            for (int i = 0; i < numsamples && i < (int)(sizeof(counters) / sizeof(counters[0])); ++i) {
+                buffer[i] = counters[i];
+            }
+        } else if (strcmp(name, "Latency") == 0) {
+            const int fifo = data->fifo->GetLatency();
+            const int pool = data->job->pending ? (int)data->max_length : 0;
+            const float latencies[] = { (float)(fifo + pool), (float)fifo, (float)pool };
+            for (int i = 0; i < numsamples && i < (int)(sizeof(latencies) / sizeof(latencies[0])); ++i) {
+                buffer[i] = latencies[i];
+            }
+        } else if (strcmp(name, "Memory") == 0) {
+            Epoch::Scope epoch;
+            // The arena holds the convolvers as well
+            size_t instance = data->arena->GetMemorySize();
+            const TailConvolver *tail = data->tail.load(std::memory_order_acquire);
+            if (tail != NULL) {
+                instance += tail->GetMemorySize();
+            }
+            const BusSend *send = data->send.load(std::memory_order_acquire);
+            if (send != NULL) {
+                instance += send->GetMemorySize();
+            }
+            const OutputMeter *meter = data->meter.load(std::memory_order_acquire);
+            if (meter != NULL) {
+                instance += sizeof(OutputMeter) + NUM_EARS * meter->ears[0].GetMemorySize();
+            }
+            const ReflectionSend *reflections = data->reflections.load(std::memory_order_acquire);
+            if (reflections != NULL) {
+                instance += reflections->GetMemorySize();
+            }
+            const FractionalDelay *propagation = data->propagation.load(std::memory_order_acquire);
+            if (propagation != NULL) {
+                instance += propagation->GetMemorySize();
+            }
+
+            size_t databases[MAX_SOFA_FILES];
+            size_t total = 0;
+            for (int i = 0; i < MAX_SOFA_FILES; ++i) {
+                const SofaDatabase *database = sofa.Acquire(i);
+                databases[i] = (database != NULL) ? database->GetMemorySize() : 0;
+                total += databases[i];
+            }
+
+            if (numsamples > 0) {
+                buffer[0] = (float)instance;
+            }
+            if (numsamples > 1) {
+                buffer[1] = (float)total;
+            }
+            for (int i = 0; i + 2 < numsamples && i < MAX_SOFA_FILES; ++i) {
+                buffer[i + 2] = (float)databases[i];
+            }
+        } else if (strcmp(name, "SpectrumL") == 0 || strcmp(name, "SpectrumR") == 0) {
+            Epoch::Scope epoch;
+            OutputMeter *meter = data->meter.load(std::memory_order_acquire);
+            if (meter != NULL) {
+                meter->ears[name[8] == 'L' ? 0 : 1].ReadSpectrum(buffer, numsamples);
+            } else if (numsamples > 0) {
+                memset(buffer, 0, numsamples * sizeof(float));
+            }
+        } else {
+            return UNITY_AUDIODSP_ERR_UNSUPPORTED;
+        }
+
         return UNITY_AUDIODSP_OK;
     }
+
+    NAP_TESTSUITE(SofaSpatializer)
+    {
+        // Doubles the first input channel into both outputs
+        static void render_double(void *arg, const float *input, float *output, int numframes, int numinputs,
+                                  int numoutputs) {
+            for (int n = 0; n < numframes; ++n) {
+                output[n * numoutputs] = output[n * numoutputs + 1] = 2.0f * input[n * numinputs];
+            }
+        }
+
+        NAP_UNITTEST(RenderBlockOfUnevenHostBlocks)
+        {
+            // Block sizes without a power of two factor of MIN_PARTITION get a power of two partition that is
+            // at least that long and are re-blocked to it, the others are rendered as they come
+            const unsigned int blocksizes[] = { 441, 1000, 240, 16, 1024, 480 };
+            const size_t irlens[] = { 200, MIN_IR_CAPACITY, 8192 };
+            bool ok = true;
+            for (size_t b = 0; b < sizeof(blocksizes) / sizeof(blocksizes[0]); ++b) {
+                for (size_t i = 0; i < sizeof(irlens) / sizeof(irlens[0]); ++i) {
+                    const int partition = choose_partition((int)blocksizes[b], irlens[i]);
+                    const unsigned int renderblock = get_render_block(blocksizes[b], partition);
+                    ok = ok && partition >= MIN_PARTITION && (partition & (partition - 1)) == 0;
+                    ok = ok && renderblock % partition == 0;
+                    ok = ok && (renderblock == blocksizes[b] || (int)renderblock == partition);
+                }
+            }
+            NAP_CHECK(ok);
+
+            // Host calls of 441 frames come out of the FIFO one render block late
+            const unsigned int blocksize = 441, total = 10 * blocksize;
+            const unsigned int renderblock = get_render_block(blocksize, choose_partition(blocksize, MIN_IR_CAPACITY));
+            NAP_CHECK(renderblock != blocksize);
+            Arena *arena = Arena::Create(BlockFifo::GetArenaSize(renderblock, NUM_EARS));
+            BlockFifo fifo;
+            fifo.Init(renderblock, NUM_EARS, *arena);
+            NAP_CHECK(fifo.Engage(1, NUM_EARS) && fifo.GetLatency() == (int)renderblock);
+            std::vector<float> input(total), output(NUM_EARS * total);
+            for (unsigned int n = 0; n < total; ++n) {
+                input[n] = (float)(n + 1);
+            }
+            for (unsigned int pos = 0; pos < total; pos += blocksize) {
+                fifo.Process(&input[pos], &output[NUM_EARS * pos], blocksize, render_double, NULL);
+            }
+            ok = true;
+            for (unsigned int n = 0; n < total; ++n) {
+                const float expected = (n < renderblock) ? 0.0f : 2.0f * input[n - renderblock];
+                ok = ok && output[NUM_EARS * n] == expected && output[NUM_EARS * n + 1] == expected;
+            }
+            NAP_CHECK(ok);
+            Arena::Destroy(arena);
+        }
+    }
 }
\ No newline at end of file
@@ -0,0 +1,261 @@
+#include "RTAudit.h"
+
+#include <new>
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_AMD64)
+#   include <xmmintrin.h>
+#   define RT_AUDIT_SSE 1
+#endif
+
+#if !UNITY_WIN
+#   include <dlfcn.h>
+#   include <fcntl.h>
+#   include <sched.h>
+#   include <stdarg.h>
+#   include <time.h>
+#   include <unistd.h>
+#endif
+
+namespace
+{
+    const int kMaxSites = 512; // Must be a power of two
+
+    struct Site
+    {
+        std::atomic<void*> address;
+        std::atomic<int> kind;
+        std::atomic<UInt64> count;
+    };
+
+    // Zero initialized before any constructor runs, so reports from static initializers are safe
+    Site sites[kMaxSites];
+    std::atomic<UInt64> dropped;
+
+    // The initial exec model keeps the first access of a new thread from allocating inside the allocator hooks
+#if defined(__GNUC__)
+    __thread int depth __attribute__((tls_model("initial-exec")));
+#else
+    __declspec(thread) int depth;
+#endif
+}
+
+RTAudit::Scope::Scope()
+    : fpstate(0)
+{
+    depth++;
+#if RT_AUDIT_SSE
+    // Flush-to-zero (bit 15) and denormals-are-zero (bit 6)
+    fpstate = _mm_getcsr();
+    _mm_setcsr(fpstate | 0x8040);
+#elif defined(__aarch64__)
+    UInt64 fpcr;
+    __asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+    fpstate = (unsigned int)fpcr;
+    fpcr |= (UInt64)1 << 24; // FZ
+    __asm__ __volatile__("msr fpcr, %0" : : "r"(fpcr));
+#endif
+}
+
+RTAudit::Scope::~Scope()
+{
+#if RT_AUDIT_SSE
+    _mm_setcsr(fpstate);
+#elif defined(__aarch64__)
+    const UInt64 fpcr = fpstate;
+    __asm__ __volatile__("msr fpcr, %0" : : "r"(fpcr));
+#endif
+    depth--;
+}
+
+bool RTAudit::InRealtime()
+{
+    return depth > 0;
+}
+
+void RTAudit::Report(Kind kind, void* site)
+{
+    // Open addressing on the call site, slots are claimed once and never released
+    size_t hash = ((size_t)site >> 2) * 2654435761u;
+    for (int n = 0; n < kMaxSites; n++)
+    {
+        Site& s = sites[(hash + n) & (kMaxSites - 1)];
+        void* address = s.address.load(std::memory_order_acquire);
+        if (address == NULL)
+        {
+            if (s.address.compare_exchange_strong(address, site, std::memory_order_acq_rel))
+            {
+                s.kind.store(kind, std::memory_order_relaxed);
+                address = site;
+            }
+        }
+        if (address == site)
+        {
+            s.count.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+int RTAudit::GetReport(char* buffer, int size)
+{
+    int numsites = 0;
+    int pos = 0;
+    if (size > 0)
+        buffer[0] = 0;
+    for (int n = 0; n < kMaxSites; n++)
+    {
+        void* address = sites[n].address.load(std::memory_order_acquire);
+        const UInt64 count = sites[n].count.load(std::memory_order_relaxed);
+        if (address == NULL || count == 0)
+            continue;
+
+        const char* symbol = "?";
+#if !UNITY_WIN
+        Dl_info info;
+        if (dladdr(address, &info) != 0 && info.dli_sname != NULL)
+            symbol = info.dli_sname;
+#endif
+        numsites++;
+        if (pos < size)
+        {
+            const int len = snprintf(buffer + pos, size - pos, "%s %llu %p %s\n",
+                    GetKindName((Kind)sites[n].kind.load(std::memory_order_relaxed)), (unsigned long long)count, address, symbol);
+            if (len > 0)
+                pos += len;
+        }
+    }
+    const UInt64 lost = dropped.load(std::memory_order_relaxed);
+    if (lost > 0 && pos < size)
+        snprintf(buffer + pos, size - pos, "dropped %llu\n", (unsigned long long)lost);
+    return numsites;
+}
+
+void RTAudit::Reset()
+{
+    for (int n = 0; n < kMaxSites; n++)
+        sites[n].count.store(0, std::memory_order_relaxed);
+    dropped.store(0, std::memory_order_relaxed);
+}
+
+const char* RTAudit::GetKindName(Kind kind)
+{
+    static const char* names[] = { "alloc", "free", "lock", "syscall" };
+    return (kind >= 0 && kind < Kind_Num) ? names[kind] : "?";
+}
+
+#if SOFA_RT_AUDIT_WRAP
+
+// The library is linked with --wrap for each of these, so every call made from its own code lands
+// here first and reaches the C library through the __real_ symbols
+extern "C"
+{
+    void* __real_malloc(size_t size);
+    void __real_free(void* ptr);
+    void* __real_calloc(size_t num, size_t size);
+    void* __real_realloc(void* ptr, size_t size);
+    int __real_pthread_mutex_lock(pthread_mutex_t* mutex);
+    int __real_pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex);
+    int __real_pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* abstime);
+    int __real_pthread_cond_signal(pthread_cond_t* cond);
+    int __real_pthread_cond_broadcast(pthread_cond_t* cond);
+    int __real_nanosleep(const struct timespec* req, struct timespec* rem);
+    int __real_usleep(useconds_t usec);
+    int __real_sched_yield();
+    ssize_t __real_read(int fd, void* buf, size_t count);
+    ssize_t __real_write(int fd, const void* buf, size_t count);
+    int __real_open(const char* path, int flags, ...);
+    int __real_close(int fd);
+    FILE* __real_fopen(const char* path, const char* mode);
+    int __real_fclose(FILE* file);
+
+    void* __wrap_malloc(size_t size) { RT_AUDIT_REPORT(RTAudit::Kind_Alloc); return __real_malloc(size); }
+    void __wrap_free(void* ptr) { if (ptr != NULL) RT_AUDIT_REPORT(RTAudit::Kind_Free); __real_free(ptr); }
+    void* __wrap_calloc(size_t num, size_t size) { RT_AUDIT_REPORT(RTAudit::Kind_Alloc); return __real_calloc(num, size); }
+    void* __wrap_realloc(void* ptr, size_t size) { RT_AUDIT_REPORT(RTAudit::Kind_Alloc); return __real_realloc(ptr, size); }
+
+    // Mangled operator new, new[], delete and delete[] on LP64
+    void* __wrap__Znwm(size_t size)
+    {
+        RT_AUDIT_REPORT(RTAudit::Kind_Alloc);
+        void* ptr = __real_malloc(size ? size : 1);
+        if (ptr == NULL)
+            throw std::bad_alloc();
+        return ptr;
+    }
+    void* __wrap__Znam(size_t size)
+    {
+        RT_AUDIT_REPORT(RTAudit::Kind_Alloc);
+        void* ptr = __real_malloc(size ? size : 1);
+        if (ptr == NULL)
+            throw std::bad_alloc();
+        return ptr;
+    }
+    void __wrap__ZdlPv(void* ptr) { if (ptr != NULL) RT_AUDIT_REPORT(RTAudit::Kind_Free); __real_free(ptr); }
+    void __wrap__ZdaPv(void* ptr) { if (ptr != NULL) RT_AUDIT_REPORT(RTAudit::Kind_Free); __real_free(ptr); }
+
+    int __wrap_pthread_mutex_lock(pthread_mutex_t* mutex) { RT_AUDIT_REPORT(RTAudit::Kind_Lock); return __real_pthread_mutex_lock(mutex); }
+    int __wrap_pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) { RT_AUDIT_REPORT(RTAudit::Kind_Lock); return __real_pthread_cond_wait(cond, mutex); }
+    int __wrap_pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* abstime) { RT_AUDIT_REPORT(RTAudit::Kind_Lock); return __real_pthread_cond_timedwait(cond, mutex, abstime); }
+    int __wrap_pthread_cond_signal(pthread_cond_t* cond) { RT_AUDIT_REPORT(RTAudit::Kind_Syscall); return __real_pthread_cond_signal(cond); }
+    int __wrap_pthread_cond_broadcast(pthread_cond_t* cond) { RT_AUDIT_REPORT(RTAudit::Kind_Syscall); return __real_pthread_cond_broadcast(cond); }
+
+    int __wrap_nanosleep(const struct timespec* req, struct timespec* rem) { RT_AUDIT_REPORT(RTAudit::Kind_Syscall); return __real_nanosleep(req, rem); }
+    int __wrap_usleep(useconds_t usec) { RT_AUDIT_REPORT(RTAudit::Kind_Syscall); return __real_usleep(usec); }
+    int __wrap_sched_yield() { RT_AUDIT_REPORT(RTAudit::Kind_Syscall); return __real_sched_yield(); }
+    ssize_t __wrap_read(int fd, void* buf, size_t count) { RT_AUDIT_REPORT(RTAudit::Kind_Syscall); return __real_read(fd, buf, count); }
+    ssize_t __wrap_write(int fd, const void* buf, size_t count) { RT_AUDIT_REPORT(RTAudit::Kind_Syscall); return __real_write(fd, buf, count); }
+    int __wrap_open(const char* path, int flags, ...)
+    {
+        RT_AUDIT_REPORT(RTAudit::Kind_Syscall);
+        int mode = 0;
+        if (flags & O_CREAT)
+        {
+            va_list args;
+            va_start(args, flags);
+            mode = va_arg(args, int);
+            va_end(args);
+        }
+        return __real_open(path, flags, mode);
+    }
+    int __wrap_close(int fd) { RT_AUDIT_REPORT(RTAudit::Kind_Syscall); return __real_close(fd); }
+    FILE* __wrap_fopen(const char* path, const char* mode) { RT_AUDIT_REPORT(RTAudit::Kind_Syscall); return __real_fopen(path, mode); }
+    int __wrap_fclose(FILE* file) { RT_AUDIT_REPORT(RTAudit::Kind_Syscall); return __real_fclose(file); }
+}
+
+#elif SOFA_RT_AUDIT
+
+// Without symbol wrapping only the C++ allocator can be replaced portably, locks are caught by Mutex::Lock
+void* operator new(size_t size)
+{
+    RT_AUDIT_REPORT(RTAudit::Kind_Alloc);
+    void* ptr = malloc(size ? size : 1);
+    if (ptr == NULL)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    RT_AUDIT_REPORT(RTAudit::Kind_Alloc);
+    void* ptr = malloc(size ? size : 1);
+    if (ptr == NULL)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    if (ptr != NULL)
+        RT_AUDIT_REPORT(RTAudit::Kind_Free);
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    if (ptr != NULL)
+        RT_AUDIT_REPORT(RTAudit::Kind_Free);
+    free(ptr);
+}
+
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+
+/// Real-time safety audit, compiled in with the SOFA_RT_AUDIT build option.
+/// Threads inside a Scope (the process callbacks of all plugins and the render pool tasks) are
+/// considered real-time. The build interposes the allocator, mutexes and a few blocking syscalls,
+/// and every call made from a real-time thread is counted per call site. GetReport lists the sites
+/// with their symbol names where the platform can resolve them.
+/// A Scope also enables flush-to-zero and denormals-are-zero, since decaying filter tails
+/// otherwise end up as denormals.
+class RTAudit
+{
+public:
+    enum Kind
+    {
+        Kind_Alloc,
+        Kind_Free,
+        Kind_Lock,
+        Kind_Syscall,
+        Kind_Num
+    };
+
+    class Scope
+    {
+    public:
+        Scope();
+        ~Scope();
+    private:
+        unsigned int fpstate;
+    };
+
+public:
+    static bool InRealtime();
+
+    // Counts a violation of the given kind at site, the return address of the offending call. Never allocates.
+    static void Report(Kind kind, void* site);
+
+    // Writes one line per site ("kind count site") into buffer, returns the number of sites. Not realtime safe.
+    static int GetReport(char* buffer, int size);
+    static void Reset();
+
+    static const char* GetKindName(Kind kind);
+};
+
+#if SOFA_RT_AUDIT
+#   define RT_AUDIT_SCOPE() RTAudit::Scope rt_audit_scope
+#   if defined(_MSC_VER)
+#       include <intrin.h>
+#       define RT_AUDIT_SITE() _ReturnAddress()
+#   else
+#       define RT_AUDIT_SITE() __builtin_return_address(0)
+#   endif
+#   define RT_AUDIT_REPORT(kind) do { if (RTAudit::InRealtime()) RTAudit::Report(kind, RT_AUDIT_SITE()); } while (0)
+#else
+#   define RT_AUDIT_SCOPE()
+#   define RT_AUDIT_REPORT(kind)
+#endif
@@ -0,0 +1,350 @@
+#include "RenderPool.h"
+#include "Epoch.h"
+#include "NAPTest.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#if UNITY_LINUX || UNITY_ANDROID
+#   include <sched.h>
+#endif
+
+namespace
+{
+    const int kMaxWorkers = 64;
+    const int kDequeCapacity = 1024; // Must be a power of two
+
+    // How long an idle worker keeps polling before it goes to sleep
+    const UInt64 kSpinTime = 200000;
+    // Sleeping workers look for new work this often, since submitting doesn't wake them
+    const int kSleepMicroseconds = 250;
+
+    void PinToCore(int core)
+    {
+        const unsigned numcores = std::thread::hardware_concurrency();
+        if (numcores == 0)
+            return;
+        core %= numcores;
+#if UNITY_WIN
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core);
+#elif UNITY_LINUX || UNITY_ANDROID
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+#else
+        // Thread affinity can't be set on this platform, the scheduler decides
+        (void)core;
+#endif
+    }
+}
+
+// A bounded deque of task pointers. The owning worker pushes and pops at the back,
+// thieves and the mixer thread take from the front. Critical sections are a handful of instructions.
+struct RenderPool::Worker
+{
+    SpinLock lock;
+    int head;
+    int tail;
+    Task* tasks[kDequeCapacity];
+    std::thread thread;
+    char pad[64];
+
+    Worker() : head(0), tail(0) {}
+
+    bool PushBack(Task* task)
+    {
+        lock.Lock();
+        bool ok = (tail - head) < kDequeCapacity;
+        if (ok)
+            tasks[(tail++) & (kDequeCapacity - 1)] = task;
+        lock.Unlock();
+        return ok;
+    }
+
+    Task* PopBack()
+    {
+        lock.Lock();
+        Task* task = (tail != head) ? tasks[(--tail) & (kDequeCapacity - 1)] : NULL;
+        lock.Unlock();
+        return task;
+    }
+
+    Task* StealFront()
+    {
+        lock.Lock();
+        Task* task = (tail != head) ? tasks[(head++) & (kDequeCapacity - 1)] : NULL;
+        lock.Unlock();
+        return task;
+    }
+
+    void Remove(Task* task)
+    {
+        lock.Lock();
+        for (int n = head; n != tail; n++)
+            if (tasks[n & (kDequeCapacity - 1)] == task)
+                tasks[n & (kDequeCapacity - 1)] = NULL;
+        lock.Unlock();
+    }
+};
+
+static void DeleteWorkers(void* ptr)
+{
+    delete[] (RenderPool::Worker*)ptr;
+}
+
+static std::mutex sleep_mutex;
+static std::condition_variable sleep_cond;
+static std::atomic<bool> stopping(false);
+
+RenderPool& RenderPool::Instance()
+{
+    static RenderPool pool;
+    return pool;
+}
+
+RenderPool::RenderPool()
+    : workers((Worker*)NULL)
+    , numworkers(0)
+    , next_worker(0)
+    , queued(0)
+    , avg_task_time(0)
+    , num_submitted(0)
+    , num_inline(0)
+    , num_overruns(0)
+{
+}
+
+RenderPool::~RenderPool()
+{
+    Stop();
+}
+
+UInt64 RenderPool::GetTime()
+{
+    return (UInt64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void RenderPool::Start(int numthreads)
+{
+    MutexScopeLock lock(control);
+    Stop();
+
+    if (numthreads <= 0)
+        return;
+    if (numthreads > kMaxWorkers)
+        numthreads = kMaxWorkers;
+
+    stopping.store(false);
+    Worker* w = new Worker[numthreads];
+    workers.store(w, std::memory_order_release);
+    for (int n = 0; n < numthreads; n++)
+        w[n].thread = std::thread(&RenderPool::WorkerLoop, this, n);
+    numworkers.store(numthreads, std::memory_order_release);
+}
+
+void RenderPool::Stop()
+{
+    MutexScopeLock lock(control);
+    const int num = numworkers.exchange(0, std::memory_order_acq_rel);
+    Worker* w = workers.load(std::memory_order_acquire);
+    if (w == NULL)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(sleep_mutex);
+        stopping.store(true);
+    }
+    sleep_cond.notify_all();
+    for (int n = 0; n < num; n++)
+        w[n].thread.join();
+
+    // Anything still queued is claimed back by its owner on the next Join.
+    // A Submit racing with this may still touch the deques, so they are retired instead of deleted.
+    workers.store(NULL, std::memory_order_release);
+    Epoch::Retire(w, &DeleteWorkers);
+    Epoch::Reclaim();
+    queued.store(0);
+}
+
+void RenderPool::Purge(Task& task)
+{
+    // Called before a task is freed, so that no worker dereferences a stale entry afterwards
+    MutexScopeLock lock(control);
+    const int num = numworkers.load(std::memory_order_acquire);
+    Worker* w = workers.load(std::memory_order_acquire);
+    for (int n = 0; n < num; n++)
+        w[n].Remove(&task);
+}
+
+bool RenderPool::Submit(Task& task, UInt64 deadline)
+{
+    Epoch::Scope epoch;
+    const int num = numworkers.load(std::memory_order_acquire);
+    Worker* w = workers.load(std::memory_order_acquire);
+    if (num == 0 || w == NULL)
+        return false;
+
+    // Estimate when the task would be done if it gets queued behind the current backlog
+    const UInt64 now = GetTime();
+    const UInt64 backlog = (UInt64)(queued.load(std::memory_order_relaxed) / num + 1) * avg_task_time.load(std::memory_order_relaxed);
+    if (now + backlog > deadline)
+    {
+        num_inline.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    task.state.store(Task_Queued, std::memory_order_release);
+    const int target = next_worker.fetch_add(1, std::memory_order_relaxed) % num;
+    if (!w[target].PushBack(&task))
+    {
+        task.state.store(Task_Idle, std::memory_order_relaxed);
+        num_inline.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    queued.fetch_add(1, std::memory_order_relaxed);
+    num_submitted.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool RenderPool::Join(Task& task, UInt64 deadline)
+{
+    int state = task.state.load(std::memory_order_acquire);
+    if (state == Task_Queued)
+    {
+        // Not picked up yet, so don't wait for a worker but process it here
+        if (Execute(task))
+        {
+            num_inline.fetch_add(1, std::memory_order_relaxed);
+            queued.fetch_sub(1, std::memory_order_relaxed);
+        }
+        state = task.state.load(std::memory_order_acquire);
+    }
+
+    while (state != Task_Done && state != Task_Idle)
+    {
+        if (deadline != NO_DEADLINE && GetTime() > deadline)
+        {
+            // Spinning on would only take the time of the rest of the block, the worker still owns the task
+            num_overruns.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        CPU_RELAX();
+        state = task.state.load(std::memory_order_acquire);
+    }
+
+    task.state.store(Task_Idle, std::memory_order_relaxed);
+    return true;
+}
+
+void RenderPool::GetStats(Stats& stats) const
+{
+    stats.submitted = num_submitted.load(std::memory_order_relaxed);
+    stats.inline_runs = num_inline.load(std::memory_order_relaxed);
+    stats.overruns = num_overruns.load(std::memory_order_relaxed);
+}
+
+bool RenderPool::Execute(Task& task)
+{
+    // Whoever wins this exchange runs the task, stale deque entries lose it
+    int expected = Task_Queued;
+    if (!task.state.compare_exchange_strong(expected, Task_Running, std::memory_order_acq_rel))
+        return false;
+
+    const UInt64 start = GetTime();
+    task.func(task.arg);
+    const UInt64 duration = GetTime() - start;
+
+    // Running average over roughly the last 16 tasks used for the deadline estimation
+    const UInt64 avg = avg_task_time.load(std::memory_order_relaxed);
+    avg_task_time.store(avg - avg / 16 + duration / 16, std::memory_order_relaxed);
+
+    task.state.store(Task_Done, std::memory_order_release);
+    return true;
+}
+
+void RenderPool::WorkerLoop(int index)
+{
+    // Leave the first core to the mixer thread
+    PinToCore(index + 1);
+
+    Worker* w = workers.load(std::memory_order_acquire);
+    Worker& self = w[index];
+    UInt64 idle_since = GetTime();
+    unsigned victim = (unsigned)index;
+    while (!stopping.load(std::memory_order_acquire))
+    {
+        Task* task = self.PopBack();
+        const int num = numworkers.load(std::memory_order_acquire);
+        for (int n = 1; task == NULL && n < num; n++)
+            task = w[(++victim) % num].StealFront();
+
+        if (task != NULL)
+        {
+            if (Execute(*task))
+                queued.fetch_sub(1, std::memory_order_relaxed);
+            idle_since = GetTime();
+            continue;
+        }
+
+        if (GetTime() - idle_since < kSpinTime)
+        {
+            CPU_RELAX();
+            continue;
+        }
+
+        // Nothing to do for a while, sleep until the next poll or until the pool is stopped
+        std::unique_lock<std::mutex> guard(sleep_mutex);
+        if (!stopping.load(std::memory_order_acquire))
+            sleep_cond.wait_for(guard, std::chrono::microseconds(kSleepMicroseconds));
+    }
+}
+
+// Only built into the SofaTests runner: the plugin runs its tests while it is loaded, where joining a worker
+// thread would deadlock on the loader lock of Windows
+#if NAP_TEST_RUNNER
+NAP_TESTSUITE(RenderPool)
+{
+    // Spins for the number of nanoseconds in arg
+    static void Spin(void* arg)
+    {
+        const UInt64 end = RenderPool::GetTime() + *(UInt64*)arg;
+        while (RenderPool::GetTime() < end)
+            CPU_RELAX();
+    }
+
+    NAP_UNITTEST(JoinGivesUpAtDeadline)
+    {
+        RenderPool& pool = RenderPool::Instance();
+        pool.Start(1);
+        UInt64 duration = 20000000;
+        RenderPool::Task task;
+        task.func = Spin;
+        task.arg = &duration;
+        NAP_CHECK(pool.Submit(task, RenderPool::NO_DEADLINE));
+
+        // Wait for the worker to pick it up, a task still queued would be run by the join itself
+        const UInt64 start = RenderPool::GetTime();
+        while (task.state.load() == RenderPool::Task_Queued && RenderPool::GetTime() - start < duration / 2)
+            CPU_RELAX();
+        bool ok = true;
+        if (task.state.load() == RenderPool::Task_Running)
+        {
+            RenderPool::Stats before, after;
+            pool.GetStats(before);
+            const UInt64 now = RenderPool::GetTime();
+            ok = ok && !pool.Join(task, now + 1000000);
+            ok = ok && RenderPool::GetTime() - now < duration / 2;
+            pool.GetStats(after);
+            ok = ok && after.overruns == before.overruns + 1;
+        }
+        NAP_CHECK(ok);
+        NAP_CHECK(pool.Join(task, RenderPool::NO_DEADLINE));
+        NAP_CHECK(task.state.load() == RenderPool::Task_Idle);
+        pool.Stop();
+    }
+}
+#endif
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+
+#include <atomic>
+
+/// Optional pool of worker threads that render blocks of audio in parallel.
+/// Every worker is pinned to its own core and owns a deque of tasks. Workers take work from the back
+/// of their own deque and steal from the front of the others when they run dry, so a burst of
+/// submissions from the mixer thread is balanced across all cores.
+/// A task that hasn't been picked up by the time it is joined is claimed back and run synchronously
+/// on the joining thread, so joining never waits on an idle queue. A running task is waited for until
+/// the deadline of the join at most. Submitting never wakes a worker from the audio thread, idle
+/// workers poll their deques with a short timed wait instead.
+class RenderPool
+{
+public:
+    enum TaskState
+    {
+        Task_Idle,
+        Task_Queued,
+        Task_Running,
+        Task_Done
+    };
+
+    struct Task
+    {
+        void (*func)(void* arg);
+        void* arg;
+        std::atomic<int> state;
+
+        Task() : func(NULL), arg(NULL), state(Task_Idle) {}
+    };
+
+    struct Stats
+    {
+        UInt64 submitted;   // Tasks handed to the workers
+        UInt64 inline_runs; // Tasks run synchronously because they would have missed their deadline
+        UInt64 overruns;    // Joins that gave up on a task still running at their deadline
+    };
+
+    // Deadline of joins that have to wait for the task no matter how long it takes, not realtime safe
+    static const UInt64 NO_DEADLINE = ~(UInt64)0;
+
+public:
+    static RenderPool& Instance();
+
+public:
+    void Start(int numthreads);
+    void Stop();
+    void Purge(Task& task);
+    inline bool IsRunning() const { return numworkers.load(std::memory_order_acquire) > 0; }
+
+    // Queues the task unless the current backlog suggests it can't be finished before the deadline.
+    // Returns false if the task was not queued, in which case the caller has to process it synchronously.
+    bool Submit(Task& task, UInt64 deadline);
+
+    // Returns true once the task is done. Tasks that haven't started yet are run on the calling thread.
+    // Returns false if the task is still running at the deadline: it finishes in the background and has
+    // to be joined again before its data is touched or it is submitted anew.
+    bool Join(Task& task, UInt64 deadline);
+
+    void GetStats(Stats& stats) const;
+
+public:
+    static UInt64 GetTime(); // Monotonic time in nanoseconds
+
+private:
+    RenderPool();
+    ~RenderPool();
+
+    void WorkerLoop(int index);
+    bool Execute(Task& task);
+
+public:
+    struct Worker;
+
+private:
+    std::atomic<Worker*> workers;
+    std::atomic<int> numworkers;
+    std::atomic<int> next_worker;
+    std::atomic<int> queued;
+    std::atomic<UInt64> avg_task_time;
+    std::atomic<UInt64> num_submitted;
+    std::atomic<UInt64> num_inline;
+    std::atomic<UInt64> num_overruns;
+    Mutex control;
+};
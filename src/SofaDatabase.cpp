@@ -0,0 +1,649 @@
+#include "SofaDatabase.h"
+#include "EarlyReflections.h"
+#include "Epoch.h"
+#include "LateTailBus.h"
+#include "NAPTest.h"
+#include "Telemetry.h"
+
+#include <algorithm>
+#include <vector>
+
+/////////////////////////////////////////
+/// SofaDatabase
+///////////////////////////////////////
+
+const float SofaDatabase::SPREAD_WIDTHS[SofaDatabase::NUM_SPREADS] = { 90.0f, 180.0f, 360.0f };
+
+SofaDatabase::SofaDatabase()
+    : hrtf(NULL)
+    , lookup(NULL)
+    , neighborhood(NULL)
+    , ir_len(0)
+    , late_offset(0)
+    , late_len(0)
+    , num_spreads(0)
+{
+    memset(&storage_err, 0, sizeof(storage_err));
+}
+
+SofaDatabase::~SofaDatabase()
+{
+    if (neighborhood != NULL)
+        mysofa_neighborhood_free(neighborhood);
+    if (lookup != NULL)
+        mysofa_lookup_free(lookup);
+    if (hrtf != NULL)
+        mysofa_free(hrtf);
+}
+
+SofaDatabase* SofaDatabase::Load(const char* filename, HRIRStorage::Format format, int* err, float mixingtime)
+{
+    MYSOFA_HRTF* hrtf = mysofa_load(filename, err);
+    if (*err != MYSOFA_OK)
+        return NULL;
+
+    return Create(hrtf, format, err, mixingtime);
+}
+
+SofaDatabase* SofaDatabase::Create(MYSOFA_HRTF* hrtf, HRIRStorage::Format format, int* err, float mixingtime)
+{
+    *err = MYSOFA_OK;
+    SofaDatabase* database = new SofaDatabase();
+    database->hrtf = hrtf;
+
+    // Convert to cartesian, initialize the look up
+    mysofa_tocartesian(hrtf);
+    database->lookup = mysofa_lookup_init(hrtf);
+    if (database->lookup == NULL)
+    {
+        *err = MYSOFA_INTERNAL_ERROR;
+        delete database;
+        return NULL;
+    }
+    database->neighborhood = mysofa_neighborhood_init(hrtf, database->lookup);
+
+    // resample if samplerates doesent match (Warning: long coputationtime!)
+    //if (samplerate != hrtf->DataSamplingRate.values[0]) { mysofa_resample(hrtf, (float)samplerate); }
+
+    /// TODO: perfomance can be improved by precomputing hrtfs into the frequency domain
+    /// and let the convolver be initializable with them
+
+    // Rooms are split at the mixing time, so sources only convolve their early part
+    const float* irs = hrtf->DataIR.values;
+    database->ir_len = hrtf->N;
+    std::vector<float> early;
+    const float samplerate = (hrtf->DataSamplingRate.elements > 0) ? hrtf->DataSamplingRate.values[0] : 0.0f;
+    const int mixing = (int)(mixingtime * samplerate + 0.5f);
+    if (mixing > 0 && mixing < (int)hrtf->N)
+    {
+        database->SplitLateTail(irs, mixing, format, early);
+        irs = &early[0];
+    }
+
+    // Keep the filters in the configured format and report the error against the float reference
+    database->storage.Init(format, irs, hrtf->M * hrtf->R, database->ir_len);
+    database->storage.MeasureError(irs, database->storage_err);
+    if (database->ir_len <= MAX_SPREAD_IR_LEN)
+        database->BuildSpreadFilters(irs, format);
+
+    // The storage holds its own copy even in the float format, so DataIR would only keep every filter twice.
+    // It is allocated by libmysofa with malloc.
+    free(hrtf->DataIR.values);
+    hrtf->DataIR.values = NULL;
+    hrtf->DataIR.elements = 0;
+
+    return database;
+}
+
+int SofaDatabase::Lookup(const float* dir) const
+{
+    // mysofa_lookup may normalize the coordinate in place
+    float coordinate[3] = { dir[0], dir[1], dir[2] };
+    return mysofa_lookup(lookup, coordinate);
+}
+
+void SofaDatabase::DecodeFilters(int measurement, float* left, float* right) const
+{
+    // DataIR is laid out as measurements x receivers x samples
+    const int filter = measurement * hrtf->R;
+    storage.Decode(filter, left);
+    storage.Decode(filter + (hrtf->R > 1 ? 1 : 0), right);
+}
+
+int SofaDatabase::InterpolateFilters(const float* dir, float* left, float* right, float* scratch) const
+{
+    const int nearest = Lookup(dir);
+
+    int candidates[7];
+    int numcandidates = 0;
+    candidates[numcandidates++] = nearest;
+    if (neighborhood != NULL)
+    {
+        const int* neighbors = mysofa_neighborhood(neighborhood, nearest);
+        for (int n = 0; n < 6; n++)
+            if (neighbors[n] >= 0)
+                candidates[numcandidates++] = neighbors[n];
+    }
+
+    // Compare directions only, the measurements may have been taken at several distances
+    const float dirlen = sqrtf(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+    if (dirlen <= 0.0f)
+    {
+        DecodeFilters(nearest, left, right);
+        return nearest;
+    }
+
+    float weights[7];
+    float weightsum = 0.0f;
+    for (int n = 0; n < numcandidates; n++)
+    {
+        const float* pos = &hrtf->SourcePosition.values[candidates[n] * hrtf->C];
+        const float poslen = sqrtf(pos[0] * pos[0] + pos[1] * pos[1] + pos[2] * pos[2]);
+        float dist = 0.0f;
+        for (int c = 0; c < 3; c++)
+        {
+            const float d = dir[c] / dirlen - ((poslen > 0.0f) ? pos[c] / poslen : 0.0f);
+            dist += d * d;
+        }
+        dist = sqrtf(dist);
+        if (dist < 1.0e-6f)
+        {
+            DecodeFilters(candidates[n], left, right);
+            return nearest;
+        }
+        weights[n] = 1.0f / dist;
+        weightsum += weights[n];
+    }
+
+    memset(left, 0, sizeof(float) * ir_len);
+    memset(right, 0, sizeof(float) * ir_len);
+    for (int n = 0; n < numcandidates; n++)
+    {
+        const float weight = weights[n] / weightsum;
+        DecodeFilters(candidates[n], scratch, scratch + ir_len);
+        for (int i = 0; i < ir_len; i++)
+        {
+            left[i] += weight * scratch[i];
+            right[i] += weight * scratch[ir_len + i];
+        }
+    }
+    return nearest;
+}
+
+void SofaDatabase::BuildSpreadFilters(const float* irs, HRIRStorage::Format format)
+{
+    const int M = (int)hrtf->M, R = (int)hrtf->R, N = ir_len;
+    const int filtersize = R * N;
+    if (M < 2 || hrtf->SourcePosition.values == NULL)
+        return;
+
+    // Directions and energies (of all receivers) of the measurements
+    std::vector<float> dirs(3 * M);
+    std::vector<float> energies(M);
+    for (int m = 0; m < M; m++)
+    {
+        const float* pos = &hrtf->SourcePosition.values[m * hrtf->C];
+        const float len = sqrtf(pos[0] * pos[0] + pos[1] * pos[1] + pos[2] * pos[2]);
+        for (int c = 0; c < 3; c++)
+            dirs[3 * m + c] = (len > 0.0f) ? pos[c] / len : 0.0f;
+        float energy = 0.0f;
+        for (int i = 0; i < filtersize; i++)
+            energy += irs[m * filtersize + i] * irs[m * filtersize + i];
+        energies[m] = energy;
+    }
+
+    float mincos[NUM_SPREADS];
+    for (int w = 0; w < NUM_SPREADS; w++)
+        mincos[w] = cosf(0.5f * SPREAD_WIDTHS[w] * kPI / 180.0f) - 1.0e-6f;
+
+    // The widest cap is the full sphere, whose average is the same for every measurement
+    std::vector<float> sphere(filtersize, 0.0f);
+    float sphereenergy = 0.0f;
+    for (int m = 0; m < M; m++)
+    {
+        for (int i = 0; i < filtersize; i++)
+            sphere[i] += irs[m * filtersize + i];
+        sphereenergy += energies[m];
+    }
+
+    // The caps are nested, every measurement is added to the narrowest cap containing it and the
+    // sums of the wider caps are completed from the narrower ones
+    const int numcaps = NUM_SPREADS - 1;
+    std::vector<float> sums(NUM_SPREADS * filtersize);
+    std::vector<float> filters((size_t)NUM_SPREADS * M * filtersize);
+    for (int m = 0; m < M; m++)
+    {
+        std::fill(sums.begin(), sums.end(), 0.0f);
+        int counts[NUM_SPREADS] = { 0 };
+        float energysums[NUM_SPREADS] = { 0.0f };
+        const float* a = &dirs[3 * m];
+        for (int n = 0; n < M; n++)
+        {
+            const float* b = &dirs[3 * n];
+            const float cosangle = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+            int w = 0;
+            while (w < numcaps && cosangle < mincos[w])
+                w++;
+            if (w == numcaps)
+                continue;
+            const float* ir = &irs[n * filtersize];
+            float* sum = &sums[w * filtersize];
+            for (int i = 0; i < filtersize; i++)
+                sum[i] += ir[i];
+            counts[w]++;
+            energysums[w] += energies[n];
+        }
+        memcpy(&sums[numcaps * filtersize], &sphere[0], sizeof(float) * filtersize);
+        counts[numcaps] = M;
+        energysums[numcaps] = sphereenergy;
+
+        for (int w = 0; w < NUM_SPREADS; w++)
+        {
+            float* sum = &sums[w * filtersize];
+            if (w > 0 && w < numcaps)
+            {
+                const float* narrower = &sums[(w - 1) * filtersize];
+                for (int i = 0; i < filtersize; i++)
+                    sum[i] += narrower[i];
+                counts[w] += counts[w - 1];
+                energysums[w] += energysums[w - 1];
+            }
+
+            // The average of partly incoherent filters is quieter, keep the mean energy of the members
+            float energy = 0.0f;
+            for (int i = 0; i < filtersize; i++)
+                energy += sum[i] * sum[i];
+            const float scale = (energy > 0.0f && counts[w] > 0) ? sqrtf(energysums[w] / (float)counts[w] / energy) : 0.0f;
+            float* filter = &filters[((size_t)w * M + m) * filtersize];
+            for (int i = 0; i < filtersize; i++)
+                filter[i] = sum[i] * scale;
+        }
+    }
+
+    for (int w = 0; w < NUM_SPREADS; w++)
+        spreads[w].Init(format, &filters[(size_t)w * M * filtersize], M * R, N);
+    num_spreads = NUM_SPREADS;
+}
+
+void SofaDatabase::SplitLateTail(const float* irs, int mixing, HRIRStorage::Format format, std::vector<float>& early)
+{
+    const int M = (int)hrtf->M, R = (int)hrtf->R, N = (int)hrtf->N;
+    const int fade = std::min((int)LATE_FADE_LEN, mixing / 2);
+    const int offset = mixing - fade;
+    const int taillen = N - offset;
+
+    // Equal power, the early parts and the averaged tail are only partly coherent
+    std::vector<float> fadein(fade);
+    for (int i = 0; i < fade; i++)
+        fadein[i] = sinf(0.5f * kPI * ((float)i + 0.5f) / (float)fade);
+
+    // Sum the tails and their energies per segment, the first receiver is the left ear and the second one
+    // the right ear as in DecodeFilters
+    const int numears = (R > 1) ? 2 : 1;
+    const int numsegments = (taillen + LATE_SEGMENT_LEN - 1) / LATE_SEGMENT_LEN;
+    std::vector<float> tails(2 * taillen, 0.0f);
+    std::vector<float> energies(2 * numsegments, 0.0f);
+    early.resize((size_t)M * R * mixing);
+    for (int m = 0; m < M; m++)
+    {
+        for (int r = 0; r < R; r++)
+        {
+            const float* ir = &irs[((size_t)m * R + r) * N];
+            float* dst = &early[((size_t)m * R + r) * mixing];
+            memcpy(dst, ir, sizeof(float) * offset);
+            for (int i = 0; i < fade; i++)
+                dst[offset + i] = ir[offset + i] * fadein[fade - 1 - i];
+            if (r >= numears)
+                continue;
+
+            float* tail = &tails[r * taillen];
+            float* energy = &energies[r * numsegments];
+            for (int i = 0; i < taillen; i++)
+            {
+                tail[i] += ir[offset + i];
+                energy[i / LATE_SEGMENT_LEN] += ir[offset + i] * ir[offset + i];
+            }
+        }
+    }
+
+    // The average of decorrelated tails is quieter. Restore the mean energy per segment, so the decay
+    // keeps its shape, and interpolate the gains between the segment centers.
+    std::vector<float> gains(numsegments);
+    for (int e = 0; e < numears; e++)
+    {
+        float* tail = &tails[e * taillen];
+        for (int s = 0; s < numsegments; s++)
+        {
+            const int end = std::min((s + 1) * LATE_SEGMENT_LEN, taillen);
+            float energy = 0.0f;
+            for (int i = s * LATE_SEGMENT_LEN; i < end; i++)
+                energy += tail[i] * tail[i];
+            gains[s] = (energy > 0.0f) ? sqrtf(energies[e * numsegments + s] / (float)M / energy) : 0.0f;
+        }
+        for (int i = 0; i < taillen; i++)
+        {
+            const float position = std::max(((float)i + 0.5f) / (float)LATE_SEGMENT_LEN - 0.5f, 0.0f);
+            const int s = std::min((int)position, numsegments - 1);
+            const float gain = (s + 1 < numsegments) ? gains[s] + (gains[s + 1] - gains[s]) * (position - (float)s) : gains[s];
+            tail[i] *= (i < fade) ? gain * fadein[i] : gain;
+        }
+    }
+    if (numears == 1)
+        memcpy(&tails[taillen], &tails[0], sizeof(float) * taillen);
+
+    late.Init(format, &tails[0], 2, taillen);
+    late_offset = offset;
+    late_len = taillen;
+    ir_len = mixing;
+}
+
+void SofaDatabase::DecodeLateTail(float* left, float* right) const
+{
+    late.Decode(0, left);
+    late.Decode(1, right);
+}
+
+void SofaDatabase::DecodeSpreadFilters(int measurement, float spread, float* left, float* right, float* scratch) const
+{
+    if (num_spreads == 0 || spread <= 0.0f)
+    {
+        DecodeFilters(measurement, left, right);
+        return;
+    }
+
+    // Point filters count as width 0
+    int upper = 0;
+    while (upper < num_spreads - 1 && SPREAD_WIDTHS[upper] < spread)
+        upper++;
+    const float lowerwidth = (upper > 0) ? SPREAD_WIDTHS[upper - 1] : 0.0f;
+    float t = (spread - lowerwidth) / (SPREAD_WIDTHS[upper] - lowerwidth);
+    if (t > 1.0f)
+        t = 1.0f;
+
+    const int filter = measurement * hrtf->R;
+    const int second = (hrtf->R > 1) ? 1 : 0;
+    spreads[upper].Decode(filter, left);
+    spreads[upper].Decode(filter + second, right);
+    if (t >= 1.0f)
+        return;
+
+    if (upper > 0)
+    {
+        spreads[upper - 1].Decode(filter, scratch);
+        spreads[upper - 1].Decode(filter + second, scratch + ir_len);
+    }
+    else
+        DecodeFilters(measurement, scratch, scratch + ir_len);
+    for (int i = 0; i < ir_len; i++)
+    {
+        left[i] = scratch[i] + (left[i] - scratch[i]) * t;
+        right[i] = scratch[ir_len + i] + (right[i] - scratch[ir_len + i]) * t;
+    }
+}
+
+size_t SofaDatabase::GetMemorySize() const
+{
+    size_t size = sizeof(SofaDatabase) + storage.GetMemorySize() + late.GetMemorySize();
+    for (int w = 0; w < num_spreads; w++)
+        size += spreads[w].GetMemorySize();
+    const MYSOFA_ARRAY* arrays[] =
+    {
+        &hrtf->ListenerPosition, &hrtf->ReceiverPosition, &hrtf->SourcePosition, &hrtf->EmitterPosition,
+        &hrtf->ListenerUp, &hrtf->ListenerView, &hrtf->DataIR, &hrtf->DataSamplingRate, &hrtf->DataDelay
+    };
+    for (size_t n = 0; n < sizeof(arrays) / sizeof(arrays[0]); n++)
+        size += sizeof(float) * arrays[n]->elements;
+    if (neighborhood != NULL)
+        size += sizeof(int) * 6 * (size_t)neighborhood->elements;
+    return size;
+}
+
+/////////////////////////////////////////
+/// SofaContainer
+///////////////////////////////////////
+
+SofaContainer& SofaContainer::Instance()
+{
+    static SofaContainer container;
+    return container;
+}
+
+SofaContainer::SofaContainer()
+    : storage_format(HRIRStorage::Format_Float)
+    , mixing_time(0.0f)
+    , is_initialized(false)
+{
+    for (int i = 0; i < MAX_SOFA_FILES; ++i)
+    {
+        databases[i].store(NULL);
+        generations[i].store(0);
+        errs[i] = MYSOFA_READ_ERROR;
+    }
+    memset(dirs, 0, sizeof(dirs));
+}
+
+SofaContainer::~SofaContainer()
+{
+    // The library is being unloaded, so there are no audio threads left that could read the slots
+    for (int i = 0; i < MAX_SOFA_FILES; ++i)
+        delete databases[i].exchange(NULL);
+    Epoch::Reclaim();
+}
+
+void SofaContainer::Init(unsigned samplerate)
+{
+    MutexScopeLock lock(mutex);
+    if (is_initialized)
+        return;
+
+    // load sofa files
+    for (int i = 0; i < MAX_SOFA_FILES; ++i)
+        Reload(i);
+
+    is_initialized = true;
+}
+
+int SofaContainer::Load(int index, const char* filename)
+{
+    if (index < 0 || index >= MAX_SOFA_FILES)
+        return MYSOFA_INVALID_FORMAT;
+
+    MutexScopeLock lock(mutex);
+
+    // Loading happens outside of any epoch, audio threads keep rendering the old database meanwhile
+    int err;
+    SofaDatabase* database = SofaDatabase::Load(filename, storage_format, &err, mixing_time);
+    return Install(index, database, err);
+}
+
+int SofaContainer::Insert(int index, MYSOFA_HRTF* hrtf)
+{
+    if (index < 0 || index >= MAX_SOFA_FILES)
+    {
+        mysofa_free(hrtf);
+        return MYSOFA_INVALID_FORMAT;
+    }
+
+    MutexScopeLock lock(mutex);
+
+    int err;
+    SofaDatabase* database = SofaDatabase::Create(hrtf, storage_format, &err, mixing_time);
+    return Install(index, database, err);
+}
+
+int SofaContainer::Install(int index, SofaDatabase* database, int err)
+{
+    if (database == NULL)
+    {
+        // Keep the previous database of the slot alive if the new one can't be used
+        if (Acquire(index) == NULL)
+            errs[index] = err;
+        Telemetry::Instance().Post(Telemetry::Event_LoadComplete, index, err);
+        return err;
+    }
+
+    errs[index] = MYSOFA_OK;
+    Publish(index, database);
+    // The database stays alive until it gets replaced by the next load, which is serialized with this one
+    LateTailBus::Instance().Prepare(index, database);
+    ReflectionBus::Instance().Prepare(index, database);
+    Telemetry::Instance().Post(Telemetry::Event_LoadComplete, index, MYSOFA_OK);
+    return MYSOFA_OK;
+}
+
+int SofaContainer::Reload(int index)
+{
+    char filename[50];
+    snprintf(filename, sizeof(filename), "Assets/Sofa/hrtf%d.sofa", index);
+    return Load(index, filename);
+}
+
+void SofaContainer::Publish(int index, SofaDatabase* database)
+{
+    SofaDatabase* old = databases[index].exchange(database, std::memory_order_acq_rel);
+    generations[index].fetch_add(1, std::memory_order_release);
+    Epoch::Retire(old);
+    Epoch::Reclaim();
+}
+
+NAP_TESTSUITE(SofaDatabase)
+{
+    static float* AllocArray(MYSOFA_ARRAY& array, unsigned int elements)
+    {
+        array.values = (float*)calloc(elements, sizeof(float));
+        array.elements = elements;
+        array.attributes = NULL;
+        return array.values;
+    }
+
+    NAP_UNITTEST(SpreadFilters)
+    {
+        // Six measurements on the axes, so the 90 degree cap holds only the measurement itself,
+        // the 180 degree cap adds the four orthogonal ones and the full sphere all six
+        const int M = 6, R = 2, N = 32;
+        MYSOFA_HRTF* hrtf = (MYSOFA_HRTF*)calloc(1, sizeof(MYSOFA_HRTF));
+        hrtf->I = 1;
+        hrtf->C = 3;
+        hrtf->R = R;
+        hrtf->E = 1;
+        hrtf->N = N;
+        hrtf->M = M;
+        AllocArray(hrtf->ListenerPosition, 3);
+        AllocArray(hrtf->ReceiverPosition, R * 3);
+        AllocArray(hrtf->EmitterPosition, 3);
+        AllocArray(hrtf->ListenerUp, 3)[2] = 1.0f;
+        AllocArray(hrtf->ListenerView, 3)[0] = 1.0f;
+        AllocArray(hrtf->DataSamplingRate, 1)[0] = 48000.0f;
+        AllocArray(hrtf->DataDelay, R);
+        float* positions = AllocArray(hrtf->SourcePosition, M * 3);
+        float* irs = AllocArray(hrtf->DataIR, M * R * N);
+        for (int m = 0; m < M; m++)
+        {
+            positions[m * 3 + m / 2] = (m & 1) ? -1.0f : 1.0f;
+            // A different impulse per measurement and ear, so the filters are orthogonal
+            irs[(m * R + 0) * N + m] = 1.0f;
+            irs[(m * R + 1) * N + m + 8] = 0.5f;
+        }
+        float reference[M * R * N];
+        memcpy(reference, irs, sizeof(reference));
+
+        int err;
+        SofaDatabase* database = SofaDatabase::Create(hrtf, HRIRStorage::Format_Float, &err);
+        NAP_CHECK(database != NULL && database->HasSpreadFilters());
+        if (database == NULL)
+            return;
+
+        float left[N], right[N], scratch[2 * N];
+        bool ok = true;
+        for (int m = 0; m < M; m++)
+        {
+            // Within the first width the filters equal the point filters
+            database->DecodeSpreadFilters(m, 45.0f, left, right, scratch);
+            for (int n = 0; n < N; n++)
+                ok = ok && left[n] == reference[(m * R + 0) * N + n] && right[n] == reference[(m * R + 1) * N + n];
+
+            // Five orthogonal filters of equal energy are scaled by sqrt(1/5) to keep the energy
+            database->DecodeSpreadFilters(m, 180.0f, left, right, scratch);
+            const int opposite = m ^ 1;
+            float energy = 0.0f;
+            for (int n = 0; n < N; n++)
+                energy += left[n] * left[n] + right[n] * right[n];
+            ok = ok && fabsf(energy - 1.25f) < 1.0e-5f;
+            ok = ok && left[opposite] == 0.0f && fabsf(left[m] - 1.0f / sqrtf(5.0f)) < 1.0e-6f;
+
+            // The full sphere is the same everywhere
+            database->DecodeSpreadFilters(m, 360.0f, left, right, scratch);
+            for (int n = 0; n < M; n++)
+                ok = ok && fabsf(left[n] - 1.0f / sqrtf(6.0f)) < 1.0e-6f;
+        }
+        NAP_CHECK(ok);
+
+        // Halfway between two widths blends halfway
+        database->DecodeSpreadFilters(0, 270.0f, left, right, scratch);
+        NAP_CHECK(fabsf(left[1] - 0.5f / sqrtf(6.0f)) < 1.0e-6f);
+        NAP_CHECK(fabsf(left[0] - 0.5f * (1.0f / sqrtf(5.0f) + 1.0f / sqrtf(6.0f))) < 1.0e-6f);
+
+        delete database;
+    }
+
+    NAP_UNITTEST(LateTailSplit)
+    {
+        // Two measurements whose tails hold an impulse each at different times, split 32 samples in
+        const int M = 2, R = 2, N = 64, mixing = 32;
+        MYSOFA_HRTF* hrtf = (MYSOFA_HRTF*)calloc(1, sizeof(MYSOFA_HRTF));
+        hrtf->I = 1;
+        hrtf->C = 3;
+        hrtf->R = R;
+        hrtf->E = 1;
+        hrtf->N = N;
+        hrtf->M = M;
+        AllocArray(hrtf->ListenerPosition, 3);
+        AllocArray(hrtf->ReceiverPosition, R * 3);
+        AllocArray(hrtf->EmitterPosition, 3);
+        AllocArray(hrtf->ListenerUp, 3)[2] = 1.0f;
+        AllocArray(hrtf->ListenerView, 3)[0] = 1.0f;
+        AllocArray(hrtf->DataSamplingRate, 1)[0] = 1000.0f;
+        AllocArray(hrtf->DataDelay, R);
+        float* positions = AllocArray(hrtf->SourcePosition, M * 3);
+        float* irs = AllocArray(hrtf->DataIR, M * R * N);
+        for (int m = 0; m < M; m++)
+        {
+            positions[m * 3] = (m & 1) ? -1.0f : 1.0f;
+            irs[(m * R + 0) * N + m] = 1.0f;
+            irs[(m * R + 1) * N + m + 4] = 1.0f;
+            irs[(m * R + 0) * N + 40 + m] = 1.0f;
+            irs[(m * R + 1) * N + 44 + m] = 0.5f;
+        }
+        // Within the fade at the mixing time
+        irs[20] = 1.0f;
+
+        int err;
+        SofaDatabase* database = SofaDatabase::Create(hrtf, HRIRStorage::Format_Float, &err, (float)mixing / 1000.0f);
+        NAP_CHECK(database != NULL && database->HasLateTail());
+        if (database == NULL || !database->HasLateTail())
+            return;
+
+        // The fade takes half of the early part, the tail starts where it begins
+        NAP_CHECK(database->ir_len == mixing);
+        NAP_CHECK(database->late_offset == mixing / 2 && database->late_len == N - mixing / 2);
+
+        float left[N], right[N];
+        database->DecodeFilters(1, left, right);
+        NAP_CHECK(left[1] == 1.0f && right[5] == 1.0f);
+        database->DecodeFilters(0, left, right);
+        NAP_CHECK(left[20] > 0.0f && left[20] < 1.0f);
+
+        // Both impulses at half the amplitude, scaled by sqrt(2) to keep the energy of each of them
+        database->DecodeLateTail(left, right);
+        NAP_CHECK(fabsf(left[40 - database->late_offset] - sqrtf(0.5f)) < 1.0e-6f);
+        NAP_CHECK(fabsf(left[41 - database->late_offset] - sqrtf(0.5f)) < 1.0e-6f);
+        NAP_CHECK(fabsf(right[45 - database->late_offset] - 0.5f * sqrtf(0.5f)) < 1.0e-6f);
+
+        // Early part and tail share the sample in the fade with constant power
+        float early[N], scratch[N];
+        database->DecodeFilters(0, early, scratch);
+        NAP_CHECK(fabsf(left[20 - database->late_offset] * left[20 - database->late_offset] / 0.5f + early[20] * early[20] - 1.0f) < 1.0e-5f);
+
+        delete database;
+    }
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+#include "HRIRStorage.h"
+
+#include <mysofa.h>
+
+#include <atomic>
+#include <vector>
+
+/// A single loaded sofa file with everything needed to look up and decode its filters.
+/// Databases are immutable once published, so audio threads can read them without locking
+/// as long as they do so inside an Epoch::Scope.
+class SofaDatabase
+{
+public:
+    // Widths in degrees (the spread of Unity's audio sources) of the precomputed spread filters.
+    // Each one averages the measurements within a cap of half that width around the measurement,
+    // which is what rendering the source as many point sources on the cap would sum up to.
+    // The last width has to cover the full sphere.
+    static const int NUM_SPREADS = 3;
+    static const float SPREAD_WIDTHS[NUM_SPREADS];
+    // Longer filters (rooms) are not spread, their late part is diffuse already
+    static const int MAX_SPREAD_IR_LEN = 2048;
+    // Samples over which the early part fades out and the late tail fades in at the mixing time
+    static const int LATE_FADE_LEN = 256;
+    // The averaged late tail gets the mean energy of the measurements back in segments of this many samples
+    static const int LATE_SEGMENT_LEN = 512;
+
+    static SofaDatabase* Load(const char* filename, HRIRStorage::Format format, int* err, float mixingtime = 0.0f);
+    // Takes ownership of an hrtf, e.g. one built in memory. Source positions are converted to cartesian
+    // coordinates if their Type attribute says spherical.
+    // Its arrays have to be allocated with malloc, since they are released with mysofa_free.
+    // Impulse responses longer than a positive mixingtime (in seconds) are split there: each measurement
+    // keeps its direction dependent early part and the late tail is averaged over all of them once.
+    static SofaDatabase* Create(MYSOFA_HRTF* hrtf, HRIRStorage::Format format, int* err, float mixingtime = 0.0f);
+    ~SofaDatabase();
+
+public:
+    int Lookup(const float* dir) const;
+    void DecodeFilters(int measurement, float* left, float* right) const;
+    // Blends the filters of the nearest measurement and its neighbors weighted by their inverse distance
+    // to dir, like mysofa_interpolate but from the stored format and without delays.
+    // Returns the nearest measurement, scratch has to hold 2 * ir_len samples.
+    int InterpolateFilters(const float* dir, float* left, float* right, float* scratch) const;
+    // Filters of a measurement for a source spread over the given width in degrees, blended between the
+    // two nearest precomputed widths. Decodes the point filters without spread filters.
+    // scratch has to hold 2 * ir_len samples.
+    void DecodeSpreadFilters(int measurement, float spread, float* left, float* right, float* scratch) const;
+    inline bool HasSpreadFilters() const { return num_spreads > 0; }
+    // The late tail of both ears, late_len samples that start late_offset samples into the impulse responses
+    void DecodeLateTail(float* left, float* right) const;
+    inline bool HasLateTail() const { return late_len > 0; }
+    // Memory held by the filters, the measurement arrays and the neighborhood (the lookup tree is not included)
+    size_t GetMemorySize() const;
+
+public:
+    MYSOFA_HRTF* hrtf;
+    MYSOFA_LOOKUP* lookup;
+    MYSOFA_NEIGHBORHOOD* neighborhood;
+    // Impulse responses, possibly in a compact format or split. DataIR of the hrtf is released once they are stored.
+    HRIRStorage storage;
+    HRIRStorage::ErrorReport storage_err;
+    // Length of the impulse responses in samples, only the early part of split ones
+    int ir_len;
+    // Direction averaged late tail of split impulse responses (left and right), in the format of storage.
+    // It overlaps the early part by the fade at the mixing time.
+    HRIRStorage late;
+    int late_offset;
+    int late_len;
+    // Spread filters of the SPREAD_WIDTHS, in the format of storage
+    HRIRStorage spreads[NUM_SPREADS];
+    int num_spreads;
+
+private:
+    SofaDatabase();
+    void BuildSpreadFilters(const float* irs, HRIRStorage::Format format);
+    // Moves everything from the mixing time on into the late tail and writes the faded early parts to early
+    void SplitLateTail(const float* irs, int mixing, HRIRStorage::Format format, std::vector<float>& early);
+};
+
+/// The sofa slots selectable in the editor.
+/// Each slot is published through an atomic pointer, replaced databases are retired to the Epoch
+/// and only freed once no audio thread can still be reading them.
+class SofaContainer
+{
+public:
+    // There cant be more sofa files loaded then this number
+    static const int MAX_SOFA_FILES = 10;
+    static const int DIR_DIM = 3;
+
+    static SofaContainer& Instance();
+
+public:
+    void Init(unsigned samplerate);
+    int Load(int index, const char* filename);
+    int Reload(int index);
+    // Publishes an hrtf that was built in memory into the slot, see SofaDatabase::Create
+    int Insert(int index, MYSOFA_HRTF* hrtf);
+    void Publish(int index, SofaDatabase* database);
+
+    // Only valid inside an Epoch::Scope
+    inline SofaDatabase* Acquire(int index) const
+    {
+        return databases[index].load(std::memory_order_acquire);
+    }
+
+    // Incremented every time a new database gets published into the slot
+    inline int GetGeneration(int index) const
+    {
+        return generations[index].load(std::memory_order_acquire);
+    }
+
+public:
+    std::atomic<SofaDatabase*> databases[MAX_SOFA_FILES];
+    std::atomic<int> generations[MAX_SOFA_FILES];
+    int errs[MAX_SOFA_FILES];
+    float dirs[DIR_DIM * MAX_SOFA_FILES];
+    // Format used to keep the impulse responses of newly loaded sofa files in memory
+    HRIRStorage::Format storage_format;
+    // Time in seconds at which newly loaded impulse responses are split into early part and late tail, 0 keeps them whole
+    float mixing_time;
+    bool is_initialized;
+
+private:
+    // Publishes a freshly loaded database or records the error of a failed load
+    int Install(int index, SofaDatabase* database, int err);
+
+private:
+    // Serializes loading between non-realtime threads
+    Mutex mutex;
+
+private:
+    SofaContainer();
+    ~SofaContainer();
+};
@@ -0,0 +1,252 @@
+#include "TailConvolver.h"
+
+#include <chrono>
+
+// Flag in ir_middle that marks filters the worker hasn't picked up yet
+static const int kIRDirty = 4;
+
+TailConvolver::TailConvolver()
+    : chunksize(0)
+    , maxtaillen(0)
+    , inchunks(NULL)
+    , chunks_in(0)
+    , chunks_out(0)
+    , underruns(0)
+    , position(0)
+    , inpos(0)
+    , ir_back(0)
+    , ir_front(1)
+    , ir_middle(2)
+    , chunk(NULL)
+    , faded(NULL)
+    , current_slot(0)
+    , has_ir(false)
+    , running(false)
+{
+    for (int e = 0; e < NUM_EARS; e++)
+        outchunks[e] = NULL;
+    for (int n = 0; n < 3; n++)
+    {
+        irs[n] = NULL;
+        irlens[n] = 0;
+    }
+}
+
+TailConvolver::~TailConvolver()
+{
+    Cleanup();
+}
+
+void TailConvolver::Cleanup()
+{
+    if (running.exchange(false))
+        worker.join();
+
+    delete[] inchunks;
+    inchunks = NULL;
+    for (int e = 0; e < NUM_EARS; e++)
+    {
+        delete[] outchunks[e];
+        outchunks[e] = NULL;
+    }
+    for (int n = 0; n < 3; n++)
+    {
+        delete[] irs[n];
+        irs[n] = NULL;
+    }
+    delete[] chunk;
+    delete[] faded;
+    chunk = NULL;
+    faded = NULL;
+}
+
+void TailConvolver::Init(int tailblocksize, int maxirlen)
+{
+    Cleanup();
+
+    chunksize = tailblocksize;
+    maxtaillen = maxirlen - GetTailOffset();
+    if (maxtaillen < 0)
+        maxtaillen = 0;
+
+    inchunks = new float[NUM_CHUNKS * chunksize];
+    memset(inchunks, 0, sizeof(float) * NUM_CHUNKS * chunksize);
+    for (int e = 0; e < NUM_EARS; e++)
+    {
+        outchunks[e] = new float[NUM_CHUNKS * chunksize];
+        memset(outchunks[e], 0, sizeof(float) * NUM_CHUNKS * chunksize);
+        convolvers[e].Init(chunksize, maxtaillen);
+    }
+    for (int n = 0; n < 3; n++)
+    {
+        irs[n] = new float[NUM_EARS * maxtaillen + 1];
+        irlens[n] = 0;
+    }
+    accumulator.resize(chunksize + 1);
+    chunk = new float[chunksize];
+    faded = new float[chunksize];
+
+    chunks_in.store(0);
+    chunks_out.store(0);
+    underruns.store(0);
+    position = 0;
+    inpos = 0;
+    ir_back = 0;
+    ir_front = 1;
+    ir_middle.store(2);
+    current_slot = 0;
+    has_ir = false;
+
+    running.store(true);
+    worker = std::thread(&TailConvolver::WorkerLoop, this);
+}
+
+void TailConvolver::SetIR(const float* left, const float* right, int irlen)
+{
+    int taillen = irlen - GetTailOffset();
+    if (taillen < 0)
+        taillen = 0;
+    if (taillen > maxtaillen)
+        taillen = maxtaillen;
+
+    float* ir = irs[ir_back];
+    memcpy(ir, left + GetTailOffset(), sizeof(float) * taillen);
+    memcpy(ir + maxtaillen, right + GetTailOffset(), sizeof(float) * taillen);
+    irlens[ir_back] = taillen;
+
+    ir_back = ir_middle.exchange(ir_back | kIRDirty, std::memory_order_acq_rel) & ~kIRDirty;
+}
+
+void TailConvolver::Process(const float* input, float* left, float* right, int length)
+{
+    // Hand the input over chunk by chunk
+    for (int i = 0; i < length;)
+    {
+        const UInt64 published = chunks_in.load(std::memory_order_relaxed);
+        int num = chunksize - inpos;
+        if (num > length - i)
+            num = length - i;
+        memcpy(inchunks + (published % NUM_CHUNKS) * chunksize + inpos, input + i, sizeof(float) * num);
+        inpos += num;
+        i += num;
+        if (inpos == chunksize)
+        {
+            chunks_in.store(published + 1, std::memory_order_release);
+            inpos = 0;
+        }
+    }
+
+    // Mix in whatever tail the worker has ready for this block
+    const UInt64 offset = (UInt64)GetTailOffset();
+    const UInt64 done = chunks_out.load(std::memory_order_acquire);
+    UInt64 t = position;
+    for (int i = 0; i < length;)
+    {
+        int num = length - i;
+        if (t < offset)
+        {
+            if ((UInt64)num > offset - t)
+                num = (int)(offset - t);
+        }
+        else
+        {
+            const UInt64 c = (t - offset) / chunksize;
+            const int pos = (int)((t - offset) % chunksize);
+            if (num > chunksize - pos)
+                num = chunksize - pos;
+
+            if (c < done)
+            {
+                const float* l = outchunks[0] + (c % NUM_CHUNKS) * chunksize + pos;
+                const float* r = outchunks[1] + (c % NUM_CHUNKS) * chunksize + pos;
+                for (int n = 0; n < num; n++)
+                {
+                    left[i + n] += l[n];
+                    right[i + n] += r[n];
+                }
+            }
+            else
+            {
+                underruns.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        i += num;
+        t += num;
+    }
+    position = t;
+}
+
+void TailConvolver::WorkerLoop()
+{
+    UInt64 next = 0;
+    while (running.load(std::memory_order_acquire))
+    {
+        const UInt64 available = chunks_in.load(std::memory_order_acquire);
+        if (next == available)
+        {
+            // Polling keeps the audio thread free of any wake up syscall, a chunk lasts much longer than this
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        // Copy the chunk out before the audio thread can come around to its slot again
+        memcpy(chunk, inchunks + (next % NUM_CHUNKS) * chunksize, sizeof(float) * chunksize);
+        if (chunks_in.load(std::memory_order_acquire) - next >= NUM_CHUNKS)
+        {
+            // Fell behind so far that the slot has been overwritten, the output of this chunk is lost anyway
+            memset(chunk, 0, sizeof(float) * chunksize);
+            underruns.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Pick up new filters
+        int slot = current_slot;
+        if (ir_middle.load(std::memory_order_acquire) & kIRDirty)
+        {
+            ir_front = ir_middle.exchange(ir_front, std::memory_order_acq_rel) & ~kIRDirty;
+            slot = has_ir ? 1 - current_slot : current_slot;
+            const float* ir = irs[ir_front];
+            for (int e = 0; e < NUM_EARS; e++)
+                convolvers[e].SetIR(slot, ir + e * maxtaillen, irlens[ir_front]);
+            if (!has_ir)
+                has_ir = true;
+        }
+
+        float* out[NUM_EARS];
+        for (int e = 0; e < NUM_EARS; e++)
+        {
+            out[e] = outchunks[e] + (next % NUM_CHUNKS) * chunksize;
+
+            convolvers[e].PushInput(chunk);
+            accumulator.setZero();
+            convolvers[e].Accumulate(current_slot, accumulator);
+            convolvers[e].Synthesize(accumulator, out[e]);
+
+            if (slot != current_slot)
+            {
+                // Linear crossfade from the old to the new tail over this chunk, both computed from the same input
+                accumulator.setZero();
+                convolvers[e].Accumulate(slot, accumulator);
+                convolvers[e].Synthesize(accumulator, faded);
+                const float step = 1.0f / (float)chunksize;
+                for (int n = 0; n < chunksize; n++)
+                {
+                    const float g = (n + 1) * step;
+                    out[e][n] += (faded[n] - out[e][n]) * g;
+                }
+            }
+        }
+        current_slot = slot;
+
+        chunks_out.store(next + 1, std::memory_order_release);
+        next++;
+    }
+}
+
+size_t TailConvolver::GetMemorySize() const
+{
+    size_t size = sizeof(float) * (size_t)chunksize * (NUM_CHUNKS * (1 + NUM_EARS) + 2);
+    size += sizeof(float) * 3 * (size_t)(NUM_EARS * maxtaillen + 1);
+    for (int e = 0; e < NUM_EARS; e++)
+        size += convolvers[e].GetMemorySize();
+    return size;
+}
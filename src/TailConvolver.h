@@ -0,0 +1,82 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+#include "PartitionedConvolver.h"
+
+#include <atomic>
+#include <thread>
+
+/// Convolves the late part of long binaural (room) impulse responses on a background thread.
+/// Only the samples from GetTailOffset() on are handled here, the caller convolves the head of the
+/// filters on the audio thread as usual.
+/// The input is handed over in chunks of tailblocksize samples. Since the tail starts two chunks
+/// into the filter, the worker has a whole chunk period to compute each chunk before its output is
+/// due. The audio thread never waits for it: if a chunk isn't ready in time its tail is skipped and
+/// counted as an underrun, so the worst case on the audio thread is a couple of memcpys.
+class TailConvolver
+{
+public:
+    TailConvolver();
+    ~TailConvolver();
+
+public:
+    // Allocates everything and starts the worker thread, not realtime safe
+    void Init(int tailblocksize, int maxirlen);
+
+    // Hands over new filters (the full impulse responses, including the head), realtime safe.
+    // The worker crossfades from the previous tail to the new one over one chunk.
+    void SetIR(const float* left, const float* right, int irlen);
+
+    // Feeds the input and adds the tail to the output of the two ears, realtime safe
+    void Process(const float* input, float* left, float* right, int length);
+
+    inline int GetTailOffset() const { return 2 * chunksize; }
+    inline int GetMaxIRLength() const { return GetTailOffset() + maxtaillen; }
+    inline UInt64 GetUnderruns() const { return underruns.load(std::memory_order_relaxed); }
+    size_t GetMemorySize() const;
+
+private:
+    void WorkerLoop();
+    void Cleanup();
+
+    // Prevent uncontrolled usage
+    TailConvolver(const TailConvolver&);
+    TailConvolver& operator=(const TailConvolver&);
+
+private:
+    static const int NUM_CHUNKS = 4;
+    static const int NUM_EARS = 2;
+
+    int chunksize;
+    int maxtaillen;
+
+    // Chunk rings shared between the audio thread and the worker
+    float* inchunks;
+    float* outchunks[NUM_EARS];
+    std::atomic<UInt64> chunks_in;
+    std::atomic<UInt64> chunks_out;
+    std::atomic<UInt64> underruns;
+
+    // Audio thread state
+    UInt64 position;
+    int inpos;
+
+    // Triple buffer for the filters: the audio thread writes the back buffer, the worker reads the
+    // front buffer and both exchange theirs with the middle one
+    float* irs[3];
+    int irlens[3];
+    int ir_back;
+    int ir_front;
+    std::atomic<int> ir_middle;
+
+    // Worker state
+    PartitionedConvolver convolvers[NUM_EARS];
+    fftconvolver::SplitComplex accumulator;
+    float* chunk;
+    float* faded;
+    int current_slot;
+    bool has_ir;
+
+    std::thread worker;
+    std::atomic<bool> running;
+};
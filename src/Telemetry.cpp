@@ -0,0 +1,109 @@
+#include "Telemetry.h"
+#include "LoadProfiler.h"
+
+#include <algorithm>
+
+namespace
+{
+    bool EventTimeLess(const Telemetry::Event& a, const Telemetry::Event& b)
+    {
+        return a.time < b.time;
+    }
+}
+
+Telemetry::Channel::Channel()
+    : id(0)
+    , registered(true)
+    , dropped(0)
+{
+    Telemetry::Instance().Register(this);
+}
+
+Telemetry::Channel::Channel(int _id)
+    : id(_id)
+    , registered(false)
+    , dropped(0)
+{
+}
+
+Telemetry::Channel::~Channel()
+{
+    if (registered)
+        Telemetry::Instance().Unregister(this);
+}
+
+void Telemetry::Channel::Post(EventType type, int a, int b)
+{
+    Post(type, a, b, LoadProfiler::GetTime());
+}
+
+void Telemetry::Channel::Post(EventType type, int a, int b, UInt64 time)
+{
+    Event event;
+    event.time = time;
+    event.type = type;
+    event.channel = id;
+    event.a = a;
+    event.b = b;
+    if (!ring.Feed(event))
+        LoadProfiler::Increment(dropped);
+}
+
+Telemetry& Telemetry::Instance()
+{
+    static Telemetry telemetry;
+    return telemetry;
+}
+
+Telemetry::Telemetry()
+    : shared(0)
+    , next_id(1)
+    , dropped_unregistered(0)
+{
+    channels.push_back(&shared);
+}
+
+Telemetry::~Telemetry()
+{
+}
+
+void Telemetry::Register(Channel* channel)
+{
+    MutexScopeLock lock(mutex);
+    channel->id = next_id++;
+    channels.push_back(channel);
+}
+
+void Telemetry::Unregister(Channel* channel)
+{
+    MutexScopeLock lock(mutex);
+    dropped_unregistered.fetch_add(channel->dropped.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    channels.erase(std::remove(channels.begin(), channels.end(), channel), channels.end());
+}
+
+void Telemetry::Post(EventType type, int a, int b)
+{
+    MutexScopeLock lock(shared_mutex);
+    shared.Post(type, a, b);
+}
+
+int Telemetry::Drain(Event* events, int maxevents)
+{
+    MutexScopeLock lock(mutex);
+
+    int numevents = 0;
+    for (size_t c = 0; c < channels.size() && numevents < maxevents; c++)
+        numevents += channels[c]->ring.Read(events + numevents, maxevents - numevents);
+
+    std::sort(events, events + numevents, EventTimeLess);
+    return numevents;
+}
+
+UInt64 Telemetry::GetDropped() const
+{
+    MutexScopeLock lock(mutex);
+    UInt64 dropped = dropped_unregistered.load(std::memory_order_relaxed);
+    for (size_t c = 0; c < channels.size(); c++)
+        dropped += channels[c]->dropped.load(std::memory_order_relaxed);
+    return dropped;
+}
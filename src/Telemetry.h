@@ -0,0 +1,99 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+
+#include <vector>
+
+/// Timestamped events of the plugin instances, collected without locking the audio threads.
+/// Every instance owns a Channel, a single producer/single consumer ring that only the mixer thread
+/// of the instance posts to. Code that may run on a render pool thread records its events with their
+/// time and hands them to the mixer thread, which posts them once it joined the render.
+/// Drain empties all channels in one call from a non-realtime thread.
+/// Events of non-realtime code (e.g. finished sofa loads) go to a shared channel guarded by a mutex.
+class Telemetry
+{
+public:
+    enum EventType
+    {
+        Event_IRSwitch,         // a = previous measurement, b = new measurement
+        Event_DatabaseSwap,     // a = slot, b = generation of the slot
+        Event_LoadComplete,     // a = slot, b = libmysofa error code
+        Event_DeadlineOverrun,  // a = callback duration, b = block duration, both in microseconds
+        Event_Passthrough,      // a = reason, see PassthroughReason
+        Event_VoiceState,       // a = 1 if the voice went over the budget or 2D, 0 if it convolves again, b = voices allowed
+        Event_Reblocking,       // a = 1 if the FIFO engaged, 0 if it was released, b = latency it adds in samples
+        Event_Num
+    };
+
+    enum PassthroughReason
+    {
+        Passthrough_NotInitialized,
+        Passthrough_NoDatabase,
+        Passthrough_UnsupportedLayout,  // more channels than MAX_CHANNELS of the spatializer
+        Passthrough_FilterTooLong       // filters longer than the spatializer instance was created for
+    };
+
+    // Layout shared with the C# side
+    struct Event
+    {
+        UInt64 time; // Monotonic time in nanoseconds
+        int type;
+        int channel; // Id of the posting instance, 0 for the shared channel
+        int a;
+        int b;
+    };
+
+    class Channel
+    {
+    public:
+        Channel();
+        ~Channel();
+
+    public:
+        // Realtime safe, events are dropped and counted when the ring is full
+        void Post(EventType type, int a, int b);
+        // Posts an event that happened at time, e.g. on another thread
+        void Post(EventType type, int a, int b, UInt64 time);
+        inline int GetId() const { return id; }
+
+    private:
+        friend class Telemetry;
+        // The shared channel is owned by Telemetry itself and not registered through Instance()
+        explicit Channel(int id);
+
+        int id;
+        bool registered;
+        RingBuffer<256, Event> ring;
+        std::atomic<UInt64> dropped;
+    };
+
+public:
+    static Telemetry& Instance();
+
+public:
+    // Posts to the shared channel, not realtime safe
+    void Post(EventType type, int a, int b);
+
+    // Moves up to maxevents events of all channels into events, ordered by time. Returns the number of events.
+    int Drain(Event* events, int maxevents);
+
+    // Events lost to full rings since startup
+    UInt64 GetDropped() const;
+
+private:
+    Telemetry();
+    ~Telemetry();
+
+    void Register(Channel* channel);
+    void Unregister(Channel* channel);
+
+private:
+    std::vector<Channel*> channels;
+    Channel shared;
+    int next_id;
+    std::atomic<UInt64> dropped_unregistered;
+    // Guards the list of channels and draining
+    mutable Mutex mutex;
+    // Serializes producers of the shared channel
+    Mutex shared_mutex;
+};
@@ -0,0 +1,211 @@
+#include "VoiceBudget.h"
+#include "NAPTest.h"
+
+#include <algorithm>
+#include <cfloat>
+
+static const UInt64 kNoTick = ~(UInt64)0;
+
+const float VoiceBudget::HYSTERESIS = 2.0f;
+
+// Weight of the latest block in the average cost of a convolution
+static const float COST_SMOOTHING = 0.1f;
+// Without convolutions to measure, the cost fades by this factor per block, so voices are tried again
+static const float COST_DECAY = 0.99f;
+
+VoiceBudget& VoiceBudget::Instance()
+{
+    static VoiceBudget budget;
+    return budget;
+}
+
+VoiceBudget::VoiceBudget()
+    : dsptick(kNoTick)
+    , threshold(-1.0f)
+    , numadmitted(0)
+    , maxvoices(0)
+    , maxtime(0.0f)
+    , allowed(MAX_VOICES)
+    , cost(0.0f)
+    , spent(0)
+    , renders(0)
+{
+    for (int v = 0; v < MAX_VOICES; v++)
+    {
+        voices[v].dsptick = kNoTick;
+        voices[v].audibility = 0.0f;
+        voices[v].registered = false;
+        voices[v].admitted = false;
+    }
+}
+
+int VoiceBudget::Register()
+{
+    int id = -1;
+    lock.Lock();
+    for (int v = 0; v < MAX_VOICES && id < 0; v++)
+    {
+        if (!voices[v].registered)
+        {
+            voices[v].registered = true;
+            voices[v].dsptick = kNoTick;
+            voices[v].admitted = false;
+            id = v;
+        }
+    }
+    lock.Unlock();
+    return id;
+}
+
+void VoiceBudget::Unregister(int voice)
+{
+    if (voice < 0 || voice >= MAX_VOICES)
+        return;
+    lock.Lock();
+    voices[voice].registered = false;
+    lock.Unlock();
+}
+
+void VoiceBudget::SetLimits(int _maxvoices, float maxmicroseconds)
+{
+    lock.Lock();
+    maxvoices = (_maxvoices > 0) ? _maxvoices : 0;
+    maxtime = (maxmicroseconds > 0.0f) ? maxmicroseconds * 1000.0f : 0.0f;
+    lock.Unlock();
+}
+
+void VoiceBudget::Report(UInt64 nanoseconds)
+{
+    spent.fetch_add(nanoseconds, std::memory_order_relaxed);
+    renders.fetch_add(1, std::memory_order_relaxed);
+}
+
+void VoiceBudget::Rank()
+{
+    // Voices that handed in their audibility for the previous block
+    int numvoices = 0;
+    for (int v = 0; v < MAX_VOICES && dsptick != kNoTick; v++)
+        if (voices[v].registered && voices[v].dsptick == dsptick)
+            scratch[numvoices++] = voices[v].audibility;
+
+    const int count = renders.exchange(0, std::memory_order_relaxed);
+    const UInt64 time = spent.exchange(0, std::memory_order_relaxed);
+    float average = cost.load(std::memory_order_relaxed);
+    if (count > 0)
+    {
+        const float latest = (float)time / (float)count;
+        average = (average > 0.0f) ? average + COST_SMOOTHING * (latest - average) : latest;
+    }
+    else
+        average *= COST_DECAY;
+    cost.store(average, std::memory_order_relaxed);
+
+    int limit = (maxvoices > 0) ? maxvoices : MAX_VOICES;
+    if (maxtime > 0.0f && average > 0.0f && maxtime / average < (float)limit)
+        limit = (int)(maxtime / average);
+    allowed.store(limit, std::memory_order_relaxed);
+
+    if (limit >= numvoices)
+        threshold = -1.0f;
+    else if (limit == 0)
+        threshold = FLT_MAX;
+    else
+    {
+        std::nth_element(scratch, scratch + numvoices - limit, scratch + numvoices);
+        threshold = scratch[numvoices - limit];
+    }
+}
+
+bool VoiceBudget::Admit(UInt64 _dsptick, int voice, float audibility)
+{
+    if (voice < 0 || voice >= MAX_VOICES)
+        return true;
+
+    lock.Lock();
+    if (dsptick != _dsptick)
+    {
+        Rank();
+        dsptick = _dsptick;
+        numadmitted = 0;
+    }
+    Voice& v = voices[voice];
+    v.audibility = v.admitted ? audibility * HYSTERESIS : audibility;
+    v.dsptick = _dsptick;
+    v.admitted = v.audibility >= threshold && numadmitted < allowed.load(std::memory_order_relaxed);
+    if (v.admitted)
+        numadmitted++;
+    const bool admitted = v.admitted;
+    lock.Unlock();
+    return admitted;
+}
+
+NAP_TESTSUITE(VoiceBudget)
+{
+    NAP_UNITTEST(RanksByAudibility)
+    {
+        // The two loudest of four voices take over from the first two within a block and keep their slots
+        VoiceBudget& budget = VoiceBudget::Instance();
+        budget.SetLimits(2, 0.0f);
+        const float audibilities[4] = { 1.0f, 2.0f, 5.0f, 10.0f };
+        int ids[4];
+        for (int v = 0; v < 4; v++)
+            ids[v] = budget.Register();
+
+        // Bit v is set if voice v was admitted in the last block
+        int admitted = 0;
+        for (int block = 0; block < 4; block++)
+        {
+            admitted = 0;
+            for (int v = 0; v < 4; v++)
+                admitted = admitted | (budget.Admit(1000 + block * 256, ids[v], audibilities[v]) ? 1 << v : 0);
+        }
+        NAP_CHECK(admitted == 12);
+        NAP_CHECK(budget.GetAllowed() == 2);
+
+        // Unregistered voices don't count
+        budget.Unregister(ids[3]);
+        budget.Unregister(ids[2]);
+        for (int block = 4; block < 6; block++)
+        {
+            admitted = 0;
+            for (int v = 0; v < 2; v++)
+                admitted = admitted | (budget.Admit(1000 + block * 256, ids[v], audibilities[v]) ? 1 << v : 0);
+        }
+        NAP_CHECK(admitted == 3);
+
+        budget.Unregister(ids[1]);
+        budget.Unregister(ids[0]);
+        budget.SetLimits(0, 0.0f);
+    }
+
+    NAP_UNITTEST(TimeLimitsVoices)
+    {
+        // Convolutions of 50 us fit twice into 100 us
+        VoiceBudget& budget = VoiceBudget::Instance();
+        budget.SetLimits(0, 100.0f);
+        int ids[4];
+        for (int v = 0; v < 4; v++)
+            ids[v] = budget.Register();
+
+        int numadmitted = 0;
+        for (int block = 0; block < 3; block++)
+        {
+            numadmitted = 0;
+            for (int v = 0; v < 4; v++)
+            {
+                if (budget.Admit(5000 + block * 256, ids[v], 1.0f))
+                {
+                    budget.Report(50000);
+                    numadmitted++;
+                }
+            }
+        }
+        NAP_CHECK(numadmitted == 2);
+        NAP_CHECK(budget.GetAllowed() == 2);
+        NAP_CHECK(fabsf(budget.GetCost() - 50000.0f) < 1.0f);
+
+        for (int v = 0; v < 4; v++)
+            budget.Unregister(ids[v]);
+        budget.SetLimits(0, 0.0f);
+    }
+}
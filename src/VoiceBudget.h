@@ -0,0 +1,69 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+
+/// Process wide budget of the spatializers that convolve their input with HRTFs.
+/// Every voice hands in its audibility once per block. With the first voice of a new block the budget
+/// ranks the audibilities of the previous block and keeps the threshold of the loudest ones that fit,
+/// so a voice is admitted if it is at least as audible as that. The budget is a number of voices, a
+/// time per block or both: the time is divided by the measured cost of a convolution per voice, so a
+/// sustained overload lowers the number of admitted voices instead of missing deadlines.
+/// Admitted voices rank twice as audible as they are, so voices of similar audibility don't flip back
+/// and forth every block. Voices over the budget are expected to render something cheap instead.
+class VoiceBudget
+{
+public:
+    static const int MAX_VOICES = 256;
+    static const float HYSTERESIS;
+
+public:
+    static VoiceBudget& Instance();
+
+public:
+    // Returns the id of a new voice, or -1 if all are taken. Voices without an id are always admitted.
+    int Register();
+    void Unregister(int voice);
+
+    // Number of voices and microseconds per block that may be spent on convolutions, 0 is unlimited
+    void SetLimits(int maxvoices, float maxmicroseconds);
+
+    // Ranks the audibility of a voice for the block starting at dsptick, returns true if it may convolve
+    bool Admit(UInt64 dsptick, int voice, float audibility);
+
+    // Adds the time an admitted voice spent convolving one block, may be called from any thread
+    void Report(UInt64 nanoseconds);
+
+    // Number of voices admitted per block at the moment, MAX_VOICES if unlimited
+    inline int GetAllowed() const { return allowed.load(std::memory_order_relaxed); }
+    // Average time of one convolution in nanoseconds
+    inline float GetCost() const { return cost.load(std::memory_order_relaxed); }
+
+private:
+    VoiceBudget();
+
+    // Derives the allowed number of voices and the threshold from the previous block, called under the lock
+    void Rank();
+
+private:
+    struct Voice
+    {
+        UInt64 dsptick; // Block the audibility was handed in for
+        float audibility;
+        bool registered;
+        bool admitted;
+    };
+
+    SpinLock lock;
+    UInt64 dsptick;
+    Voice voices[MAX_VOICES];
+    // Audibilities of the previous block, sorted by Rank
+    float scratch[MAX_VOICES];
+    float threshold;
+    int numadmitted;
+    int maxvoices;
+    float maxtime;
+    std::atomic<int> allowed;
+    std::atomic<float> cost;
+    std::atomic<UInt64> spent;
+    std::atomic<int> renders;
+};
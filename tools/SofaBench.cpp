@@ -0,0 +1,392 @@
+// Headless benchmark of the SOFA Spatializer.
+// Loads the effects through UnityGetAudioEffectDefinitions like the Unity mixer does, publishes a
+// synthetic HRTF database built in memory and drives a number of instances with moving sources
+// through CreateCallback/ProcessCallback. Reports the processing cost per sample, the rate of
+// filter switches and how many sources fit into the real-time budget of one core.
+//
+// Usage: SofaBench [--sources=64] [--seconds=10] [--blocksize=1024] [--samplerate=48000]
+//                  [--irlen=256] [--measurements=1000] [--speed=90] [--threads=0]
+//                  [--format=0] [--tail] [--send] [--reflections=0] [--mixing=0] [--reverb]
+//                  [--voices=0] [--silent=0] [--hostblock=0]
+
+#include "AudioPluginUtil.h"
+#include "EarlyReflections.h"
+#include "RenderPool.h"
+#include "SofaDatabase.h"
+#include "VoiceBudget.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+struct Options
+{
+    int sources = 64;
+    float seconds = 10.0f;
+    int blocksize = 1024;
+    int samplerate = 48000;
+    int irlen = 256;
+    int measurements = 1000;
+    float speed = 90.0f; // Degrees per second of the fastest source
+    int threads = 0;
+    int format = HRIRStorage::Format_Float;
+    bool tail = false;
+    bool send = false;
+    bool reverb = false; // Sends every source to the reverb of the mix bus
+    int reflections = 0; // Image source order of the early reflections
+    float mixing = 0.0f; // Seconds after which the filters are split off into the shared late tail, 0 keeps them whole
+    int voices = 0;      // Sources that may convolve at once, the others are panned. 0 convolves all of them.
+    int silent = 0;      // Sources fed with silence, which are skipped once their filters rang out
+    int hostblock = 0;   // Splits every block into calls of this many frames, which the spatializers re-block. 0 doesn't.
+};
+
+struct Instance
+{
+    UnityAudioEffectState state;
+    UnityAudioSpatializerData spatializer;
+    float azimuth;
+    float elevation;
+    float speed;
+    std::vector<float> in;
+    std::vector<float> out;
+};
+
+static bool parse_option(const char *arg, const char *name, float *value) {
+    const size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+        return false;
+    }
+    *value = (float)atof(arg + len + 1);
+    return true;
+}
+
+static bool parse_options(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        float value;
+        if (strcmp(argv[i], "--tail") == 0) {
+            options.tail = true;
+        } else if (strcmp(argv[i], "--send") == 0) {
+            options.send = true;
+        } else if (strcmp(argv[i], "--reverb") == 0) {
+            options.reverb = true;
+        } else if (parse_option(argv[i], "--sources", &value)) {
+            options.sources = (int)value;
+        } else if (parse_option(argv[i], "--seconds", &value)) {
+            options.seconds = value;
+        } else if (parse_option(argv[i], "--blocksize", &value)) {
+            options.blocksize = (int)value;
+        } else if (parse_option(argv[i], "--samplerate", &value)) {
+            options.samplerate = (int)value;
+        } else if (parse_option(argv[i], "--irlen", &value)) {
+            options.irlen = (int)value;
+        } else if (parse_option(argv[i], "--measurements", &value)) {
+            options.measurements = (int)value;
+        } else if (parse_option(argv[i], "--speed", &value)) {
+            options.speed = value;
+        } else if (parse_option(argv[i], "--threads", &value)) {
+            options.threads = (int)value;
+        } else if (parse_option(argv[i], "--format", &value)) {
+            options.format = (int)value;
+        } else if (parse_option(argv[i], "--reflections", &value)) {
+            options.reflections = (int)value;
+        } else if (parse_option(argv[i], "--mixing", &value)) {
+            options.mixing = value;
+        } else if (parse_option(argv[i], "--voices", &value)) {
+            options.voices = (int)value;
+        } else if (parse_option(argv[i], "--silent", &value)) {
+            options.silent = (int)value;
+        } else if (parse_option(argv[i], "--hostblock", &value)) {
+            options.hostblock = (int)value;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return false;
+        }
+    }
+    return options.sources > 0 && options.blocksize > 0 && options.samplerate > 0 && options.irlen > 0 && options.measurements > 0;
+}
+
+static float *alloc_array(MYSOFA_ARRAY &array, unsigned int elements) {
+    array.values = (float*)calloc(elements, sizeof(float));
+    array.elements = elements;
+    array.attributes = NULL;
+    return array.values;
+}
+
+// Builds an hrtf shaped like a measured sofa file: measurements spread evenly over the sphere, two
+// receivers and decaying noise filters with an interaural delay and level difference
+static MYSOFA_HRTF *make_hrtf(const Options &options) {
+    MYSOFA_HRTF *hrtf = (MYSOFA_HRTF*)calloc(1, sizeof(MYSOFA_HRTF));
+    hrtf->I = 1;
+    hrtf->C = 3;
+    hrtf->R = 2;
+    hrtf->E = 1;
+    hrtf->N = options.irlen;
+    hrtf->M = options.measurements;
+
+    alloc_array(hrtf->ListenerPosition, hrtf->C);
+    float *receivers = alloc_array(hrtf->ReceiverPosition, hrtf->R * hrtf->C);
+    receivers[1] = 0.09f;
+    receivers[4] = -0.09f;
+    alloc_array(hrtf->EmitterPosition, hrtf->C);
+    alloc_array(hrtf->ListenerUp, hrtf->C)[2] = 1.0f;
+    alloc_array(hrtf->ListenerView, hrtf->C)[0] = 1.0f;
+    alloc_array(hrtf->DataSamplingRate, 1)[0] = (float)options.samplerate;
+    alloc_array(hrtf->DataDelay, hrtf->R);
+
+    float *positions = alloc_array(hrtf->SourcePosition, hrtf->M * hrtf->C);
+    float *ir = alloc_array(hrtf->DataIR, hrtf->M * hrtf->R * hrtf->N);
+
+    Random random;
+    random.Seed(1234);
+    const float golden_angle = kPI * (3.0f - sqrtf(5.0f));
+    for (unsigned int m = 0; m < hrtf->M; ++m) {
+        // Fibonacci sphere
+        const float z = 1.0f - 2.0f * (m + 0.5f) / (float)hrtf->M;
+        const float radius = sqrtf(1.0f - z * z);
+        const float x = cosf(golden_angle * m) * radius;
+        const float y = sinf(golden_angle * m) * radius;
+        positions[m * 3 + 0] = x;
+        positions[m * 3 + 1] = y;
+        positions[m * 3 + 2] = z;
+
+        for (unsigned int r = 0; r < hrtf->R; ++r) {
+            // y points to the left ear, the far ear gets a later and quieter response
+            const float side = (r == 0) ? y : -y;
+            const int delay = (int)((1.0f - side) * 0.00035f * options.samplerate);
+            const float gain = 0.6f + 0.4f * side;
+            float *filter = ir + (m * hrtf->R + r) * hrtf->N;
+            for (unsigned int n = delay; n < hrtf->N; ++n) {
+                filter[n] = random.GetFloat(-1.0f, 1.0f) * gain * expf(-8.0f * (float)(n - delay) / (float)hrtf->N);
+            }
+        }
+    }
+    return hrtf;
+}
+
+static UnityAudioEffectDefinition *find_effect(const char *name) {
+    UnityAudioEffectDefinition **definitions;
+    const int num = UnityGetAudioEffectDefinitions(&definitions);
+    for (int i = 0; i < num; ++i) {
+        if (strcmp(definitions[i]->name, name) == 0) {
+            return definitions[i];
+        }
+    }
+    return NULL;
+}
+
+static int find_parameter(const UnityAudioEffectDefinition *definition, const char *name) {
+    for (UInt32 i = 0; i < definition->numparameters; ++i) {
+        if (strcmp(definition->paramdefs[i].name, name) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static void init_state(UnityAudioEffectState &state, const Options &options) {
+    static int internal;
+    memset(&state, 0, sizeof(state));
+    state.structsize = sizeof(UnityAudioEffectState);
+    state.samplerate = options.samplerate;
+    state.dspbuffersize = options.blocksize;
+    state.hostapiversion = UNITY_AUDIO_PLUGIN_API_VERSION;
+    // GetEffectData asserts that the host data is set
+    state.internal = &internal;
+}
+
+// Moves the source of an instance along its trajectory: a circle around the listener whose
+// elevation swings up and down
+static void update_trajectory(Instance &instance, float dt) {
+    instance.azimuth += instance.speed * dt;
+    const float azimuth = instance.azimuth * kPI / 180.0f;
+    const float elevation = instance.elevation * sinf(azimuth * 0.5f) * kPI / 180.0f;
+
+    // Unity coordinates: x right, y up, z forward. The listener sits at the origin.
+    float *m = instance.spatializer.sourcematrix;
+    m[12] = 2.0f * sinf(azimuth) * cosf(elevation);
+    m[13] = 2.0f * sinf(elevation);
+    m[14] = 2.0f * cosf(azimuth) * cosf(elevation);
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        fprintf(stderr, "Usage: %s [--sources=N] [--seconds=S] [--blocksize=N] [--samplerate=N] [--irlen=N] "
+                "[--measurements=N] [--speed=DEG] [--threads=N] [--format=0|1|2] [--tail] [--send] [--reflections=N] [--mixing=S] [--reverb] [--voices=N] [--silent=N] [--hostblock=N]\n", argv[0]);
+        return 1;
+    }
+
+    UnityAudioEffectDefinition *spatializer = find_effect("SOFA Spatializer");
+    UnityAudioEffectDefinition *bus = find_effect("SOFA Mix Bus");
+    if (spatializer == NULL || bus == NULL) {
+        fprintf(stderr, "The SOFA effects are not registered\n");
+        return 1;
+    }
+
+    // Fill slot 0 before any instance is created, the sofa files of the assets folder are not needed
+    SofaContainer &sofa = SofaContainer::Instance();
+    sofa.storage_format = (HRIRStorage::Format)options.format;
+    sofa.mixing_time = options.mixing;
+    sofa.Init(options.samplerate);
+    const int err = sofa.Insert(0, make_hrtf(options));
+    if (err != MYSOFA_OK) {
+        fprintf(stderr, "Could not create the hrtf database (%d)\n", err);
+        return 1;
+    }
+
+    if (options.threads > 0) {
+        RenderPool::Instance().Start(options.threads);
+    }
+    VoiceBudget::Instance().SetLimits(options.voices, 0.0f);
+
+    const int tail_param = find_parameter(spatializer, "BRIR Tail");
+    const int send_param = find_parameter(spatializer, "Bus Send");
+    const int reflections_param = find_parameter(spatializer, "Reflections");
+
+    Random random;
+    random.Seed(42);
+    std::vector<Instance> instances(options.sources);
+    for (int i = 0; i < options.sources; ++i) {
+        Instance &instance = instances[i];
+        init_state(instance.state, options);
+        memset(&instance.spatializer, 0, sizeof(instance.spatializer));
+        for (int j = 0; j < 4; ++j) {
+            instance.spatializer.listenermatrix[j * 5] = 1.0f;
+            instance.spatializer.sourcematrix[j * 5] = 1.0f;
+        }
+        instance.spatializer.spatialblend = 1.0f;
+        instance.spatializer.reverbzonemix = options.reverb ? 1.0f : 0.0f;
+        instance.state.spatializerdata = &instance.spatializer;
+        instance.azimuth = random.GetFloat(0.0f, 360.0f);
+        instance.elevation = random.GetFloat(0.0f, 60.0f);
+        instance.speed = options.speed * random.GetFloat(0.1f, 1.0f);
+        instance.in.resize(options.blocksize * 2);
+        instance.out.resize(options.blocksize * 2);
+        for (size_t n = 0; n < instance.in.size(); ++n) {
+            instance.in[n] = (i < options.silent) ? 0.0f : random.GetFloat(-0.5f, 0.5f);
+        }
+
+        spatializer->create(&instance.state);
+        if (options.tail && tail_param >= 0) {
+            spatializer->setfloatparameter(&instance.state, tail_param, 1.0f);
+        }
+        if (options.send && send_param >= 0) {
+            spatializer->setfloatparameter(&instance.state, send_param, 1.0f);
+        }
+        if (options.reflections > 0 && reflections_param >= 0) {
+            spatializer->setfloatparameter(&instance.state, reflections_param, (float)options.reflections);
+        }
+    }
+
+    UnityAudioEffectState bus_state;
+    std::vector<float> bus_buffer(options.blocksize * 2);
+    init_state(bus_state, options);
+    bus->create(&bus_state);
+
+    // Render
+    const int num_blocks = (int)(options.seconds * options.samplerate / options.blocksize);
+    const float dt = (float)options.blocksize / (float)options.samplerate;
+    const double budget = 1e9 * dt;
+    std::vector<double> block_times;
+    block_times.reserve(num_blocks);
+
+    for (int b = 0; b < num_blocks; ++b) {
+        const UInt64 tick = (UInt64)b * options.blocksize;
+        for (size_t i = 0; i < instances.size(); ++i) {
+            update_trajectory(instances[i], dt);
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < instances.size(); ++i) {
+            Instance &instance = instances[i];
+            instance.state.prevdsptick = instance.state.currdsptick;
+            instance.state.currdsptick = tick;
+            const int call = (options.hostblock > 0) ? options.hostblock : options.blocksize;
+            for (int offset = 0; offset < options.blocksize; offset += call) {
+                const int length = std::min(call, options.blocksize - offset);
+                spatializer->process(&instance.state, &instance.in[2 * offset], &instance.out[2 * offset], length, 2, 2);
+            }
+        }
+        bus_state.prevdsptick = bus_state.currdsptick;
+        bus_state.currdsptick = tick;
+        memset(&bus_buffer[0], 0, bus_buffer.size() * sizeof(float));
+        bus->process(&bus_state, &bus_buffer[0], &bus_buffer[0], options.blocksize, 2, 2);
+        const auto end = std::chrono::steady_clock::now();
+
+        block_times.push_back((double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    }
+
+    // Gather the counters before the instances are released
+    double ir_switches = 0.0;
+    double virtual_blocks = 0.0;
+    double idle_blocks = 0.0;
+    double dropped_blocks = 0.0;
+    for (size_t i = 0; i < instances.size(); ++i) {
+        float counters[7] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+        spatializer->getfloatbuffer(&instances[i].state, "Counters", counters, 7);
+        ir_switches += counters[1];
+        virtual_blocks += counters[4];
+        idle_blocks += counters[5];
+        dropped_blocks += counters[6];
+    }
+
+    for (size_t i = 0; i < instances.size(); ++i) {
+        spatializer->release(&instances[i].state);
+    }
+    bus->release(&bus_state);
+    RenderPool::Instance().Stop();
+
+    if (block_times.empty()) {
+        fprintf(stderr, "Nothing rendered, increase --seconds\n");
+        return 1;
+    }
+
+    // Report
+    double total = 0.0;
+    for (size_t b = 0; b < block_times.size(); ++b) {
+        total += block_times[b];
+    }
+    std::vector<double> sorted(block_times);
+    std::sort(sorted.begin(), sorted.end());
+    const double mean = total / sorted.size();
+    const double p99 = sorted[std::min(sorted.size() - 1, (size_t)(0.99 * sorted.size()))];
+    const double max = sorted.back();
+    const double audio_seconds = num_blocks * dt;
+    const double ns_per_sample = total / ((double)num_blocks * options.blocksize * options.sources);
+
+    printf("sources              %d\n", options.sources);
+    printf("block size           %d @ %d Hz (budget %.1f us)\n", options.blocksize, options.samplerate, budget * 1e-3);
+    printf("filters              %d measurements x %d samples (%s)\n", options.measurements, options.irlen,
+           HRIRStorage::GetFormatName((HRIRStorage::Format)options.format));
+    printf("render threads       %d%s%s%s\n", options.threads, options.tail ? ", tail" : "", options.send ? ", bus send" : "",
+           options.reverb ? ", reverb" : "");
+    if (options.threads > 0) {
+        printf("dropped blocks       %.0f (renders still running at the deadline)\n", dropped_blocks);
+    }
+    if (options.reflections > 0) {
+        printf("reflections          order %d, %d clusters\n", options.reflections, ReflectionBus::NUM_CLUSTERS);
+    }
+    if (options.mixing > 0.0f) {
+        printf("late tail            split at %.0f ms, shared by all sources\n", options.mixing * 1e3f);
+    }
+    if (options.voices > 0) {
+        printf("voice budget         %d convolving, %.1f %% of the blocks panned\n", options.voices,
+               100.0 * virtual_blocks / ((double)num_blocks * options.sources));
+    }
+    if (options.silent > 0) {
+        printf("silent sources       %d, %.1f %% of all blocks skipped\n", options.silent,
+               100.0 * idle_blocks / ((double)num_blocks * options.sources));
+    }
+    if (options.hostblock > 0) {
+        printf("host calls           %d frames, re-blocked with %d frames of latency\n", options.hostblock,
+               options.blocksize);
+    }
+    printf("ns per sample        %.2f (per source)\n", ns_per_sample);
+    printf("block time           mean %.1f us, p99 %.1f us, max %.1f us\n", mean * 1e-3, p99 * 1e-3, max * 1e-3);
+    printf("load                 %.1f %%\n", 100.0 * mean / budget);
+    printf("IR switches          %.1f per second\n", ir_switches / audio_seconds);
+    // With render threads the measured time is wall clock, so this is per mixer thread rather than per core
+    printf("sources per core     %d (p99 inside the budget)\n", (int)(options.sources * budget / p99));
+
+    return 0;
+}
@@ -0,0 +1,465 @@
+// Offline binaural renderer built on the SOFA Spatializer.
+// Every mono stem is rendered by its own spatializer instance, driven through the same callbacks Unity
+// uses, along a trajectory given as keyframes. Stems are spread over all cores and mixed into one
+// binaural wav file. Latency doesn't matter here, so large blocks can be used, long (room) impulse
+// responses are convolved inline and the filters can be interpolated between the measurements.
+//
+// Usage: SofaRender --sofa=file.sofa --out=binaural.wav [--blocksize=2048] [--threads=N]
+//                   [--interpolate] [--format=0] [--pcm16] stem.wav[,trajectory.txt] ...
+//
+// Trajectory files hold one keyframe per line, positions are interpolated linearly in between:
+//   <time in s> <azimuth in degrees> <elevation in degrees> [<distance in m>]
+// Azimuth follows the sofa convention, 0 is in front and 90 to the left. Lines starting with # are
+// ignored. Stems without a trajectory are placed in front of the listener.
+
+#include "AudioPluginUtil.h"
+#include "SofaDatabase.h"
+#include "Epoch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const int MAX_BLOCKSIZE = 16384; // The plugin keeps its block buffers on the stack
+
+struct Keyframe
+{
+    float time;
+    float azimuth;
+    float elevation;
+    float distance;
+};
+
+struct Stem
+{
+    std::string filename;
+    std::string trajectory_file;
+    std::vector<float> samples;
+    int samplerate = 0;
+    std::vector<Keyframe> trajectory;
+    // Rendered stereo signal, interleaved
+    std::vector<float> output;
+    double render_seconds = 0.0;
+};
+
+struct Options
+{
+    const char *sofa_file = NULL;
+    const char *out_file = NULL;
+    int blocksize = 2048;
+    int threads = 0;
+    bool interpolate = false;
+    int format = HRIRStorage::Format_Float;
+    bool pcm16 = false;
+};
+
+/////////////////////////////////////////
+/// Wav files
+///////////////////////////////////////
+
+static UInt32 read_u32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((UInt32)p[3] << 24);
+}
+
+static UInt16 read_u16(const unsigned char *p) {
+    return (UInt16)(p[0] | (p[1] << 8));
+}
+
+// Reads 16, 24 and 32 bit pcm or 32 bit float files. Several channels are mixed down to mono.
+static bool read_wav(const char *filename, std::vector<float> &samples, int &samplerate) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    std::vector<unsigned char> data;
+    unsigned char buffer[65536];
+    size_t num;
+    while ((num = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        data.insert(data.end(), buffer, buffer + num);
+    }
+    fclose(file);
+
+    if (data.size() < 12 || memcmp(&data[0], "RIFF", 4) != 0 || memcmp(&data[8], "WAVE", 4) != 0) {
+        return false;
+    }
+
+    int format = 0, channels = 0, bits = 0;
+    const unsigned char *pcm = NULL;
+    size_t pcm_size = 0;
+    size_t pos = 12;
+    while (pos + 8 <= data.size()) {
+        const unsigned char *chunk = &data[pos];
+        const size_t size = read_u32(chunk + 4);
+        const size_t available = std::min(size, data.size() - pos - 8);
+        if (memcmp(chunk, "fmt ", 4) == 0 && available >= 16) {
+            format = read_u16(chunk + 8);
+            channels = read_u16(chunk + 10);
+            samplerate = (int)read_u32(chunk + 12);
+            bits = read_u16(chunk + 22);
+            if (format == 0xFFFE && available >= 26) {
+                // WAVE_FORMAT_EXTENSIBLE, the sub format starts with the plain format tag
+                format = read_u16(chunk + 32);
+            }
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            pcm = chunk + 8;
+            pcm_size = available;
+        }
+        pos += 8 + size + (size & 1);
+    }
+
+    const bool supported = (format == 1 && (bits == 16 || bits == 24 || bits == 32)) || (format == 3 && bits == 32);
+    if (pcm == NULL || channels < 1 || !supported) {
+        return false;
+    }
+
+    const int bytes = bits / 8;
+    const size_t frames = pcm_size / (bytes * channels);
+    samples.assign(frames, 0.0f);
+    for (size_t i = 0; i < frames; ++i) {
+        float sum = 0.0f;
+        for (int ch = 0; ch < channels; ++ch) {
+            const unsigned char *p = pcm + (i * channels + ch) * bytes;
+            if (format == 3) {
+                float value;
+                memcpy(&value, p, sizeof(value));
+                sum += value;
+            } else if (bits == 16) {
+                sum += (float)(SInt16)read_u16(p) / 32768.0f;
+            } else if (bits == 24) {
+                sum += (float)((SInt32)((p[0] << 8) | (p[1] << 16) | ((UInt32)p[2] << 24)) >> 8) / 8388608.0f;
+            } else {
+                sum += (float)(SInt32)read_u32(p) / 2147483648.0f;
+            }
+        }
+        samples[i] = sum / (float)channels;
+    }
+    return true;
+}
+
+static void write_u32(FILE *file, UInt32 value) {
+    const unsigned char bytes[4] = { (unsigned char)value, (unsigned char)(value >> 8), (unsigned char)(value >> 16), (unsigned char)(value >> 24) };
+    fwrite(bytes, 1, 4, file);
+}
+
+static void write_u16(FILE *file, UInt16 value) {
+    const unsigned char bytes[2] = { (unsigned char)value, (unsigned char)(value >> 8) };
+    fwrite(bytes, 1, 2, file);
+}
+
+// Writes interleaved stereo as 32 bit float or 16 bit pcm
+static bool write_wav(const char *filename, const std::vector<float> &samples, int samplerate, bool pcm16) {
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    const int channels = 2, bytes = pcm16 ? 2 : 4;
+    const UInt32 data_size = (UInt32)(samples.size() * bytes);
+    fwrite("RIFF", 1, 4, file);
+    write_u32(file, 36 + data_size);
+    fwrite("WAVEfmt ", 1, 8, file);
+    write_u32(file, 16);
+    write_u16(file, pcm16 ? 1 : 3);
+    write_u16(file, channels);
+    write_u32(file, samplerate);
+    write_u32(file, samplerate * channels * bytes);
+    write_u16(file, channels * bytes);
+    write_u16(file, bytes * 8);
+    fwrite("data", 1, 4, file);
+    write_u32(file, data_size);
+    for (size_t i = 0; i < samples.size(); ++i) {
+        if (pcm16) {
+            const float value = std::max(-1.0f, std::min(1.0f, samples[i]));
+            write_u16(file, (UInt16)(SInt16)lrintf(value * 32767.0f));
+        } else {
+            fwrite(&samples[i], sizeof(float), 1, file);
+        }
+    }
+    const bool ok = ferror(file) == 0;
+    fclose(file);
+    return ok;
+}
+
+/////////////////////////////////////////
+/// Trajectories
+///////////////////////////////////////
+
+static bool read_trajectory(const char *filename, std::vector<Keyframe> &trajectory) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        Keyframe key;
+        key.distance = 1.0f;
+        if (line[0] == '#') {
+            continue;
+        }
+        const int num = sscanf(line, "%f %f %f %f", &key.time, &key.azimuth, &key.elevation, &key.distance);
+        if (num >= 3) {
+            trajectory.push_back(key);
+        }
+    }
+    fclose(file);
+    return !trajectory.empty();
+}
+
+static Keyframe evaluate_trajectory(const std::vector<Keyframe> &trajectory, float time) {
+    if (trajectory.empty()) {
+        Keyframe front = { 0.0f, 0.0f, 0.0f, 1.0f };
+        return front;
+    }
+    if (time <= trajectory.front().time) {
+        return trajectory.front();
+    }
+    for (size_t i = 1; i < trajectory.size(); ++i) {
+        const Keyframe &a = trajectory[i - 1], &b = trajectory[i];
+        if (time < b.time) {
+            const float t = (time - a.time) / (b.time - a.time);
+            Keyframe key;
+            key.time = time;
+            key.azimuth = a.azimuth + t * (b.azimuth - a.azimuth);
+            key.elevation = a.elevation + t * (b.elevation - a.elevation);
+            key.distance = a.distance + t * (b.distance - a.distance);
+            return key;
+        }
+    }
+    return trajectory.back();
+}
+
+// Places the source in Unity coordinates (x right, y up, z forward) around a listener at the origin
+static void set_source_position(UnityAudioSpatializerData &spatializer, const Keyframe &key) {
+    const float azimuth = key.azimuth * kPI / 180.0f;
+    const float elevation = key.elevation * kPI / 180.0f;
+    const float front = key.distance * cosf(elevation) * cosf(azimuth);
+    const float left = key.distance * cosf(elevation) * sinf(azimuth);
+    const float up = key.distance * sinf(elevation);
+    spatializer.sourcematrix[12] = -left;
+    spatializer.sourcematrix[13] = up;
+    spatializer.sourcematrix[14] = front;
+}
+
+/////////////////////////////////////////
+/// Rendering
+///////////////////////////////////////
+
+static int find_parameter(const UnityAudioEffectDefinition *definition, const char *name) {
+    for (UInt32 i = 0; i < definition->numparameters; ++i) {
+        if (strcmp(definition->paramdefs[i].name, name) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static void render_stem(UnityAudioEffectDefinition *definition, const Options &options, int ir_len, Stem &stem) {
+    static int internal;
+    UnityAudioEffectState state;
+    UnityAudioSpatializerData spatializer;
+    memset(&state, 0, sizeof(state));
+    memset(&spatializer, 0, sizeof(spatializer));
+    for (int j = 0; j < 4; ++j) {
+        spatializer.listenermatrix[j * 5] = 1.0f;
+        spatializer.sourcematrix[j * 5] = 1.0f;
+    }
+    spatializer.spatialblend = 1.0f;
+    state.structsize = sizeof(UnityAudioEffectState);
+    state.samplerate = stem.samplerate;
+    state.dspbuffersize = options.blocksize;
+    state.hostapiversion = UNITY_AUDIO_PLUGIN_API_VERSION;
+    state.internal = &internal;
+    state.spatializerdata = &spatializer;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    definition->create(&state);
+    const int interpolate_param = find_parameter(definition, "Interpolate");
+    if (options.interpolate && interpolate_param >= 0) {
+        definition->setfloatparameter(&state, interpolate_param, 1.0f);
+    }
+
+    // Render until the last filter has decayed
+    const int blocksize = options.blocksize;
+    const size_t length = stem.samples.size() + ir_len;
+    const size_t num_blocks = (length + blocksize - 1) / blocksize;
+    std::vector<float> in(blocksize * 2), out(blocksize * 2);
+    stem.output.assign(num_blocks * blocksize * 2, 0.0f);
+
+    for (size_t b = 0; b < num_blocks; ++b) {
+        const size_t offset = b * blocksize;
+        for (int i = 0; i < blocksize; ++i) {
+            const float sample = (offset + i < stem.samples.size()) ? stem.samples[offset + i] : 0.0f;
+            in[i * 2] = sample;
+            in[i * 2 + 1] = sample;
+        }
+
+        // The position in the middle of the block
+        const float time = ((float)offset + 0.5f * blocksize) / (float)stem.samplerate;
+        set_source_position(spatializer, evaluate_trajectory(stem.trajectory, time));
+
+        state.prevdsptick = state.currdsptick;
+        state.currdsptick = offset;
+        definition->process(&state, &in[0], &out[0], blocksize, 2, 2);
+        memcpy(&stem.output[offset * 2], &out[0], blocksize * 2 * sizeof(float));
+    }
+
+    definition->release(&state);
+    stem.output.resize(length * 2);
+
+    const auto end = std::chrono::steady_clock::now();
+    stem.render_seconds = std::chrono::duration<double>(end - start).count();
+}
+
+static bool parse_options(int argc, char **argv, Options &options, std::vector<Stem> &stems) {
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--sofa=", 7) == 0) {
+            options.sofa_file = arg + 7;
+        } else if (strncmp(arg, "--out=", 6) == 0) {
+            options.out_file = arg + 6;
+        } else if (strncmp(arg, "--blocksize=", 12) == 0) {
+            options.blocksize = atoi(arg + 12);
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            options.threads = atoi(arg + 10);
+        } else if (strncmp(arg, "--format=", 9) == 0) {
+            options.format = atoi(arg + 9);
+        } else if (strcmp(arg, "--interpolate") == 0) {
+            options.interpolate = true;
+        } else if (strcmp(arg, "--pcm16") == 0) {
+            options.pcm16 = true;
+        } else if (strncmp(arg, "--", 2) == 0) {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            return false;
+        } else {
+            Stem stem;
+            const char *comma = strrchr(arg, ',');
+            stem.filename = comma != NULL ? std::string(arg, comma) : std::string(arg);
+            if (comma != NULL) {
+                stem.trajectory_file = comma + 1;
+            }
+            stems.push_back(stem);
+        }
+    }
+    return options.sofa_file != NULL && options.out_file != NULL && !stems.empty() &&
+           options.blocksize > 0 && options.blocksize <= MAX_BLOCKSIZE &&
+           options.format >= 0 && options.format < HRIRStorage::Format_Num;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    std::vector<Stem> stems;
+    if (!parse_options(argc, argv, options, stems)) {
+        fprintf(stderr, "Usage: %s --sofa=file.sofa --out=binaural.wav [--blocksize=N (<= %d)] [--threads=N] "
+                "[--interpolate] [--format=0|1|2] [--pcm16] stem.wav[,trajectory.txt] ...\n", argv[0], MAX_BLOCKSIZE);
+        return 1;
+    }
+
+    // Inputs
+    int samplerate = 0;
+    for (size_t i = 0; i < stems.size(); ++i) {
+        Stem &stem = stems[i];
+        if (!read_wav(stem.filename.c_str(), stem.samples, stem.samplerate)) {
+            fprintf(stderr, "Could not read %s, only pcm and float wav files are supported\n", stem.filename.c_str());
+            return 1;
+        }
+        if (samplerate != 0 && stem.samplerate != samplerate) {
+            fprintf(stderr, "%s has a sample rate of %d Hz instead of %d Hz\n", stem.filename.c_str(), stem.samplerate, samplerate);
+            return 1;
+        }
+        samplerate = stem.samplerate;
+        if (!stem.trajectory_file.empty() && !read_trajectory(stem.trajectory_file.c_str(), stem.trajectory)) {
+            fprintf(stderr, "Could not read the trajectory %s\n", stem.trajectory_file.c_str());
+            return 1;
+        }
+    }
+
+    UnityAudioEffectDefinition **definitions;
+    UnityAudioEffectDefinition *definition = NULL;
+    const int num_definitions = UnityGetAudioEffectDefinitions(&definitions);
+    for (int i = 0; i < num_definitions; ++i) {
+        if (strcmp(definitions[i]->name, "SOFA Spatializer") == 0) {
+            definition = definitions[i];
+        }
+    }
+    if (definition == NULL) {
+        fprintf(stderr, "The SOFA Spatializer is not registered\n");
+        return 1;
+    }
+
+    // The spatializer renders slot 0
+    SofaContainer &sofa = SofaContainer::Instance();
+    sofa.storage_format = (HRIRStorage::Format)options.format;
+    sofa.Init(samplerate);
+    const int err = sofa.Load(0, options.sofa_file);
+    if (err != MYSOFA_OK) {
+        fprintf(stderr, "Could not load %s (%d)\n", options.sofa_file, err);
+        return 1;
+    }
+    int ir_len;
+    {
+        Epoch::Scope epoch;
+        const SofaDatabase *database = sofa.Acquire(0);
+        ir_len = database->ir_len;
+        const float sofa_samplerate = database->hrtf->DataSamplingRate.values[0];
+        if ((int)sofa_samplerate != samplerate) {
+            fprintf(stderr, "Warning: the filters are sampled at %.0f Hz, the stems at %d Hz\n", sofa_samplerate, samplerate);
+        }
+    }
+
+    // Every worker takes the next stem that is left
+    int num_threads = options.threads > 0 ? options.threads : (int)std::thread::hardware_concurrency();
+    num_threads = std::max(1, std::min(num_threads, (int)stems.size()));
+    std::atomic<int> next_stem(0);
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < num_threads; ++t) {
+        workers.push_back(std::thread([&]() {
+            int i;
+            while ((i = next_stem.fetch_add(1)) < (int)stems.size()) {
+                render_stem(definition, options, ir_len, stems[i]);
+            }
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); ++t) {
+        workers[t].join();
+    }
+    const double total_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Mix and report
+    std::vector<float> mix;
+    double audio_seconds = 0.0;
+    for (size_t i = 0; i < stems.size(); ++i) {
+        const Stem &stem = stems[i];
+        if (mix.size() < stem.output.size()) {
+            mix.resize(stem.output.size(), 0.0f);
+        }
+        for (size_t n = 0; n < stem.output.size(); ++n) {
+            mix[n] += stem.output[n];
+        }
+
+        const double seconds = (double)stem.samples.size() / stem.samplerate;
+        audio_seconds += seconds;
+        printf("%-40s %8.2f s audio in %7.3f s, %7.1fx real time, %7.1f ns/sample\n", stem.filename.c_str(), seconds,
+               stem.render_seconds, seconds / stem.render_seconds, 1e9 * stem.render_seconds / (double)std::max<size_t>(1, stem.samples.size()));
+    }
+
+    float peak = 0.0f;
+    for (size_t n = 0; n < mix.size(); ++n) {
+        peak = std::max(peak, fabsf(mix[n]));
+    }
+
+    printf("%d stems on %d threads: %.2f s audio in %.3f s, %.1fx real time, peak %.1f dBFS\n", (int)stems.size(), num_threads,
+           audio_seconds, total_seconds, audio_seconds / total_seconds, 20.0f * log10f(std::max(peak, 1.0e-10f)));
+    if (options.pcm16 && peak > 1.0f) {
+        fprintf(stderr, "Warning: the mix clips in 16 bit\n");
+    }
+
+    if (!write_wav(options.out_file, mix, samplerate, options.pcm16)) {
+        fprintf(stderr, "Could not write %s\n", options.out_file);
+        return 1;
+    }
+    return 0;
+}
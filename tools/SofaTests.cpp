@@ -0,0 +1,97 @@
+// Runner of the NAP unit tests (see NAPTest.h).
+// The tests run while the executable is initialized, like they do when Unity loads the plugin. Afterwards
+// the recorded throughput is compared against a baseline file and regressions beyond the tolerance fail.
+// Timings missing from the baseline are appended, so the first run on a machine creates it.
+//
+// Usage: SofaTests [--baseline=file] [--tolerance=0.25] [--update]
+//
+// Baseline format, one timing per line: <name> <nanoseconds per sample>
+
+#include "NAPTest.h"
+
+#if !ENABLE_TESTS
+#error "SofaTests has to be built with ENABLE_TESTS"
+#endif
+
+#include <map>
+#include <string>
+
+typedef std::map<std::string, double> Timings;
+
+static void read_baseline(const char *filename, Timings &timings) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        return;
+    }
+    char name[64];
+    double value;
+    while (fscanf(file, "%63s %lf", name, &value) == 2) {
+        timings[name] = value;
+    }
+    fclose(file);
+}
+
+static bool write_baseline(const char *filename, const Timings &timings) {
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        return false;
+    }
+    for (Timings::const_iterator it = timings.begin(); it != timings.end(); ++it) {
+        fprintf(file, "%s %.3f\n", it->first.c_str(), it->second);
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    const char *baseline_file = NULL;
+    double tolerance = 0.25;
+    bool update = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--baseline=", 11) == 0) {
+            baseline_file = argv[i] + 11;
+        } else if (strncmp(argv[i], "--tolerance=", 12) == 0) {
+            tolerance = atof(argv[i] + 12);
+        } else if (strcmp(argv[i], "--update") == 0) {
+            update = true;
+        } else {
+            fprintf(stderr, "Usage: %s [--baseline=file] [--tolerance=0.25] [--update]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int failures = NAP_GetNumFailures();
+
+    if (baseline_file != NULL) {
+        Timings baseline;
+        read_baseline(baseline_file, baseline);
+
+        bool changed = false;
+        for (int i = 0; i < NAP_GetNumTimings(); ++i) {
+            const char *name = NAP_GetTimingName(i);
+            const double timing = NAP_GetTiming(i);
+            Timings::iterator it = baseline.find(name);
+            if (it == baseline.end() || update) {
+                printf("%-28s %10.3f ns/sample (recorded)\n", name, timing);
+                baseline[name] = timing;
+                changed = true;
+                continue;
+            }
+
+            const bool regressed = timing > it->second * (1.0 + tolerance);
+            printf("%-28s %10.3f ns/sample, baseline %10.3f (%+.1f %%)%s\n", name, timing, it->second,
+                   100.0 * (timing / it->second - 1.0), regressed ? " REGRESSION" : "");
+            if (regressed) {
+                failures++;
+            }
+        }
+
+        if (changed && !write_baseline(baseline_file, baseline)) {
+            fprintf(stderr, "Could not write %s\n", baseline_file);
+            failures++;
+        }
+    }
+
+    printf("%d failure(s)\n", failures);
+    return failures == 0 ? 0 : 1;
+}